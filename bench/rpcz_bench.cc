@@ -0,0 +1,379 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the throughput and latency of an echo service over inproc, ipc
+// and tcp, sweeping payload sizes, client concurrency and thread counts. The
+// mem transport bypasses ZeroMQ between client and server, which leaves the
+// cost of rpcz itself, ntcp compares ZeroMQ's tcp with rpcz's own
+// epoll-based TCP transport over loopback, and shm goes through shared
+// memory rings:
+//
+//     rpcz_bench --payload_sizes=16,4K,1M --concurrency=1,64 --format=json
+//
+// In closed-loop mode each of the concurrent clients sends its next request
+// when it gets the previous response, so latencies are service times. In
+// open-loop mode requests are sent at fixed rates regardless of responses,
+// and latencies are measured from the time each request was scheduled to be
+// sent. A stalled server then shows up in the percentiles instead of just
+// slowing down the load (coordinated omission).
+
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <zmq.hpp>
+
+#include "rpcz/latency_histogram.hpp"
+#include "rpcz/load_generator.hpp"
+#include "rpcz/rpcz.hpp"
+
+#include "echo.pb.h"
+#include "echo.rpcz.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace po = boost::program_options;
+
+std::string FLAGS_transports;
+std::string FLAGS_modes;
+std::string FLAGS_payload_sizes;
+std::string FLAGS_concurrency;
+std::string FLAGS_rates;
+std::string FLAGS_connection_manager_threads;
+std::string FLAGS_zeromq_io_threads;
+std::string FLAGS_format;
+int FLAGS_connections;
+int FLAGS_duration_ms;
+int FLAGS_warmup_ms;
+int FLAGS_deadline_ms;
+int FLAGS_max_inflight_mb;
+int FLAGS_tcp_port;
+bool FLAGS_raw;
+
+static const char *PNAME = "rpcz_bench";
+
+namespace rpcz {
+
+class EchoServiceImpl : public EchoService {
+  virtual void Echo(const EchoRequest& request, reply<EchoResponse> reply) {
+    EchoResponse response;
+    response.set_payload(request.payload());
+    reply.send(response);
+  }
+};
+
+struct bench_config {
+  std::string transport;
+  bool open_loop;
+  int64 payload_bytes;
+  // Calls in flight for closed-loop runs, calls per second for open-loop.
+  int64 load;
+  int64 connection_manager_threads;
+  int64 zeromq_io_threads;
+};
+
+std::string get_endpoint(const std::string& transport, int run) {
+  if (transport == "inproc") {
+    return "inproc://rpcz_bench";
+  } else if (transport == "mem") {
+    return "mem://rpcz_bench";
+  } else if (transport == "ntcp") {
+    return "ntcp://127.0.0.1:" + boost::lexical_cast<std::string>(
+        FLAGS_tcp_port + run);
+  } else if (transport == "shm") {
+    return "shm://rpcz_bench." + boost::lexical_cast<std::string>(run);
+  } else if (transport == "ipc") {
+    return "ipc:///tmp/rpcz_bench." + boost::lexical_cast<std::string>(
+        getpid());
+  } else {
+    return "tcp://127.0.0.1:" + boost::lexical_cast<std::string>(
+        FLAGS_tcp_port + run);
+  }
+}
+
+void print_header() {
+  if (FLAGS_format == "csv") {
+    cout << "transport,mode,payload_bytes,concurrency,target_rate,"
+         << "connection_manager_threads,zeromq_io_threads,calls,errors,"
+         << "msgs_per_sec,mb_per_sec,mean_usec,p50_usec,p99_usec,p999_usec,"
+         << "max_usec" << endl;
+  } else {
+    cout << "[";
+  }
+}
+
+void print_result(const bench_config& config, int run,
+                  const latency_histogram& histogram,
+                  uint64 calls, uint64 errors) {
+  double seconds = FLAGS_duration_ms / 1000.0;
+  double msgs_per_sec = calls / seconds;
+  // Request and response payloads.
+  double mb_per_sec = msgs_per_sec * config.payload_bytes * 2 / 1e6;
+  const char* mode = config.open_loop ? "open" : "closed";
+  int64 concurrency = config.open_loop ? 0 : config.load;
+  int64 rate = config.open_loop ? config.load : 0;
+  if (FLAGS_format == "csv") {
+    cout << config.transport << "," << mode << "," << config.payload_bytes
+         << "," << concurrency << "," << rate << ","
+         << config.connection_manager_threads << ","
+         << config.zeromq_io_threads << "," << calls << "," << errors << ","
+         << msgs_per_sec << "," << mb_per_sec << "," << histogram.mean()
+         << "," << histogram.percentile(0.5) << ","
+         << histogram.percentile(0.99) << ","
+         << histogram.percentile(0.999) << "," << histogram.max() << endl;
+  } else {
+    cout << (run ? "," : "") << "\n  {\"transport\": \"" << config.transport
+         << "\", \"mode\": \"" << mode
+         << "\", \"payload_bytes\": " << config.payload_bytes
+         << ", \"concurrency\": " << concurrency
+         << ", \"target_rate\": " << rate
+         << ", \"connection_manager_threads\": "
+         << config.connection_manager_threads
+         << ", \"zeromq_io_threads\": " << config.zeromq_io_threads
+         << ", \"calls\": " << calls << ", \"errors\": " << errors
+         << ", \"msgs_per_sec\": " << msgs_per_sec
+         << ", \"mb_per_sec\": " << mb_per_sec
+         << ", \"mean_usec\": " << histogram.mean()
+         << ", \"p50_usec\": " << histogram.percentile(0.5)
+         << ", \"p99_usec\": " << histogram.percentile(0.99)
+         << ", \"p999_usec\": " << histogram.percentile(0.999)
+         << ", \"max_usec\": " << histogram.max() << "}";
+    cout.flush();
+  }
+}
+
+void print_footer() {
+  if (FLAGS_format != "csv") {
+    cout << "\n]" << endl;
+  }
+}
+
+// Runs one configuration and prints its results.
+void run_benchmark(const bench_config& config, int run) {
+  std::string endpoint(get_endpoint(config.transport, run));
+  zmq::context_t context(config.zeromq_io_threads);
+  application::options options;
+  options.zeromq_context = &context;
+  options.connection_manager_threads = config.connection_manager_threads;
+  // "local" is tcp with the switch to ipc for same-host servers; the other
+  // transports measure themselves.
+  options.locality_upgrade = config.transport == "local";
+
+  application server_application(options);
+  server echo_server(server_application);
+  echo_server.register_service(new EchoServiceImpl);
+  echo_server.bind(endpoint);
+
+  application client_application(options);
+  std::vector<rpc_channel*> channels;
+  for (int i = 0; i < FLAGS_connections; ++i) {
+    channels.push_back(client_application.create_rpc_channel(endpoint));
+  }
+  EchoRequest request;
+  request.set_payload(std::string(config.payload_bytes, 'x'));
+  const google::protobuf::MethodDescriptor* echo =
+      EchoService::descriptor()->FindMethodByName("Echo");
+  // By default the calls go through call_method, like EchoService_Stub's,
+  // so that the request serialization and the response parsing are
+  // measured. --raw sends the serialized request with call_method0.
+  std::vector<load_request> requests(
+      1, FLAGS_raw ?
+      load_request(echo->service()->name(), echo->name(),
+                   request.SerializeAsString()) :
+      load_request(echo, &request));
+
+  load_generator generator(channels, FLAGS_deadline_ms);
+  generator.set_warmup_usec(uint64(FLAGS_warmup_ms) * 1000);
+  uint64 duration_usec = uint64(FLAGS_duration_ms) * 1000;
+  if (config.open_loop) {
+    generator.run_open_loop(requests, config.load, duration_usec);
+  } else {
+    generator.run_closed_loop(requests, config.load, duration_usec);
+  }
+  print_result(config, run, generator.get_histogram(), generator.get_calls(),
+               generator.get_errors());
+  delete_container_pointers(channels.begin(), channels.end());
+  if (config.transport == "ipc") {
+    unlink(endpoint.substr(strlen("ipc://")).c_str());
+  }
+}
+
+std::vector<std::string> split_list(const std::string& list) {
+  std::vector<std::string> items;
+  boost::split(items, list, boost::is_any_of(","));
+  return items;
+}
+
+// Parses a comma separated list of numbers with optional K or M suffixes.
+std::vector<int64> parse_sizes(const std::string& list) {
+  std::vector<std::string> items(split_list(list));
+  std::vector<int64> sizes;
+  for (size_t i = 0; i < items.size(); ++i) {
+    std::string item(items[i]);
+    int64 multiplier = 1;
+    if (!item.empty() && (item[item.size() - 1] == 'K' ||
+                          item[item.size() - 1] == 'M')) {
+      multiplier = item[item.size() - 1] == 'K' ? 1 << 10 : 1 << 20;
+      item.erase(item.size() - 1);
+    }
+    sizes.push_back(boost::lexical_cast<int64>(item) * multiplier);
+  }
+  return sizes;
+}
+
+int run() {
+  std::vector<std::string> transports(split_list(FLAGS_transports));
+  std::vector<std::string> modes(split_list(FLAGS_modes));
+  std::vector<int64> payload_sizes(parse_sizes(FLAGS_payload_sizes));
+  std::vector<int64> concurrency(parse_sizes(FLAGS_concurrency));
+  std::vector<int64> rates(parse_sizes(FLAGS_rates));
+  std::vector<int64> cm_threads(parse_sizes(FLAGS_connection_manager_threads));
+  std::vector<int64> io_threads(parse_sizes(FLAGS_zeromq_io_threads));
+  for (size_t i = 0; i < transports.size(); ++i) {
+    if (transports[i] != "inproc" && transports[i] != "ipc" &&
+        transports[i] != "tcp" && transports[i] != "mem" &&
+        transports[i] != "ntcp" && transports[i] != "shm" &&
+        transports[i] != "local") {
+      cerr << "Unknown transport: " << transports[i] << endl;
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < modes.size(); ++i) {
+    if (modes[i] != "closed" && modes[i] != "open") {
+      cerr << "Unknown mode: " << modes[i] << endl;
+      return 1;
+    }
+  }
+  if (FLAGS_connections < 1) {
+    cerr << "--connections must be positive." << endl;
+    return 1;
+  }
+  for (size_t i = 0; i < rates.size(); ++i) {
+    if (rates[i] < 1) {
+      cerr << "--rates must be positive." << endl;
+      return 1;
+    }
+  }
+
+  print_header();
+  int run = 0;
+  for (size_t t = 0; t < transports.size(); ++t)
+  for (size_t io = 0; io < io_threads.size(); ++io)
+  for (size_t cm = 0; cm < cm_threads.size(); ++cm)
+  for (size_t m = 0; m < modes.size(); ++m)
+  for (size_t p = 0; p < payload_sizes.size(); ++p) {
+    bench_config config;
+    config.transport = transports[t];
+    config.open_loop = modes[m] == "open";
+    config.payload_bytes = payload_sizes[p];
+    config.connection_manager_threads = cm_threads[cm];
+    config.zeromq_io_threads = io_threads[io];
+    const std::vector<int64>& loads = config.open_loop ? rates : concurrency;
+    for (size_t l = 0; l < loads.size(); ++l) {
+      config.load = loads[l];
+      if (!config.open_loop && config.payload_bytes * config.load * 2 >
+          int64(FLAGS_max_inflight_mb) << 20) {
+        cerr << "Skipping " << config.transport << " payload "
+             << config.payload_bytes << " concurrency " << config.load
+             << ": over --max_inflight_mb." << endl;
+        continue;
+      }
+      run_benchmark(config, run);
+      ++run;
+    }
+  }
+  print_footer();
+  return 0;
+}
+}  // namespace rpcz
+
+int main(int argc, char *argv[]) {
+  po::options_description desc("Allowed options");
+  po::variables_map vm;
+
+  desc.add_options()
+      ("help", "produce help message")
+      ("transports",
+       po::value<std::string>(&FLAGS_transports)->default_value(
+           "inproc,ipc,tcp"),
+       "Transports to benchmark: mem, inproc, ipc, shm, tcp, ntcp and local "
+       "(tcp upgraded to ipc).")
+      ("modes", po::value<std::string>(&FLAGS_modes)->default_value("closed"),
+       "closed (fixed concurrency), open (fixed rates) or both.")
+      ("payload_sizes",
+       po::value<std::string>(&FLAGS_payload_sizes)->default_value(
+           "16,256,4K,64K,1M,16M"),
+       "Request and response payload sizes in bytes. K and M suffixes are "
+       "accepted.")
+      ("concurrency",
+       po::value<std::string>(&FLAGS_concurrency)->default_value("1,16,64"),
+       "Calls in flight, for closed-loop runs.")
+      ("rates",
+       po::value<std::string>(&FLAGS_rates)->default_value("1K,10K"),
+       "Calls per second, for open-loop runs.")
+      ("connection_manager_threads",
+       po::value<std::string>(
+           &FLAGS_connection_manager_threads)->default_value("4"),
+       "Worker threads of the client and of the server.")
+      ("zeromq_io_threads",
+       po::value<std::string>(&FLAGS_zeromq_io_threads)->default_value("1"),
+       "ZeroMQ I/O threads.")
+      ("connections", po::value<int>(&FLAGS_connections)->default_value(1),
+       "Client connections the calls are spread over.")
+      ("duration_ms", po::value<int>(&FLAGS_duration_ms)->default_value(2000),
+       "Measured time of each run.")
+      ("warmup_ms", po::value<int>(&FLAGS_warmup_ms)->default_value(500),
+       "Time before the measurement of each run starts.")
+      ("deadline_ms", po::value<int>(&FLAGS_deadline_ms)->default_value(10000),
+       "Deadline of each call. Calls that time out count as errors.")
+      ("max_inflight_mb",
+       po::value<int>(&FLAGS_max_inflight_mb)->default_value(512),
+       "Skip closed-loop runs that would keep more payload in flight.")
+      ("tcp_port", po::value<int>(&FLAGS_tcp_port)->default_value(5599),
+       "First port for tcp runs; each run uses the next one.")
+      ("raw", po::value<bool>(&FLAGS_raw)->default_value(false),
+       "Send pre-serialized requests and do not parse the responses, to "
+       "measure the transport without protobuf.")
+      ("format", po::value<std::string>(&FLAGS_format)->default_value("csv"),
+       "Output format: csv or json.");
+
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (po::error &e) {
+    cerr << "Command line error: " << e.what() << endl;
+    cerr << desc;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    cout << PNAME << " Usage Instructions" << endl << endl << desc;
+    return 1;
+  }
+  if (FLAGS_modes == "both") {
+    FLAGS_modes = "closed,open";
+  }
+  try {
+    return rpcz::run();
+  } catch (boost::bad_lexical_cast&) {
+    cerr << "Could not parse a numeric list." << endl;
+    return 1;
+  }
+}
@@ -0,0 +1,283 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the primitives on rpcz's request path: ZeroMQ frame
+// forwarding, passing closures between threads, the broker's bookkeeping of
+// pending requests, the reactor's timers and sync_event. Run with a
+// substring of benchmark names to run only those:
+//
+//     rpcz_microbench remote_response_map
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/thread.hpp>
+#include <zmq.hpp>
+
+#include "rpcz/callback.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/connection_manager.hpp"
+#include "rpcz/event_id_generator.hpp"
+#include "rpcz/reactor.hpp"
+#include "rpcz/remote_response.hpp"
+#include "rpcz/sync_event.hpp"
+#include "rpcz/zmq_utils.hpp"
+
+using std::cout;
+using std::endl;
+
+namespace rpcz {
+namespace {
+// Each benchmark is run with growing iteration counts until one run takes
+// at least this long.
+const uint64 kMinRunTimeUsec = 500000;
+
+// Keeps the compiler from optimizing away the benchmarked work.
+volatile uint64 sink;
+
+typedef boost::function<void(int64)> benchmark_function;
+
+std::string filter;
+
+void run_benchmark(const std::string& name, benchmark_function function) {
+  if (name.find(filter) == std::string::npos) {
+    return;
+  }
+  int64 iterations = 1;
+  for (;;) {
+    uint64 start_usec = zclock_time_usec();
+    function(iterations);
+    uint64 elapsed_usec = zclock_time_usec() - start_usec;
+    if (elapsed_usec >= kMinRunTimeUsec || iterations >= (1LL << 32)) {
+      cout << std::left << std::setw(48) << name << std::right
+           << std::setw(12) << iterations << std::setw(12) << std::fixed
+           << std::setprecision(1) << elapsed_usec * 1000.0 / iterations
+           << " ns/op" << endl;
+      return;
+    }
+    int64 next = elapsed_usec ?
+        int64(iterations * 1.4 * kMinRunTimeUsec / elapsed_usec) :
+        iterations * 100;
+    iterations = std::max(iterations + 1, std::min(next, iterations * 100));
+  }
+}
+
+zmq::context_t* context;
+int next_endpoint = 0;
+
+// Returns a connected pair of PAIR sockets.
+void make_pair(zmq::socket_t** in, zmq::socket_t** out) {
+  std::string endpoint("inproc://rpcz_microbench." +
+                       boost::lexical_cast<std::string>(next_endpoint++));
+  *out = new zmq::socket_t(*context, ZMQ_PAIR);
+  (*out)->bind(endpoint.c_str());
+  *in = new zmq::socket_t(*context, ZMQ_PAIR);
+  (*in)->connect(endpoint.c_str());
+}
+
+// A request of two frames (header and payload) goes through a middle
+// socket with message_iterator and forward_messages(), like the broker
+// forwards requests and replies.
+void bm_forward_messages(size_t payload_size, int64 iterations) {
+  zmq::socket_t *source, *middle_in, *middle_out, *destination;
+  make_pair(&source, &middle_in);
+  make_pair(&middle_out, &destination);
+  for (int64 i = 0; i < iterations; ++i) {
+    zmq::message_t header(32);
+    zmq::message_t payload(payload_size);
+    source->send(header, ZMQ_SNDMORE);
+    source->send(payload, 0);
+    {
+      message_iterator iter(*middle_in);
+      sink += forward_messages(iter, *middle_out);
+    }
+    message_iterator iter(*destination);
+    while (iter.has_more()) {
+      sink += iter.next().size();
+    }
+  }
+  delete source;
+  delete middle_in;
+  delete middle_out;
+  delete destination;
+}
+
+void response_callback(connection_manager::status status,
+                       message_iterator& iter) {
+  sink += status;
+}
+
+// How a client_request_callback travels from rpc_channel_impl to the
+// broker and back to a worker.
+void bm_send_object(int64 iterations) {
+  zmq::socket_t *in, *out;
+  make_pair(&in, &out);
+  connection_manager::client_request_callback callback(
+      boost::bind(&response_callback, _1, _2));
+  for (int64 i = 0; i < iterations; ++i) {
+    send_object(in, callback, 0);
+    zmq::message_t msg;
+    out->recv(&msg);
+    connection_manager::client_request_callback received(
+        interpret_message<connection_manager::client_request_callback>(msg));
+    sink += received.empty();
+  }
+  delete in;
+  delete out;
+}
+
+void add_to_sink(uint64 value) {
+  sink += value;
+}
+
+void bm_new_callback(int64 iterations) {
+  for (int64 i = 0; i < iterations; ++i) {
+    closure* callback = new_callback(&add_to_sink, uint64(i));
+    callback->run();
+  }
+}
+
+void bm_event_id_generator(int64 iterations) {
+  event_id_generator generator;
+  uint64 sum = 0;
+  for (int64 i = 0; i < iterations; ++i) {
+    sum += generator.get_next();
+  }
+  sink += sum;
+}
+
+// Steady state of the broker with pending requests in flight: every
+// iteration inserts a request and finds and erases the oldest one, like
+// send_request() and handle_client_socket().
+void bm_remote_response_map(size_t pending, int64 iterations) {
+  event_id_generator generator;
+  remote_response_map map;
+  std::vector<event_id> ids(pending);
+  connection_manager::client_request_callback callback(
+      boost::bind(&response_callback, _1, _2));
+  for (size_t i = 0; i < pending; ++i) {
+    ids[i] = generator.get_next();
+    map[ids[i]].callback = callback;
+  }
+  for (int64 i = 0; i < iterations; ++i) {
+    event_id& oldest = ids[i % pending];
+    remote_response_map::iterator it = map.find(oldest);
+    sink += it->second.request_bytes;
+    map.erase(it);
+    oldest = generator.get_next();
+    remote_response& response = map[oldest];
+    response.callback = callback;
+    response.request_bytes = i;
+  }
+}
+
+// A deadline is scheduled for every request that has one; they are run
+// in batches by the reactor's loop. pending timers are scheduled far in the
+// future to give the map its typical size.
+void bm_reactor_closures(size_t pending, int64 iterations) {
+  const int64 kBatch = 16;
+  reactor reactor;
+  uint64 now = zclock_time();
+  for (size_t i = 0; i < pending; ++i) {
+    reactor.run_closure_at(now + 3600 * 1000 + i,
+                           new_callback(&add_to_sink, uint64(i)));
+  }
+  for (int64 i = 0; i < iterations; ++i) {
+    reactor.run_closure_at(now, new_callback(&add_to_sink, uint64(i)));
+    if (i % kBatch == kBatch - 1) {
+      sink += reactor.process_closure_run_map();
+    }
+  }
+  sink += reactor.process_closure_run_map();
+}
+
+void bm_sync_event_uncontended(int64 iterations) {
+  for (int64 i = 0; i < iterations; ++i) {
+    sync_event event;
+    event.signal();
+    event.wait();
+  }
+}
+
+struct event_pair {
+  sync_event ping;
+  sync_event pong;
+};
+
+void answer_pings(boost::ptr_vector<event_pair>* pairs) {
+  for (size_t i = 0; i < pairs->size(); ++i) {
+    (*pairs)[i].ping.wait();
+    (*pairs)[i].pong.signal();
+  }
+}
+
+// Round trip between two threads: how long a thread blocked in
+// rpc::wait() takes to wake up.
+void bm_sync_event_ping_pong(int64 iterations) {
+  const int64 kBatch = 1000;
+  for (int64 done = 0; done < iterations; done += kBatch) {
+    boost::ptr_vector<event_pair> pairs;
+    for (int64 i = 0; i < std::min(kBatch, iterations - done); ++i) {
+      pairs.push_back(new event_pair);
+    }
+    boost::thread thread(boost::bind(&answer_pings, &pairs));
+    for (size_t i = 0; i < pairs.size(); ++i) {
+      pairs[i].ping.signal();
+      pairs[i].pong.wait();
+    }
+    thread.join();
+  }
+}
+}  // unnamed namespace
+
+void run_benchmarks() {
+  zmq::context_t zmq_context(1);
+  context = &zmq_context;
+  size_t payload_sizes[] = {16, 4096, 1 << 20};
+  for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(*payload_sizes);
+       ++i) {
+    run_benchmark("forward_messages/" +
+                  boost::lexical_cast<std::string>(payload_sizes[i]),
+                  boost::bind(&bm_forward_messages, payload_sizes[i], _1));
+  }
+  run_benchmark("send_object+interpret_message", &bm_send_object);
+  run_benchmark("new_callback+run", &bm_new_callback);
+  run_benchmark("event_id_generator::get_next", &bm_event_id_generator);
+  size_t pending[] = {1, 1000, 100000};
+  for (size_t i = 0; i < sizeof(pending) / sizeof(*pending); ++i) {
+    std::string suffix("/" + boost::lexical_cast<std::string>(pending[i]));
+    run_benchmark("remote_response_map" + suffix,
+                  boost::bind(&bm_remote_response_map, pending[i], _1));
+    run_benchmark("reactor::run_closure_at+process" + suffix,
+                  boost::bind(&bm_reactor_closures, pending[i], _1));
+  }
+  run_benchmark("sync_event/uncontended", &bm_sync_event_uncontended);
+  run_benchmark("sync_event/ping_pong", &bm_sync_event_ping_pong);
+  context = NULL;
+}
+}  // namespace rpcz
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    rpcz::filter = argv[1];
+  }
+  rpcz::run_benchmarks();
+  return 0;
+}
@@ -0,0 +1,377 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A proxy that sits between rpcz clients and a server and makes the link
+// between them behave like a slow, lossy network, so that deadlines, retries
+// and load balancing can be tested on a single host:
+//
+//     rpcz_netem --listen=tcp://*:5556 --connect=tcp://localhost:5555
+//         --latency_ms=20 --jitter_ms=5 --distribution=pareto --drop=0.01
+//
+// Clients connect to the --listen endpoint. Each request and each reply is
+// then delayed by a latency drawn from the distribution, dropped with the
+// given probability, or sent right away with the --reorder probability so
+// that it overtakes the messages still being delayed. --bandwidth_kbps
+// limits each direction like a link of that speed, and --stall_ms holds all
+// messages for that long every --stall_every_ms. Timing has millisecond
+// resolution. The same --seed gives the same sequence of impairments.
+//
+// Clients stay on the proxy: it drops the handshake that would make them
+// switch to a local endpoint of the server.
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <boost/program_options.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <zmq.hpp>
+
+#include "rpcz/callback.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/connection_manager.hpp"
+#include "rpcz/locality.hpp"
+#include "rpcz/macros.hpp"
+#include "rpcz/reactor.hpp"
+#include "rpcz/zmq_utils.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace po = boost::program_options;
+
+std::string FLAGS_listen;
+std::string FLAGS_connect;
+std::string FLAGS_distribution;
+std::string FLAGS_impair;
+double FLAGS_latency_ms;
+double FLAGS_jitter_ms;
+double FLAGS_drop;
+double FLAGS_reorder;
+int FLAGS_bandwidth_kbps;
+int FLAGS_stall_every_ms;
+int FLAGS_stall_ms;
+unsigned int FLAGS_seed;
+
+namespace rpcz {
+namespace {
+const double kPi = 3.14159265358979323846;
+}  // unnamed namespace
+
+// One direction of the emulated link. Decides when each message goes out,
+// if at all.
+class link_model {
+ public:
+  link_model(const std::string& name, bool impaired, boost::mt19937* random)
+      : name_(name), impaired_(impaired), random_(random), free_usec_(0),
+        messages_(0), bytes_(0), dropped_(0), reordered_(0) {}
+
+  // Returns the time at which a message of the given size that arrives now
+  // should be sent on, in microseconds, or 0 if it is dropped.
+  uint64 schedule(uint64 now_usec, size_t bytes) {
+    ++messages_;
+    bytes_ += bytes;
+    if (!impaired_) {
+      return now_usec;
+    }
+    if (FLAGS_drop > 0 && uniform() < FLAGS_drop) {
+      ++dropped_;
+      return 0;
+    }
+    // The link sends one message at a time.
+    uint64 sent_usec = now_usec;
+    if (FLAGS_bandwidth_kbps > 0) {
+      sent_usec = std::max(now_usec, free_usec_) +
+          uint64(bytes) * 8000 / FLAGS_bandwidth_kbps;
+      free_usec_ = sent_usec;
+    }
+    uint64 delay_usec = 0;
+    if (FLAGS_reorder > 0 && uniform() < FLAGS_reorder) {
+      ++reordered_;
+    } else {
+      delay_usec = sample_latency_usec();
+    }
+    return end_of_stall(sent_usec + delay_usec);
+  }
+
+  void print_stats() const {
+    cout << name_ << ": " << messages_ << " messages, " << bytes_
+         << " bytes, " << dropped_ << " dropped, " << reordered_
+         << " reordered" << endl;
+  }
+
+ private:
+  double uniform() {
+    return boost::uniform_01<double>()(*random_);
+  }
+
+  uint64 sample_latency_usec() {
+    double latency = FLAGS_latency_ms;
+    if (FLAGS_jitter_ms > 0) {
+      double u = uniform();
+      if (FLAGS_distribution == "normal") {
+        // Box-Muller, with the jitter as standard deviation.
+        latency += FLAGS_jitter_ms * sqrt(-2 * log(1 - u)) *
+            cos(2 * kPi * uniform());
+      } else if (FLAGS_distribution == "exponential") {
+        latency += -FLAGS_jitter_ms * log(1 - u);
+      } else if (FLAGS_distribution == "pareto") {
+        // Shape 2: a heavy tail that still averages to the jitter.
+        latency += FLAGS_jitter_ms * (1 / sqrt(1 - u) - 1);
+      } else {
+        latency += FLAGS_jitter_ms * (2 * u - 1);
+      }
+    }
+    return latency > 0 ? uint64(latency * 1000) : 0;
+  }
+
+  // Moves a time that falls into one of the periodic stalls to its end.
+  uint64 end_of_stall(uint64 usec) const {
+    if (FLAGS_stall_every_ms <= 0 || FLAGS_stall_ms <= 0) {
+      return usec;
+    }
+    uint64 period_usec = uint64(FLAGS_stall_every_ms) * 1000;
+    uint64 stall_usec = uint64(FLAGS_stall_ms) * 1000;
+    uint64 phase_usec = usec % period_usec;
+    return phase_usec < stall_usec ? usec + stall_usec - phase_usec : usec;
+  }
+
+  const std::string name_;
+  const bool impaired_;
+  boost::mt19937* random_;
+  uint64 free_usec_;
+  uint64 messages_;
+  uint64 bytes_;
+  uint64 dropped_;
+  uint64 reordered_;
+};
+
+// Relays requests from the clients of the frontend to the backend and the
+// replies back. Towards the server the proxy is a client like any other:
+// requests get a new event id, which maps back to the client and its event
+// id when the reply arrives.
+class proxy {
+ public:
+  proxy(zmq::context_t* context, reactor* reactor)
+      : reactor_(reactor),
+        frontend_(new zmq::socket_t(*context, ZMQ_ROUTER)),
+        backend_(new zmq::socket_t(*context, ZMQ_DEALER)),
+        random_(FLAGS_seed),
+        requests_("requests", FLAGS_impair != "replies", &random_),
+        replies_("replies", FLAGS_impair != "requests", &random_),
+        next_event_id_(0) {
+    int linger_ms = 0;
+    frontend_->setsockopt(ZMQ_LINGER, &linger_ms, sizeof(linger_ms));
+    backend_->setsockopt(ZMQ_LINGER, &linger_ms, sizeof(linger_ms));
+    frontend_->bind(FLAGS_listen.c_str());
+    backend_->connect(FLAGS_connect.c_str());
+    reactor_->add_socket(frontend_, new_permanent_callback(
+            this, &proxy::handle_frontend));
+    reactor_->add_socket(backend_, new_permanent_callback(
+            this, &proxy::handle_backend));
+  }
+
+  void print_stats() const {
+    requests_.print_stats();
+    replies_.print_stats();
+    cout << "awaiting a reply: " << pending_.size() << endl;
+  }
+
+ private:
+  struct pending_request {
+    std::string client;
+    std::string event_id;
+  };
+  typedef std::map<uint64, pending_request> pending_map;
+
+  // (client, "", event id, header, payload) from a client.
+  void handle_frontend() {
+    message_iterator iter(*frontend_);
+    std::string client(message_to_string(iter.next()));
+    if (!iter.has_more() || iter.next().size() != 0 || !iter.has_more()) {
+      return;
+    }
+    std::string event_id(message_to_string(iter.next()));
+    if (event_id == kLocalityProbe) {
+      return;
+    }
+    message_vector* out = new message_vector;
+    out->push_back(string_to_message(""));
+    out->push_back(new zmq::message_t(sizeof(next_event_id_)));
+    size_t bytes = move_frames(iter, out);
+    uint64 send_usec = requests_.schedule(zclock_time_usec(), bytes);
+    if (send_usec == 0) {
+      delete out;
+      return;
+    }
+    uint64 id = next_event_id_++;
+    memcpy((*out)[1].data(), &id, sizeof(id));
+    pending_request& pending = pending_[id];
+    pending.client = client;
+    pending.event_id = event_id;
+    send_at(backend_, out, send_usec);
+  }
+
+  // ("", event id, reply frames) from the server.
+  void handle_backend() {
+    message_iterator iter(*backend_);
+    if (iter.next().size() != 0 || !iter.has_more()) {
+      return;
+    }
+    zmq::message_t& id_frame = iter.next();
+    if (id_frame.size() != sizeof(uint64)) {
+      return;
+    }
+    pending_map::iterator it = pending_.find(
+        interpret_message<uint64>(id_frame));
+    if (it == pending_.end()) {
+      return;
+    }
+    message_vector* out = new message_vector;
+    out->push_back(string_to_message(it->second.client));
+    out->push_back(string_to_message(""));
+    out->push_back(string_to_message(it->second.event_id));
+    pending_.erase(it);
+    size_t bytes = move_frames(iter, out);
+    uint64 send_usec = replies_.schedule(zclock_time_usec(), bytes);
+    if (send_usec == 0) {
+      delete out;
+      return;
+    }
+    send_at(frontend_, out, send_usec);
+  }
+
+  static size_t move_frames(message_iterator& iter, message_vector* out) {
+    size_t bytes = 0;
+    while (iter.has_more()) {
+      zmq::message_t* frame = new zmq::message_t;
+      frame->move(&iter.next());
+      bytes += frame->size();
+      out->push_back(frame);
+    }
+    return bytes;
+  }
+
+  void send_at(zmq::socket_t* socket, message_vector* frames,
+               uint64 send_usec) {
+    if (send_usec <= zclock_time_usec()) {
+      send(socket, frames);
+      return;
+    }
+    // The reactor's timers have millisecond resolution; round up so that
+    // messages are never early.
+    reactor_->run_closure_at((send_usec + 999) / 1000, new_callback(
+            &proxy::send, socket, frames));
+  }
+
+  static void send(zmq::socket_t* socket, message_vector* frames) {
+    write_vector_to_socket(socket, *frames);
+    delete frames;
+  }
+
+  reactor* reactor_;
+  // Owned by the reactor.
+  zmq::socket_t* frontend_;
+  zmq::socket_t* backend_;
+  boost::mt19937 random_;
+  link_model requests_;
+  link_model replies_;
+  uint64 next_event_id_;
+  pending_map pending_;
+  DISALLOW_COPY_AND_ASSIGN(proxy);
+};
+
+int run_proxy() {
+  if (FLAGS_drop < 0 || FLAGS_drop > 1 || FLAGS_reorder < 0 ||
+      FLAGS_reorder > 1) {
+    cerr << "--drop and --reorder are probabilities." << endl;
+    return 1;
+  }
+  if (FLAGS_distribution != "uniform" && FLAGS_distribution != "normal" &&
+      FLAGS_distribution != "exponential" &&
+      FLAGS_distribution != "pareto") {
+    cerr << "Unknown distribution: " << FLAGS_distribution << endl;
+    return 1;
+  }
+  if (FLAGS_impair != "both" && FLAGS_impair != "requests" &&
+      FLAGS_impair != "replies") {
+    cerr << "--impair must be both, requests or replies." << endl;
+    return 1;
+  }
+  zmq::context_t context(1);
+  install_signal_handler();
+  {
+    reactor reactor;
+    proxy proxy(&context, &reactor);
+    reactor.loop();
+    proxy.print_stats();
+  }
+  return 0;
+}
+}  // namespace rpcz
+
+int main(int argc, char *argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("listen", po::value<std::string>(&FLAGS_listen),
+       "Endpoint that the clients connect to.")
+      ("connect", po::value<std::string>(&FLAGS_connect),
+       "Endpoint of the server.")
+      ("latency_ms", po::value<double>(&FLAGS_latency_ms)->default_value(0),
+       "Base one-way latency.")
+      ("jitter_ms", po::value<double>(&FLAGS_jitter_ms)->default_value(0),
+       "Spread of the latency: the half-width for uniform, the standard "
+       "deviation for normal and the mean of the added delay for "
+       "exponential and pareto.")
+      ("distribution",
+       po::value<std::string>(&FLAGS_distribution)->default_value("uniform"),
+       "Latency distribution: uniform, normal, exponential or pareto.")
+      ("drop", po::value<double>(&FLAGS_drop)->default_value(0),
+       "Probability of dropping a message.")
+      ("reorder", po::value<double>(&FLAGS_reorder)->default_value(0),
+       "Probability of sending a message without the latency.")
+      ("bandwidth_kbps",
+       po::value<int>(&FLAGS_bandwidth_kbps)->default_value(0),
+       "Link speed of each direction in kilobits per second, 0 for no "
+       "limit.")
+      ("stall_every_ms",
+       po::value<int>(&FLAGS_stall_every_ms)->default_value(0),
+       "Period of the link stalls, 0 for none.")
+      ("stall_ms", po::value<int>(&FLAGS_stall_ms)->default_value(0),
+       "Duration of each link stall.")
+      ("impair", po::value<std::string>(&FLAGS_impair)->default_value("both"),
+       "Directions to impair: both, requests or replies.")
+      ("seed", po::value<unsigned int>(&FLAGS_seed)->default_value(1),
+       "Seed of the random impairments.");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (po::error &e) {
+    cerr << "Command line error: " << e.what() << endl;
+    return 1;
+  }
+  if (vm.count("help") || FLAGS_listen.empty() || FLAGS_connect.empty()) {
+    cout << "Usage: " << argv[0] << " --listen=<endpoint> "
+         << "--connect=<endpoint> [options]" << endl << endl << desc;
+    return 1;
+  }
+  return rpcz::run_proxy();
+}
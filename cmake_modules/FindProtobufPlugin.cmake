@@ -49,6 +49,10 @@
 #          header files
 #   ARGN = proto files
 #
+# PROTOBUF_IMPORT_DIRS can be set to more directories to search for the
+# imported protos. PROTOBUF_GENERATE_MULTI and PROTOBUF_GENERATE_SINGLE take
+# PLUGIN_OPTIONS, the parameter string passed to the plugin.
+#
 #  ====================================================================
 
 
@@ -85,7 +89,7 @@ function(PROTOBUF_GENERATE_PYTHON SRCS)
 endfunction()
 
 function(PROTOBUF_GENERATE_MULTI)
-  CMAKE_PARSE_ARGUMENTS(OPTIONS "" "PLUGIN;PLUGIN_NAME"
+  CMAKE_PARSE_ARGUMENTS(OPTIONS "" "PLUGIN;PLUGIN_NAME;PLUGIN_OPTIONS"
                         "PROTOS;OUTPUT_STRUCT;FLAGS;DEPENDS" ${ARGN})
   if(NOT OPTIONS_PROTOS)
     message(SEND_ERROR "Error: PROTOBUF_GENERATE_MULTI() called without any proto files")
@@ -113,6 +117,7 @@ function(PROTOBUF_GENERATE_MULTI)
     endforeach()
     PROTOBUF_GENERATE_SINGLE(PLUGIN ${OPTIONS_PLUGIN} FILE ${FIL}
                              PLUGIN_NAME ${OPTIONS_PLUGIN_NAME}
+                             PLUGIN_OPTIONS "${OPTIONS_PLUGIN_OPTIONS}"
                              OUTPUTS ${OUTPUTS}
                              DEPENDS ${OPTIONS_DEPENDS}
                              FLAGS ${INCLUDE_FLAG} ${OPTIONS_FLAGS})
@@ -140,22 +145,34 @@ function(_protobuf_generate_path IPATH)
   else()
     set(_protobuf_include_path -I ${CMAKE_CURRENT_SOURCE_DIR})
   endif()
+  # Directories of the imported protos.
+  foreach(DIR ${PROTOBUF_IMPORT_DIRS})
+    get_filename_component(ABS_PATH ${DIR} ABSOLUTE)
+    list(FIND _protobuf_include_path ${ABS_PATH} _contains_already)
+    if(${_contains_already} EQUAL -1)
+        list(APPEND _protobuf_include_path -I ${ABS_PATH})
+    endif()
+  endforeach()
   set(${IPATH} ${_protobuf_include_path} PARENT_SCOPE)
 endfunction()
 
 include(${CMAKE_ROOT}/Modules/CMakeParseArguments.cmake)
 
 function(PROTOBUF_GENERATE_SINGLE)
-  CMAKE_PARSE_ARGUMENTS(OPTIONS "" "PLUGIN;PLUGIN_NAME;FILE" "FLAGS;OUTPUTS;DEPENDS"
-                        ${ARGN})
+  CMAKE_PARSE_ARGUMENTS(OPTIONS "" "PLUGIN;PLUGIN_NAME;PLUGIN_OPTIONS;FILE"
+                        "FLAGS;OUTPUTS;DEPENDS" ${ARGN})
   if(NOT OPTIONS_PLUGIN_NAME)
     set(OPTIONS_PLUGIN_NAME ${OPTIONS_PLUGIN})
   endif(NOT OPTIONS_PLUGIN_NAME)
+  set(OUT_DIR ${CMAKE_CURRENT_BINARY_DIR})
+  if(OPTIONS_PLUGIN_OPTIONS)
+    set(OUT_DIR ${OPTIONS_PLUGIN_OPTIONS}:${CMAKE_CURRENT_BINARY_DIR})
+  endif(OPTIONS_PLUGIN_OPTIONS)
   get_filename_component(ABS_FILE ${OPTIONS_FILE} ABSOLUTE)
   add_custom_command(
     OUTPUT ${OPTIONS_OUTPUTS}
     COMMAND  ${PROTOBUF_PROTOC_EXECUTABLE}
-    ARGS --${OPTIONS_PLUGIN}_out  ${CMAKE_CURRENT_BINARY_DIR} ${OPTIONS_FLAGS}
+    ARGS --${OPTIONS_PLUGIN}_out  ${OUT_DIR} ${OPTIONS_FLAGS}
          ${ABS_FILE}
     DEPENDS ${OPTIONS_FILE} ${OPTIONS_DEPENDS}
     COMMENT "Running ${OPTIONS_PLUGIN_NAME} protocol buffer compiler on ${OPTIONS_FILE}"
@@ -1,8 +1,12 @@
 set(RPCZ_PLUGIN_ROOT ${CMAKE_CURRENT_LIST_DIR}/../build/src/rpcz/plugin)
 
+# PROTOBUF_GENERATE_RPCZ(SRCS HDRS <protos> [OPTIONS <plugin options>]), e.g.
+# OPTIONS sync_errors=status.
 function(PROTOBUF_GENERATE_RPCZ SRCS HDRS)
+  CMAKE_PARSE_ARGUMENTS(RPCZ "" "OPTIONS" "" ${ARGN})
   set(PLUGIN_BIN ${RPCZ_PLUGIN_ROOT}/cpp/protoc-gen-cpp_rpcz)
-  PROTOBUF_GENERATE_MULTI(PLUGIN "cpp_rpcz" PROTOS ${ARGN}
+  PROTOBUF_GENERATE_MULTI(PLUGIN "cpp_rpcz" PROTOS ${RPCZ_UNPARSED_ARGUMENTS}
+                          PLUGIN_OPTIONS "${RPCZ_OPTIONS}"
                           OUTPUT_STRUCT "_SRCS:.rpcz.cc;_HDRS:.rpcz.h"
                           FLAGS "--plugin=protoc-gen-cpp_rpcz=${PLUGIN_BIN}"
                           DEPENDS ${PLUGIN_BIN})
@@ -0,0 +1,132 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_ACCESS_LOG_H
+#define RPCZ_ACCESS_LOG_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include "rpcz/macros.hpp"
+#include "rpcz/request_sampler.hpp"
+#include "rpcz/sync_event.hpp"
+
+namespace rpcz {
+class access_log_buffer;
+
+// One served request, as stored in the access log file. Records are written
+// in the host's byte order.
+struct access_log_record {
+  // When the server read the request, in microseconds since the epoch.
+  uint64 timestamp_usec;
+  // From reading the request to sending the reply.
+  uint64 latency_usec;
+  uint32 request_bytes;
+  uint32 response_bytes;
+  // An rpcz::status_code and, for APPLICATION_ERROR, the application error.
+  int32 status;
+  int32 application_error;
+  // The ZeroMQ identity of the client, truncated to 31 bytes.
+  uint8 peer_size;
+  char peer[31];
+  // "service.method", NUL-padded and truncated to 64 bytes.
+  char method[64];
+};
+
+// Access log files start with this header, followed by records.
+struct access_log_file_header {
+  char magic[8];  // kAccessLogMagic
+  uint32 version;
+  uint32 record_size;
+};
+
+static const char kAccessLogMagic[8] = {'R', 'P', 'C', 'Z', 'A', 'L', 'O', 'G'};
+static const uint32 kAccessLogVersion = 1;
+
+// An access_log records a sample of the requests served by a server into a
+// binary file:
+//
+//     access_log log("/var/log/search.alog");
+//     log.set_default_sample_rate(100);
+//     log.set_sample_rate("SearchService", "Search", 1);
+//     server.set_access_log(&log);
+//
+// The request path only copies a fixed-size record into a ring buffer owned by
+// the calling thread; a background thread writes them out. When a buffer is
+// full, records are dropped rather than blocking the server. Use zaccesslog to
+// print a log file.
+class access_log {
+ public:
+  // Opens (truncates) the given file. Throws std::runtime_error if the file
+  // can not be opened. records_per_thread is rounded up to a power of two.
+  explicit access_log(const std::string& filename,
+                      size_t records_per_thread = 4096);
+
+  // Writes out all pending records and closes the file. All servers using the
+  // log must be destroyed first.
+  ~access_log();
+
+  // Logs one in every one_in requests, 0 logs nothing. Applies to methods
+  // without a rate of their own. The default is 1 (every request). Sample
+  // rates have to be set before the log is handed to a server.
+  void set_default_sample_rate(uint32 one_in);
+  void set_sample_rate(const std::string& service, const std::string& method,
+                       uint32 one_in);
+
+  // Returns whether the current request of the given method should be logged.
+  bool should_sample(const std::string& service, const std::string& method);
+
+  // Queues a record to be written. Safe to call from any thread.
+  void append(const access_log_record& record);
+
+  // Number of records dropped because a buffer was full.
+  uint64 get_dropped_records();
+
+ private:
+  access_log_buffer* get_thread_buffer();
+  void drain_loop();
+  void drain();
+
+  FILE* file_;
+  size_t records_per_thread_;
+  request_sampler sampler_;
+  boost::thread_specific_ptr<access_log_buffer> thread_buffer_;
+  boost::mutex buffers_mu_;
+  std::vector<access_log_buffer*> buffers_;
+  sync_event quit_;
+  boost::thread drain_thread_;
+  DISALLOW_COPY_AND_ASSIGN(access_log);
+};
+
+// Reads the records of an access log file.
+class access_log_reader {
+ public:
+  access_log_reader();
+  ~access_log_reader();
+
+  // Returns false if the file can not be read or is not an access log.
+  bool open(const std::string& filename);
+
+  // Reads the next record. Returns false at the end of the file.
+  bool next(access_log_record* record);
+
+ private:
+  FILE* file_;
+  DISALLOW_COPY_AND_ASSIGN(access_log_reader);
+};
+}  // namespace rpcz
+#endif
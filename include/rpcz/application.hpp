@@ -17,7 +17,9 @@
 #ifndef RPCZ_APPLICATION_H
 #define RPCZ_APPLICATION_H
 
+#include <map>
 #include <string>
+#include <boost/thread/mutex.hpp>
 #include "rpcz/macros.hpp"
 
 namespace zmq {
@@ -26,6 +28,8 @@ class context_t;
 
 namespace rpcz {
 class connection_manager;
+struct metrics_snapshot;
+class response_cache;
 class rpc_channel;
 class server;
 
@@ -33,11 +37,31 @@ class server;
 // RPCZ client or server application.
 class application {
  public:
+  // How channels created by create_rpc_channel() call a server of this
+  // application that is bound to their endpoint.
+  enum dispatch_mode {
+    // Through the connection manager, like any other server.
+    DISPATCH_REMOTE = 0,
+    // By calling the service directly on the calling thread.
+    DISPATCH_ON_CALLING_THREAD = 1,
+    // By calling the service directly on a connection manager thread.
+    DISPATCH_ON_WORKERS = 2,
+  };
+
   class options {
    public:
     options() : connection_manager_threads(10),
                 zeromq_context(NULL),
-                zeromq_io_threads(1) {}
+                zeromq_io_threads(1),
+                cpu_accounting(false),
+                worker_stall_threshold_ms(0),
+                replace_stalled_workers(false),
+                max_replacement_workers(10),
+                in_process_dispatch(DISPATCH_REMOTE),
+                copy_in_process_requests(true),
+                locality_upgrade(false),
+                response_cache(NULL),
+                coalesce_calls(false) {}
 
     // Number of connection manager threads. Those threads are used for
     // running user code: handling server requests or running callbacks.
@@ -52,6 +76,46 @@ class application {
     // Number of ZeroMQ I/O threads, to be passed to zmq_init(). This value is
     // ignored when you provide your own ZeroMQ context.
     int zeromq_io_threads;
+
+    // Whether to measure the wall and cpu time spent in each method's
+    // handlers and callbacks. See connection_manager::set_cpu_accounting().
+    bool cpu_accounting;
+
+    // If positive, worker threads that spend longer than this in a single
+    // handler or callback are reported, and optionally replaced. See
+    // connection_manager::enable_watchdog().
+    int64 worker_stall_threshold_ms;
+    bool replace_stalled_workers;
+    int max_replacement_workers;
+
+    // Calls to servers bound through this application skip serialization,
+    // ZeroMQ and the broker unless this is DISPATCH_REMOTE: the service gets
+    // the request object, and the response is copied into the caller's.
+    // Deadlines and errors behave as for remote calls, but the server's
+    // access log, traffic capture and metrics do not see these calls. A
+    // server has to outlive the channels that call it directly.
+    dispatch_mode in_process_dispatch;
+
+    // Whether services called directly get a copy of the request. If false,
+    // the request has to stay valid until the service replies.
+    bool copy_in_process_requests;
+
+    // Whether tcp:// connections to a server on the same host switch to an
+    // ipc:// endpoint that the server binds for that purpose. See
+    // connection_manager::set_locality_upgrade(). Off by default.
+    bool locality_upgrade;
+
+    // If not NULL, channels created by the application answer calls to the
+    // cacheable methods of this cache from it when they can. Channels that
+    // dispatch in process do not use it. The cache must outlive the
+    // application's channels.
+    rpcz::response_cache* response_cache;
+
+    // Whether channels created by the application send a call that is
+    // identical to one in flight, or attach it to the one in flight. Only
+    // safe when the methods called have no side effects. See
+    // rpc_channel::create().
+    bool coalesce_calls;
   };
 
   application();
@@ -62,7 +126,9 @@ class application {
 
   // Creates an rpc_channel to the given endpoint. Attach it to a Stub and you
   // can start making calls through this channel from any thread. No locking
-  // needed. It is your responsibility to delete this object.
+  // needed. It is your responsibility to delete this object, before the
+  // application; deleting it closes its connection. See
+  // options::in_process_dispatch for endpoints served by this application.
   virtual rpc_channel* create_rpc_channel(const std::string& endpoint);
 
   // Blocks the current thread until another thread calls terminate.
@@ -71,13 +137,30 @@ class application {
   // Releases all the threads that are blocked inside run()
   virtual void terminate();
 
+  // Copies the current values of the application's counters into snapshot.
+  virtual void get_metrics_snapshot(metrics_snapshot* snapshot);
+
  private:
   void init(const options& options);
 
+  typedef std::map<std::string, server*> server_map;
+
+  // Called by servers of this application when they bind and go away.
+  void register_local_server(const std::string& endpoint, server* server);
+  void unregister_local_server(server* server);
+
   bool owns_context_;
   zmq::context_t* context_;
   scoped_ptr<connection_manager> connection_manager_;
+  dispatch_mode in_process_dispatch_;
+  bool copy_in_process_requests_;
+  response_cache* response_cache_;
+  bool coalesce_calls_;
+  boost::mutex local_servers_mu_;
+  server_map local_servers_;
+  friend class proxy_server;
   friend class server;
+  friend class traffic_mirror;
 };
 }  // namespace rpcz
 #endif
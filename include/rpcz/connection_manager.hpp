@@ -18,6 +18,7 @@
 #define RPCZ_CONNECTION_MANAGER_H
 
 #include <string>
+#include <boost/atomic.hpp>
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
 #include "rpcz/macros.hpp"
@@ -34,8 +35,13 @@ class client_connection;
 class closure;
 class connection;
 class connection_thread_context;
+struct connection_counters;
 class message_iterator;
 class message_vector;
+class metrics_registry;
+struct metrics_snapshot;
+class worker_watchdog;
+struct worker_state;
 
 // A connection_manager is a multi-threaded asynchronous system for communication
 // over ZeroMQ sockets. A connection_manager can:
@@ -66,6 +72,8 @@ class connection_manager {
     ACTIVE = 1,
     DONE = 2,
     DEADLINE_EXCEEDED = 3,
+    // The request was sent on a connection that was closed.
+    CLOSED = 4,
   };
 
   typedef boost::function<void(const client_connection&, message_iterator&)>
@@ -94,17 +102,58 @@ class connection_manager {
   // Executes the closure on one of the worker threads.
   virtual void add(closure* closure);
 
+  // Executes the closure on one of the worker threads once timeout_ms
+  // milliseconds have passed.
+  virtual void add_timeout(int64 timeout_ms, closure* closure);
+
   // Blocks this thread until terminate() is called from another thread.
   virtual void run();
 
   // Releases all the threads that are blocked inside run()
   virtual void terminate();
 
+  // Enables measuring the wall and cpu time that the worker threads spend in
+  // each method's server handlers and client callbacks. Off by default.
+  virtual void set_cpu_accounting(bool enabled);
+
+  // Whether connections to tcp:// and ntcp:// endpoints of a server on the
+  // same host switch to an ipc:// endpoint that the server advertises, and
+  // whether servers bound to such endpoints advertise one. Both sides have
+  // to enable it. Off by default, because an upgraded connection never
+  // falls back to tcp: if the server comes back without its ipc:// endpoint,
+  // requests sent on the connection are lost. Applies to the connect() and
+  // bind() calls made after it.
+  virtual void set_locality_upgrade(bool enabled);
+
+  // Copies the current values of all counters into snapshot.
+  virtual void get_metrics_snapshot(metrics_snapshot* snapshot);
+
+  // Starts a thread that reports worker threads that spend more than
+  // stall_threshold_ms in a single handler, callback or closure. A stalled
+  // worker is logged with the method it runs and, on Linux, its stack, and
+  // gets no new work until it finishes. If replace_stalled_workers is true,
+  // a new worker thread is started for each stall, so stuck handlers do not
+  // reduce the capacity of the connection_manager. At most
+  // max_replacement_workers of them run at a time, and each one is retired
+  // once the worker it replaced finishes. Can be called once.
+  virtual void enable_watchdog(int64 stall_threshold_ms,
+                               bool replace_stalled_workers,
+                               int max_replacement_workers);
+
  private:
   zmq::context_t* context_;
+  boost::atomic<bool> locality_upgrade_;
+  scoped_ptr<metrics_registry> metrics_;
+  scoped_ptr<worker_watchdog> watchdog_;
 
   inline zmq::socket_t& get_frontend_socket();
 
+  // Starts a worker thread. The new worker announces itself to the broker.
+  void start_worker();
+
+  // Asks the broker to start a worker thread.
+  void request_worker();
+
   boost::thread broker_thread_;
   boost::thread_group worker_threads_;
   boost::thread_specific_ptr<zmq::socket_t> socket_;
@@ -114,7 +163,11 @@ class connection_manager {
   DISALLOW_COPY_AND_ASSIGN(connection_manager);
   friend class connection;
   friend class client_connection;
-  friend class connection_managerThread;
+  friend class connection_manager_thread;
+  friend class rpc_channel_impl;
+  friend class server;
+  friend void worker_thread(connection_manager*, zmq::context_t*, std::string,
+                            worker_state*);
 };
 
 // Installs a SIGINT and SIGTERM handlers that causes all RPCZ's event loops
@@ -135,10 +188,25 @@ class connection {
   //               forever.
   // callback - a closure that will be ran on one of the worker threads when a
   //           response arrives or it timeouts.
+  // sent_time_usec - if not NULL, receives the time at which the request was
+  //                  sent out, in microseconds since the epoch. It is set
+  //                  before the callback runs and has to stay valid until
+  //                  then.
   void send_request(
       message_vector& request,
       int64 deadline_ms,
-      connection_manager::client_request_callback callback);
+      connection_manager::client_request_callback callback,
+      uint64* sent_time_usec = NULL);
+
+  // Closes the connection once the requests sent on it got their reply or
+  // timed out, and drops its entry from the metrics. Requests sent on the
+  // connection, or its copies, afterwards complete with CLOSED. Closing a
+  // connection again does nothing.
+  void close();
+
+  // Identifies this connection among the connections of its manager. The id
+  // of a closed connection is not given to the connections made later.
+  uint64 get_connection_id() const { return connection_id_; }
 
  private:
   connection(connection_manager *manager, uint64 connection_id) :
@@ -146,6 +214,7 @@ class connection {
   connection_manager* manager_;
   uint64 connection_id_;
   friend class connection_manager;
+  friend class rpc_channel_impl;
 };
 
 class client_connection {
@@ -154,15 +223,21 @@ class client_connection {
 
  private:
   client_connection(connection_manager* manager, uint64 socket_id,
-                   std::string& sender, std::string& event_id)
-      : manager_(manager), socket_id_(socket_id), sender_(sender),
-      event_id_(event_id) {}
+                    connection_counters* counters,
+                    std::string& sender, std::string& event_id)
+      : manager_(manager), socket_id_(socket_id), counters_(counters),
+      sender_(sender), event_id_(event_id) {}
 
   connection_manager* manager_;
   uint64 socket_id_;
+  // The gauges of the bound endpoint, owned by the metrics registry.
+  connection_counters* counters_;
   const std::string sender_;
   const std::string event_id_;
-  friend void worker_thread(connection_manager*, zmq::context_t*, std::string);
+  friend void worker_thread(connection_manager*, zmq::context_t*, std::string,
+                            worker_state*);
+  friend class connection_manager_thread;
+  friend class server;
 };
 }  // namespace rpcz
 #endif
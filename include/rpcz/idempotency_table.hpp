@@ -0,0 +1,91 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_IDEMPOTENCY_TABLE_H
+#define RPCZ_IDEMPOTENCY_TABLE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "rpcz/macros.hpp"
+
+namespace zmq {
+class message_t;
+}  // namespace zmq
+
+namespace rpcz {
+class idempotency_stripe;
+class rpc_response_header;
+class server_channel;
+
+// An idempotency_table lets a server execute a request that carries an
+// idempotency key (see rpc::set_idempotency_key()) only once, so that
+// clients can retry and hedge calls that are not idempotent themselves:
+//
+//     idempotency_table table(100000, 60000);
+//     server.set_idempotency_table(&table);
+//
+// A retry that arrives while the first request is being handled waits for
+// its reply; one that arrives after gets the same reply, errors included.
+// Replies are kept for ttl_ms, and the oldest are dropped when there are
+// more than max_entries. The table is split into stripes that have their
+// own lock.
+class idempotency_table {
+ public:
+  idempotency_table(size_t max_entries, int64 ttl_ms, int stripes = 16);
+
+  // All servers using the table must be destroyed first.
+  ~idempotency_table();
+
+  enum begin_result {
+    // The request is new, and the caller has to call finish() or abandon()
+    // with its reply.
+    STARTED = 0,
+    // The request is in progress; the table took the channel, and returns it
+    // from finish().
+    WAITING = 1,
+    // The request was completed; its reply was copied.
+    REPLAYED = 2,
+  };
+
+  // Looks up the request with the given key. Key has to include the
+  // service and method. Safe to call from any thread.
+  begin_result begin(const std::string& key, server_channel* channel,
+                     rpc_response_header* header, zmq::message_t* payload);
+
+  // Keeps the reply of a request that begin() STARTED, and hands over the
+  // channels that waited for it. The table keeps a copy of the payload frame,
+  // which shares its data.
+  void finish(const std::string& key, const rpc_response_header& header,
+              zmq::message_t* payload, std::vector<server_channel*>* waiters);
+
+  // Forgets a request that begin() STARTED and that will not be replied, and
+  // hands over the channels that waited for it.
+  void abandon(const std::string& key, std::vector<server_channel*>* waiters);
+
+  // The number of requests that waited for, or got, the reply of an earlier
+  // request.
+  uint64 get_deduplicated_requests() const;
+
+  // The number of requests in progress or replied that the table holds.
+  size_t get_entries() const;
+
+ private:
+  idempotency_stripe* get_stripe(const std::string& key);
+
+  std::vector<idempotency_stripe*> stripes_;
+  DISALLOW_COPY_AND_ASSIGN(idempotency_table);
+};
+}  // namespace rpcz
+#endif
@@ -28,6 +28,16 @@ namespace rpcz {
 using google::protobuf::scoped_ptr; 
 using google::protobuf::uint64;
 using google::protobuf::int64;
+using google::protobuf::uint32;
+using google::protobuf::int32;
+using google::protobuf::uint8;
+
+// Declares a thread-local variable of a POD type.
+#ifdef _MSC_VER
+#define RPCZ_THREAD_LOCAL __declspec(thread)
+#else
+#define RPCZ_THREAD_LOCAL __thread
+#endif
 
 // A macro to disallow the copy constructor and operator= functions
 // This should be used in the private: declarations for a class
@@ -0,0 +1,92 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_METRICS_H
+#define RPCZ_METRICS_H
+
+#include <string>
+#include <vector>
+#include "rpcz/macros.hpp"
+
+namespace rpcz {
+
+// Time spent by the connection manager threads on behalf of a method. For
+// servers this covers the invocations of the service handler, for clients
+// the invocations of the response callbacks. Wall time well above cpu time
+// means the code was blocked (on locks, I/O or downstream calls).
+struct method_stats {
+  std::string service;
+  std::string method;
+  uint64 calls;
+  uint64 wall_usec;
+  uint64 cpu_usec;
+};
+
+// Allocations made by rpcz itself for one subsystem: "frames" (ZeroMQ
+// messages holding headers and payloads), "closures" (callbacks and function
+// objects passed between threads), "pending_entries" (the broker's map of
+// requests awaiting a reply), "channels" (rpc and server channels) and
+// "messages" (request protocol buffers parsed by servers). The counts are
+// cumulative.
+struct allocation_stats {
+  std::string subsystem;
+  uint64 objects;
+  uint64 bytes;
+};
+
+// Data held on behalf of a connection. For a client connection these are
+// the requests that were sent and wait for a reply. For a bound server
+// endpoint these are the requests being handled, and the replies that were
+// produced but not yet sent out by the broker.
+struct connection_stats {
+  std::string endpoint;
+  bool server;
+  int64 inflight_requests;
+  int64 inflight_request_bytes;
+  int64 inflight_response_bytes;
+};
+
+// A point-in-time copy of a connection_manager's counters. See
+// connection_manager::get_metrics_snapshot().
+struct metrics_snapshot {
+  metrics_snapshot() : worker_stalls(0), replacement_workers(0) {}
+
+  // Filled only when cpu accounting is enabled.
+  std::vector<method_stats> server_methods;
+  std::vector<method_stats> client_methods;
+
+  // Process wide, counted only while memory accounting is enabled.
+  std::vector<allocation_stats> allocations;
+
+  // One entry for each connect() and bind() of the connection_manager, until
+  // the connection is closed. The gauges move only while memory accounting
+  // is enabled.
+  std::vector<connection_stats> connections;
+
+  // Number of times a worker thread was found running a single command for
+  // longer than the stall threshold. See
+  // connection_manager::enable_watchdog().
+  uint64 worker_stalls;
+
+  // Worker threads currently running in place of stalled ones. They retire
+  // as the stalled workers finish.
+  uint64 replacement_workers;
+};
+
+// Enables counting allocations and in-flight bytes. It costs a few atomic
+// additions per request, so it is off by default. Affects all the
+// connection managers of the process.
+void set_memory_accounting(bool enabled);
+}  // namespace rpcz
+#endif
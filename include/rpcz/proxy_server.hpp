@@ -0,0 +1,95 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_PROXY_SERVER_H
+#define RPCZ_PROXY_SERVER_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "rpcz/macros.hpp"
+
+namespace rpcz {
+class application;
+class client_connection;
+class connection_manager;
+class message_iterator;
+
+// A proxy_server forwards the requests it receives to upstream servers and
+// relays their replies back, for gateways in front of rpcz backends. Only
+// the request header is parsed, to route the request by service and method;
+// payloads and replies are forwarded as they are, without copying, so the
+// proxy needs no generated code for the services it forwards:
+//
+//     proxy_server proxy(application);
+//     proxy.add_route("SearchService", "", "tcp://search1:5555");
+//     proxy.add_route("SearchService", "", "tcp://search2:5555");
+//     proxy.add_route("", "", "tcp://default:5555");
+//     proxy.bind("tcp://*:5556");
+//
+// Requests for which there is no route fail with NO_SUCH_SERVICE.
+class proxy_server {
+ public:
+  // Constructs a proxy_server that uses the provided application. The
+  // application must outlive the proxy_server.
+  explicit proxy_server(application& application);
+
+  // Constructs a proxy_server that uses the provided connection_manager. The
+  // connection_manager must outlive the proxy_server.
+  explicit proxy_server(connection_manager& connection_manager);
+
+  ~proxy_server();
+
+  // Adds an upstream endpoint for the requests to the given method of the
+  // service. An empty method matches all the methods of the service that
+  // have no route of their own, and an empty service all the services that
+  // have none. Requests are sent to the upstream of their route with the
+  // fewest requests in flight. Must be called before bind().
+  void add_route(const std::string& service, const std::string& method,
+                 const std::string& endpoint);
+
+  // Requests that get no reply from upstream within deadline_ms fail with
+  // DEADLINE_EXCEEDED. -1, the default, waits forever. Must be called
+  // before bind().
+  void set_deadline_ms(int64 deadline_ms);
+
+  void bind(const std::string& endpoint);
+
+ private:
+  struct upstream;
+  struct route;
+  typedef std::map<std::string, upstream*> upstream_map;
+  typedef std::map<std::pair<std::string, std::string>, route*> route_map;
+
+  void handle_request(const client_connection& connection,
+                      message_iterator& iter);
+
+  // Relays the reply, or the result, a connection_manager::status, if there
+  // is none.
+  void handle_reply(const client_connection& connection, upstream* upstream,
+                    int result, message_iterator& iter);
+
+  // Returns the upstream for the request, or NULL if there is no route.
+  upstream* find_upstream(const std::string& service,
+                          const std::string& method);
+
+  connection_manager& connection_manager_;
+  int64 deadline_ms_;
+  upstream_map upstreams_;
+  route_map routes_;
+  DISALLOW_COPY_AND_ASSIGN(proxy_server);
+};
+}  // namespace rpcz
+#endif
@@ -0,0 +1,51 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_REQUEST_SAMPLER_H
+#define RPCZ_REQUEST_SAMPLER_H
+
+#include <map>
+#include <string>
+#include "rpcz/macros.hpp"
+
+namespace rpcz {
+
+// Picks a random sample of requests, at a rate that can be set per method,
+// for the access_log, traffic_capture and traffic_mirror. Rates have to be
+// set before should_sample() is called; after that, should_sample() is safe
+// to call from any thread.
+class request_sampler {
+ public:
+  // Samples every request until told otherwise.
+  request_sampler();
+
+  // Samples one in every one_in requests, 0 samples nothing. Applies to
+  // methods without a rate of their own.
+  void set_default_sample_rate(uint32 one_in);
+  void set_sample_rate(const std::string& service, const std::string& method,
+                       uint32 one_in);
+
+  // Returns whether the current request of the given method is sampled.
+  bool should_sample(const std::string& service,
+                     const std::string& method) const;
+
+ private:
+  typedef std::map<std::string, std::map<std::string, uint32> >
+      sample_rate_map;
+
+  uint32 default_one_in_;
+  sample_rate_map sample_rates_;
+};
+}  // namespace rpcz
+#endif
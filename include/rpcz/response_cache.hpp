@@ -0,0 +1,104 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_RESPONSE_CACHE_H
+#define RPCZ_RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "rpcz/macros.hpp"
+
+namespace google {
+namespace protobuf {
+class ServiceDescriptor;
+}  // namespace protobuf
+}  // namespace google
+
+namespace rpcz {
+class response_cache_shard;
+
+// A response_cache keeps the responses of idempotent methods on the client,
+// so that calls repeating a recent request are answered without a round-trip:
+//
+//     response_cache cache(64 << 20);
+//     cache.set_cacheable("ConfigService", "Lookup", 5000);
+//     application::options options;
+//     options.response_cache = &cache;
+//
+// Entries are keyed by service, method and serialized request, and expire
+// ttl_ms after the response was received. Only successful responses are
+// cached. When the cache holds more than max_bytes, entries are evicted with
+// the CLOCK algorithm. The cache is split into shards that have their own
+// lock; lookups only take it shared, so they do not wait for each other.
+class response_cache {
+ public:
+  explicit response_cache(size_t max_bytes, int shards = 16);
+
+  // All the channels using the cache must be deleted first.
+  ~response_cache();
+
+  // Caches the responses of the given method for ttl_ms. Has to be called
+  // before the cache is used by a channel.
+  void set_cacheable(const std::string& service, const std::string& method,
+                     int64 ttl_ms);
+
+  // Caches the responses of the methods of the service that have a
+  // cache_ttl_ms in their rpcz options (see rpcz_options.proto). The service
+  // is named after its descriptor unless a name is given.
+  void set_cacheable(const google::protobuf::ServiceDescriptor* descriptor);
+  void set_cacheable(const google::protobuf::ServiceDescriptor* descriptor,
+                     const std::string& service);
+
+  // Returns how long the responses of the method are cached, 0 if they are
+  // not.
+  int64 get_ttl_ms(const std::string& service,
+                   const std::string& method) const;
+
+  // Returns the key for a request to the given method.
+  static std::string make_key(const std::string& service,
+                              const std::string& method,
+                              const void* request, size_t request_size);
+
+  // Copies the response cached for key into response. Returns false if there
+  // is none, or if it has expired. Safe to call from any thread.
+  bool lookup(const std::string& key, std::string* response);
+
+  // Caches a response for ttl_ms, replacing the previous one. Safe to call
+  // from any thread.
+  void insert(const std::string& key, const std::string& response,
+              int64 ttl_ms);
+
+  // Removes all the entries.
+  void clear();
+
+  uint64 get_hits() const;
+  uint64 get_misses() const;
+  uint64 get_evictions() const;
+
+  // The size of the cached entries, keys included.
+  size_t get_bytes() const;
+
+ private:
+  response_cache_shard* get_shard(const std::string& key);
+
+  typedef std::map<std::string, std::map<std::string, int64> > ttl_map;
+
+  ttl_map ttls_;
+  std::vector<response_cache_shard*> shards_;
+  DISALLOW_COPY_AND_ASSIGN(response_cache);
+};
+}  // namespace rpcz
+#endif
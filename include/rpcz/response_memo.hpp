@@ -0,0 +1,106 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_RESPONSE_MEMO_H
+#define RPCZ_RESPONSE_MEMO_H
+
+#include <stddef.h>
+#include <list>
+#include <map>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "rpcz/macros.hpp"
+
+namespace zmq {
+class message_t;
+}  // namespace zmq
+
+namespace rpcz {
+struct response_memo_entry;
+
+// A response_memo keeps the serialized responses of pure methods on the
+// server, so that requests repeating a recent one are answered without
+// running the handler:
+//
+//     response_memo memo(64 << 20);
+//     memo.set_memoized("ConfigService", "Lookup", 5000);
+//     server.set_response_memo(&memo);
+//
+// Entries are found by a hash of service, method and request bytes, and
+// compared in full before they are used. They expire ttl_ms after the
+// response was sent, and the least recently used are evicted when the memo
+// holds more than max_bytes. Replies from the memo share the memoized frame
+// instead of copying it. Only successful responses are memoized.
+class response_memo {
+ public:
+  explicit response_memo(size_t max_bytes);
+
+  // All servers using the memo must be destroyed first.
+  ~response_memo();
+
+  // Memoizes the responses of the given method for ttl_ms. Has to be called
+  // before the memo is handed to a server.
+  void set_memoized(const std::string& service, const std::string& method,
+                    int64 ttl_ms);
+
+  // Returns how long the responses of the method are memoized, 0 if they
+  // are not.
+  int64 get_ttl_ms(const std::string& service,
+                   const std::string& method) const;
+
+  // Makes response share the frame memoized for the request. Returns false
+  // if there is none, or if it has expired. Safe to call from any thread.
+  bool lookup(const std::string& service, const std::string& method,
+              zmq::message_t* request, zmq::message_t* response);
+
+  // Memoizes response for ttl_ms. The memo copies the request bytes, and
+  // keeps a copy of the response frame, which shares its data. Safe to call
+  // from any thread.
+  void insert(const std::string& service, const std::string& method,
+              zmq::message_t* request, zmq::message_t* response,
+              int64 ttl_ms);
+
+  // Removes all the entries.
+  void clear();
+
+  uint64 get_hits() const;
+  uint64 get_misses() const;
+  uint64 get_evictions() const;
+
+  // The size of the memoized entries, requests included.
+  size_t get_bytes() const;
+
+ private:
+  typedef std::map<std::string, std::map<std::string, int64> > ttl_map;
+  typedef std::list<response_memo_entry*> entry_list;
+  typedef boost::unordered_map<uint64, entry_list::iterator> index_map;
+
+  // mu_ must be held.
+  void remove(entry_list::iterator position);
+
+  const size_t max_bytes_;
+  ttl_map ttls_;
+  mutable boost::mutex mu_;
+  // Most recently used first.
+  entry_list entries_;
+  index_map index_;
+  size_t bytes_;
+  uint64 hits_;
+  uint64 misses_;
+  uint64 evictions_;
+  DISALLOW_COPY_AND_ASSIGN(response_memo);
+};
+}  // namespace rpcz
+#endif
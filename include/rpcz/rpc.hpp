@@ -53,6 +53,30 @@ static const application_error_code METHOD_NOT_IMPLEMENTED = rpc_response_header
 
 class sync_event;
 
+// Statistics about a completed call, as seen by the client. All times are in
+// microseconds.
+struct rpc_stats {
+  rpc_stats() : latency_usec(0), queue_time_usec(0), server_time_usec(-1),
+                request_bytes(0), response_bytes(0), connection_id(0) {}
+
+  // From the call until its completion (reply or deadline).
+  int64 latency_usec;
+
+  // Time the request waited in the client before it was sent.
+  int64 queue_time_usec;
+
+  // Processing time reported by the server. -1 when the server did not report
+  // it (for example, when the call timed out).
+  int64 server_time_usec;
+
+  // Size of the request and response on the wire, headers included.
+  size_t request_bytes;
+  size_t response_bytes;
+
+  // The connection that served the call (see connection::get_connection_id).
+  uint64 connection_id;
+};
+
 class rpc {
  public:
   rpc();
@@ -83,6 +107,23 @@ class rpc {
     deadline_ms_ = deadline_ms;
   }
 
+  // Servers with an idempotency table execute the requests to a method that
+  // carry the same key only once, and answer retries with the first reply.
+  // Set the same key on the rpc of each retry. Empty, the default, means
+  // no key.
+  inline const std::string& get_idempotency_key() const {
+    return idempotency_key_;
+  }
+
+  inline void set_idempotency_key(const std::string& key) {
+    idempotency_key_ = key;
+  }
+
+  // Valid once the call has completed.
+  inline const rpc_stats& get_stats() const {
+    return stats_;
+  }
+
   void set_failed(int application_error_code, const std::string& message);
 
   int wait();
@@ -96,8 +137,14 @@ class rpc {
   std::string error_message_;
   int application_error_code_;
   int64 deadline_ms_;
+  std::string idempotency_key_;
+  rpc_stats stats_;
+  // Set by the connection manager when the request leaves the client.
+  uint64 sent_time_usec_;
   scoped_ptr<sync_event> sync_event_;
 
+  friend class local_call;
+  friend class local_rpc_channel;
   friend class rpc_channel_impl;
   friend class server_channel_impl;
   DISALLOW_COPY_AND_ASSIGN(rpc);
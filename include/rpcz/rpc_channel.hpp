@@ -33,6 +33,7 @@ class MethodDescriptor;
 namespace rpcz {
 class closure;
 class connection;
+class response_cache;
 class rpc;
 
 class rpc_channel {
@@ -55,6 +56,16 @@ class rpc_channel {
 
   static rpc_channel* create(connection connection);
 
+  // Creates a channel whose calls to cacheable methods go through the given
+  // cache, which must outlive the channel, unless it is NULL. If
+  // coalesce_calls is true, a call identical to one in flight, with the same
+  // method, request bytes and deadline, is not sent: it completes with the
+  // reply to the call in flight. Nothing checks that the methods are
+  // idempotent, so only coalesce calls on channels whose methods have no
+  // side effects.
+  static rpc_channel* create(connection connection, response_cache* cache,
+                             bool coalesce_calls = false);
+
   virtual ~rpc_channel() {};
 };
 }  // namespace
@@ -18,15 +18,24 @@
 #define RPCZ_RPCZ_H
 
 // Master include file
+#include "rpcz/access_log.hpp"
 #include "rpcz/application.hpp"
 #include "rpcz/callback.hpp"
 #include "rpcz/connection_manager.hpp"
+#include "rpcz/idempotency_table.hpp"
 #include "rpcz/macros.hpp"
+#include "rpcz/metrics.hpp"
+#include "rpcz/proxy_server.hpp"
+#include "rpcz/request_sampler.hpp"
+#include "rpcz/response_cache.hpp"
+#include "rpcz/response_memo.hpp"
 #include "rpcz/rpc.hpp"
 #include "rpcz/rpc_channel.hpp"
 #include "rpcz/server.hpp"
 #include "rpcz/service.hpp"
 #include "rpcz/sync_event.hpp"
+#include "rpcz/traffic_capture.hpp"
+#include "rpcz/traffic_mirror.hpp"
 
 // Two include files were intentionally left out since they rely on ZeroMQ
 // headers being around and probably most people will not need this low-level
@@ -25,13 +25,20 @@ class socket_t;
 };
 
 namespace rpcz {
+class access_log;
 class application;
 class client_connection;
+class coalescing_table;
 class connection_manager;
+class idempotency_table;
+class local_rpc_channel;
 class message_iterator;
+class response_memo;
 class rpc_service;
 class server_channel;
 class service;
+class traffic_capture;
+class traffic_mirror;
 
 // A server object maps incoming RPC requests to a provided service interface.
 // The service interface methods are executed inside a worker thread.
@@ -51,7 +58,8 @@ class server {
   // before bind() is called. The name parameter identifies the service for
   // external clients. If you use the first form, the service name from the
   // protocol buffer definition will be used. Takes ownership of the
-  // provided service.
+  // provided service. Identical concurrent requests to the methods that are
+  // idempotent in their rpcz options are coalesced, as by set_coalesced().
   void register_service(service* service);
   void register_service(service* service, const std::string& name);
 
@@ -60,13 +68,62 @@ class server {
   // Registers a low-level rpc_service.
   void register_service(rpc_service* rpc_service, const std::string& name);
 
+  // Records the requests served by this server into the given access log.
+  // Must be called before bind(). Does not take ownership; the log has to
+  // outlive the server.
+  void set_access_log(access_log* access_log);
+
+  // Records the sampled requests received by this server, with their
+  // payloads, into the given capture. Must be called before bind(). Does
+  // not take ownership; the capture has to outlive the server.
+  void set_traffic_capture(traffic_capture* capture);
+
+  // Sends a copy of the sampled requests received by this server to the
+  // mirror's shadow endpoint. Must be called before bind(). Does not take
+  // ownership; the mirror has to outlive the server.
+  void set_traffic_mirror(traffic_mirror* mirror);
+
+  // Answers requests to the memoized methods of the given memo from it,
+  // without running the handler, when it has a response for them. Must be
+  // called before bind(). Does not take ownership; the memo has to outlive
+  // the server.
+  void set_response_memo(response_memo* memo);
+
+  // Runs the handler of the given method once for identical requests, with
+  // the same payload bytes, that arrive while it handles one of them; they
+  // all get its reply, which shares a single payload frame. A handler that
+  // never replies leaves the identical requests unanswered too. Must be
+  // called before bind().
+  void set_coalesced(const std::string& service, const std::string& method);
+
+  // The number of requests that were answered along with an identical one.
+  uint64 get_coalesced_requests() const;
+
+  // Executes the requests to a method that carry the same idempotency key
+  // only once; the others get the first one's reply from the table. Must be
+  // called before bind(). Does not take ownership; the table has to outlive
+  // the server.
+  void set_idempotency_table(idempotency_table* table);
+
  private:
   void handle_request(const client_connection& connection,
                       message_iterator& iter);
 
+  // Returns the service registered under the given name, or NULL.
+  rpc_service* find_service(const std::string& name) const;
+
+  // NULL if the server was constructed with a connection_manager.
+  application* application_;
   connection_manager& connection_manager_;
+  access_log* access_log_;
+  traffic_capture* traffic_capture_;
+  traffic_mirror* traffic_mirror_;
+  response_memo* response_memo_;
+  scoped_ptr<coalescing_table> coalescing_table_;
+  idempotency_table* idempotency_table_;
   typedef std::map<std::string, rpcz::rpc_service*> rpc_service_map;
   rpc_service_map service_map_;
+  friend class local_rpc_channel;
   DISALLOW_COPY_AND_ASSIGN(server);
 };
 
@@ -79,6 +136,17 @@ class rpc_service {
   virtual void dispatch_request(const std::string& method,
                                const void* payload, size_t payload_len,
                                server_channel* channel_) = 0;
+
+  // Handles a request from the same process, given as a message or, if
+  // request is NULL, serialized in payload. Takes ownership of the channel
+  // like dispatch_request(). Returns false, and leaves the channel to the
+  // caller, if the service only takes requests through dispatch_request().
+  virtual bool dispatch_local(const std::string& method,
+                              const google::protobuf::Message* request,
+                              const std::string& payload,
+                              server_channel* channel) {
+    return false;
+  }
 };
 }  // namespace
 #endif
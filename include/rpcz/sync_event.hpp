@@ -30,6 +30,10 @@ class sync_event {
   // Blocks the current thread until another thread calls signal().
   void wait();
 
+  // Like wait(), but gives up after timeout_ms milliseconds. Returns whether
+  // the event occured.
+  bool wait_for(int64 timeout_ms);
+
   // Signals that the event has occured. All threads that called wait() are
   // released.
   void signal();
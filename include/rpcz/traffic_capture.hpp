@@ -0,0 +1,133 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_TRAFFIC_CAPTURE_H
+#define RPCZ_TRAFFIC_CAPTURE_H
+
+#include <stdio.h>
+#include <string>
+#include <boost/atomic.hpp>
+#include "rpcz/macros.hpp"
+#include "rpcz/request_sampler.hpp"
+
+namespace rpcz {
+
+// Capture files start with this header, followed by records. Everything is
+// in the host's byte order.
+struct traffic_capture_file_header {
+  char magic[8];  // kTrafficCaptureMagic
+  uint32 version;
+  uint32 header_size;
+};
+
+// Each record is this header followed by the service name, the method name
+// and the request payload, padded to a multiple of 8 bytes. A record_size
+// of 0 marks the end of the file.
+struct traffic_capture_record_header {
+  uint32 record_size;
+  uint32 service_size;
+  uint32 method_size;
+  uint32 payload_size;
+  // When the server read the request, in microseconds since the epoch.
+  uint64 timestamp_usec;
+};
+
+static const char kTrafficCaptureMagic[8] = {
+  'R', 'P', 'C', 'Z', 'C', 'A', 'P', 'T'};
+static const uint32 kTrafficCaptureVersion = 1;
+
+// A traffic_capture records a sample of the requests received by a server,
+// with their payloads, so that they can be replayed against another server
+// with zreplay:
+//
+//     traffic_capture capture("/var/tmp/search.capture", 1 << 30);
+//     capture.set_default_sample_rate(10);
+//     server.set_traffic_capture(&capture);
+//
+// The file is memory-mapped at its maximal size and records are appended
+// without locks; the file is truncated to the recorded data when the capture
+// is destroyed. Once the file is full, further requests are not recorded.
+// Not supported on Windows.
+class traffic_capture {
+ public:
+  // Creates (truncates) the given file. Throws std::runtime_error if the file
+  // can not be created or mapped. max_bytes is the largest size of the file;
+  // requests with payloads above max_payload_bytes are not recorded.
+  traffic_capture(const std::string& filename, uint64 max_bytes,
+                  uint32 max_payload_bytes = 1 << 20);
+
+  // Flushes the records and truncates the file. All servers using the
+  // capture must be destroyed first.
+  ~traffic_capture();
+
+  // Records one in every one_in requests, 0 records nothing. Applies to
+  // methods without a rate of their own. The default is 1 (every request).
+  // Sample rates have to be set before the capture is handed to a server.
+  void set_default_sample_rate(uint32 one_in);
+  void set_sample_rate(const std::string& service, const std::string& method,
+                       uint32 one_in);
+
+  // Returns whether the current request of the given method should be
+  // recorded.
+  bool should_sample(const std::string& service, const std::string& method);
+
+  // Appends a request. Returns false if it was dropped because of the size
+  // caps. Safe to call from any thread.
+  bool record(uint64 timestamp_usec, const std::string& service,
+              const std::string& method, const void* payload,
+              size_t payload_size);
+
+  // Number of requests dropped because of the size caps.
+  uint64 get_dropped_records() const;
+
+  // Number of bytes of the file used so far.
+  uint64 get_used_bytes() const;
+
+ private:
+  int fd_;
+  char* data_;
+  const uint64 max_bytes_;
+  const uint32 max_payload_bytes_;
+  boost::atomic<uint64> used_bytes_;
+  boost::atomic<uint64> dropped_;
+  request_sampler sampler_;
+  DISALLOW_COPY_AND_ASSIGN(traffic_capture);
+};
+
+// A request read from a capture file.
+struct captured_request {
+  uint64 timestamp_usec;
+  std::string service;
+  std::string method;
+  std::string payload;
+};
+
+// Reads the requests of a capture file.
+class traffic_capture_reader {
+ public:
+  traffic_capture_reader();
+  ~traffic_capture_reader();
+
+  // Returns false if the file can not be read or is not a capture file.
+  bool open(const std::string& filename);
+
+  // Reads the next request. Returns false at the end of the file.
+  bool next(captured_request* request);
+
+ private:
+  FILE* file_;
+  DISALLOW_COPY_AND_ASSIGN(traffic_capture_reader);
+};
+}  // namespace rpcz
+#endif
@@ -0,0 +1,101 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_TRAFFIC_MIRROR_H
+#define RPCZ_TRAFFIC_MIRROR_H
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include "rpcz/connection_manager.hpp"
+#include "rpcz/macros.hpp"
+#include "rpcz/request_sampler.hpp"
+
+namespace zmq {
+class message_t;
+}  // namespace zmq
+
+namespace rpcz {
+class application;
+struct traffic_mirror_stats;
+
+// A traffic_mirror sends a copy of a sample of the requests received by a
+// server to a shadow server and throws its replies away, to try a new build
+// under real load:
+//
+//     traffic_mirror mirror(application, "tcp://shadow:5555");
+//     mirror.set_default_sample_rate(10);
+//     server.set_traffic_mirror(&mirror);
+//
+// The copies share the request's frames instead of copying the payload.
+// Mirroring never waits for the shadow: while max_inflight mirrored requests
+// wait for a reply, further requests are not mirrored, and mirrored requests
+// give up after deadline_ms.
+class traffic_mirror {
+ public:
+  // Connects to the shadow endpoint through the application's connection
+  // manager. The application must outlive the mirror.
+  traffic_mirror(application& application, const std::string& endpoint);
+
+  // Same, with a connection_manager that must outlive the mirror.
+  traffic_mirror(connection_manager& connection_manager,
+                 const std::string& endpoint);
+
+  // All servers using the mirror must be destroyed first. Replies to
+  // requests mirrored before are still discarded.
+  ~traffic_mirror();
+
+  // Mirrors one in every one_in requests, 0 mirrors nothing. Applies to
+  // methods without a rate of their own. The default is 1 (every request).
+  // Sample rates have to be set before the mirror is handed to a server.
+  void set_default_sample_rate(uint32 one_in);
+  void set_sample_rate(const std::string& service, const std::string& method,
+                       uint32 one_in);
+
+  // How long mirrored requests wait for the shadow's reply; 1000 by
+  // default.
+  void set_deadline_ms(int64 deadline_ms);
+
+  // The largest number of mirrored requests that wait for a reply; 100 by
+  // default.
+  void set_max_inflight(uint32 max_inflight);
+
+  // Returns whether the current request of the given method should be
+  // mirrored.
+  bool should_sample(const std::string& service, const std::string& method);
+
+  // Sends the request, made of the given frames, to the shadow. Takes
+  // ownership of the frames. Returns false if the request was dropped
+  // because of max_inflight. Safe to call from any thread.
+  bool mirror(zmq::message_t* header, zmq::message_t* payload);
+
+  // Requests sent to the shadow.
+  uint64 get_mirrored_requests() const;
+
+  // Requests not sent because of max_inflight.
+  uint64 get_dropped_requests() const;
+
+  // Mirrored requests that failed or timed out at the shadow.
+  uint64 get_failed_requests() const;
+
+ private:
+  connection connection_;
+  int64 deadline_ms_;
+  uint32 max_inflight_;
+  request_sampler sampler_;
+  // Shared with the reply callbacks, which can outlive the mirror.
+  boost::shared_ptr<traffic_mirror_stats> stats_;
+  DISALLOW_COPY_AND_ASSIGN(traffic_mirror);
+};
+}  // namespace rpcz
+#endif
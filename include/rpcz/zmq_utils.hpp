@@ -52,14 +52,22 @@ class message_t;
 }
 
 namespace rpcz {
+class transport_socket;
 
 class message_iterator {
  public:
   explicit message_iterator(zmq::socket_t& socket) :
-      socket_(socket), has_more_(true), more_size_(sizeof(has_more_)) { };
+      socket_(&socket), transport_(NULL), has_more_(true),
+      more_size_(sizeof(has_more_)) { };
+
+  // Iterates over a message received by one of the broker's transports.
+  explicit message_iterator(transport_socket& socket) :
+      socket_(NULL), transport_(&socket), has_more_(true),
+      more_size_(sizeof(has_more_)) { };
 
   message_iterator(const message_iterator& other) :
       socket_(other.socket_),
+      transport_(other.transport_),
       has_more_(other.has_more_),
       more_size_(other.more_size_) {
   }
@@ -71,13 +79,19 @@ class message_iterator {
   inline bool has_more() { return has_more_; }
 
   inline zmq::message_t& next() {
-    socket_.recv(&message_, 0);
-    socket_.getsockopt(ZMQ_RCVMORE, &has_more_, &more_size_);
+    if (transport_) {
+      return next_from_transport();
+    }
+    socket_->recv(&message_, 0);
+    socket_->getsockopt(ZMQ_RCVMORE, &has_more_, &more_size_);
     return message_;
   }
 
  private:
-  zmq::socket_t& socket_;
+  zmq::message_t& next_from_transport();
+
+  zmq::socket_t* socket_;
+  transport_socket* transport_;
   zmq::message_t message_;
   more_t has_more_;
   size_t more_size_;
@@ -188,11 +202,16 @@ inline bool send_char(zmq::socket_t* socket, char ch, int flags=0) {
 
 void log_message_vector(message_vector& vector);
 
-inline void forward_messages(message_iterator& iter, zmq::socket_t& socket) {
+// Sends the remaining messages of iter to socket. Returns the number of
+// bytes forwarded.
+inline size_t forward_messages(message_iterator& iter, zmq::socket_t& socket) {
+  size_t bytes = 0;
   while (iter.has_more()) {
     zmq::message_t& msg = iter.next();
+    bytes += msg.size();
     socket.send(msg, iter.has_more() ? ZMQ_SNDMORE : 0);
   }
+  return bytes;
 }
 }  // namespace rpcz
 #endif
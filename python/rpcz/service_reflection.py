@@ -35,12 +35,15 @@ class GeneratedServiceType(type):
                                                         attrs)
 
 
-def _BuildStubMethod(method_descriptor):
+def _BuildStubMethod(method_descriptor, options):
+    default_deadline_ms = options.get('deadline_ms', -1)
     def call(stub, request, rpc=None, callback=None,
              deadline_ms=None):
         response = method_descriptor.output_type._concrete_class()
         if rpc is None:
             blocking_mode = True
+            if deadline_ms is None and default_deadline_ms != -1:
+                deadline_ms = default_deadline_ms
             rpc = rpcz.rpc.RPC(deadline_ms = deadline_ms)
         else:
             blocking_mode = False
@@ -66,7 +69,12 @@ class GeneratedServiceStubType(GeneratedServiceType):
     def __new__(cls, name, bases, attrs):
         descriptor = attrs['DESCRIPTOR']
         attrs['__init__'] = _StubInitMethod
+        # Generated from rpcz_options.proto by the plugin, in the service.
+        method_options = {}
+        for base in bases:
+            method_options = getattr(base, 'METHOD_OPTIONS', method_options)
         for method in descriptor.methods:
-            attrs[method.name] = _BuildStubMethod(method)
+            attrs[method.name] = _BuildStubMethod(
+                method, method_options.get(method.name, {}))
         return super(GeneratedServiceStubType, cls).__new__(cls, name, bases,
                                                             attrs)
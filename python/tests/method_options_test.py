@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+# Checks the METHOD_OPTIONS that the python plugin generates from the rpcz
+# options of test/proto/search.proto. The generated module is read rather
+# than imported, so that the test does not need the compiled extension:
+#
+#   method_options_test.py <build dir>/test/proto/search_rpcz.py
+
+import ast
+import sys
+import unittest
+
+SEARCH_RPCZ_PY = None
+
+
+def read_method_options(service_name):
+  with open(SEARCH_RPCZ_PY) as f:
+    module = ast.parse(f.read())
+  for node in module.body:
+    if isinstance(node, ast.ClassDef) and node.name == service_name:
+      for statement in node.body:
+        if (isinstance(statement, ast.Assign) and
+            statement.targets[0].id == 'METHOD_OPTIONS'):
+          return ast.literal_eval(statement.value)
+  raise AssertionError('No METHOD_OPTIONS in ' + service_name)
+
+
+class MethodOptionsTest(unittest.TestCase):
+  def test_method_options_override_service_defaults(self):
+    options = read_method_options('ConfigService')
+    self.assertEqual(2000, options['Lookup']['deadline_ms'])
+    self.assertTrue(options['Lookup']['idempotent'])
+    self.assertEqual(5000, options['Lookup']['cache_ttl_ms'])
+    self.assertEqual('lookups', options['Lookup']['executor'])
+    self.assertEqual(50, options['Update']['deadline_ms'])
+    self.assertFalse(options['Update']['idempotent'])
+    self.assertEqual(3, options['Update']['priority'])
+
+  def test_defaults(self):
+    options = read_method_options('SearchService')
+    self.assertEqual({'deadline_ms': -1,
+                      'idempotent': False,
+                      'cache_ttl_ms': 0,
+                      'one_way': False,
+                      'compress': False,
+                      'priority': 0,
+                      'executor': ''}, options['Search'])
+
+
+if __name__ == '__main__':
+  SEARCH_RPCZ_PY = sys.argv.pop(1)
+  unittest.main()
@@ -0,0 +1,195 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/access_log.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+
+#include "rpcz/logging.hpp"
+
+namespace rpcz {
+namespace {
+// How often the background thread writes out the buffers.
+const int64 kDrainIntervalMs = 100;
+
+void no_cleanup(access_log_buffer*) {
+  // Buffers are owned by the access_log, not by their thread.
+}
+
+size_t round_up_to_power_of_two(size_t n) {
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+}  // unnamed namespace
+
+// A single-producer single-consumer ring of records. The producer is the
+// thread that owns the buffer, the consumer is the drain thread.
+class access_log_buffer {
+ public:
+  explicit access_log_buffer(size_t capacity)
+      : records_(capacity), mask_(capacity - 1), head_(0), tail_(0),
+        dropped_(0) {
+  }
+
+  void push(const access_log_record& record) {
+    uint64 head = head_.load(boost::memory_order_relaxed);
+    if (head - tail_.load(boost::memory_order_acquire) > mask_) {
+      dropped_.fetch_add(1, boost::memory_order_relaxed);
+      return;
+    }
+    records_[head & mask_] = record;
+    head_.store(head + 1, boost::memory_order_release);
+  }
+
+  void write_to(FILE* file) {
+    uint64 tail = tail_.load(boost::memory_order_relaxed);
+    uint64 head = head_.load(boost::memory_order_acquire);
+    while (tail != head) {
+      size_t index = tail & mask_;
+      size_t count = std::min<uint64>(head - tail, records_.size() - index);
+      if (fwrite(&records_[index], sizeof(access_log_record), count, file)
+          != count) {
+        LOG(ERROR) << "Failed writing to the access log.";
+      }
+      tail += count;
+    }
+    tail_.store(tail, boost::memory_order_release);
+  }
+
+  uint64 get_dropped() {
+    return dropped_.load(boost::memory_order_relaxed);
+  }
+
+ private:
+  std::vector<access_log_record> records_;
+  const uint64 mask_;
+  boost::atomic<uint64> head_;
+  boost::atomic<uint64> tail_;
+  boost::atomic<uint64> dropped_;
+  DISALLOW_COPY_AND_ASSIGN(access_log_buffer);
+};
+
+access_log::access_log(const std::string& filename, size_t records_per_thread)
+    : file_(fopen(filename.c_str(), "wb")),
+      records_per_thread_(round_up_to_power_of_two(records_per_thread)),
+      thread_buffer_(&no_cleanup) {
+  if (file_ == NULL) {
+    throw std::runtime_error("Could not open access log: " + filename);
+  }
+  access_log_file_header header;
+  memcpy(header.magic, kAccessLogMagic, sizeof(header.magic));
+  header.version = kAccessLogVersion;
+  header.record_size = sizeof(access_log_record);
+  if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+    fclose(file_);
+    throw std::runtime_error("Could not write access log: " + filename);
+  }
+  drain_thread_ = boost::thread(boost::bind(&access_log::drain_loop, this));
+}
+
+access_log::~access_log() {
+  quit_.signal();
+  drain_thread_.join();
+  delete_container_pointers(buffers_.begin(), buffers_.end());
+  fclose(file_);
+}
+
+void access_log::set_default_sample_rate(uint32 one_in) {
+  sampler_.set_default_sample_rate(one_in);
+}
+
+void access_log::set_sample_rate(const std::string& service,
+                                 const std::string& method,
+                                 uint32 one_in) {
+  sampler_.set_sample_rate(service, method, one_in);
+}
+
+bool access_log::should_sample(const std::string& service,
+                               const std::string& method) {
+  return sampler_.should_sample(service, method);
+}
+
+void access_log::append(const access_log_record& record) {
+  get_thread_buffer()->push(record);
+}
+
+uint64 access_log::get_dropped_records() {
+  boost::unique_lock<boost::mutex> lock(buffers_mu_);
+  uint64 dropped = 0;
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    dropped += buffers_[i]->get_dropped();
+  }
+  return dropped;
+}
+
+access_log_buffer* access_log::get_thread_buffer() {
+  access_log_buffer* buffer = thread_buffer_.get();
+  if (buffer == NULL) {
+    buffer = new access_log_buffer(records_per_thread_);
+    {
+      boost::unique_lock<boost::mutex> lock(buffers_mu_);
+      buffers_.push_back(buffer);
+    }
+    thread_buffer_.reset(buffer);
+  }
+  return buffer;
+}
+
+void access_log::drain_loop() {
+  while (!quit_.wait_for(kDrainIntervalMs)) {
+    drain();
+  }
+  drain();
+}
+
+void access_log::drain() {
+  boost::unique_lock<boost::mutex> lock(buffers_mu_);
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    buffers_[i]->write_to(file_);
+  }
+  fflush(file_);
+}
+
+access_log_reader::access_log_reader() : file_(NULL) {
+}
+
+access_log_reader::~access_log_reader() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+bool access_log_reader::open(const std::string& filename) {
+  file_ = fopen(filename.c_str(), "rb");
+  if (file_ == NULL) {
+    return false;
+  }
+  access_log_file_header header;
+  return (fread(&header, sizeof(header), 1, file_) == 1 &&
+          memcmp(header.magic, kAccessLogMagic, sizeof(header.magic)) == 0 &&
+          header.version == kAccessLogVersion &&
+          header.record_size == sizeof(access_log_record));
+}
+
+bool access_log_reader::next(access_log_record* record) {
+  return fread(record, sizeof(*record), 1, file_) == 1;
+}
+}  // namespace rpcz
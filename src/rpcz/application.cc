@@ -15,13 +15,38 @@
 // Author: nadavs@google.com <Nadav Samet>
 
 #include <string>
+#include <vector>
 #include <zmq.hpp>
 #include "rpcz/application.hpp"
 #include "rpcz/connection_manager.hpp"
+#include "rpcz/local_rpc_channel.hpp"
 #include "rpcz/rpc_channel.hpp"
+#include "rpcz/rpc_channel_impl.hpp"
 #include "rpcz/server.hpp"
 
 namespace rpcz {
+namespace {
+// Returns the endpoints that clients of this process connect to in order to
+// reach a server bound to the given endpoint: the endpoint itself, and the
+// loopback addresses for wildcard TCP addresses.
+std::vector<std::string> get_local_endpoints(const std::string& endpoint) {
+  std::vector<std::string> endpoints(1, endpoint);
+  size_t host_start = endpoint.find("://");
+  size_t port_start = endpoint.rfind(':');
+  if (host_start == std::string::npos || port_start <= host_start) {
+    return endpoints;
+  }
+  host_start += 3;
+  std::string host(endpoint.substr(host_start, port_start - host_start));
+  if (host == "*" || host == "0.0.0.0") {
+    std::string scheme(endpoint.substr(0, host_start));
+    std::string port(endpoint.substr(port_start));
+    endpoints.push_back(scheme + "localhost" + port);
+    endpoints.push_back(scheme + "127.0.0.1" + port);
+  }
+  return endpoints;
+}
+}  // unnamed namespace
 
 application::application() {
   init(options());
@@ -49,11 +74,33 @@ void application::init(const application::options& options) {
   connection_manager_.reset(new connection_manager(
           context_,
           options.connection_manager_threads));
+  connection_manager_->set_cpu_accounting(options.cpu_accounting);
+  connection_manager_->set_locality_upgrade(options.locality_upgrade);
+  in_process_dispatch_ = options.in_process_dispatch;
+  copy_in_process_requests_ = options.copy_in_process_requests;
+  response_cache_ = options.response_cache;
+  coalesce_calls_ = options.coalesce_calls;
+  if (options.worker_stall_threshold_ms > 0) {
+    connection_manager_->enable_watchdog(options.worker_stall_threshold_ms,
+                                         options.replace_stalled_workers,
+                                         options.max_replacement_workers);
+  }
 }
 
 rpc_channel* application::create_rpc_channel(const std::string& endpoint) {
-  return rpc_channel::create(
-      connection_manager_->connect(endpoint));
+  if (in_process_dispatch_ != DISPATCH_REMOTE) {
+    boost::unique_lock<boost::mutex> lock(local_servers_mu_);
+    server_map::const_iterator it = local_servers_.find(endpoint);
+    if (it != local_servers_.end()) {
+      return new local_rpc_channel(
+          it->second, connection_manager_.get(),
+          in_process_dispatch_ == DISPATCH_ON_WORKERS,
+          copy_in_process_requests_);
+    }
+  }
+  return rpc_channel_impl::create_owning(
+      connection_manager_->connect(endpoint), response_cache_,
+      coalesce_calls_);
 }
 
 void application::run() {
@@ -63,4 +110,29 @@ void application::run() {
 void application::terminate() {
   connection_manager_->terminate();
 }
+
+void application::get_metrics_snapshot(metrics_snapshot* snapshot) {
+  connection_manager_->get_metrics_snapshot(snapshot);
+}
+
+void application::register_local_server(const std::string& endpoint,
+                                        server* server) {
+  std::vector<std::string> endpoints(get_local_endpoints(endpoint));
+  boost::unique_lock<boost::mutex> lock(local_servers_mu_);
+  for (size_t i = 0; i < endpoints.size(); ++i) {
+    local_servers_[endpoints[i]] = server;
+  }
+}
+
+void application::unregister_local_server(server* server) {
+  boost::unique_lock<boost::mutex> lock(local_servers_mu_);
+  server_map::iterator it = local_servers_.begin();
+  while (it != local_servers_.end()) {
+    if (it->second == server) {
+      local_servers_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
 }  // namespace rpcz
@@ -19,6 +19,7 @@
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <time.h>
 #endif
 
 namespace rpcz {
@@ -39,4 +40,42 @@ uint64 zclock_time(void) {
 #endif
 }
 
+uint64 zclock_time_usec(void) {
+#ifdef WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+	ULARGE_INTEGER temp;
+	temp.HighPart = ft.dwHighDateTime;
+	temp.LowPart = ft.dwLowDateTime;
+    return (uint64) (temp.QuadPart / 10);
+#else
+	struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (uint64) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+uint64 thread_cpu_time_usec(void) {
+#ifdef WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+      return 0;
+    }
+	ULARGE_INTEGER kernel_time, user_time;
+	kernel_time.HighPart = kernel.dwHighDateTime;
+	kernel_time.LowPart = kernel.dwLowDateTime;
+	user_time.HighPart = user.dwHighDateTime;
+	user_time.LowPart = user.dwLowDateTime;
+    return (uint64) ((kernel_time.QuadPart + user_time.QuadPart) / 10);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+      return 0;
+    }
+    return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
 }  // namespace rpcz
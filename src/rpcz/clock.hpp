@@ -23,5 +23,12 @@ namespace rpcz {
 
 uint64 zclock_time();
 
+// Same as zclock_time(), in microseconds.
+uint64 zclock_time_usec();
+
+// Cpu time consumed by the calling thread, in microseconds. Returns 0 where
+// per-thread cpu clocks are not available.
+uint64 thread_cpu_time_usec();
+
 }  // namespace
 #endif
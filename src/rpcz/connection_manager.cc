@@ -17,6 +17,7 @@
 #include "rpcz/connection_manager.hpp"
 
 #include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/tss.hpp>
@@ -34,39 +35,24 @@
 #include "google/protobuf/stubs/common.h"
 #include "rpcz/callback.hpp"
 #include "rpcz/clock.hpp"
+#include "rpcz/event_id_generator.hpp"
+#include "rpcz/locality.hpp"
 #include "rpcz/logging.hpp"
 #include "rpcz/macros.hpp"
+#include "rpcz/memory_transport.hpp"
+#include "rpcz/metrics_registry.hpp"
 #include "rpcz/reactor.hpp"
+#include "rpcz/remote_response.hpp"
+#include "rpcz/rpcz.pb.h"
+#include "rpcz/shm_transport.hpp"
+#include "rpcz/tcp_transport.hpp"
+#include "rpcz/trace.hpp"
+#include "rpcz/transport.hpp"
+#include "rpcz/watchdog.hpp"
 #include "rpcz/zmq_utils.hpp"
 
 namespace rpcz {
 namespace {
-const uint64 kLargePrime = (1ULL << 63) - 165;
-const uint64 kGenerator = 2;
-
-typedef uint64 event_id;
-
-class event_id_generator {
- public:
-  event_id_generator() {
-    state_ = (reinterpret_cast<uint64>(this) << 32);
-#ifdef WIN32
-		state_ += GetCurrentProcessId();
-#else
-		state_ += getpid();
-#endif
-  }
-
-  event_id get_next() {
-    state_ = (state_ * kGenerator) % kLargePrime;
-    return state_;
-  }
-
- private:
-  uint64 state_;
-  DISALLOW_COPY_AND_ASSIGN(event_id_generator);
-};
-
 // Command codes for internal process communication.
 //
 // Message sent from outside to the broker thread:
@@ -74,6 +60,10 @@ const char kRequest = 0x01;      // send request to a connected socket.
 const char kConnect = 0x02;      // connect to a given endpoint.
 const char kBind    = 0x03;      // bind to an endpoint.
 const char kReply   = 0x04;      // reply to a request
+const char kAddWorker = 0x05;    // start another worker thread.
+const char kAddTimeout = 0x06;   // run a closure on a worker at a given time.
+const char kClose   = 0x07;      // close a connection once its requests are
+                                 // done.
 const char kQuit    = 0x0f;      // Starts the quit second.
 
 // Messages sent from the broker to a worker thread:
@@ -87,38 +77,103 @@ const char kInvokeclient_request_callback = 0x13;  // run a user supplied
 const char kWorkerQuit = 0x1f;          // Asks the worker to quit.
 
 // Messages sent from a worker thread to the broker:
-const char kReady = 0x21;        // Always the first message sent.
+const char kReady = 0x21;        // Always the first message sent. Carries
+                                 // the worker_state of the worker.
 const char kWorkerDone = 0x22;   // Sent just before the worker quits.
+const char kRetireWorker = 0x23; // The worker was replaced during a stall
+                                 // and asks to quit.
+
+// send_object() for the function objects passed between threads.
+template<typename T>
+inline bool send_closure(zmq::socket_t* socket, const T& object, int flags) {
+  count_allocation(ALLOCATION_CLOSURES, sizeof(T));
+  return send_object(socket, object, flags);
+}
+
+#ifdef RPCZ_ENABLE_TRACING
+// Extracts service and method from a serialized rpc_request_header for use as
+// probe arguments.
+void parse_traced_header(zmq::message_t& msg,
+                         std::string* service, std::string* method) {
+  rpc_request_header header;
+  if (header.ParseFromArray(msg.data(), msg.size())) {
+    *service = header.service();
+    *method = header.method();
+  }
+}
+
+// Same as forward_messages() for an incoming server request, which is made of
+// (sender, "", event_id, header, payload). Fires broker_forward.
+size_t forward_traced_request(message_iterator& iter, zmq::socket_t& socket) {
+  size_t bytes = 0;
+  uint64 event_id = 0;
+  std::string service;
+  std::string method;
+  for (int i = 0; iter.has_more(); ++i) {
+    zmq::message_t& msg = iter.next();
+    bytes += msg.size();
+    if (i == 2) {
+      event_id = trace_event_id(msg.data(), msg.size());
+    } else if (i == 3) {
+      parse_traced_header(msg, &service, &method);
+    }
+    socket.send(msg, iter.has_more() ? ZMQ_SNDMORE : 0);
+  }
+  RPCZ_TRACE(broker_forward, event_id, service.c_str(), method.c_str());
+  return bytes;
+}
+#endif  // RPCZ_ENABLE_TRACING
 }  // unnamed namespace
 
 struct remote_response_wrapper {
   int64 deadline_ms;
   uint64 start_time;
+  uint64* sent_time_usec;
   connection_manager::client_request_callback callback;
 };
 
 void connection::send_request(
     message_vector& request,
     int64 deadline_ms,
-    connection_manager::client_request_callback callback) {
+    connection_manager::client_request_callback callback,
+    uint64* sent_time_usec) {
   remote_response_wrapper wrapper;
   wrapper.start_time = zclock_time();
   wrapper.deadline_ms = deadline_ms;
+  wrapper.sent_time_usec = sent_time_usec;
   wrapper.callback = callback;
 
   zmq::socket_t& socket = manager_->get_frontend_socket();
   send_empty_message(&socket, ZMQ_SNDMORE);
   send_char(&socket, kRequest, ZMQ_SNDMORE);
   send_uint64(&socket, connection_id_, ZMQ_SNDMORE);
-  send_object(&socket, wrapper, ZMQ_SNDMORE);
+  send_closure(&socket, wrapper, ZMQ_SNDMORE);
   write_vector_to_socket(&socket, request);
 }
 
+void connection::close() {
+  zmq::socket_t& socket = manager_->get_frontend_socket();
+  send_empty_message(&socket, ZMQ_SNDMORE);
+  send_char(&socket, kClose, ZMQ_SNDMORE);
+  send_uint64(&socket, connection_id_, 0);
+}
+
 void client_connection::reply(message_vector* v) {
+  // The broker takes exactly these bytes off the gauge, even if memory
+  // accounting is switched in between.
+  uint64 accounted_bytes = 0;
+  if (memory_accounting()) {
+    accounted_bytes = sender_.size() + event_id_.size();
+    for (size_t i = 0; i < v->size(); ++i) {
+      accounted_bytes += (*v)[i].size();
+    }
+    add_inflight_response(counters_, accounted_bytes);
+  }
   zmq::socket_t& socket = manager_->get_frontend_socket();
   send_empty_message(&socket, ZMQ_SNDMORE);
   send_char(&socket, kReply, ZMQ_SNDMORE);
   send_uint64(&socket, socket_id_, ZMQ_SNDMORE);
+  send_uint64(&socket, accounted_bytes, ZMQ_SNDMORE);
   send_string(&socket, sender_, ZMQ_SNDMORE);
   send_empty_message(&socket, ZMQ_SNDMORE);
   send_string(&socket, event_id_, ZMQ_SNDMORE);
@@ -126,11 +181,14 @@ void client_connection::reply(message_vector* v) {
 }
 
 void worker_thread(connection_manager* connection_manager,
-                  zmq::context_t* context, std::string endpoint) {
+                   zmq::context_t* context, std::string endpoint,
+                   worker_state* state) {
   zmq::socket_t socket(*context, ZMQ_DEALER);
   socket.connect(endpoint.c_str());
+  set_current_worker(state, connection_manager->watchdog_.get());
   send_empty_message(&socket, ZMQ_SNDMORE);
-  send_char(&socket, kReady);
+  send_char(&socket, kReady, ZMQ_SNDMORE);
+  send_pointer(&socket, state, 0);
   bool should_quit = false;
   while (!should_quit) {
     message_iterator iter(socket);
@@ -141,18 +199,25 @@ void worker_thread(connection_manager* connection_manager,
         should_quit = true;
         break;
       case krunclosure:
+        begin_worker_command("a closure");
         interpret_message<closure*>(iter.next())->run();
         break;
       case krunserver_function: {
+        begin_worker_command("a request");
         connection_manager::server_function sf =
             interpret_message<connection_manager::server_function>(iter.next());
         uint64 socket_id = interpret_message<uint64>(iter.next());
+        connection_counters* counters =
+            interpret_message<connection_counters*>(iter.next());
         std::string sender(message_to_string(iter.next()));
         if (iter.next().size() != 0) {
           break;
         }
         std::string event_id(message_to_string(iter.next()));
-        sf(client_connection(connection_manager, socket_id, sender, event_id),
+        scoped_method_accounting accounting(
+            connection_manager->metrics_.get());
+        sf(client_connection(connection_manager, socket_id, counters, sender,
+                             event_id),
            iter);
         }
         break;
@@ -160,11 +225,19 @@ void worker_thread(connection_manager* connection_manager,
         connection_manager::client_request_callback cb =
             interpret_message<connection_manager::client_request_callback>(
                 iter.next());
+        begin_worker_command("a response callback");
         connection_manager::status status = connection_manager::status(
             interpret_message<uint64>(iter.next()));
+        scoped_method_accounting accounting(
+            connection_manager->metrics_.get());
         cb(status, iter);
       }
     }
+    if (end_worker_command()) {
+      // The broker answers with kWorkerQuit once it stopped sending us work.
+      send_empty_message(&socket, ZMQ_SNDMORE);
+      send_char(&socket, kRetireWorker);
+    }
   }
   send_empty_message(&socket, ZMQ_SNDMORE);
   send_char(&socket, kWorkerDone);
@@ -179,9 +252,12 @@ class connection_manager_thread {
       connection_manager* connection_manager,
       zmq::socket_t* frontend_socket) : 
     connection_manager_(connection_manager),
-    context_(context),
+    zmq_transport_(context),
+    host_identity_(get_host_identity()),
     frontend_socket_(frontend_socket),
-    current_worker_(0) {
+    current_worker_(0),
+    live_workers_(nthreads),
+    quitting_(false) {
       wait_for_workers_ready_reply(nthreads);
       ready_event->signal();
       reactor_.add_socket(
@@ -197,10 +273,23 @@ class connection_manager_thread {
       CHECK_EQ(0, iter.next().size());
       char command(interpret_message<char>(iter.next()));
       CHECK_EQ(kReady, command) << "Got unexpected command " << (int)command;
-      workers_.push_back(sender);
+      add_worker(sender, interpret_message<worker_state*>(iter.next()));
     }
   }
 
+  void add_worker(const std::string& sender, worker_state* state) {
+    worker worker;
+    worker.sender = sender;
+    worker.state = state;
+    workers_.push_back(worker);
+  }
+
+  void send_worker_quit(const std::string& sender) {
+    send_string(frontend_socket_, sender, ZMQ_SNDMORE);
+    send_empty_message(frontend_socket_, ZMQ_SNDMORE);
+    send_char(frontend_socket_, kWorkerQuit, 0);
+  }
+
   static void run(zmq::context_t* context,
                   int nthreads,
                   sync_event* ready_event,
@@ -220,15 +309,23 @@ class connection_manager_thread {
     switch (command) {
       case kQuit:
         // Ask the workers to quit. They'll in turn send kWorkerDone.
+        quitting_ = true;
         for (int i = 0; i < workers_.size(); ++i) {
-          send_string(frontend_socket_, workers_[i], ZMQ_SNDMORE);
-          send_empty_message(frontend_socket_, ZMQ_SNDMORE);
-          send_char(frontend_socket_, kWorkerQuit, 0);
+          send_worker_quit(workers_[i].sender);
+        }
+        break;
+      case kAddWorker:
+        if (!quitting_) {
+          ++live_workers_;
+          connection_manager_->start_worker();
         }
         break;
       case kConnect:
         handle_connect_command(sender, message_to_string(iter.next()));
         break;
+      case kClose:
+        handle_close_command(interpret_message<uint64>(iter.next()));
+        break;
       case kBind: {
         std::string endpoint(message_to_string(iter.next()));
         connection_manager::server_function sf(
@@ -244,12 +341,30 @@ class connection_manager_thread {
         send_reply(iter);
         break;
       case kReady:
-        CHECK(false);
+        // A worker started by kAddWorker.
+        if (quitting_) {
+          send_worker_quit(sender);
+        } else {
+          add_worker(sender, interpret_message<worker_state*>(iter.next()));
+          retire_pending_workers();
+        }
+        break;
+      case kRetireWorker:
+        // When quitting, every worker was already asked to quit.
+        if (!quitting_) {
+          pending_retirements_.push_back(sender);
+          retire_pending_workers();
+        }
         break;
       case kWorkerDone:
-        workers_.erase(std::remove(workers_.begin(), workers_.end(), sender));
+        for (size_t i = 0; i < workers_.size(); ++i) {
+          if (workers_[i].sender == sender) {
+            workers_.erase(workers_.begin() + i);
+            break;
+          }
+        }
         current_worker_ = 0;
-        if (workers_.size() == 0) {
+        if (--live_workers_ == 0) {
           // All workers are gone, time to quit.
           reactor_.set_should_quit();
         }
@@ -257,13 +372,49 @@ class connection_manager_thread {
       case krunclosure:
         add_closure(interpret_message<closure*>(iter.next()));
         break;
+      case kAddTimeout: {
+        uint64 timestamp = interpret_message<uint64>(iter.next());
+        closure* callback = interpret_message<closure*>(iter.next());
+        reactor_.run_closure_at(timestamp, new_callback(
+                this, &connection_manager_thread::add_closure, callback));
+        break;
+      }
+    }
+  }
+
+  // Stops sending work to the retiring workers and asks them to quit. A
+  // worker can ask to retire before its replacement is ready; it keeps
+  // working until there is another worker to take over.
+  void retire_pending_workers() {
+    while (!pending_retirements_.empty() && workers_.size() > 1) {
+      std::string sender = pending_retirements_.back();
+      pending_retirements_.pop_back();
+      for (size_t i = 0; i < workers_.size(); ++i) {
+        if (workers_[i].sender == sender) {
+          workers_.erase(workers_.begin() + i);
+          current_worker_ = 0;
+          send_worker_quit(sender);
+          break;
+        }
+      }
     }
   }
 
   inline void begin_worker_command(char command) {
-    send_string(frontend_socket_, workers_[current_worker_], ZMQ_SNDMORE);
+    // Skip the workers that the watchdog found stuck, unless all are.
+    for (size_t i = 0; i < workers_.size() &&
+         workers_[current_worker_].state->phase.load(
+             boost::memory_order_relaxed) == worker_state::STALLED; ++i) {
+      next_worker();
+    }
+    send_string(frontend_socket_, workers_[current_worker_].sender,
+                ZMQ_SNDMORE);
     send_empty_message(frontend_socket_, ZMQ_SNDMORE);
     send_char(frontend_socket_, command, ZMQ_SNDMORE);
+    next_worker();
+  }
+
+  inline void next_worker() {
     ++current_worker_;
     if (current_worker_ == workers_.size()) {
       current_worker_ = 0;
@@ -275,64 +426,189 @@ class connection_manager_thread {
     send_pointer(frontend_socket_, closure, 0);
   }
 
-  inline static void enable_ipv6(zmq::socket_t* socket)
-  {
-#if ZMQ_VERSION_MAJOR == 3
-    int ipv4only = 0;
-    socket->setsockopt(ZMQ_IPV4ONLY, &ipv4only, sizeof(ipv4only));
-#elif ZMQ_VERSION_MAJOR >= 4
-    int ipv6 = 1;
-    socket->setsockopt(ZMQ_IPV6, &ipv6, sizeof(ipv6));
-#endif
+  // Returns the transport for the endpoint's scheme.
+  inline transport* get_transport(const std::string& endpoint) {
+    if (memory_transport::handles(endpoint)) {
+      return &memory_transport_;
+    }
+    if (tcp_transport::handles(endpoint)) {
+      return &tcp_transport_;
+    }
+    if (shm_transport::handles(endpoint)) {
+      return &shm_transport_;
+    }
+    return &zmq_transport_;
   }
 
   inline void handle_connect_command(const std::string& sender,
                                    const std::string& endpoint) {
-    zmq::socket_t* socket = new zmq::socket_t(*context_, ZMQ_DEALER);
-    connections_.push_back(socket);
-    int linger_ms = 0;
-    socket->setsockopt(ZMQ_LINGER, &linger_ms, sizeof(linger_ms));
-#if RPCZ_ENABLE_IPV6
-   enable_ipv6(socket);
-#endif
-    socket->connect(endpoint.c_str());
+    transport_socket* socket = get_transport(endpoint)->connect(endpoint);
+    uint32 slot;
+    if (free_connection_slots_.empty()) {
+      slot = connections_.size();
+      connections_.push_back(client_socket());
+    } else {
+      slot = free_connection_slots_.back();
+      free_connection_slots_.pop_back();
+    }
+    client_socket& connection = connections_[slot];
+    connection.socket = socket;
+    connection.counters =
+        connection_manager_->metrics_->add_connection(endpoint, false);
+    uint64 connection_id = make_connection_id(slot, connection.generation);
     reactor_.add_socket(socket, new_permanent_callback(
             this, &connection_manager_thread::handle_client_socket,
-            socket));
+            socket, connection_id));
+    if (connection_manager_->locality_upgrade_ && !host_identity_.empty() &&
+        is_upgradable_endpoint(endpoint)) {
+      send_string(socket, "", ZMQ_SNDMORE);
+      send_string(socket, kLocalityProbe, 0);
+    }
 
     send_string(frontend_socket_, sender, ZMQ_SNDMORE);
     send_empty_message(frontend_socket_, ZMQ_SNDMORE);
-    send_uint64(frontend_socket_, connections_.size() - 1, 0);
+    send_uint64(frontend_socket_, connection_id, 0);
+  }
+
+  inline void handle_close_command(uint64 connection_id) {
+    client_socket* connection = find_connection(connection_id);
+    if (connection == NULL || connection->closing) {
+      return;
+    }
+    connection->closing = true;
+    if (connection->pending_requests == 0) {
+      close_connection(connection_id);
+    }
+  }
+
+  // Called when a request got its reply or timed out. Connections with
+  // pending requests stay open, so the id is valid.
+  inline void finish_request(uint64 connection_id) {
+    client_socket* connection = find_connection(connection_id);
+    --connection->pending_requests;
+    if (connection->closing && connection->pending_requests == 0) {
+      close_connection(connection_id);
+    }
+  }
+
+  // Deletes the sockets and the gauges of the connection, and frees its slot
+  // for the next connect().
+  void close_connection(uint64 connection_id) {
+    uint32 slot = uint32(connection_id);
+    client_socket& connection = connections_[slot];
+    reactor_.remove_socket(connection.socket);
+    if (connection.upgraded_from) {
+      reactor_.remove_socket(connection.upgraded_from);
+    }
+    connection_manager_->metrics_->remove_connection(connection.counters);
+    uint32 generation = connection.generation + 1;
+    connection = client_socket();
+    connection.generation = generation;
+    free_connection_slots_.push_back(slot);
   }
 
   inline void handle_bind_command(
       const std::string& sender,
       const std::string& endpoint,
       connection_manager::server_function server_function) {
-    zmq::socket_t* socket = new zmq::socket_t(*context_, ZMQ_ROUTER);
-    int linger_ms = 0;
-    socket->setsockopt(ZMQ_LINGER, &linger_ms, sizeof(linger_ms));
-#if RPCZ_ENABLE_IPV6
-   enable_ipv6(socket);
-#endif
-    socket->bind(endpoint.c_str());
+    if (connection_manager_->locality_upgrade_ && !host_identity_.empty() &&
+        is_upgradable_endpoint(endpoint)) {
+      // Serve same-host clients on a local endpoint as well, and tell them
+      // about it when they probe the TCP one.
+      std::string local_endpoint(get_local_endpoint(endpoint));
+      try {
+        bind_socket(local_endpoint, server_function);
+        server_function = boost::bind(
+            &connection_manager_thread::answer_locality_probe,
+            host_identity_, local_endpoint, server_function, _1, _2);
+      } catch (const std::exception& e) {
+        LOG(WARNING) << "Could not bind " << local_endpoint << ": "
+                     << e.what();
+      }
+    }
+    bind_socket(endpoint, server_function);
+
+    send_string(frontend_socket_, sender, ZMQ_SNDMORE);
+    send_empty_message(frontend_socket_, ZMQ_SNDMORE);
+    send_empty_message(frontend_socket_, 0);
+  }
+
+  inline void bind_socket(
+      const std::string& endpoint,
+      connection_manager::server_function server_function) {
+    transport_socket* socket = get_transport(endpoint)->bind(endpoint);
     uint64 socket_id = server_sockets_.size();
     server_sockets_.push_back(socket);
+    server_connection_counters_.push_back(
+        connection_manager_->metrics_->add_connection(endpoint, true));
     reactor_.add_socket(socket, new_permanent_callback(
             this, &connection_manager_thread::handle_server_socket,
             socket_id, server_function));
+  }
 
-    send_string(frontend_socket_, sender, ZMQ_SNDMORE);
-    send_empty_message(frontend_socket_, ZMQ_SNDMORE);
-    send_empty_message(frontend_socket_, 0);
+  // Runs on a worker in place of the server function of an upgradable
+  // endpoint. Answers locality probes, which carry no request.
+  static void answer_locality_probe(
+      const std::string& host_identity, const std::string& local_endpoint,
+      connection_manager::server_function server_function,
+      const client_connection& connection, message_iterator& iter) {
+    if (iter.has_more() || connection.event_id_ != kLocalityProbe) {
+      server_function(connection, iter);
+      return;
+    }
+    message_vector v;
+    v.push_back(string_to_message(host_identity));
+    v.push_back(string_to_message(local_endpoint));
+    client_connection(connection).reply(&v);
+  }
+
+  // Switches the connection to the server's local endpoint if the server
+  // is on this host. Replies to requests sent before keep arriving on the
+  // original socket, which stays open.
+  void handle_locality_reply(uint64 connection_id, message_iterator& iter) {
+    if (!iter.has_more()) {
+      return;
+    }
+    std::string host_identity(message_to_string(iter.next()));
+    if (!iter.has_more()) {
+      return;
+    }
+    std::string local_endpoint(message_to_string(iter.next()));
+    client_socket* connection = find_connection(connection_id);
+    if (iter.has_more() || host_identity != host_identity_ ||
+        !connection_manager_->locality_upgrade_ ||
+        connection == NULL || connection->upgraded_from != NULL) {
+      return;
+    }
+    transport_socket* socket;
+    try {
+      socket = get_transport(local_endpoint)->connect(local_endpoint);
+    } catch (const std::exception& e) {
+      LOG(WARNING) << "Could not connect to " << local_endpoint << ": "
+                   << e.what();
+      return;
+    }
+    connection->upgraded_from = connection->socket;
+    connection->socket = socket;
+    reactor_.add_socket(socket, new_permanent_callback(
+            this, &connection_manager_thread::handle_client_socket,
+            socket, connection_id));
   }
 
   void handle_server_socket(uint64 socket_id,
                           connection_manager::server_function server_function) {
     message_iterator iter(*server_sockets_[socket_id]);
     begin_worker_command(krunserver_function);
-    send_object(frontend_socket_, server_function, ZMQ_SNDMORE);
+    send_closure(frontend_socket_, server_function, ZMQ_SNDMORE);
     send_uint64(frontend_socket_, socket_id, ZMQ_SNDMORE);
+    send_pointer(frontend_socket_, server_connection_counters_[socket_id],
+                 ZMQ_SNDMORE);
+#ifdef RPCZ_ENABLE_TRACING
+    if (RPCZ_TRACE_ENABLED(broker_forward)) {
+      forward_traced_request(iter, *frontend_socket_);
+      return;
+    }
+#endif
     forward_messages(iter, *frontend_socket_);
   }
 
@@ -340,21 +616,58 @@ class connection_manager_thread {
     uint64 connection_id = interpret_message<uint64>(iter.next());
     remote_response_wrapper remote_response_wrapper =
         interpret_message<rpcz::remote_response_wrapper>(iter.next());
+    client_socket* connection = find_connection(connection_id);
+    if (connection == NULL || connection->closing) {
+      begin_worker_command(kInvokeclient_request_callback);
+      send_closure(frontend_socket_, remote_response_wrapper.callback,
+                   ZMQ_SNDMORE);
+      send_uint64(frontend_socket_, connection_manager::CLOSED, 0);
+      return;
+    }
+    ++connection->pending_requests;
     event_id event_id = event_id_generator_.get_next();
-    remote_response_map_[event_id] = remote_response_wrapper.callback;
+    remote_response& remote_response = remote_response_map_[event_id];
+    count_allocation(ALLOCATION_PENDING_ENTRIES,
+                     sizeof(remote_response_map::value_type));
+    remote_response.callback = remote_response_wrapper.callback;
+    remote_response.connection_id = connection_id;
     if (remote_response_wrapper.deadline_ms != -1) {
+      closure* timeout = new_callback(
+          this, &connection_manager_thread::handle_timeout, event_id);
+      count_allocation(ALLOCATION_CLOSURES, sizeof(*timeout));
       reactor_.run_closure_at(
           remote_response_wrapper.start_time +
               remote_response_wrapper.deadline_ms,
-          new_callback(this, &connection_manager_thread::handle_timeout, event_id));
+          timeout);
+    }
+    if (remote_response_wrapper.sent_time_usec) {
+      *remote_response_wrapper.sent_time_usec = zclock_time_usec();
     }
-    zmq::socket_t*& socket = connections_[connection_id];
+    transport_socket* socket = connection->socket;
     send_string(socket, "", ZMQ_SNDMORE);
     send_uint64(socket, event_id, ZMQ_SNDMORE);
-    forward_messages(iter, *socket);
+#ifdef RPCZ_ENABLE_TRACING
+    if (RPCZ_TRACE_ENABLED(request_enqueued) ||
+        RPCZ_TRACE_ENABLED(reply_received) ||
+        RPCZ_TRACE_ENABLED(timeout_fired)) {
+      zmq::message_t& header = iter.next();
+      parse_traced_header(header, &remote_response.service,
+                          &remote_response.method);
+      RPCZ_TRACE(request_enqueued, event_id, remote_response.service.c_str(),
+                 remote_response.method.c_str());
+      remote_response.request_bytes = header.size();
+      socket->send(header, iter.has_more() ? ZMQ_SNDMORE : 0);
+    }
+#endif
+    remote_response.request_bytes += forward_messages(iter, *socket);
+    if (memory_accounting()) {
+      remote_response.counters = connection->counters;
+      add_inflight_request(remote_response.counters, 1,
+                           remote_response.request_bytes);
+    }
   }
 
-  void handle_client_socket(zmq::socket_t* socket) {
+  void handle_client_socket(transport_socket* socket, uint64 connection_id) {
     message_iterator iter(*socket);
     if (iter.next().size() != 0) {
       return;
@@ -362,17 +675,29 @@ class connection_manager_thread {
     if (!iter.has_more()) {
       return;
     }
-    event_id event_id(interpret_message<event_id>(iter.next()));
+    zmq::message_t& msg = iter.next();
+    if (msg.size() != sizeof(event_id)) {
+      if (message_to_string(msg) == kLocalityProbe) {
+        handle_locality_reply(connection_id, iter);
+      }
+      return;
+    }
+    event_id event_id(interpret_message<rpcz::event_id>(msg));
     remote_response_map::iterator response_iter = remote_response_map_.find(event_id);
     if (response_iter == remote_response_map_.end()) {
       return;
     }
-    connection_manager::client_request_callback& callback = response_iter->second;
+    remote_response& remote_response = response_iter->second;
+    RPCZ_TRACE(reply_received, event_id, remote_response.service.c_str(),
+               remote_response.method.c_str());
+    add_inflight_request(remote_response.counters, -1,
+                         -remote_response.request_bytes);
     begin_worker_command(kInvokeclient_request_callback);
-    send_object(frontend_socket_, callback, ZMQ_SNDMORE);
+    send_closure(frontend_socket_, remote_response.callback, ZMQ_SNDMORE);
     send_uint64(frontend_socket_, connection_manager::DONE, ZMQ_SNDMORE);
     forward_messages(iter, *frontend_socket_);
     remote_response_map_.erase(response_iter);
+    finish_request(connection_id);
   }
 
   void handle_timeout(event_id event_id) {
@@ -380,38 +705,113 @@ class connection_manager_thread {
     if (response_iter == remote_response_map_.end()) {
       return;
     }
-    connection_manager::client_request_callback& callback = response_iter->second;
+    remote_response& remote_response = response_iter->second;
+    RPCZ_TRACE(timeout_fired, event_id, remote_response.service.c_str(),
+               remote_response.method.c_str());
+    add_inflight_request(remote_response.counters, -1,
+                         -remote_response.request_bytes);
     begin_worker_command(kInvokeclient_request_callback);
-    send_object(frontend_socket_, callback, ZMQ_SNDMORE);
+    send_closure(frontend_socket_, remote_response.callback, ZMQ_SNDMORE);
     send_uint64(frontend_socket_, connection_manager::DEADLINE_EXCEEDED, 0);
+    uint64 connection_id = remote_response.connection_id;
     remote_response_map_.erase(response_iter);
+    finish_request(connection_id);
   }
 
   inline void send_reply(message_iterator& iter) {
     uint64 socket_id = interpret_message<uint64>(iter.next());
-    zmq::socket_t* socket = server_sockets_[socket_id];
+    uint64 accounted_bytes = interpret_message<uint64>(iter.next());
+    transport_socket* socket = server_sockets_[socket_id];
     forward_messages(iter, *socket);
+    if (accounted_bytes != 0) {
+      add_inflight_response(server_connection_counters_[socket_id],
+                            -static_cast<int64>(accounted_bytes));
+    }
   }
 
  private:
-  typedef std::map<event_id, connection_manager::client_request_callback>
-      remote_response_map;
+  struct worker {
+    std::string sender;
+    worker_state* state;
+  };
+
+  // A connection made by connect(). All fields but the generation are NULL
+  // or zero once it is closed.
+  struct client_socket {
+    client_socket() : socket(NULL), upgraded_from(NULL), counters(NULL),
+                      pending_requests(0), closing(false), generation(0) {}
+
+    transport_socket* socket;
+    // The socket used before a locality upgrade, which still gets the
+    // replies to the requests sent on it.
+    transport_socket* upgraded_from;
+    // Owned by the metrics registry.
+    connection_counters* counters;
+    // Requests waiting for their reply or deadline.
+    uint64 pending_requests;
+    // close() was called; the connection closes once no request is pending.
+    bool closing;
+    // Incremented when the slot is freed. See make_connection_id().
+    uint32 generation;
+  };
+
+  // A connection id is the index of the connection's slot in connections_,
+  // tagged with the generation of the slot, which changes every time the
+  // slot is freed. Ids of closed connections are then never mistaken for
+  // the connection that reuses the slot.
+  static uint64 make_connection_id(uint32 slot, uint32 generation) {
+    return (uint64(generation) << 32) | slot;
+  }
+
+  // Returns the connection with the given id, or NULL if it was closed.
+  client_socket* find_connection(uint64 connection_id) {
+    uint32 slot = uint32(connection_id);
+    if (slot >= connections_.size()) {
+      return NULL;
+    }
+    client_socket* connection = &connections_[slot];
+    if (connection->socket == NULL ||
+        connection->generation != uint32(connection_id >> 32)) {
+      return NULL;
+    }
+    return connection;
+  }
+
   typedef std::map<uint64, event_id> deadline_map;
   connection_manager* connection_manager_;
   remote_response_map remote_response_map_;
   deadline_map deadline_map_;
   event_id_generator event_id_generator_;
   reactor reactor_;
-  std::vector<zmq::socket_t*> connections_;
-  std::vector<zmq::socket_t*> server_sockets_;
-  zmq::context_t* context_;
+  // Indexed by the slot of the connection ids.
+  std::vector<client_socket> connections_;
+  // Slots of connections_ freed by closed connections.
+  std::vector<uint32> free_connection_slots_;
+  std::vector<transport_socket*> server_sockets_;
+  // Owned by the metrics registry, indexed like the server sockets.
+  std::vector<connection_counters*> server_connection_counters_;
+  zmq_transport zmq_transport_;
+  memory_transport memory_transport_;
+  tcp_transport tcp_transport_;
+  shm_transport shm_transport_;
+  const std::string host_identity_;
   zmq::socket_t* frontend_socket_;
-  std::vector<std::string> workers_;
+  std::vector<worker> workers_;
   int current_worker_;
+  // Workers that asked to retire and still get work.
+  std::vector<std::string> pending_retirements_;
+  // Workers that were started and did not send kWorkerDone yet.
+  int live_workers_;
+  bool quitting_;
 };
 
 connection_manager::connection_manager(zmq::context_t* context, int nthreads)
   : context_(context),
+    locality_upgrade_(false),
+    metrics_(new metrics_registry),
+    watchdog_(new worker_watchdog(
+        metrics_.get(),
+        boost::bind(&connection_manager::request_worker, this))),
     frontend_endpoint_(
         "inproc://" + boost::lexical_cast<std::string>(this) + ".cm.frontend") {
   zmq::socket_t* frontend_socket = new zmq::socket_t(*context, ZMQ_ROUTER);
@@ -419,8 +819,7 @@ connection_manager::connection_manager(zmq::context_t* context, int nthreads)
   frontend_socket->setsockopt(ZMQ_LINGER, &linger_ms, sizeof(linger_ms));
   frontend_socket->bind(frontend_endpoint_.c_str());
   for (int i = 0; i < nthreads; ++i) {
-    worker_threads_.add_thread(
-        new boost::thread(&worker_thread, this, context, frontend_endpoint_));
+    start_worker();
   }
   sync_event event;
   broker_thread_ = boost::thread(&connection_manager_thread::run,
@@ -429,6 +828,18 @@ connection_manager::connection_manager(zmq::context_t* context, int nthreads)
   event.wait();
 }
 
+void connection_manager::start_worker() {
+  worker_threads_.add_thread(
+      new boost::thread(&worker_thread, this, context_, frontend_endpoint_,
+                        watchdog_->new_worker_state()));
+}
+
+void connection_manager::request_worker() {
+  zmq::socket_t& socket = get_frontend_socket();
+  send_empty_message(&socket, ZMQ_SNDMORE);
+  send_char(&socket, kAddWorker, 0);
+}
+
 zmq::socket_t& connection_manager::get_frontend_socket() {
   zmq::socket_t* socket = socket_.get();
   if (socket == NULL) {
@@ -459,7 +870,7 @@ void connection_manager::bind(const std::string& endpoint,
   send_empty_message(&socket, ZMQ_SNDMORE);
   send_char(&socket, kBind, ZMQ_SNDMORE);
   send_string(&socket, endpoint, ZMQ_SNDMORE);
-  send_object(&socket, function, 0);
+  send_closure(&socket, function, 0);
   zmq::message_t msg;
   socket.recv(&msg);
   socket.recv(&msg);
@@ -473,6 +884,14 @@ void connection_manager::add(closure* closure) {
   send_pointer(&socket, closure, 0);
   return;
 }
+
+void connection_manager::add_timeout(int64 timeout_ms, closure* closure) {
+  zmq::socket_t& socket = get_frontend_socket();
+  send_empty_message(&socket, ZMQ_SNDMORE);
+  send_char(&socket, kAddTimeout, ZMQ_SNDMORE);
+  send_uint64(&socket, zclock_time() + timeout_ms, ZMQ_SNDMORE);
+  send_pointer(&socket, closure, 0);
+}
  
 void connection_manager::run() {
   is_termating_.wait();
@@ -482,7 +901,28 @@ void connection_manager::terminate() {
   is_termating_.signal();
 }
 
+void connection_manager::set_cpu_accounting(bool enabled) {
+  metrics_->set_cpu_accounting(enabled);
+}
+
+void connection_manager::set_locality_upgrade(bool enabled) {
+  locality_upgrade_ = enabled;
+}
+
+void connection_manager::get_metrics_snapshot(metrics_snapshot* snapshot) {
+  metrics_->snapshot(snapshot);
+}
+
+void connection_manager::enable_watchdog(int64 stall_threshold_ms,
+                                         bool replace_stalled_workers,
+                                         int max_replacement_workers) {
+  watchdog_->start(stall_threshold_ms, replace_stalled_workers,
+                   max_replacement_workers);
+}
+
 connection_manager::~connection_manager() {
+  // No more replacement workers from here on.
+  watchdog_->stop();
   zmq::socket_t& socket = get_frontend_socket();
   send_empty_message(&socket, ZMQ_SNDMORE);
   send_char(&socket, kQuit, 0);
@@ -0,0 +1,56 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_EVENT_ID_GENERATOR_H
+#define RPCZ_EVENT_ID_GENERATOR_H
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "rpcz/macros.hpp"
+
+namespace rpcz {
+
+// Identifies a request sent by the broker, so that its reply can be matched.
+typedef uint64 event_id;
+
+// Generates event ids that are unlikely to repeat across processes and
+// connection managers. Not thread-safe; owned by the broker thread.
+class event_id_generator {
+ public:
+  event_id_generator() {
+    state_ = (reinterpret_cast<uint64>(this) << 32);
+#ifdef WIN32
+		state_ += GetCurrentProcessId();
+#else
+		state_ += getpid();
+#endif
+  }
+
+  event_id get_next() {
+    state_ = (state_ * kGenerator) % kLargePrime;
+    return state_;
+  }
+
+ private:
+  static const uint64 kLargePrime = (1ULL << 63) - 165;
+  static const uint64 kGenerator = 2;
+
+  uint64 state_;
+  DISALLOW_COPY_AND_ASSIGN(event_id_generator);
+};
+}  // namespace rpcz
+#endif
@@ -0,0 +1,195 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/idempotency_table.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include <string>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "zmq.hpp"
+
+#include "rpcz/clock.hpp"
+#include "rpcz/logging.hpp"
+#include "rpcz/rpcz.pb.h"
+
+namespace rpcz {
+
+namespace {
+struct idempotency_entry {
+  idempotency_entry() : done(false) {}
+
+  bool done;
+  // Set once done.
+  rpc_response_header header;
+  zmq::message_t payload;
+  // Channels of the requests that arrived while this one was in progress.
+  std::vector<server_channel*> waiters;
+};
+}  // unnamed namespace
+
+class idempotency_stripe {
+ public:
+  idempotency_stripe(size_t max_entries, int64 ttl_ms)
+      : max_entries_(max_entries), ttl_ms_(ttl_ms), deduplicated_(0) {}
+
+  ~idempotency_stripe() {
+    delete_container_second_pointer(entries_.begin(), entries_.end());
+  }
+
+  idempotency_table::begin_result begin(
+      const std::string& key, server_channel* channel,
+      rpc_response_header* header, zmq::message_t* payload) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    drop_expired(zclock_time_usec());
+    idempotency_entry*& entry = entries_[key];
+    if (entry == NULL) {
+      entry = new idempotency_entry;
+      return idempotency_table::STARTED;
+    }
+    ++deduplicated_;
+    if (!entry->done) {
+      entry->waiters.push_back(channel);
+      return idempotency_table::WAITING;
+    }
+    header->CopyFrom(entry->header);
+    // Copying changes the source frame's reference count, hence under mu_.
+    payload->copy(&entry->payload);
+    return idempotency_table::REPLAYED;
+  }
+
+  void finish(const std::string& key, const rpc_response_header& header,
+              zmq::message_t* payload,
+              std::vector<server_channel*>* waiters) {
+    uint64 now = zclock_time_usec();
+    boost::unique_lock<boost::mutex> lock(mu_);
+    entry_map::iterator it = entries_.find(key);
+    CHECK(it != entries_.end());
+    idempotency_entry* entry = it->second;
+    CHECK(!entry->done);
+    waiters->swap(entry->waiters);
+    entry->done = true;
+    entry->header.CopyFrom(header);
+    entry->payload.copy(payload);
+    // Entries are finished in the order they expire.
+    done_keys_.push_back(std::make_pair(now + ttl_ms_ * 1000, key));
+    while (done_keys_.size() > max_entries_) {
+      drop_oldest();
+    }
+    drop_expired(now);
+  }
+
+  void abandon(const std::string& key,
+               std::vector<server_channel*>* waiters) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    entry_map::iterator it = entries_.find(key);
+    CHECK(it != entries_.end());
+    CHECK(!it->second->done);
+    waiters->swap(it->second->waiters);
+    delete it->second;
+    entries_.erase(it);
+  }
+
+  uint64 get_deduplicated_requests() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    return deduplicated_;
+  }
+
+  size_t get_entries() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    return entries_.size();
+  }
+
+ private:
+  typedef boost::unordered_map<std::string, idempotency_entry*> entry_map;
+
+  // mu_ must be held.
+  void drop_oldest() {
+    entry_map::iterator it = entries_.find(done_keys_.front().second);
+    delete it->second;
+    entries_.erase(it);
+    done_keys_.pop_front();
+  }
+
+  // mu_ must be held.
+  void drop_expired(uint64 now) {
+    while (!done_keys_.empty() && done_keys_.front().first <= now) {
+      drop_oldest();
+    }
+  }
+
+  const size_t max_entries_;
+  const int64 ttl_ms_;
+  boost::mutex mu_;
+  entry_map entries_;
+  // The expiration times and keys of the done entries, oldest first.
+  std::deque<std::pair<uint64, std::string> > done_keys_;
+  uint64 deduplicated_;
+};
+
+idempotency_table::idempotency_table(size_t max_entries, int64 ttl_ms,
+                                     int stripes) {
+  CHECK_GE(stripes, 1);
+  size_t max_stripe_entries = std::max<size_t>(1, max_entries / stripes);
+  for (int i = 0; i < stripes; ++i) {
+    stripes_.push_back(new idempotency_stripe(max_stripe_entries, ttl_ms));
+  }
+}
+
+idempotency_table::~idempotency_table() {
+  delete_container_pointers(stripes_.begin(), stripes_.end());
+}
+
+idempotency_stripe* idempotency_table::get_stripe(const std::string& key) {
+  return stripes_[boost::hash<std::string>()(key) % stripes_.size()];
+}
+
+idempotency_table::begin_result idempotency_table::begin(
+    const std::string& key, server_channel* channel,
+    rpc_response_header* header, zmq::message_t* payload) {
+  return get_stripe(key)->begin(key, channel, header, payload);
+}
+
+void idempotency_table::finish(const std::string& key,
+                               const rpc_response_header& header,
+                               zmq::message_t* payload,
+                               std::vector<server_channel*>* waiters) {
+  get_stripe(key)->finish(key, header, payload, waiters);
+}
+
+void idempotency_table::abandon(const std::string& key,
+                                std::vector<server_channel*>* waiters) {
+  get_stripe(key)->abandon(key, waiters);
+}
+
+uint64 idempotency_table::get_deduplicated_requests() const {
+  uint64 deduplicated = 0;
+  for (size_t i = 0; i < stripes_.size(); ++i) {
+    deduplicated += stripes_[i]->get_deduplicated_requests();
+  }
+  return deduplicated;
+}
+
+size_t idempotency_table::get_entries() const {
+  size_t entries = 0;
+  for (size_t i = 0; i < stripes_.size(); ++i) {
+    entries += stripes_[i]->get_entries();
+  }
+  return entries;
+}
+}  // namespace rpcz
@@ -0,0 +1,152 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_LATENCY_HISTOGRAM_H
+#define RPCZ_LATENCY_HISTOGRAM_H
+
+#include <ostream>
+#include <boost/atomic.hpp>
+#include "rpcz/macros.hpp"
+
+namespace rpcz {
+
+// A histogram of latencies in microseconds that can be recorded into from
+// many threads at once. Values below 32 are exact; above that each power of
+// two is split into 16 buckets, so percentiles are within 1/16 of the
+// recorded values. Values are capped at 2^40 usec (about 12 days).
+class latency_histogram {
+ public:
+  latency_histogram() {
+    reset();
+  }
+
+  void reset() {
+    for (int i = 0; i < kBuckets; ++i) {
+      buckets_[i].store(0, boost::memory_order_relaxed);
+    }
+    count_.store(0, boost::memory_order_relaxed);
+    sum_.store(0, boost::memory_order_relaxed);
+    max_.store(0, boost::memory_order_relaxed);
+  }
+
+  void record(uint64 usec) {
+    if (usec > kMaxValue) {
+      usec = kMaxValue;
+    }
+    buckets_[bucket_for(usec)].fetch_add(1, boost::memory_order_relaxed);
+    count_.fetch_add(1, boost::memory_order_relaxed);
+    sum_.fetch_add(usec, boost::memory_order_relaxed);
+    uint64 max = max_.load(boost::memory_order_relaxed);
+    while (usec > max &&
+           !max_.compare_exchange_weak(max, usec,
+                                       boost::memory_order_relaxed)) {
+    }
+  }
+
+  uint64 count() const {
+    return count_.load(boost::memory_order_relaxed);
+  }
+
+  uint64 max() const {
+    return max_.load(boost::memory_order_relaxed);
+  }
+
+  double mean() const {
+    uint64 count = this->count();
+    return count ? double(sum_.load(boost::memory_order_relaxed)) / count : 0;
+  }
+
+  // Returns the smallest value such that at least the given fraction
+  // (0 to 1) of the recorded values are not above it, rounded up to its
+  // bucket's upper bound. Returns 0 for an empty histogram.
+  uint64 percentile(double fraction) const {
+    uint64 count = this->count();
+    if (count == 0) {
+      return 0;
+    }
+    uint64 rank = uint64(fraction * count + 0.5);
+    if (rank == 0) {
+      rank = 1;
+    }
+    uint64 seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += buckets_[i].load(boost::memory_order_relaxed);
+      if (seen >= rank) {
+        uint64 upper = bucket_upper_bound(i);
+        return upper < max() ? upper : max();
+      }
+    }
+    return max();
+  }
+
+  // Prints one line per non-empty bucket with its range, count and
+  // cumulative fraction.
+  void print(std::ostream& out) const {
+    uint64 count = this->count();
+    uint64 seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      uint64 n = buckets_[i].load(boost::memory_order_relaxed);
+      if (n == 0) {
+        continue;
+      }
+      seen += n;
+      out << bucket_lower_bound(i) << "-" << bucket_upper_bound(i)
+          << "us\t" << n << "\t" << double(seen) / count << "\n";
+    }
+  }
+
+ private:
+  static const int kSubBuckets = 16;
+  static const int kMaxExponent = 40;
+  static const uint64 kMaxValue = (1ULL << kMaxExponent) - 1;
+  static const int kBuckets = 2 * kSubBuckets +
+      (kMaxExponent - 5) * kSubBuckets;
+
+  static int bucket_for(uint64 value) {
+    if (value < 2 * kSubBuckets) {
+      return int(value);
+    }
+    int exponent = 5;
+    while (value >> (exponent + 1)) {
+      ++exponent;
+    }
+    return 2 * kSubBuckets + (exponent - 5) * kSubBuckets +
+        int((value >> (exponent - 4)) & (kSubBuckets - 1));
+  }
+
+  static uint64 bucket_lower_bound(int bucket) {
+    if (bucket < 2 * kSubBuckets) {
+      return bucket;
+    }
+    int exponent = 5 + (bucket - 2 * kSubBuckets) / kSubBuckets;
+    uint64 sub_bucket = (bucket - 2 * kSubBuckets) % kSubBuckets;
+    return (kSubBuckets + sub_bucket) << (exponent - 4);
+  }
+
+  static uint64 bucket_upper_bound(int bucket) {
+    if (bucket < 2 * kSubBuckets) {
+      return bucket;
+    }
+    int exponent = 5 + (bucket - 2 * kSubBuckets) / kSubBuckets;
+    return bucket_lower_bound(bucket) + (1ULL << (exponent - 4)) - 1;
+  }
+
+  boost::atomic<uint64> buckets_[kBuckets];
+  boost::atomic<uint64> count_;
+  boost::atomic<uint64> sum_;
+  boost::atomic<uint64> max_;
+  DISALLOW_COPY_AND_ASSIGN(latency_histogram);
+};
+}  // namespace rpcz
+#endif
@@ -0,0 +1,212 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/load_generator.hpp"
+
+#include <limits>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include <google/protobuf/message.h>
+#include "rpcz/callback.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/logging.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/rpcz.pb.h"
+
+namespace rpcz {
+
+struct load_generator::pending_call {
+  pending_call(const load_request* request, uint64 client,
+               uint64 scheduled_usec)
+      : request(request), client(client), scheduled_usec(scheduled_usec) {}
+
+  rpcz::rpc rpc;
+  std::string response;
+  // The parsed response of message requests.
+  scoped_ptr<google::protobuf::Message> response_message;
+  const load_request* request;
+  // The request, for calls started by send_at().
+  scoped_ptr<load_request> copy;
+  uint64 client;
+  uint64 scheduled_usec;
+};
+
+load_generator::load_generator(const std::vector<rpc_channel*>& channels,
+                               int64 deadline_ms)
+    : channels_(channels), deadline_ms_(deadline_ms), warmup_usec_(0),
+      requests_(NULL), closed_loop_(false), measure_start_usec_(0),
+      end_usec_(std::numeric_limits<uint64>::max()), next_request_(0),
+      next_client_(0), outstanding_(1), errors_(0) {
+  CHECK(!channels_.empty());
+}
+
+void load_generator::set_warmup_usec(uint64 warmup_usec) {
+  warmup_usec_ = warmup_usec;
+}
+
+void load_generator::run_closed_loop(const std::vector<load_request>& requests,
+                                     int64 concurrency, uint64 duration_usec) {
+  closed_loop_ = true;
+  start_clock(requests, duration_usec);
+  outstanding_ += concurrency;
+  uint64 now = zclock_time_usec();
+  for (int64 i = 0; i < concurrency; ++i) {
+    start_call(new pending_call(next_request(), i, now));
+  }
+  wait();
+}
+
+void load_generator::run_open_loop(const std::vector<load_request>& requests,
+                                   int64 rate, uint64 duration_usec) {
+  CHECK_GE(rate, 1);
+  start_clock(requests, duration_usec);
+  uint64 start_usec = measure_start_usec_ - warmup_usec_;
+  for (uint64 i = 0; ; ++i) {
+    uint64 scheduled_usec = start_usec + i * 1000000 / rate;
+    if (scheduled_usec >= end_usec_) {
+      break;
+    }
+    sleep_until(scheduled_usec);
+    ++outstanding_;
+    start_call(new pending_call(next_request(), i, scheduled_usec));
+  }
+  wait();
+}
+
+void load_generator::send_at(const load_request& request,
+                             uint64 scheduled_usec) {
+  sleep_until(scheduled_usec);
+  ++outstanding_;
+  pending_call* call = new pending_call(NULL, next_client_++, scheduled_usec);
+  call->copy.reset(new load_request(request));
+  call->request = call->copy.get();
+  start_call(call);
+}
+
+void load_generator::wait() {
+  finish_call();
+  done_.wait();
+}
+
+uint64 load_generator::get_calls() const {
+  return histogram_.count();
+}
+
+uint64 load_generator::get_errors() const {
+  return errors_;
+}
+
+const latency_histogram& load_generator::get_histogram() const {
+  return histogram_;
+}
+
+void load_generator::print_report(std::ostream& out, uint64 elapsed_usec) {
+  uint64 calls = get_calls();
+  uint64 errors = get_errors();
+  out << "calls: " << calls + errors
+      << " ok: " << calls << " errors: " << errors << std::endl
+      << "qps: " << calls * 1e6 / elapsed_usec << std::endl
+      << "latency (usec): mean " << histogram_.mean()
+      << " p50 " << histogram_.percentile(0.5)
+      << " p90 " << histogram_.percentile(0.9)
+      << " p99 " << histogram_.percentile(0.99)
+      << " p99.9 " << histogram_.percentile(0.999)
+      << " max " << histogram_.max() << std::endl << std::endl;
+  histogram_.print(out);
+  boost::unique_lock<boost::mutex> lock(errors_mu_);
+  if (!errors_by_kind_.empty()) {
+    out << std::endl << "errors:" << std::endl;
+    for (error_map::const_iterator it = errors_by_kind_.begin();
+         it != errors_by_kind_.end(); ++it) {
+      out << "  " << it->first << ": " << it->second << std::endl;
+    }
+  }
+}
+
+void load_generator::start_clock(const std::vector<load_request>& requests,
+                                 uint64 duration_usec) {
+  CHECK(!requests.empty());
+  requests_ = &requests;
+  measure_start_usec_ = zclock_time_usec() + warmup_usec_;
+  end_usec_ = measure_start_usec_ + duration_usec;
+}
+
+const load_request* load_generator::next_request() {
+  return &(*requests_)[next_request_++ % requests_->size()];
+}
+
+void load_generator::start_call(pending_call* call) {
+  call->rpc.set_deadline_ms(deadline_ms_);
+  rpc_channel* channel = channels_[call->client % channels_.size()];
+  closure* done = new_callback(this, &load_generator::call_done, call);
+  const load_request* request = call->request;
+  if (request->message) {
+    call->response_message.reset(
+        google::protobuf::MessageFactory::generated_factory()->GetPrototype(
+            request->descriptor->output_type())->New());
+    channel->call_method(request->service, request->descriptor,
+                         *request->message, call->response_message.get(),
+                         &call->rpc, done);
+  } else {
+    channel->call_method0(request->service, request->method,
+                          request->payload, &call->response, &call->rpc,
+                          done);
+  }
+}
+
+void load_generator::call_done(pending_call* call) {
+  uint64 now = zclock_time_usec();
+  if (call->scheduled_usec >= measure_start_usec_ &&
+      call->scheduled_usec < end_usec_) {
+    if (call->rpc.ok()) {
+      histogram_.record(now - call->scheduled_usec);
+    } else {
+      std::string error(call->request->service + "." + call->request->method +
+                        " " + rpc_response_header::status_code_Name(
+                            call->rpc.get_status()));
+      if (call->rpc.get_status() == status::APPLICATION_ERROR) {
+        error += " " + boost::lexical_cast<std::string>(
+            call->rpc.get_application_error_code());
+      }
+      ++errors_;
+      boost::unique_lock<boost::mutex> lock(errors_mu_);
+      ++errors_by_kind_[error];
+    }
+  }
+  uint64 client = call->client;
+  delete call;
+  if (closed_loop_ && now < end_usec_) {
+    start_call(new pending_call(next_request(), client, now));
+  } else {
+    finish_call();
+  }
+}
+
+void load_generator::finish_call() {
+  if (--outstanding_ == 0) {
+    done_.signal();
+  }
+}
+
+void load_generator::sleep_until(uint64 usec) {
+  uint64 now = zclock_time_usec();
+  if (usec > now + 200) {
+    boost::this_thread::sleep(boost::posix_time::microseconds(
+            usec - now - 100));
+  }
+  while (zclock_time_usec() < usec) {
+  }
+}
+}  // namespace rpcz
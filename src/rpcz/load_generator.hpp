@@ -0,0 +1,139 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_LOAD_GENERATOR_H
+#define RPCZ_LOAD_GENERATOR_H
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <google/protobuf/descriptor.h>
+#include "rpcz/latency_histogram.hpp"
+#include "rpcz/macros.hpp"
+#include "rpcz/sync_event.hpp"
+
+namespace rpcz {
+class rpc_channel;
+
+// A request to a method. Serialized requests are sent as they are and their
+// responses are not parsed. Message requests are sent like a generated stub
+// sends them: each call serializes the message and parses the response.
+struct load_request {
+  load_request() : descriptor(NULL), message(NULL) {}
+  load_request(const std::string& service, const std::string& method,
+               const std::string& payload)
+      : service(service), method(method), payload(payload),
+        descriptor(NULL), message(NULL) {}
+  // The message must outlive the calls.
+  load_request(const google::protobuf::MethodDescriptor* descriptor,
+               const google::protobuf::Message* message)
+      : service(descriptor->service()->name()), method(descriptor->name()),
+        descriptor(descriptor), message(message) {}
+
+  std::string service;
+  std::string method;
+  std::string payload;
+  // NULL for serialized requests.
+  const google::protobuf::MethodDescriptor* descriptor;
+  const google::protobuf::Message* message;
+};
+
+// Sends requests asynchronously, spread over a set of channels,
+// and records the latencies and errors of the calls. This is the load
+// generator of rpcz_bench, zsendrpc bench and zreplay.
+//
+// Latencies are measured from the time each call was due, so calls that are
+// sent late because the generator fell behind count the delay instead of
+// hiding it (coordinated omission).
+//
+// A load_generator runs a single load: one of the run_ methods, or a series
+// of send_at() followed by wait().
+class load_generator {
+ public:
+  // The channels must outlive the generator. deadline_ms applies to each
+  // call, -1 for none.
+  load_generator(const std::vector<rpc_channel*>& channels, int64 deadline_ms);
+
+  // Calls scheduled during the first warmup_usec of a run are made but not
+  // measured. The default is 0.
+  void set_warmup_usec(uint64 warmup_usec);
+
+  // Keeps concurrency calls in flight for duration_usec after the warmup,
+  // cycling through the requests.
+  void run_closed_loop(const std::vector<load_request>& requests,
+                       int64 concurrency, uint64 duration_usec);
+
+  // Starts rate calls per second for duration_usec after the warmup,
+  // cycling through the requests. rate must be positive.
+  void run_open_loop(const std::vector<load_request>& requests,
+                     int64 rate, uint64 duration_usec);
+
+  // Sends the request when zclock_time_usec() reaches scheduled_usec, or
+  // right away if it is already past. For loads with a schedule of their
+  // own, like a replayed capture.
+  void send_at(const load_request& request, uint64 scheduled_usec);
+
+  // Waits for all the calls started with send_at() to finish.
+  void wait();
+
+  // Measured calls that succeeded and that failed.
+  uint64 get_calls() const;
+  uint64 get_errors() const;
+
+  // Latencies of the measured calls that succeeded.
+  const latency_histogram& get_histogram() const;
+
+  // Prints the call counts, the rate of successful calls over elapsed_usec,
+  // the latency percentiles and histogram, and the errors by method and
+  // status.
+  void print_report(std::ostream& out, uint64 elapsed_usec);
+
+ private:
+  struct pending_call;
+
+  void start_clock(const std::vector<load_request>& requests,
+                   uint64 duration_usec);
+  const load_request* next_request();
+  void start_call(pending_call* call);
+  void call_done(pending_call* call);
+  void finish_call();
+
+  // Sleeps until about 100 usec before the deadline, then spins.
+  static void sleep_until(uint64 usec);
+
+  typedef std::map<std::string, uint64> error_map;
+
+  const std::vector<rpc_channel*>& channels_;
+  const int64 deadline_ms_;
+  uint64 warmup_usec_;
+  const std::vector<load_request>* requests_;
+  bool closed_loop_;
+  uint64 measure_start_usec_;
+  uint64 end_usec_;
+  boost::atomic<uint64> next_request_;
+  boost::atomic<uint64> next_client_;
+  // Calls in flight, plus one held by the thread that starts them.
+  boost::atomic<int64> outstanding_;
+  latency_histogram histogram_;
+  boost::atomic<uint64> errors_;
+  boost::mutex errors_mu_;
+  error_map errors_by_kind_;
+  sync_event done_;
+  DISALLOW_COPY_AND_ASSIGN(load_generator);
+};
+}  // namespace rpcz
+#endif
@@ -0,0 +1,248 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/local_rpc_channel.hpp"
+
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include "rpcz/callback.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/connection_manager.hpp"
+#include "rpcz/logging.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/server.hpp"
+#include "rpcz/service.hpp"
+#include "rpcz/sync_event.hpp"
+
+namespace rpcz {
+
+// The caller's side of a direct call. Completed once, by the reply or by the
+// deadline, whichever comes first; the other one is ignored, like a reply
+// that arrives after the deadline.
+class local_call {
+ public:
+  local_call(rpc* rpc, google::protobuf::Message* response_msg,
+             std::string* response_str, closure* done)
+      : rpc_(rpc), response_msg_(response_msg), response_str_(response_str),
+        done_(done), start_time_usec_(zclock_time_usec()), completed_(false) {
+  }
+
+  void reply(const google::protobuf::Message& response,
+             int64 server_time_usec) {
+    if (!claim()) {
+      return;
+    }
+    if (response_msg_) {
+      if (response_msg_->GetDescriptor() == response.GetDescriptor()) {
+        response_msg_->CopyFrom(response);
+      } else if (!response_msg_->ParseFromString(
+              response.SerializeAsString())) {
+        rpc_->set_failed(application_error::INVALID_MESSAGE, "");
+        finish(server_time_usec);
+        return;
+      }
+    } else if (response_str_) {
+      response.SerializeToString(response_str_);
+    }
+    rpc_->set_status(status::OK);
+    finish(server_time_usec);
+  }
+
+  void reply0(const std::string& response, int64 server_time_usec) {
+    if (!claim()) {
+      return;
+    }
+    if (response_msg_) {
+      if (!response_msg_->ParseFromString(response)) {
+        rpc_->set_failed(application_error::INVALID_MESSAGE, "");
+        finish(server_time_usec);
+        return;
+      }
+    } else if (response_str_) {
+      *response_str_ = response;
+    }
+    rpc_->set_status(status::OK);
+    finish(server_time_usec);
+  }
+
+  void fail(int application_error, const std::string& error_message,
+            int64 server_time_usec) {
+    if (!claim()) {
+      return;
+    }
+    rpc_->set_failed(application_error, error_message);
+    finish(server_time_usec);
+  }
+
+  void expire() {
+    if (!claim()) {
+      return;
+    }
+    rpc_->set_status(status::DEADLINE_EXCEEDED);
+    finish(-1);
+  }
+
+ private:
+  bool claim() {
+    return !completed_.exchange(true);
+  }
+
+  void finish(int64 server_time_usec) {
+    rpc_stats& stats = rpc_->stats_;
+    stats.latency_usec = zclock_time_usec() - start_time_usec_;
+    stats.server_time_usec = server_time_usec;
+    // We call signal() before we execute closure since the closure may
+    // delete the rpc object (which contains the sync_event).
+    closure* done = done_;
+    rpc_->sync_event_->signal();
+    if (done) {
+      done->run();
+    }
+  }
+
+  rpc* rpc_;
+  google::protobuf::Message* response_msg_;
+  std::string* response_str_;
+  closure* done_;
+  uint64 start_time_usec_;
+  boost::atomic<bool> completed_;
+  DISALLOW_COPY_AND_ASSIGN(local_call);
+};
+
+// The server's side of a direct call: holds the request until the service
+// replies.
+class local_server_channel : public server_channel {
+ public:
+  local_server_channel(boost::shared_ptr<local_call> call,
+                       const std::string& service_name,
+                       const std::string& method_name)
+      : call_(call), service_name_(service_name), method_name_(method_name),
+        request_(NULL), start_time_usec_(0) {}
+
+  virtual void send(const google::protobuf::Message& response) {
+    call_->reply(response, zclock_time_usec() - start_time_usec_);
+  }
+
+  virtual void send_error(int application_error,
+                          const std::string& error_message="") {
+    call_->fail(application_error, error_message,
+                zclock_time_usec() - start_time_usec_);
+  }
+
+  virtual void send0(const std::string& response) {
+    call_->reply0(response, zclock_time_usec() - start_time_usec_);
+  }
+
+ private:
+  boost::shared_ptr<local_call> call_;
+  const std::string service_name_;
+  const std::string method_name_;
+  // Either the request, owned by request_copy_ or by the caller, or NULL
+  // and the serialized request in payload_.
+  const google::protobuf::Message* request_;
+  scoped_ptr<google::protobuf::Message> request_copy_;
+  std::string payload_;
+  uint64 start_time_usec_;
+
+  friend class local_rpc_channel;
+};
+
+namespace {
+void expire_local_call(boost::shared_ptr<local_call> call) {
+  call->expire();
+}
+}  // unnamed namespace
+
+local_rpc_channel::local_rpc_channel(server* server,
+                                     connection_manager* manager,
+                                     bool on_workers, bool copy_requests)
+    : server_(server), manager_(manager), on_workers_(on_workers),
+      copy_requests_(copy_requests) {
+}
+
+void local_rpc_channel::call_method(
+    const std::string& service_name,
+    const google::protobuf::MethodDescriptor* method,
+    const google::protobuf::Message& request,
+    google::protobuf::Message* response,
+    rpc* rpc,
+    closure* done) {
+  CHECK_EQ(rpc->get_status(), status::INACTIVE);
+  boost::shared_ptr<local_call> call(
+      new local_call(rpc, response, NULL, done));
+  local_server_channel* channel = new local_server_channel(
+      call, service_name, method->name());
+  if (copy_requests_) {
+    channel->request_copy_.reset(request.New());
+    channel->request_copy_->CopyFrom(request);
+    channel->request_ = channel->request_copy_.get();
+  } else {
+    channel->request_ = &request;
+  }
+  start_call(call, channel, rpc);
+}
+
+void local_rpc_channel::call_method0(const std::string& service_name,
+                                     const std::string& method_name,
+                                     const std::string& request,
+                                     std::string* response,
+                                     rpc* rpc,
+                                     closure* done) {
+  CHECK_EQ(rpc->get_status(), status::INACTIVE);
+  boost::shared_ptr<local_call> call(
+      new local_call(rpc, NULL, response, done));
+  local_server_channel* channel = new local_server_channel(
+      call, service_name, method_name);
+  channel->payload_ = request;
+  start_call(call, channel, rpc);
+}
+
+void local_rpc_channel::start_call(boost::shared_ptr<local_call> call,
+                                   local_server_channel* channel, rpc* rpc) {
+  rpc->set_status(status::ACTIVE);
+  if (rpc->get_deadline_ms() != -1) {
+    manager_->add_timeout(rpc->get_deadline_ms(),
+                          new_callback(&expire_local_call, call));
+  }
+  if (on_workers_) {
+    manager_->add(new_callback(&local_rpc_channel::dispatch, server_,
+                               channel));
+  } else {
+    dispatch(server_, channel);
+  }
+}
+
+void local_rpc_channel::dispatch(server* server,
+                                 local_server_channel* channel) {
+  channel->start_time_usec_ = zclock_time_usec();
+  rpc_service* service = server->find_service(channel->service_name_);
+  if (service == NULL) {
+    channel->send_error(application_error::NO_SUCH_SERVICE);
+    delete channel;
+    return;
+  }
+  if (service->dispatch_local(channel->method_name_, channel->request_,
+                              channel->payload_, channel)) {
+    return;
+  }
+  if (channel->request_) {
+    channel->payload_ = channel->request_->SerializeAsString();
+  }
+  service->dispatch_request(channel->method_name_, channel->payload_.data(),
+                            channel->payload_.size(), channel);
+}
+}  // namespace rpcz
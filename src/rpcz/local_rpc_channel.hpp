@@ -0,0 +1,71 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_LOCAL_RPC_CHANNEL_H
+#define RPCZ_LOCAL_RPC_CHANNEL_H
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include "rpcz/macros.hpp"
+#include "rpcz/rpc_channel.hpp"
+
+namespace rpcz {
+class connection_manager;
+class local_call;
+class local_server_channel;
+class server;
+
+// An rpc_channel that calls the services of a server in the same process
+// directly: requests and responses are passed as objects, copied at most
+// once, instead of going through the connection manager. Services that only
+// take serialized requests get them serialized. Deadlines are enforced with
+// the connection manager's timers. The server has to outlive the channel.
+class local_rpc_channel : public rpc_channel {
+ public:
+  // With on_workers, services are called on a connection manager thread,
+  // and otherwise on the calling thread. With copy_requests, services get a
+  // copy of the request; otherwise the request has to stay valid until the
+  // service replies.
+  local_rpc_channel(server* server, connection_manager* manager,
+                    bool on_workers, bool copy_requests);
+
+  virtual void call_method(const std::string& service_name,
+                          const google::protobuf::MethodDescriptor* method,
+                          const google::protobuf::Message& request,
+                          google::protobuf::Message* response,
+                          rpc* rpc,
+                          closure* done);
+
+  virtual void call_method0(const std::string& service_name,
+                           const std::string& method_name,
+                           const std::string& request,
+                           std::string* response,
+                           rpc* rpc,
+                           closure* done);
+
+ private:
+  void start_call(boost::shared_ptr<local_call> call,
+                  local_server_channel* channel, rpc* rpc);
+
+  // Calls the service. Takes ownership of the channel.
+  static void dispatch(server* server, local_server_channel* channel);
+
+  server* server_;
+  connection_manager* manager_;
+  const bool on_workers_;
+  const bool copy_requests_;
+  DISALLOW_COPY_AND_ASSIGN(local_rpc_channel);
+};
+}  // namespace rpcz
+#endif
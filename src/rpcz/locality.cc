@@ -0,0 +1,89 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/locality.hpp"
+
+#include <ctype.h>
+#include <fstream>
+#include <string>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace rpcz {
+
+const char kLocalityProbe[] = "rpcz.locality";
+
+namespace {
+const char* const kSchemes[] = {"tcp://", "ntcp://"};
+
+// Returns the "host:port" part of an upgradable endpoint, or an empty string.
+std::string get_address(const std::string& endpoint) {
+  for (size_t i = 0; i < sizeof(kSchemes) / sizeof(kSchemes[0]); ++i) {
+    const std::string scheme(kSchemes[i]);
+    if (endpoint.compare(0, scheme.size(), scheme) != 0) {
+      continue;
+    }
+    std::string address(endpoint.substr(scheme.size()));
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 ||
+        colon + 1 == address.size()) {
+      return "";
+    }
+    for (size_t j = colon + 1; j < address.size(); ++j) {
+      if (!isdigit(static_cast<unsigned char>(address[j]))) {
+        return "";
+      }
+    }
+    return address;
+  }
+  return "";
+}
+}  // unnamed namespace
+
+std::string get_host_identity() {
+#ifdef __linux__
+  std::string boot_id;
+  std::ifstream file("/proc/sys/kernel/random/boot_id");
+  if (!std::getline(file, boot_id) || boot_id.empty()) {
+    return "";
+  }
+  // ipc:// endpoints are paths, so both sides have to see the same /tmp.
+  char mount_namespace[64];
+  ssize_t size = readlink("/proc/self/ns/mnt", mount_namespace,
+                          sizeof(mount_namespace));
+  if (size <= 0 || size == sizeof(mount_namespace)) {
+    return "";
+  }
+  return boot_id + "/" + std::string(mount_namespace, size);
+#else
+  return "";
+#endif
+}
+
+bool is_upgradable_endpoint(const std::string& endpoint) {
+  return !get_address(endpoint).empty();
+}
+
+std::string get_local_endpoint(const std::string& endpoint) {
+  std::string name(get_address(endpoint));
+  for (size_t i = 0; i < name.size(); ++i) {
+    char c = name[i];
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-') {
+      name[i] = '_';
+    }
+  }
+  return "ipc:///tmp/rpcz.local." + name;
+}
+}  // namespace rpcz
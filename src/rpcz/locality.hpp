@@ -0,0 +1,45 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_LOCALITY_H
+#define RPCZ_LOCALITY_H
+
+#include <string>
+
+namespace rpcz {
+
+// The locality handshake lets clients that reach a server over TCP from the
+// same host switch to an ipc:// endpoint that the server binds next to its
+// TCP one. Right after connecting, the client sends ("", kLocalityProbe).
+// A server that supports it answers with (kLocalityProbe, host identity,
+// local endpoint), and the client sends its later requests to the local
+// endpoint if the host identity equals its own. Older servers ignore the
+// probe, since it has no request header.
+extern const char kLocalityProbe[];
+
+// Identifies this host and filesystem namespace: two processes with the same
+// identity can reach each other's ipc:// endpoints. Empty where unknown
+// (outside Linux), in which case there is no upgrade.
+std::string get_host_identity();
+
+// Returns true for the endpoints that take part in the handshake: tcp:// and
+// ntcp:// endpoints with a numeric port.
+bool is_upgradable_endpoint(const std::string& endpoint);
+
+// Returns the ipc:// endpoint that a server bound to the given upgradable
+// endpoint advertises. The name depends only on the TCP address, so a server
+// that restarts binds the same local endpoint again.
+std::string get_local_endpoint(const std::string& endpoint);
+}  // namespace rpcz
+#endif
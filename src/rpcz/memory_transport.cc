@@ -0,0 +1,347 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/memory_transport.hpp"
+
+#include <string.h>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "rpcz/logging.hpp"
+
+namespace rpcz {
+namespace {
+const char kScheme[] = "mem://";
+
+struct memory_message {
+  // The identity of the client that sent the message, for the server.
+  std::string peer;
+  boost::ptr_vector<zmq::message_t> frames;
+};
+
+// The incoming messages of a socket. Pushed by any broker, popped by the
+// broker that owns the socket.
+class memory_queue {
+ public:
+  memory_queue() : waiting_(false), closed_(false) {
+#ifdef WIN32
+    throw std::runtime_error("mem:// endpoints are not supported on Windows.");
+#else
+    CHECK_EQ(0, pipe(fds_));
+    fcntl(fds_[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds_[1], F_SETFL, O_NONBLOCK);
+#endif
+  }
+
+  ~memory_queue() {
+    delete_container_pointers(messages_.begin(), messages_.end());
+#ifndef WIN32
+    close(fds_[0]);
+    close(fds_[1]);
+#endif
+  }
+
+  // Takes ownership of the message, unless the queue is closed and false is
+  // returned.
+  bool push(memory_message* message) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    if (closed_) {
+      return false;
+    }
+    messages_.push_back(message);
+    if (waiting_) {
+      waiting_ = false;
+#ifndef WIN32
+      char wakeup = 0;
+      if (write(fds_[1], &wakeup, 1) != 1) {
+        // The pipe is full, so the reader is being woken up anyway.
+      }
+#endif
+    }
+    return true;
+  }
+
+  memory_message* pop() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    CHECK(!messages_.empty());
+    memory_message* message = messages_.front();
+    messages_.pop_front();
+    return message;
+  }
+
+  bool prepare_poll() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    if (!messages_.empty()) {
+      return true;
+    }
+    waiting_ = true;
+    return false;
+  }
+
+  int ready_messages(bool polled) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    waiting_ = false;
+#ifndef WIN32
+    if (polled) {
+      char buffer[64];
+      while (read(fds_[0], buffer, sizeof(buffer)) > 0) {
+      }
+    }
+#endif
+    return messages_.size();
+  }
+
+  // Messages pushed from now on are dropped.
+  void close_queue() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    closed_ = true;
+  }
+
+  int get_fd() const {
+    return fds_[0];
+  }
+
+ private:
+  boost::mutex mu_;
+  std::deque<memory_message*> messages_;
+  // Whether the owner sleeps in zmq_poll() and needs a wake-up.
+  bool waiting_;
+  bool closed_;
+  int fds_[2];
+  DISALLOW_COPY_AND_ASSIGN(memory_queue);
+};
+
+// A bound name: the queue of the server and the queues of its clients.
+struct memory_endpoint {
+  memory_endpoint() : server_queue(new memory_queue), next_client_id(0) {}
+
+  boost::shared_ptr<memory_queue> server_queue;
+  boost::mutex mu;
+  std::map<std::string, boost::weak_ptr<memory_queue> > clients;
+  uint32 next_client_id;
+};
+
+typedef std::map<std::string, boost::weak_ptr<memory_endpoint> > endpoint_map;
+
+boost::mutex endpoints_mu;
+endpoint_map endpoints;
+
+boost::shared_ptr<memory_endpoint> find_endpoint(const std::string& name) {
+  boost::unique_lock<boost::mutex> lock(endpoints_mu);
+  endpoint_map::const_iterator it = endpoints.find(name);
+  if (it == endpoints.end()) {
+    return boost::shared_ptr<memory_endpoint>();
+  }
+  return it->second.lock();
+}
+
+class memory_socket : public transport_socket {
+ public:
+  // With peer_frame, received messages start with the identity of their
+  // sender and sent messages with the identity of their recipient.
+  memory_socket(boost::shared_ptr<memory_queue> queue, bool peer_frame)
+      : queue_(queue), peer_frame_(peer_frame), next_frame_(0) {}
+
+  virtual bool send(zmq::message_t& frame, int flags) {
+    if (outgoing_.get() == NULL) {
+      outgoing_.reset(new memory_message);
+      if (peer_frame_) {
+        outgoing_->peer = message_to_string(frame);
+        return true;
+      }
+    }
+    zmq::message_t* owned = new zmq::message_t;
+    owned->move(&frame);
+    outgoing_->frames.push_back(owned);
+    if (!(flags & ZMQ_SNDMORE)) {
+      deliver(outgoing_.release());
+    }
+    return true;
+  }
+
+  virtual void recv(zmq::message_t* frame, bool* more) {
+    if (incoming_.get() == NULL) {
+      incoming_.reset(queue_->pop());
+      next_frame_ = 0;
+      if (peer_frame_) {
+        frame->rebuild(incoming_->peer.size());
+        memcpy(frame->data(), incoming_->peer.data(), incoming_->peer.size());
+        *more = true;
+        return;
+      }
+    }
+    frame->move(&incoming_->frames[next_frame_++]);
+    *more = next_frame_ < incoming_->frames.size();
+    if (!*more) {
+      incoming_.reset();
+    }
+  }
+
+  virtual zmq::pollitem_t get_pollitem() {
+    zmq::pollitem_t pollitem = {NULL, queue_->get_fd(), ZMQ_POLLIN, 0};
+    return pollitem;
+  }
+
+  virtual int ready_messages(bool polled) {
+    return queue_->ready_messages(polled);
+  }
+
+  virtual bool prepare_poll() {
+    return queue_->prepare_poll();
+  }
+
+ protected:
+  // Takes ownership of a message that was completely sent.
+  virtual void deliver(memory_message* message) = 0;
+
+  boost::shared_ptr<memory_queue> queue_;
+
+ private:
+  const bool peer_frame_;
+  scoped_ptr<memory_message> outgoing_;
+  scoped_ptr<memory_message> incoming_;
+  size_t next_frame_;
+};
+
+class memory_client_socket : public memory_socket {
+ public:
+  explicit memory_client_socket(const std::string& name)
+      : memory_socket(boost::shared_ptr<memory_queue>(new memory_queue),
+                      false),
+        name_(name) {
+    attach();
+  }
+
+  ~memory_client_socket() {
+    detach();
+  }
+
+ protected:
+  virtual void deliver(memory_message* message) {
+    // Looks for the server again if it was not bound yet or went away,
+    // since the name may have been bound again.
+    if (endpoint_) {
+      message->peer = identity_;
+      if (endpoint_->server_queue->push(message)) {
+        return;
+      }
+    }
+    if (attach()) {
+      message->peer = identity_;
+      if (endpoint_->server_queue->push(message)) {
+        return;
+      }
+    }
+    delete message;
+  }
+
+ private:
+  // Registers with the server once it is bound. Returns false if it is not.
+  bool attach() {
+    detach();
+    endpoint_ = find_endpoint(name_);
+    if (!endpoint_) {
+      return false;
+    }
+    boost::unique_lock<boost::mutex> lock(endpoint_->mu);
+    // Like ZeroMQ's generated identities: a zero byte and a counter.
+    uint32 id = endpoint_->next_client_id++;
+    identity_.assign(1, '\0');
+    identity_.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    endpoint_->clients[identity_] = queue_;
+    return true;
+  }
+
+  void detach() {
+    if (endpoint_) {
+      boost::unique_lock<boost::mutex> lock(endpoint_->mu);
+      endpoint_->clients.erase(identity_);
+    }
+    endpoint_.reset();
+  }
+
+  const std::string name_;
+  boost::shared_ptr<memory_endpoint> endpoint_;
+  std::string identity_;
+};
+
+class memory_server_socket : public memory_socket {
+ public:
+  memory_server_socket(const std::string& name,
+                       boost::shared_ptr<memory_endpoint> endpoint)
+      : memory_socket(endpoint->server_queue, true),
+        name_(name), endpoint_(endpoint) {}
+
+  ~memory_server_socket() {
+    {
+      boost::unique_lock<boost::mutex> lock(endpoints_mu);
+      endpoints.erase(name_);
+    }
+    queue_->close_queue();
+  }
+
+ protected:
+  virtual void deliver(memory_message* message) {
+    boost::shared_ptr<memory_queue> client;
+    {
+      boost::unique_lock<boost::mutex> lock(endpoint_->mu);
+      std::map<std::string, boost::weak_ptr<memory_queue> >::const_iterator
+          it = endpoint_->clients.find(message->peer);
+      if (it != endpoint_->clients.end()) {
+        client = it->second.lock();
+      }
+    }
+    if (!client || !client->push(message)) {
+      // The client went away.
+      delete message;
+    }
+  }
+
+ private:
+  const std::string name_;
+  boost::shared_ptr<memory_endpoint> endpoint_;
+};
+}  // unnamed namespace
+
+bool memory_transport::handles(const std::string& endpoint) {
+  return endpoint.compare(0, sizeof(kScheme) - 1, kScheme) == 0;
+}
+
+transport_socket* memory_transport::connect(const std::string& endpoint) {
+  return new memory_client_socket(endpoint.substr(sizeof(kScheme) - 1));
+}
+
+transport_socket* memory_transport::bind(const std::string& endpoint) {
+  std::string name(endpoint.substr(sizeof(kScheme) - 1));
+  boost::shared_ptr<memory_endpoint> bound(new memory_endpoint);
+  {
+    boost::unique_lock<boost::mutex> lock(endpoints_mu);
+    boost::weak_ptr<memory_endpoint>& entry = endpoints[name];
+    if (entry.lock()) {
+      throw std::runtime_error("Address already in use: " + endpoint);
+    }
+    entry = bound;
+  }
+  return new memory_server_socket(name, bound);
+}
+}  // namespace rpcz
@@ -0,0 +1,48 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_MEMORY_TRANSPORT_H
+#define RPCZ_MEMORY_TRANSPORT_H
+
+#include <string>
+#include "rpcz/macros.hpp"
+#include "rpcz/transport.hpp"
+
+namespace rpcz {
+
+// The transport of mem://<name> endpoints, which connect the clients and
+// servers of one process, also across connection managers. Frames are
+// handed over from the sending broker to the receiving one without copies.
+// A broker that is busy picks up new messages without any system call; a
+// broker that sleeps in zmq_poll() is woken up through a pipe.
+//
+// A message sent to a name that is not bound (yet) is dropped, unlike with
+// ZeroMQ. Not supported on Windows.
+class memory_transport : public transport {
+ public:
+  memory_transport() {}
+
+  // Returns true for mem:// endpoints.
+  static bool handles(const std::string& endpoint);
+
+  virtual transport_socket* connect(const std::string& endpoint);
+
+  // Throws std::runtime_error if the name is already bound.
+  virtual transport_socket* bind(const std::string& endpoint);
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(memory_transport);
+};
+}  // namespace rpcz
+#endif
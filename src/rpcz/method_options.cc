@@ -0,0 +1,29 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/method_options.hpp"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+
+namespace rpcz {
+
+method_options get_method_options(
+    const google::protobuf::MethodDescriptor* descriptor) {
+  method_options options(
+      descriptor->service()->options().GetExtension(service_defaults));
+  options.MergeFrom(descriptor->options().GetExtension(method));
+  return options;
+}
+}  // namespace rpcz
@@ -0,0 +1,34 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_METHOD_OPTIONS_H
+#define RPCZ_METHOD_OPTIONS_H
+
+#include "rpcz/rpcz_options.pb.h"
+
+namespace google {
+namespace protobuf {
+class MethodDescriptor;
+}  // namespace protobuf
+}  // namespace google
+
+namespace rpcz {
+
+// Returns the rpcz options of the method (see rpcz_options.proto): the ones
+// it sets, over the service_defaults of its service. Used by the server, the
+// response_cache and the code generators, so that they all agree.
+method_options get_method_options(
+    const google::protobuf::MethodDescriptor* descriptor);
+}  // namespace rpcz
+#endif
@@ -0,0 +1,166 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/metrics_registry.hpp"
+
+#include <algorithm>
+#include "rpcz/clock.hpp"
+#include "rpcz/logging.hpp"
+
+namespace rpcz {
+namespace internal {
+boost::atomic<bool> memory_accounting(false);
+boost::atomic<uint64> allocated_objects[ALLOCATION_KIND_COUNT];
+boost::atomic<uint64> allocated_bytes[ALLOCATION_KIND_COUNT];
+}  // namespace internal
+
+namespace {
+// The method the running handler or callback of this thread belongs to.
+RPCZ_THREAD_LOCAL method_counters* current_method = NULL;
+
+const char* const kAllocationKindNames[ALLOCATION_KIND_COUNT] = {
+  "frames", "closures", "pending_entries", "channels", "messages"
+};
+}  // unnamed namespace
+
+void set_memory_accounting(bool enabled) {
+  internal::memory_accounting.store(enabled, boost::memory_order_relaxed);
+}
+
+metrics_registry::metrics_registry()
+    : cpu_accounting_(false), worker_stalls_(0), replacement_workers_(0) {
+}
+
+metrics_registry::~metrics_registry() {
+  delete_container_second_pointer(server_methods_.begin(),
+                                  server_methods_.end());
+  delete_container_second_pointer(client_methods_.begin(),
+                                  client_methods_.end());
+  delete_container_pointers(connections_.begin(), connections_.end());
+}
+
+method_counters* metrics_registry::get_server_method(
+    const std::string& service, const std::string& method) {
+  return get_method(&server_methods_, service, method);
+}
+
+method_counters* metrics_registry::get_client_method(
+    const std::string& service, const std::string& method) {
+  return get_method(&client_methods_, service, method);
+}
+
+method_counters* metrics_registry::get_method(method_map* methods,
+                                              const std::string& service,
+                                              const std::string& method) {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  method_counters*& counters = (*methods)[std::make_pair(service, method)];
+  if (counters == NULL) {
+    counters = new method_counters;
+  }
+  return counters;
+}
+
+connection_counters* metrics_registry::add_connection(
+    const std::string& endpoint, bool server) {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  connection_counters* counters = new connection_counters(endpoint, server);
+  connections_.push_back(counters);
+  return counters;
+}
+
+void metrics_registry::remove_connection(connection_counters* counters) {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  std::vector<connection_counters*>::iterator it =
+      std::find(connections_.begin(), connections_.end(), counters);
+  CHECK(it != connections_.end());
+  connections_.erase(it);
+  delete counters;
+}
+
+void metrics_registry::snapshot(metrics_snapshot* snapshot) {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  snapshot_methods(server_methods_, &snapshot->server_methods);
+  snapshot_methods(client_methods_, &snapshot->client_methods);
+
+  snapshot->allocations.clear();
+  for (int i = 0; i < ALLOCATION_KIND_COUNT; ++i) {
+    allocation_stats allocation;
+    allocation.subsystem = kAllocationKindNames[i];
+    allocation.objects =
+        internal::allocated_objects[i].load(boost::memory_order_relaxed);
+    allocation.bytes =
+        internal::allocated_bytes[i].load(boost::memory_order_relaxed);
+    snapshot->allocations.push_back(allocation);
+  }
+
+  snapshot->worker_stalls = worker_stalls_.load(boost::memory_order_relaxed);
+  snapshot->replacement_workers =
+      replacement_workers_.load(boost::memory_order_relaxed);
+
+  snapshot->connections.clear();
+  for (size_t i = 0; i < connections_.size(); ++i) {
+    const connection_counters& counters = *connections_[i];
+    connection_stats connection;
+    connection.endpoint = counters.endpoint;
+    connection.server = counters.server;
+    connection.inflight_requests =
+        counters.inflight_requests.load(boost::memory_order_relaxed);
+    connection.inflight_request_bytes =
+        counters.inflight_request_bytes.load(boost::memory_order_relaxed);
+    connection.inflight_response_bytes =
+        counters.inflight_response_bytes.load(boost::memory_order_relaxed);
+    snapshot->connections.push_back(connection);
+  }
+}
+
+void metrics_registry::snapshot_methods(const method_map& methods,
+                                        std::vector<method_stats>* stats) {
+  stats->clear();
+  for (method_map::const_iterator it = methods.begin(); it != methods.end();
+       ++it) {
+    method_stats method;
+    method.service = it->first.first;
+    method.method = it->first.second;
+    method.calls = it->second->calls.load(boost::memory_order_relaxed);
+    method.wall_usec = it->second->wall_usec.load(boost::memory_order_relaxed);
+    method.cpu_usec = it->second->cpu_usec.load(boost::memory_order_relaxed);
+    stats->push_back(method);
+  }
+}
+
+void set_current_method(method_counters* counters) {
+  current_method = counters;
+}
+
+scoped_method_accounting::scoped_method_accounting(metrics_registry* registry)
+    : enabled_(registry->cpu_accounting()) {
+  if (enabled_) {
+    current_method = NULL;
+    wall_start_usec_ = zclock_time_usec();
+    cpu_start_usec_ = thread_cpu_time_usec();
+  }
+}
+
+scoped_method_accounting::~scoped_method_accounting() {
+  if (!enabled_ || current_method == NULL) {
+    return;
+  }
+  uint64 cpu_usec = thread_cpu_time_usec() - cpu_start_usec_;
+  uint64 wall_usec = zclock_time_usec() - wall_start_usec_;
+  current_method->calls.fetch_add(1, boost::memory_order_relaxed);
+  current_method->wall_usec.fetch_add(wall_usec, boost::memory_order_relaxed);
+  current_method->cpu_usec.fetch_add(cpu_usec, boost::memory_order_relaxed);
+  current_method = NULL;
+}
+}  // namespace rpcz
@@ -0,0 +1,180 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_METRICS_REGISTRY_H
+#define RPCZ_METRICS_REGISTRY_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include "rpcz/macros.hpp"
+#include "rpcz/metrics.hpp"
+
+namespace rpcz {
+
+// Counters of a single method. Updated concurrently by the worker threads.
+struct method_counters {
+  method_counters() : calls(0), wall_usec(0), cpu_usec(0) {}
+
+  boost::atomic<uint64> calls;
+  boost::atomic<uint64> wall_usec;
+  boost::atomic<uint64> cpu_usec;
+};
+
+// Gauges of a client connection or a bound server endpoint.
+struct connection_counters {
+  connection_counters(const std::string& endpoint, bool server)
+      : endpoint(endpoint), server(server), inflight_requests(0),
+        inflight_request_bytes(0), inflight_response_bytes(0) {}
+
+  const std::string endpoint;
+  const bool server;
+  boost::atomic<int64> inflight_requests;
+  boost::atomic<int64> inflight_request_bytes;
+  boost::atomic<int64> inflight_response_bytes;
+};
+
+enum allocation_kind {
+  ALLOCATION_FRAMES = 0,
+  ALLOCATION_CLOSURES,
+  ALLOCATION_PENDING_ENTRIES,
+  ALLOCATION_CHANNELS,
+  ALLOCATION_MESSAGES,
+  ALLOCATION_KIND_COUNT
+};
+
+namespace internal {
+extern boost::atomic<bool> memory_accounting;
+extern boost::atomic<uint64> allocated_objects[ALLOCATION_KIND_COUNT];
+extern boost::atomic<uint64> allocated_bytes[ALLOCATION_KIND_COUNT];
+}  // namespace internal
+
+inline bool memory_accounting() {
+  return internal::memory_accounting.load(boost::memory_order_relaxed);
+}
+
+// Counts an allocation made by rpcz, if memory accounting is enabled.
+inline void count_allocation(allocation_kind kind, size_t bytes) {
+  if (!memory_accounting()) {
+    return;
+  }
+  internal::allocated_objects[kind].fetch_add(1, boost::memory_order_relaxed);
+  internal::allocated_bytes[kind].fetch_add(bytes, boost::memory_order_relaxed);
+}
+
+// Adjusts the in-flight gauges of a connection. counters may be NULL.
+inline void add_inflight_request(connection_counters* counters,
+                                 int64 requests, int64 bytes) {
+  if (counters) {
+    counters->inflight_requests.fetch_add(requests,
+                                          boost::memory_order_relaxed);
+    counters->inflight_request_bytes.fetch_add(bytes,
+                                               boost::memory_order_relaxed);
+  }
+}
+
+inline void add_inflight_response(connection_counters* counters,
+                                  int64 bytes) {
+  if (counters) {
+    counters->inflight_response_bytes.fetch_add(bytes,
+                                                boost::memory_order_relaxed);
+  }
+}
+
+// Holds the counters of a connection_manager.
+class metrics_registry {
+ public:
+  metrics_registry();
+  ~metrics_registry();
+
+  // Cpu accounting measures the thread cpu time of every handler and
+  // callback. It costs two clock reads per invocation and a lookup per call,
+  // so it is off by default.
+  void set_cpu_accounting(bool enabled) {
+    cpu_accounting_.store(enabled, boost::memory_order_relaxed);
+  }
+  bool cpu_accounting() const {
+    return cpu_accounting_.load(boost::memory_order_relaxed);
+  }
+
+  // Returns the counters of the given method. The pointers stay valid for
+  // the lifetime of the registry.
+  method_counters* get_server_method(const std::string& service,
+                                     const std::string& method);
+  method_counters* get_client_method(const std::string& service,
+                                     const std::string& method);
+
+  // Registers the gauges of a new connection or bound endpoint. The broker
+  // thread keeps the returned pointer with the socket, so that the gauges
+  // are updated without a lookup.
+  connection_counters* add_connection(const std::string& endpoint,
+                                      bool server);
+  // Unregisters and deletes the gauges of a closed connection.
+  void remove_connection(connection_counters* counters);
+
+  // Counts a worker thread that got stuck in a command.
+  void add_worker_stall() {
+    worker_stalls_.fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  // Tracks the workers started to replace stalled ones.
+  void set_replacement_workers(uint64 workers) {
+    replacement_workers_.store(workers, boost::memory_order_relaxed);
+  }
+
+  void snapshot(metrics_snapshot* snapshot);
+
+ private:
+  typedef std::map<std::pair<std::string, std::string>, method_counters*>
+      method_map;
+
+  method_counters* get_method(method_map* methods,
+                              const std::string& service,
+                              const std::string& method);
+  void snapshot_methods(const method_map& methods,
+                        std::vector<method_stats>* stats);
+
+  boost::atomic<bool> cpu_accounting_;
+  boost::atomic<uint64> worker_stalls_;
+  boost::atomic<uint64> replacement_workers_;
+  boost::mutex mu_;
+  method_map server_methods_;
+  method_map client_methods_;
+  std::vector<connection_counters*> connections_;
+  DISALLOW_COPY_AND_ASSIGN(metrics_registry);
+};
+
+// Tells the enclosing scoped_method_accounting of the current thread which
+// method the running handler or callback belongs to.
+void set_current_method(method_counters* counters);
+
+// Measures the wall and thread cpu time of its scope and adds them to the
+// method set by set_current_method() within it, if any. Does nothing if cpu
+// accounting is disabled.
+class scoped_method_accounting {
+ public:
+  explicit scoped_method_accounting(metrics_registry* registry);
+  ~scoped_method_accounting();
+
+ private:
+  bool enabled_;
+  uint64 wall_start_usec_;
+  uint64 cpu_start_usec_;
+  DISALLOW_COPY_AND_ASSIGN(scoped_method_accounting);
+};
+}  // namespace rpcz
+#endif
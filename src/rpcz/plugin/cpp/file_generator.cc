@@ -32,12 +32,14 @@ using namespace ::google::protobuf;
 using namespace google::protobuf::compiler::cpp;
 
 FileGenerator::FileGenerator(const FileDescriptor* file,
-                             const string& dllexport_decl)
+                             const string& dllexport_decl,
+                             bool sync_errors_throw)
     : file_(file), dllexport_decl_(dllexport_decl) {
   SplitStringUsing(file_->package(), ".", &package_parts_);
   for (int i = 0; i < file->service_count(); i++) {
     service_generators_.push_back(
-      new ServiceGenerator(file->service(i), dllexport_decl));
+      new ServiceGenerator(file->service(i), dllexport_decl,
+                           sync_errors_throw));
   }
 }
 
@@ -57,7 +59,9 @@ void FileGenerator::GenerateHeader(io::Printer* printer) {
     "#ifndef RPCZ_$filename_identifier$__INCLUDED\n"
     "#define RPCZ_$filename_identifier$__INCLUDED\n"
     "\n"
+    "#include <new>\n"
     "#include <string>\n"
+    "#include <rpcz/rpc.hpp>\n"
     "#include <rpcz/service.hpp>\n"
     "\n"
     "namespace google {\n"
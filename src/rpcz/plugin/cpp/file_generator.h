@@ -48,7 +48,8 @@ namespace cpp {
 class FileGenerator {
   public:
     FileGenerator(const google::protobuf::FileDescriptor* file,
-                  const std::string& dllexport_decl);
+                  const std::string& dllexport_decl,
+                  bool sync_errors_throw);
 
     ~FileGenerator();
 
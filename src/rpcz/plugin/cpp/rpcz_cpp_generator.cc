@@ -73,9 +73,25 @@ bool RpczCppGenerator::Generate(
   // __declspec(dllimport) depending on what is being compiled.
   string dllexport_decl;
 
+  // The plain sync stub methods throw ::rpcz::rpc_error on failure by
+  // default. With sync_errors=status, they return the status of the call
+  // instead, like the std::nothrow variants that are always generated:
+  //   protoc --cpp_rpcz_out=sync_errors=status:outdir foo.proto
+  bool sync_errors_throw = true;
+
   for (size_t i = 0; i < options.size(); i++) {
     if (options[i].first == "dllexport_decl") {
       dllexport_decl = options[i].second;
+    } else if (options[i].first == "sync_errors") {
+      if (options[i].second == "throw") {
+        sync_errors_throw = true;
+      } else if (options[i].second == "status") {
+        sync_errors_throw = false;
+      } else {
+        *error = "sync_errors must be throw or status, not: " +
+            options[i].second;
+        return false;
+      }
     } else {
       *error = "Unknown generator option: " + options[i].first;
       return false;
@@ -88,7 +104,7 @@ bool RpczCppGenerator::Generate(
   string basename = StripSuffixString(file->name(), ".proto");
   basename.append(".rpcz");
 
-  FileGenerator file_generator(file, dllexport_decl);
+  FileGenerator file_generator(file, dllexport_decl, sync_errors_throw);
 
   // Generate header.
   {
@@ -19,6 +19,7 @@
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 
+#include "rpcz/method_options.hpp"
 #include "rpcz/plugin/common/strutil.h"
 #include "rpcz/plugin/cpp/cpp_helpers.h"
 
@@ -30,8 +31,9 @@ using namespace google::protobuf;
 using namespace google::protobuf::compiler::cpp;
 
 ServiceGenerator::ServiceGenerator(const ServiceDescriptor* descriptor,
-                                   const string& dllexport_decl)
-  : descriptor_(descriptor) {
+                                   const string& dllexport_decl,
+                                   bool sync_errors_throw)
+  : descriptor_(descriptor), sync_errors_throw_(sync_errors_throw) {
   vars_["classname"] = descriptor_->name();
   vars_["full_name"] = descriptor_->full_name();
   if (dllexport_decl.empty()) {
@@ -70,6 +72,7 @@ void ServiceGenerator::GenerateInterface(io::Printer* printer) {
     "static const ::google::protobuf::ServiceDescriptor* descriptor();\n"
     "\n");
 
+  GenerateMethodOptions(printer);
   GenerateMethodSignatures(VIRTUAL, printer, false);
 
   printer->Print(
@@ -126,15 +129,66 @@ void ServiceGenerator::GenerateStubDefinition(io::Printer* printer) {
     "\n");
 }
 
+void ServiceGenerator::GenerateMethodOptions(io::Printer* printer) {
+  for (int i = 0; i < descriptor_->method_count(); i++) {
+    const MethodDescriptor* method = descriptor_->method(i);
+    ::rpcz::method_options options(get_method_options(method));
+    map<string, string> sub_vars;
+    sub_vars["name"] = method->name();
+    sub_vars["deadline_ms"] = SimpleItoa(options.deadline_ms());
+    sub_vars["idempotent"] = options.idempotent() ? "true" : "false";
+    sub_vars["cache_ttl_ms"] = SimpleItoa(options.cache_ttl_ms());
+    sub_vars["one_way"] = options.one_way() ? "true" : "false";
+    sub_vars["compress"] = options.compress() ? "true" : "false";
+    sub_vars["priority"] = SimpleItoa(options.priority());
+
+    printer->Print(sub_vars,
+      "// The rpcz options of $name$(), from rpcz_options.proto.\n"
+      "struct $name$_options {\n"
+      "  static const ::google::protobuf::int64 deadline_ms = $deadline_ms$;\n"
+      "  static const bool idempotent = $idempotent$;\n"
+      "  static const ::google::protobuf::int64 cache_ttl_ms = $cache_ttl_ms$;\n"
+      "  static const bool one_way = $one_way$;\n"
+      "  static const bool compress = $compress$;\n"
+      "  static const ::google::protobuf::int32 priority = $priority$;\n"
+      "  static const char executor[];\n"
+      "};\n"
+      "\n");
+  }
+}
+
+void ServiceGenerator::GenerateMethodOptionDefinitions(io::Printer* printer) {
+  for (int i = 0; i < descriptor_->method_count(); i++) {
+    const MethodDescriptor* method = descriptor_->method(i);
+    map<string, string> sub_vars;
+    sub_vars["classname"] = descriptor_->name();
+    sub_vars["name"] = method->name();
+    sub_vars["executor"] = CEscape(get_method_options(method).executor());
+
+    printer->Print(sub_vars,
+      "const ::google::protobuf::int64 $classname$::$name$_options::deadline_ms;\n"
+      "const bool $classname$::$name$_options::idempotent;\n"
+      "const ::google::protobuf::int64 $classname$::$name$_options::cache_ttl_ms;\n"
+      "const bool $classname$::$name$_options::one_way;\n"
+      "const bool $classname$::$name$_options::compress;\n"
+      "const ::google::protobuf::int32 $classname$::$name$_options::priority;\n"
+      "const char $classname$::$name$_options::executor[] = \"$executor$\";\n"
+      "\n");
+  }
+}
+
 void ServiceGenerator::GenerateMethodSignatures(
     VirtualOrNon virtual_or_non, io::Printer* printer, bool stub) {
   for (int i = 0; i < descriptor_->method_count(); i++) {
     const MethodDescriptor* method = descriptor_->method(i);
     map<string, string> sub_vars;
+    sub_vars["classname"] = descriptor_->name();
     sub_vars["name"] = method->name();
     sub_vars["input_type"] = ClassName(method->input_type(), true);
     sub_vars["output_type"] = ClassName(method->output_type(), true);
     sub_vars["virtual"] = virtual_or_non == VIRTUAL ? "virtual " : "";
+    sub_vars["sync_result"] =
+        sync_errors_throw_ ? "void" : "::rpcz::status_code";
 
     if (stub) {
       printer->Print(sub_vars,
@@ -143,9 +197,23 @@ void ServiceGenerator::GenerateMethodSignatures(
                      "                     ::rpcz::rpc* rpc,"
                      "                     ::rpcz::closure* done);\n");
       printer->Print(sub_vars,
-                     "$virtual$void $name$(const $input_type$& request,\n"
+                     "$virtual$$sync_result$ $name$(const $input_type$& request,\n"
+                     "                     $output_type$* response,\n"
+                     "                     long deadline_ms =\n"
+                     "                         $classname$::$name$_options::deadline_ms);\n");
+      // Sync variants that return the status of the call instead of
+      // throwing; the second one leaves its details in rpc.
+      printer->Print(sub_vars,
+                     "$virtual$::rpcz::status_code $name$(const $input_type$& request,\n"
+                     "                     $output_type$* response,\n"
+                     "                     const ::std::nothrow_t&,\n"
+                     "                     long deadline_ms =\n"
+                     "                         $classname$::$name$_options::deadline_ms);\n");
+      printer->Print(sub_vars,
+                     "$virtual$::rpcz::status_code $name$(const $input_type$& request,\n"
                      "                     $output_type$* response,\n"
-                     "                     long deadline_ms = -1);\n");
+                     "                     ::rpcz::rpc* rpc,\n"
+                     "                     const ::std::nothrow_t&);\n");
     } else {
       printer->Print(
           sub_vars,
@@ -184,6 +252,8 @@ void ServiceGenerator::GenerateImplementation(io::Printer* printer) {
     "}\n"
     "\n");
 
+  GenerateMethodOptionDefinitions(printer);
+
   // Generate methods of the interface.
   GenerateNotImplementedMethods(printer);
   GenerateCallMethod(printer);
@@ -316,25 +386,61 @@ void ServiceGenerator::GenerateStubMethods(io::Printer* printer) {
       "void $classname$_Stub::$name$(const $input_type$& request,\n"
       "                              $output_type$* response,\n"
       "                              ::rpcz::rpc* rpc,\n"
-      "                              ::rpcz::closure* done) {\n"
+      "                              ::rpcz::closure* done) {\n");
+    if (get_method_options(method).deadline_ms() != -1) {
+      printer->Print(sub_vars,
+        "  if (rpc->get_deadline_ms() == -1) {\n"
+        "    rpc->set_deadline_ms($classname$::$name$_options::deadline_ms);\n"
+        "  }\n");
+    }
+    printer->Print(sub_vars,
       "  channel_->call_method(service_name_,\n"
       "                        $classname$::descriptor()->method($index$),\n"
       "                        request, response, rpc, done);\n"
       "}\n");
+    // All the sync variants go through the one that waits on the caller's
+    // rpc.
     printer->Print(sub_vars,
-      "void $classname$_Stub::$name$(const $input_type$& request,\n"
-      "                              $output_type$* response,\n"
-      "                              long deadline_ms) {\n"
+      "::rpcz::status_code $classname$_Stub::$name$(\n"
+      "    const $input_type$& request,\n"
+      "    $output_type$* response,\n"
+      "    ::rpcz::rpc* rpc,\n"
+      "    const ::std::nothrow_t&) {\n"
+      "  $name$(request, response, rpc, NULL);\n"
+      "  rpc->wait();\n"
+      "  return rpc->get_status();\n"
+      "}\n");
+    printer->Print(sub_vars,
+      "::rpcz::status_code $classname$_Stub::$name$(\n"
+      "    const $input_type$& request,\n"
+      "    $output_type$* response,\n"
+      "    const ::std::nothrow_t&,\n"
+      "    long deadline_ms) {\n"
       "  ::rpcz::rpc rpc;\n"
       "  rpc.set_deadline_ms(deadline_ms);\n"
-      "  channel_->call_method(service_name_,\n"
-      "                        $classname$::descriptor()->method($index$),\n"
-      "                        request, response, &rpc, NULL);\n"
-      "  rpc.wait();\n"
-      "  if (!rpc.ok()) {\n"
-      "    throw ::rpcz::rpc_error(rpc);\n"
-      "  }\n"
+      "  return $name$(request, response, &rpc, ::std::nothrow);\n"
       "}\n");
+    if (sync_errors_throw_) {
+      printer->Print(sub_vars,
+        "void $classname$_Stub::$name$(const $input_type$& request,\n"
+        "                              $output_type$* response,\n"
+        "                              long deadline_ms) {\n"
+        "  ::rpcz::rpc rpc;\n"
+        "  rpc.set_deadline_ms(deadline_ms);\n"
+        "  if ($name$(request, response, &rpc, ::std::nothrow) !=\n"
+        "      ::rpcz::status::OK) {\n"
+        "    throw ::rpcz::rpc_error(rpc);\n"
+        "  }\n"
+        "}\n");
+    } else {
+      printer->Print(sub_vars,
+        "::rpcz::status_code $classname$_Stub::$name$(\n"
+        "    const $input_type$& request,\n"
+        "    $output_type$* response,\n"
+        "    long deadline_ms) {\n"
+        "  return $name$(request, response, ::std::nothrow, deadline_ms);\n"
+        "}\n");
+    }
   }
 }
 
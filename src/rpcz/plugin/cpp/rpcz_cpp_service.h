@@ -42,10 +42,11 @@ namespace cpp {
 
 class ServiceGenerator {
  public:
-  // See generator.cc for the meaning of dllexport_decl.
-  explicit ServiceGenerator(
-      const google::protobuf::ServiceDescriptor* descriptor,
-      const std::string& dllexport_decl);
+  // See generator.cc for the meaning of dllexport_decl and
+  // sync_errors_throw.
+  ServiceGenerator(const google::protobuf::ServiceDescriptor* descriptor,
+                   const std::string& dllexport_decl,
+                   bool sync_errors_throw);
   ~ServiceGenerator();
 
   // Header stuff.
@@ -76,6 +77,9 @@ class ServiceGenerator {
   // Generate the stub class definition.
   void GenerateStubDefinition(google::protobuf::io::Printer* printer);
 
+  // Generate a struct of constants with the rpcz options of each method.
+  void GenerateMethodOptions(google::protobuf::io::Printer* printer);
+
   // Prints signatures for all methods in the
   void GenerateMethodSignatures(VirtualOrNon virtual_or_non,
                                 google::protobuf::io::Printer* printer,
@@ -83,6 +87,9 @@ class ServiceGenerator {
 
   // Source file stuff.
 
+  // Generate the definitions of the constants of GenerateMethodOptions().
+  void GenerateMethodOptionDefinitions(google::protobuf::io::Printer* printer);
+
   // Generate the default implementations of the service methods, which
   // produce a "not implemented" error.
   void GenerateNotImplementedMethods(google::protobuf::io::Printer* printer);
@@ -99,6 +106,7 @@ class ServiceGenerator {
 
   const google::protobuf::ServiceDescriptor* descriptor_;
   std::map<std::string, std::string> vars_;
+  bool sync_errors_throw_;
 
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ServiceGenerator);
 };
@@ -38,6 +38,7 @@
 #include <stddef.h>
 #include <map>
 
+#include "rpcz/method_options.hpp"
 #include "rpcz/plugin/common/strutil.h"
 
 namespace rpcz {
@@ -250,9 +251,41 @@ void FileGenerator::PrintServiceClass(const ServiceDescriptor& descriptor) const
       "$descriptor_key$ = $descriptor_name$\n",
       "descriptor_key", kDescriptorKey,
       "descriptor_name", ModuleLevelServiceDescriptorName(descriptor));
+  PrintMethodOptions(descriptor);
   printer_->Outdent();
 }
 
+void FileGenerator::PrintMethodOptions(
+    const ServiceDescriptor& descriptor) const {
+  // The rpcz options of each method, from rpcz_options.proto.
+  printer_->Print("METHOD_OPTIONS = {\n");
+  printer_->Indent();
+  for (int i = 0; i < descriptor.method_count(); ++i) {
+    const MethodDescriptor* method = descriptor.method(i);
+    ::rpcz::method_options options(get_method_options(method));
+    map<string, string> m;
+    m["name"] = method->name();
+    m["deadline_ms"] = SimpleItoa(options.deadline_ms());
+    m["idempotent"] = options.idempotent() ? "True" : "False";
+    m["cache_ttl_ms"] = SimpleItoa(options.cache_ttl_ms());
+    m["one_way"] = options.one_way() ? "True" : "False";
+    m["compress"] = options.compress() ? "True" : "False";
+    m["priority"] = SimpleItoa(options.priority());
+    m["executor"] = CEscape(options.executor());
+    printer_->Print(
+        m,
+        "'$name$': {'deadline_ms': $deadline_ms$,\n"
+        "    'idempotent': $idempotent$,\n"
+        "    'cache_ttl_ms': $cache_ttl_ms$,\n"
+        "    'one_way': $one_way$,\n"
+        "    'compress': $compress$,\n"
+        "    'priority': $priority$,\n"
+        "    'executor': '$executor$'},\n");
+  }
+  printer_->Outdent();
+  printer_->Print("}\n");
+}
+
 void FileGenerator::PrintServiceStub(const ServiceDescriptor& descriptor) const {
   // Print the service stub.
   printer_->Print("class $class_name$_Stub($class_name$):\n",
@@ -76,6 +76,7 @@ class FileGenerator {
   void PrintServices() const;
   void PrintServiceDescriptor(const google::protobuf::ServiceDescriptor& descriptor) const;
   void PrintServiceClass(const google::protobuf::ServiceDescriptor& descriptor) const;
+  void PrintMethodOptions(const google::protobuf::ServiceDescriptor& descriptor) const;
   void PrintServiceStub(const google::protobuf::ServiceDescriptor& descriptor) const;
 
   std::string OptionsValue(const std::string& class_name,
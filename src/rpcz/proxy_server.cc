@@ -0,0 +1,199 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/proxy_server.hpp"
+
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include "zmq.hpp"
+
+#include "rpcz/application.hpp"
+#include "rpcz/connection_manager.hpp"
+#include "rpcz/logging.hpp"
+#include "rpcz/macros.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpcz.pb.h"
+#include "rpcz/zmq_utils.hpp"
+
+namespace rpcz {
+
+struct proxy_server::upstream {
+  explicit upstream(const rpcz::connection& connection)
+      : connection(connection), inflight(0) {}
+
+  rpcz::connection connection;
+  boost::atomic<int64> inflight;
+};
+
+struct proxy_server::route {
+  route() : next(0) {}
+
+  std::vector<upstream*> upstreams;
+  // Where the search for the least loaded upstream starts, so that idle
+  // upstreams take turns.
+  boost::atomic<uint64> next;
+};
+
+namespace {
+void reply_error(const client_connection& connection, status_code status,
+                 int application_error, const std::string& error_message) {
+  rpc_response_header header;
+  header.set_status(status);
+  header.set_application_error(application_error);
+  if (!error_message.empty()) {
+    header.set_error(error_message);
+  }
+  message_vector v;
+  v.push_back(string_to_message(header.SerializeAsString()));
+  v.push_back(new zmq::message_t());
+  client_connection(connection).reply(&v);
+}
+}  // unnamed namespace
+
+proxy_server::proxy_server(application& application)
+    : connection_manager_(*application.connection_manager_.get()),
+      deadline_ms_(-1) {
+}
+
+proxy_server::proxy_server(connection_manager& connection_manager)
+    : connection_manager_(connection_manager),
+      deadline_ms_(-1) {
+}
+
+proxy_server::~proxy_server() {
+  for (upstream_map::iterator it = upstreams_.begin();
+       it != upstreams_.end(); ++it) {
+    it->second->connection.close();
+  }
+  delete_container_second_pointer(routes_.begin(), routes_.end());
+  delete_container_second_pointer(upstreams_.begin(), upstreams_.end());
+}
+
+void proxy_server::add_route(const std::string& service,
+                             const std::string& method,
+                             const std::string& endpoint) {
+  upstream*& upstream = upstreams_[endpoint];
+  if (upstream == NULL) {
+    upstream = new proxy_server::upstream(
+        connection_manager_.connect(endpoint));
+  }
+  route*& route = routes_[std::make_pair(service, method)];
+  if (route == NULL) {
+    route = new proxy_server::route;
+  }
+  route->upstreams.push_back(upstream);
+}
+
+void proxy_server::set_deadline_ms(int64 deadline_ms) {
+  deadline_ms_ = deadline_ms;
+}
+
+void proxy_server::bind(const std::string& endpoint) {
+  connection_manager::server_function f = boost::bind(
+      &proxy_server::handle_request, this, _1, _2);
+  connection_manager_.bind(endpoint, f);
+}
+
+proxy_server::upstream* proxy_server::find_upstream(
+    const std::string& service, const std::string& method) {
+  route_map::const_iterator it = routes_.find(
+      std::make_pair(service, method));
+  if (it == routes_.end()) {
+    it = routes_.find(std::make_pair(service, std::string()));
+  }
+  if (it == routes_.end()) {
+    it = routes_.find(std::make_pair(std::string(), std::string()));
+  }
+  if (it == routes_.end()) {
+    return NULL;
+  }
+  route* route = it->second;
+  size_t size = route->upstreams.size();
+  size_t start = route->next++ % size;
+  upstream* best = route->upstreams[start];
+  for (size_t i = 1; i < size; ++i) {
+    upstream* candidate = route->upstreams[(start + i) % size];
+    if (candidate->inflight.load(boost::memory_order_relaxed) <
+        best->inflight.load(boost::memory_order_relaxed)) {
+      best = candidate;
+    }
+  }
+  return best;
+}
+
+void proxy_server::handle_request(const client_connection& connection,
+                                  message_iterator& iter) {
+  if (!iter.has_more()) {
+    return;
+  }
+  message_vector request;
+  zmq::message_t* header_frame = new zmq::message_t;
+  header_frame->move(&iter.next());
+  request.push_back(header_frame);
+  if (!iter.has_more()) {
+    return;
+  }
+  zmq::message_t* payload = new zmq::message_t;
+  payload->move(&iter.next());
+  request.push_back(payload);
+  if (iter.has_more()) {
+    return;
+  }
+  rpc_request_header header;
+  if (!header.ParseFromArray(header_frame->data(), header_frame->size())) {
+    DLOG(INFO) << "Received bad header.";
+    reply_error(connection, status::APPLICATION_ERROR,
+                application_error::INVALID_HEADER, "");
+    return;
+  }
+  upstream* upstream = find_upstream(header.service(), header.method());
+  if (upstream == NULL) {
+    DLOG(INFO) << "No route for " << header.service() << "."
+               << header.method();
+    reply_error(connection, status::APPLICATION_ERROR,
+                application_error::NO_SUCH_SERVICE, "");
+    return;
+  }
+  ++upstream->inflight;
+  upstream->connection.send_request(
+      request, deadline_ms_,
+      boost::bind(&proxy_server::handle_reply, this, connection, upstream,
+                  _1, _2));
+}
+
+void proxy_server::handle_reply(const client_connection& connection,
+                                upstream* upstream, int result,
+                                message_iterator& iter) {
+  --upstream->inflight;
+  if (result == connection_manager::DEADLINE_EXCEEDED) {
+    reply_error(connection, status::DEADLINE_EXCEEDED, 0,
+                "Upstream deadline exceeded.");
+    return;
+  }
+  if (result == connection_manager::CLOSED) {
+    reply_error(connection, status::TERMINATED, 0,
+                "Upstream connection closed.");
+    return;
+  }
+  message_vector reply;
+  while (iter.has_more()) {
+    zmq::message_t* frame = new zmq::message_t;
+    frame->move(&iter.next());
+    reply.push_back(frame);
+  }
+  client_connection(connection).reply(&reply);
+}
+}  // namespace rpcz
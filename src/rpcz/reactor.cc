@@ -21,6 +21,7 @@
 #include "rpcz/clock.hpp"
 #include "rpcz/logging.hpp"
 #include "rpcz/macros.hpp"
+#include "rpcz/transport.hpp"
 #include "rpcz/zmq_utils.hpp"
 #include "zmq.hpp"
 
@@ -52,7 +53,7 @@ void signal_handler(int signal_value) {
 #endif
 }  // unnamed namespace
 
-reactor::reactor() : should_quit_(false) {
+reactor::reactor() : should_quit_(false), is_dirty_(false) {
 };
 
 reactor::~reactor() {
@@ -64,19 +65,40 @@ reactor::~reactor() {
 }
 
 void reactor::add_socket(zmq::socket_t* socket, closure* closure) {
+  add_socket(new zmq_transport_socket(socket), closure);
+}
+
+void reactor::add_socket(transport_socket* socket, closure* closure) {
   sockets_.push_back(std::make_pair(socket, closure));
   is_dirty_ = true;
 }
 
+void reactor::remove_socket(transport_socket* socket) {
+  removed_sockets_.push_back(socket);
+  is_dirty_ = true;
+}
+
+void reactor::delete_removed_sockets() {
+  for (size_t i = 0; i < removed_sockets_.size(); ++i) {
+    for (size_t j = 0; j < sockets_.size(); ++j) {
+      if (sockets_[j].first == removed_sockets_[i]) {
+        delete sockets_[j].first;
+        delete sockets_[j].second;
+        sockets_.erase(sockets_.begin() + j);
+        break;
+      }
+    }
+  }
+  removed_sockets_.clear();
+}
+
 namespace {
 void rebuild_poll_items(
-    const std::vector<std::pair<zmq::socket_t*, closure*> >& sockets,
+    const std::vector<std::pair<transport_socket*, closure*> >& sockets,
     std::vector<zmq::pollitem_t>* pollitems) {
   pollitems->resize(sockets.size());
   for (size_t i = 0; i < sockets.size(); ++i) {
-    zmq::socket_t& socket = *sockets[i].first;
-    zmq::pollitem_t pollitem = {socket, 0, ZMQ_POLLIN, 0};
-    (*pollitems)[i] = pollitem;
+    (*pollitems)[i] = sockets[i].first->get_pollitem();
   }
 }
 }  // namespace
@@ -88,10 +110,16 @@ void reactor::run_closure_at(uint64 timestamp, closure* closure) {
 int reactor::loop() {
   while (!should_quit_ && !g_interrupted) {
     if (is_dirty_) {
+      delete_removed_sockets();
       rebuild_poll_items(sockets_, &pollitems_);
       is_dirty_ = false;
     }
     long poll_timeout = process_closure_run_map();
+    for (size_t i = 0; i < pollitems_.size(); ++i) {
+      if (sockets_[i].first->prepare_poll()) {
+        poll_timeout = 0;
+      }
+    }
     int rc = zmq_poll(&pollitems_[0], pollitems_.size(), poll_timeout);
 
     if (rc == -1) {
@@ -102,11 +130,12 @@ int reactor::loop() {
       }
     }
     for (size_t i = 0; i < pollitems_.size(); ++i) {
-      if (!pollitems_[i].revents & ZMQ_POLLIN) {
-        continue;
-      }
+      int ready = sockets_[i].first->ready_messages(
+          pollitems_[i].revents & ZMQ_POLLIN);
       pollitems_[i].revents = 0;
-      sockets_[i].second->run();
+      for (; ready > 0; --ready) {
+        sockets_[i].second->run();
+      }
     }
   }
   if (g_interrupted) {
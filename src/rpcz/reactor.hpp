@@ -25,13 +25,21 @@
 namespace rpcz {
 
 class closure;
+class transport_socket;
 
 class reactor {
  public:
   reactor();
   ~reactor();
 
+  // Runs the callback for each message that arrives on the socket. Takes
+  // ownership of the socket and the callback.
   void add_socket(zmq::socket_t* socket, closure* callback);
+  void add_socket(transport_socket* socket, closure* callback);
+
+  // Stops watching the socket, and deletes it with its callback before the
+  // next poll. Can be called from a callback.
+  void remove_socket(transport_socket* socket);
 
   void run_closure_at(uint64 timestamp, closure *callback);
 
@@ -39,12 +47,20 @@ class reactor {
 
   void set_should_quit();
 
- private:
+  // Runs the closures that are due. Returns the time until the next one in
+  // zmq_poll() units, or -1 if there is none. Called by loop(); public for
+  // the benchmarks.
   long process_closure_run_map();
 
+ private:
+
+  // Deletes the sockets passed to remove_socket().
+  void delete_removed_sockets();
+
   bool should_quit_;
   bool is_dirty_;
-  std::vector<std::pair<zmq::socket_t*, closure*> > sockets_;
+  std::vector<std::pair<transport_socket*, closure*> > sockets_;
+  std::vector<transport_socket*> removed_sockets_;
   std::vector<zmq::pollitem_t> pollitems_;
   typedef std::map<uint64, std::vector<closure*> > closure_run_map;
   closure_run_map closure_run_map_;
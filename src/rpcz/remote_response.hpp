@@ -0,0 +1,47 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_REMOTE_RESPONSE_H
+#define RPCZ_REMOTE_RESPONSE_H
+
+#include <map>
+#include <string>
+#include "rpcz/connection_manager.hpp"
+#include "rpcz/event_id_generator.hpp"
+#include "rpcz/macros.hpp"
+
+namespace rpcz {
+struct connection_counters;
+
+// What the broker keeps for a request that is waiting for its reply.
+struct remote_response {
+  remote_response() : connection_id(0), counters(NULL), request_bytes(0) {}
+
+  connection_manager::client_request_callback callback;
+  // The connection the request was sent on.
+  uint64 connection_id;
+  // The gauges the request was added to, NULL if memory accounting was off.
+  connection_counters* counters;
+  int64 request_bytes;
+#ifdef RPCZ_ENABLE_TRACING
+  // Probe arguments. Filled only while a client side probe is attached.
+  std::string service;
+  std::string method;
+#endif
+};
+
+// The requests of a broker that wait for their replies.
+typedef std::map<event_id, remote_response> remote_response_map;
+}  // namespace rpcz
+#endif
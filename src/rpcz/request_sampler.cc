@@ -0,0 +1,70 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/request_sampler.hpp"
+
+#include "rpcz/clock.hpp"
+
+namespace rpcz {
+namespace {
+RPCZ_THREAD_LOCAL uint64 random_state = 0;
+
+// xorshift64, seeded per thread.
+uint64 next_random() {
+  if (random_state == 0) {
+    random_state = zclock_time_usec() ^
+        reinterpret_cast<uint64>(&random_state);
+    if (random_state == 0) {
+      random_state = 1;
+    }
+  }
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+}  // unnamed namespace
+
+request_sampler::request_sampler() : default_one_in_(1) {
+}
+
+void request_sampler::set_default_sample_rate(uint32 one_in) {
+  default_one_in_ = one_in;
+}
+
+void request_sampler::set_sample_rate(const std::string& service,
+                                      const std::string& method,
+                                      uint32 one_in) {
+  sample_rates_[service][method] = one_in;
+}
+
+bool request_sampler::should_sample(const std::string& service,
+                                    const std::string& method) const {
+  uint32 one_in = default_one_in_;
+  if (!sample_rates_.empty()) {
+    sample_rate_map::const_iterator service_it = sample_rates_.find(service);
+    if (service_it != sample_rates_.end()) {
+      std::map<std::string, uint32>::const_iterator method_it =
+          service_it->second.find(method);
+      if (method_it != service_it->second.end()) {
+        one_in = method_it->second;
+      }
+    }
+  }
+  if (one_in <= 1) {
+    return one_in == 1;
+  }
+  return next_random() % one_in == 0;
+}
+}  // namespace rpcz
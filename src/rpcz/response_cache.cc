@@ -0,0 +1,286 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/response_cache.hpp"
+
+#include <list>
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <google/protobuf/descriptor.h>
+
+#include "rpcz/clock.hpp"
+#include "rpcz/logging.hpp"
+#include "rpcz/method_options.hpp"
+
+namespace rpcz {
+
+namespace {
+// Accounted for each entry on top of its key and response.
+const size_t kEntryOverhead = 64;
+
+struct cache_entry {
+  cache_entry(const std::string& key, const std::string& response,
+              uint64 expires_usec)
+      : key(key), response(response), expires_usec(expires_usec),
+        referenced(false) {}
+
+  size_t bytes() const {
+    return key.size() + response.size() + kEntryOverhead;
+  }
+
+  const std::string key;
+  const std::string response;
+  const uint64 expires_usec;
+  // Set by lookups, cleared by the clock hand.
+  boost::atomic<bool> referenced;
+};
+}  // unnamed namespace
+
+class response_cache_shard {
+ public:
+  explicit response_cache_shard(size_t max_bytes)
+      : max_bytes_(max_bytes), bytes_(0), hand_(ring_.end()),
+        hits_(0), misses_(0), evictions_(0) {}
+
+  ~response_cache_shard() {
+    clear();
+  }
+
+  bool lookup(const std::string& key, std::string* response) {
+    boost::shared_lock<boost::shared_mutex> lock(mu_);
+    index_map::const_iterator it = index_.find(key);
+    if (it == index_.end() ||
+        (*it->second)->expires_usec <= zclock_time_usec()) {
+      misses_.fetch_add(1, boost::memory_order_relaxed);
+      return false;
+    }
+    cache_entry* entry = *it->second;
+    entry->referenced.store(true, boost::memory_order_relaxed);
+    response->assign(entry->response);
+    hits_.fetch_add(1, boost::memory_order_relaxed);
+    return true;
+  }
+
+  void insert(const std::string& key, const std::string& response,
+              uint64 expires_usec) {
+    scoped_ptr<cache_entry> entry(
+        new cache_entry(key, response, expires_usec));
+    boost::unique_lock<boost::shared_mutex> lock(mu_);
+    index_map::iterator it = index_.find(key);
+    if (it != index_.end()) {
+      remove(it->second);
+    }
+    if (entry->bytes() > max_bytes_) {
+      return;
+    }
+    while (bytes_ + entry->bytes() > max_bytes_) {
+      evict_one();
+    }
+    bytes_ += entry->bytes();
+    // Right behind the hand, so that the entry gets a full turn before it can
+    // be evicted.
+    index_[key] = ring_.insert(hand_, entry.release());
+  }
+
+  void clear() {
+    boost::unique_lock<boost::shared_mutex> lock(mu_);
+    while (!ring_.empty()) {
+      remove(ring_.begin());
+    }
+  }
+
+  size_t get_bytes() {
+    boost::shared_lock<boost::shared_mutex> lock(mu_);
+    return bytes_;
+  }
+
+  uint64 get_hits() const {
+    return hits_.load(boost::memory_order_relaxed);
+  }
+
+  uint64 get_misses() const {
+    return misses_.load(boost::memory_order_relaxed);
+  }
+
+  uint64 get_evictions() const {
+    return evictions_.load(boost::memory_order_relaxed);
+  }
+
+ private:
+  typedef std::list<cache_entry*> entry_ring;
+  typedef boost::unordered_map<std::string, entry_ring::iterator> index_map;
+
+  // Moves the hand until it finds an entry that was not looked up since the
+  // hand last passed it, or that expired, and removes it. mu_ must be held
+  // exclusively and the ring must not be empty.
+  void evict_one() {
+    CHECK(!ring_.empty());
+    uint64 now = zclock_time_usec();
+    for (;;) {
+      if (hand_ == ring_.end()) {
+        hand_ = ring_.begin();
+      }
+      cache_entry* entry = *hand_;
+      if (entry->expires_usec <= now ||
+          !entry->referenced.exchange(false, boost::memory_order_relaxed)) {
+        remove(hand_);
+        evictions_.fetch_add(1, boost::memory_order_relaxed);
+        return;
+      }
+      ++hand_;
+    }
+  }
+
+  // mu_ must be held exclusively.
+  void remove(entry_ring::iterator position) {
+    cache_entry* entry = *position;
+    index_.erase(entry->key);
+    bytes_ -= entry->bytes();
+    if (position == hand_) {
+      hand_ = ring_.erase(position);
+    } else {
+      ring_.erase(position);
+    }
+    delete entry;
+  }
+
+  const size_t max_bytes_;
+  boost::shared_mutex mu_;
+  index_map index_;
+  entry_ring ring_;
+  size_t bytes_;
+  entry_ring::iterator hand_;
+  boost::atomic<uint64> hits_;
+  boost::atomic<uint64> misses_;
+  boost::atomic<uint64> evictions_;
+  DISALLOW_COPY_AND_ASSIGN(response_cache_shard);
+};
+
+response_cache::response_cache(size_t max_bytes, int shards) {
+  CHECK_GE(shards, 1);
+  for (int i = 0; i < shards; ++i) {
+    shards_.push_back(new response_cache_shard(max_bytes / shards));
+  }
+}
+
+response_cache::~response_cache() {
+  delete_container_pointers(shards_.begin(), shards_.end());
+}
+
+void response_cache::set_cacheable(const std::string& service,
+                                   const std::string& method,
+                                   int64 ttl_ms) {
+  ttls_[service][method] = ttl_ms;
+}
+
+void response_cache::set_cacheable(
+    const google::protobuf::ServiceDescriptor* descriptor) {
+  set_cacheable(descriptor, descriptor->name());
+}
+
+void response_cache::set_cacheable(
+    const google::protobuf::ServiceDescriptor* descriptor,
+    const std::string& service) {
+  for (int i = 0; i < descriptor->method_count(); ++i) {
+    int64 ttl_ms = get_method_options(descriptor->method(i)).cache_ttl_ms();
+    if (ttl_ms > 0) {
+      set_cacheable(service, descriptor->method(i)->name(), ttl_ms);
+    }
+  }
+}
+
+int64 response_cache::get_ttl_ms(const std::string& service,
+                                 const std::string& method) const {
+  ttl_map::const_iterator service_it = ttls_.find(service);
+  if (service_it == ttls_.end()) {
+    return 0;
+  }
+  std::map<std::string, int64>::const_iterator method_it =
+      service_it->second.find(method);
+  if (method_it == service_it->second.end()) {
+    return 0;
+  }
+  return method_it->second;
+}
+
+std::string response_cache::make_key(const std::string& service,
+                                     const std::string& method,
+                                     const void* request,
+                                     size_t request_size) {
+  std::string key;
+  key.reserve(service.size() + method.size() + 2 + request_size);
+  key.append(service);
+  key.push_back('\0');
+  key.append(method);
+  key.push_back('\0');
+  key.append(static_cast<const char*>(request), request_size);
+  return key;
+}
+
+response_cache_shard* response_cache::get_shard(const std::string& key) {
+  return shards_[boost::hash<std::string>()(key) % shards_.size()];
+}
+
+bool response_cache::lookup(const std::string& key, std::string* response) {
+  return get_shard(key)->lookup(key, response);
+}
+
+void response_cache::insert(const std::string& key,
+                            const std::string& response, int64 ttl_ms) {
+  get_shard(key)->insert(key, response,
+                         zclock_time_usec() + ttl_ms * 1000);
+}
+
+void response_cache::clear() {
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    shards_[i]->clear();
+  }
+}
+
+uint64 response_cache::get_hits() const {
+  uint64 hits = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    hits += shards_[i]->get_hits();
+  }
+  return hits;
+}
+
+uint64 response_cache::get_misses() const {
+  uint64 misses = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    misses += shards_[i]->get_misses();
+  }
+  return misses;
+}
+
+uint64 response_cache::get_evictions() const {
+  uint64 evictions = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    evictions += shards_[i]->get_evictions();
+  }
+  return evictions;
+}
+
+size_t response_cache::get_bytes() const {
+  size_t bytes = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    bytes += shards_[i]->get_bytes();
+  }
+  return bytes;
+}
+}  // namespace rpcz
@@ -0,0 +1,183 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/response_memo.hpp"
+
+#include <string.h>
+#include <string>
+#include <boost/functional/hash.hpp>
+#include "zmq.hpp"
+
+#include "rpcz/clock.hpp"
+
+namespace rpcz {
+
+struct response_memo_entry {
+  uint64 hash;
+  std::string service;
+  std::string method;
+  // A copy of the request bytes: request frames can point into a transport's
+  // receive buffer (see shm_transport), which must not be held for the TTL.
+  std::string request;
+  zmq::message_t response;
+  uint64 expires_usec;
+  size_t bytes;
+};
+
+namespace {
+// Accounted for each entry on top of its names and frames.
+const size_t kEntryOverhead = 128;
+
+uint64 hash_request(const std::string& service, const std::string& method,
+                    zmq::message_t* request) {
+  size_t seed = 0;
+  boost::hash_combine(seed, service);
+  boost::hash_combine(seed, method);
+  const char* data = static_cast<const char*>(request->data());
+  boost::hash_range(seed, data, data + request->size());
+  return seed;
+}
+
+// Whether the entry is for the given request, and not for one whose hash
+// collides.
+bool matches(response_memo_entry* entry, const std::string& service,
+             const std::string& method, zmq::message_t* request) {
+  return entry->request.size() == request->size() &&
+      entry->service == service && entry->method == method &&
+      memcmp(entry->request.data(), request->data(), request->size()) == 0;
+}
+}  // unnamed namespace
+
+response_memo::response_memo(size_t max_bytes)
+    : max_bytes_(max_bytes), bytes_(0), hits_(0), misses_(0),
+      evictions_(0) {
+}
+
+response_memo::~response_memo() {
+  clear();
+}
+
+void response_memo::set_memoized(const std::string& service,
+                                 const std::string& method,
+                                 int64 ttl_ms) {
+  ttls_[service][method] = ttl_ms;
+}
+
+int64 response_memo::get_ttl_ms(const std::string& service,
+                                const std::string& method) const {
+  ttl_map::const_iterator service_it = ttls_.find(service);
+  if (service_it == ttls_.end()) {
+    return 0;
+  }
+  std::map<std::string, int64>::const_iterator method_it =
+      service_it->second.find(method);
+  if (method_it == service_it->second.end()) {
+    return 0;
+  }
+  return method_it->second;
+}
+
+bool response_memo::lookup(const std::string& service,
+                           const std::string& method,
+                           zmq::message_t* request,
+                           zmq::message_t* response) {
+  uint64 hash = hash_request(service, method, request);
+  boost::unique_lock<boost::mutex> lock(mu_);
+  index_map::iterator it = index_.find(hash);
+  if (it == index_.end() ||
+      !matches(*it->second, service, method, request)) {
+    ++misses_;
+    return false;
+  }
+  response_memo_entry* entry = *it->second;
+  if (entry->expires_usec <= zclock_time_usec()) {
+    remove(it->second);
+    ++misses_;
+    return false;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  // Copying changes the source frame's reference count, hence under mu_.
+  response->copy(&entry->response);
+  ++hits_;
+  return true;
+}
+
+void response_memo::insert(const std::string& service,
+                           const std::string& method,
+                           zmq::message_t* request,
+                           zmq::message_t* response,
+                           int64 ttl_ms) {
+  size_t bytes = service.size() + method.size() + request->size() +
+      response->size() + kEntryOverhead;
+  if (bytes > max_bytes_) {
+    return;
+  }
+  scoped_ptr<response_memo_entry> entry(new response_memo_entry);
+  entry->hash = hash_request(service, method, request);
+  entry->service = service;
+  entry->method = method;
+  entry->request.assign(static_cast<const char*>(request->data()),
+                        request->size());
+  entry->response.copy(response);
+  entry->expires_usec = zclock_time_usec() + ttl_ms * 1000;
+  entry->bytes = bytes;
+  boost::unique_lock<boost::mutex> lock(mu_);
+  index_map::iterator it = index_.find(entry->hash);
+  if (it != index_.end()) {
+    remove(it->second);
+  }
+  while (bytes_ + bytes > max_bytes_) {
+    remove(--entries_.end());
+    ++evictions_;
+  }
+  bytes_ += bytes;
+  entries_.push_front(entry.get());
+  index_[entry.release()->hash] = entries_.begin();
+}
+
+void response_memo::remove(entry_list::iterator position) {
+  response_memo_entry* entry = *position;
+  index_.erase(entry->hash);
+  bytes_ -= entry->bytes;
+  entries_.erase(position);
+  delete entry;
+}
+
+void response_memo::clear() {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  while (!entries_.empty()) {
+    remove(entries_.begin());
+  }
+}
+
+uint64 response_memo::get_hits() const {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  return hits_;
+}
+
+uint64 response_memo::get_misses() const {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  return misses_;
+}
+
+uint64 response_memo::get_evictions() const {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  return evictions_;
+}
+
+size_t response_memo::get_bytes() const {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  return bytes_;
+}
+}  // namespace rpcz
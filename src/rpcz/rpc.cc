@@ -27,6 +27,7 @@ rpc::rpc()
     : status_(status::INACTIVE),
       application_error_code_(0),
       deadline_ms_(-1),
+      sent_time_usec_(0),
       sync_event_(new sync_event()) {
 };
 
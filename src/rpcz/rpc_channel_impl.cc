@@ -14,11 +14,16 @@
 //
 // Author: nadavs@google.com <Nadav Samet>
 
+#include <vector>
 #include <google/protobuf/descriptor.h>
+#include <boost/shared_ptr.hpp>
 #include <zmq.hpp>
 #include "rpcz/callback.hpp"
+#include "rpcz/clock.hpp"
 #include "rpcz/connection_manager.hpp"
 #include "rpcz/logging.hpp"
+#include "rpcz/metrics_registry.hpp"
+#include "rpcz/response_cache.hpp"
 #include "rpcz/rpc.hpp"
 #include "rpcz/rpc_channel_impl.hpp"
 #include "rpcz/sync_event.hpp"
@@ -27,14 +32,29 @@
 namespace rpcz {
 
 rpc_channel* rpc_channel::create(connection connection) {
-  return new rpc_channel_impl(connection);
+  return create(connection, NULL);
 }
 
-rpc_channel_impl::rpc_channel_impl(connection connection)
-    : connection_(connection) {
+rpc_channel* rpc_channel::create(connection connection,
+                                 response_cache* cache,
+                                 bool coalesce_calls) {
+  count_allocation(ALLOCATION_CHANNELS, sizeof(rpc_channel_impl));
+  return new rpc_channel_impl(connection, cache, coalesce_calls, false);
 }
 
-rpc_channel_impl::~rpc_channel_impl() {
+rpc_channel* rpc_channel_impl::create_owning(connection connection,
+                                             response_cache* cache,
+                                             bool coalesce_calls) {
+  count_allocation(ALLOCATION_CHANNELS, sizeof(rpc_channel_impl));
+  return new rpc_channel_impl(connection, cache, coalesce_calls, true);
+}
+
+rpc_channel_impl::rpc_channel_impl(connection connection,
+                                   response_cache* cache,
+                                   bool coalesce_calls,
+                                   bool owns_connection)
+    : connection_(connection), cache_(cache),
+      coalesce_calls_(coalesce_calls), owns_connection_(owns_connection) {
 }
 
 struct rpc_response_context {
@@ -42,8 +62,29 @@ struct rpc_response_context {
   ::google::protobuf::Message* response_msg;
   std::string* response_str;
   closure* user_closure;
+  uint64 start_time_usec;
+  // Where to account the callback's time, NULL when cpu accounting is off.
+  method_counters* counters;
+  // Where to cache the response, NULL when the method is not cacheable.
+  boost::shared_ptr<std::string> cache_key;
+  int64 cache_ttl_ms;
+  // Set when identical calls may wait for this one.
+  boost::shared_ptr<std::string> coalesce_key;
 };
 
+// The calls waiting for an identical call in flight.
+struct coalesced_client_call {
+  std::vector<rpc_response_context> waiters;
+};
+
+rpc_channel_impl::~rpc_channel_impl() {
+  delete_container_second_pointer(coalesced_calls_.begin(),
+                                  coalesced_calls_.end());
+  if (owns_connection_) {
+    connection_.close();
+  }
+}
+
 void rpc_channel_impl::call_method_full(
     const std::string& service_name,
     const std::string& method_name,
@@ -54,9 +95,13 @@ void rpc_channel_impl::call_method_full(
     rpc* rpc_,
     closure* done) {
   CHECK_EQ(rpc_->get_status(), status::INACTIVE);
+  uint64 start_time_usec = zclock_time_usec();
   rpc_request_header generic_request;
   generic_request.set_service(service_name);
   generic_request.set_method(method_name);
+  if (!rpc_->get_idempotency_key().empty()) {
+    generic_request.set_idempotency_key(rpc_->get_idempotency_key());
+  }
 
   size_t msg_size = generic_request.ByteSize();
   scoped_ptr<zmq::message_t> msg_out(new zmq::message_t(msg_size));
@@ -74,22 +119,142 @@ void rpc_channel_impl::call_method_full(
     payload_out.reset(string_to_message(request));
   }
 
-  message_vector msg_vector;
-  msg_vector.push_back(msg_out.release());
-  msg_vector.push_back(payload_out.release());
+  boost::shared_ptr<std::string> call_key;
+  int64 cache_ttl_ms = cache_ ?
+      cache_->get_ttl_ms(service_name, method_name) : 0;
+  // Calls with distinct idempotency keys are distinct, even if their
+  // requests are identical.
+  bool coalesce = coalesce_calls_ && rpc_->get_idempotency_key().empty();
+  if (cache_ttl_ms > 0 || coalesce) {
+    call_key.reset(new std::string(response_cache::make_key(
+        service_name, method_name, payload_out->data(),
+        payload_out->size())));
+  }
+  if (cache_ttl_ms > 0) {
+    std::string cached;
+    if (cache_->lookup(*call_key, &cached)) {
+      handle_cached_response(cached, response_msg, response_str, rpc_, done,
+                             start_time_usec);
+      return;
+    }
+  }
 
   rpc_response_context response_context;
   response_context.rpc_ = rpc_;
   response_context.user_closure = done;
   response_context.response_str = response_str;
   response_context.response_msg = response_msg;
+  response_context.start_time_usec = start_time_usec;
+  metrics_registry* metrics = connection_.manager_->metrics_.get();
+  response_context.counters = metrics->cpu_accounting() ?
+      metrics->get_client_method(service_name, method_name) : NULL;
+  if (cache_ttl_ms > 0) {
+    response_context.cache_key = call_key;
+  }
+  response_context.cache_ttl_ms = cache_ttl_ms;
   rpc_->set_status(status::ACTIVE);
+  if (coalesce) {
+    // A call only waits for an identical call with the same deadline. That
+    // call was sent first, so it completes before the waiting call's
+    // deadline expires.
+    boost::shared_ptr<std::string> coalesce_key(new std::string(*call_key));
+    int64 deadline_ms = rpc_->get_deadline_ms();
+    coalesce_key->append(reinterpret_cast<const char*>(&deadline_ms),
+                         sizeof(deadline_ms));
+    if (join_coalesced_call(*coalesce_key, response_context)) {
+      return;
+    }
+    response_context.coalesce_key = coalesce_key;
+  }
+
+  count_allocation(ALLOCATION_FRAMES, msg_out->size());
+  count_allocation(ALLOCATION_FRAMES, payload_out->size());
+  rpc_->stats_.request_bytes = msg_out->size() + payload_out->size();
+  rpc_->stats_.connection_id = connection_.get_connection_id();
+  message_vector msg_vector;
+  msg_vector.push_back(msg_out.release());
+  msg_vector.push_back(payload_out.release());
 
   connection_.send_request(
       msg_vector,
       rpc_->get_deadline_ms(),
       bind(&rpc_channel_impl::handle_client_response, this,
-           response_context, _1, _2));
+           response_context, _1, _2),
+      &rpc_->sent_time_usec_);
+}
+
+bool rpc_channel_impl::join_coalesced_call(
+    const std::string& key, const rpc_response_context& response_context) {
+  boost::unique_lock<boost::mutex> lock(coalesced_calls_mu_);
+  coalesced_client_call*& call = coalesced_calls_[key];
+  if (call == NULL) {
+    call = new coalesced_client_call;
+    return false;
+  }
+  call->waiters.push_back(response_context);
+  return true;
+}
+
+coalesced_client_call* rpc_channel_impl::leave_coalesced_call(
+    const std::string& key) {
+  boost::unique_lock<boost::mutex> lock(coalesced_calls_mu_);
+  coalesced_call_map::iterator it = coalesced_calls_.find(key);
+  CHECK(it != coalesced_calls_.end());
+  coalesced_client_call* call = it->second;
+  coalesced_calls_.erase(it);
+  return call;
+}
+
+void rpc_channel_impl::complete_waiting_call(
+    const rpc& completed_rpc, zmq::message_t* payload,
+    const rpc_response_context& waiting_call) {
+  rpc* rpc_ = waiting_call.rpc_;
+  if (completed_rpc.get_status() == status::OK) {
+    rpc_->set_status(status::OK);
+    if (waiting_call.response_msg) {
+      if (!waiting_call.response_msg->ParseFromArray(payload->data(),
+                                                     payload->size())) {
+        rpc_->set_failed(application_error::INVALID_MESSAGE, "");
+      }
+    } else if (waiting_call.response_str) {
+      waiting_call.response_str->assign(
+          static_cast<char*>(payload->data()), payload->size());
+    }
+  } else if (completed_rpc.get_status() == status::APPLICATION_ERROR) {
+    rpc_->set_failed(completed_rpc.get_application_error_code(),
+                     completed_rpc.get_error_message());
+  } else {
+    rpc_->set_status(completed_rpc.get_status());
+  }
+  rpc_->stats_.server_time_usec = completed_rpc.stats_.server_time_usec;
+  rpc_->stats_.latency_usec =
+      zclock_time_usec() - waiting_call.start_time_usec;
+  rpc_->sync_event_->signal();
+  if (waiting_call.user_closure) {
+    waiting_call.user_closure->run();
+  }
+}
+
+void rpc_channel_impl::handle_cached_response(
+    const std::string& response,
+    ::google::protobuf::Message* response_msg,
+    std::string* response_str,
+    rpc* rpc_,
+    closure* done,
+    uint64 start_time_usec) {
+  rpc_->set_status(status::OK);
+  if (response_msg) {
+    if (!response_msg->ParseFromString(response)) {
+      rpc_->set_failed(application_error::INVALID_MESSAGE, "");
+    }
+  } else if (response_str) {
+    response_str->assign(response);
+  }
+  rpc_->stats_.latency_usec = zclock_time_usec() - start_time_usec;
+  rpc_->sync_event_->signal();
+  if (done) {
+    done->run();
+  }
 }
 
 void rpc_channel_impl::call_method0(const std::string& service_name,
@@ -128,11 +293,25 @@ void rpc_channel_impl::call_method(
 void rpc_channel_impl::handle_client_response(
     rpc_response_context response_context, connection_manager::status status,
     message_iterator& iter) {
+  if (response_context.counters) {
+    set_current_method(response_context.counters);
+  }
+  rpc_stats& stats = response_context.rpc_->stats_;
+  // Identical calls that arrive from now on are sent.
+  scoped_ptr<coalesced_client_call> coalesced;
+  if (response_context.coalesce_key) {
+    coalesced.reset(leave_coalesced_call(*response_context.coalesce_key));
+  }
+  zmq::message_t* reply_payload = NULL;
   switch (status) {
     case connection_manager::DEADLINE_EXCEEDED:
       response_context.rpc_->set_status(
           status::DEADLINE_EXCEEDED);
       break;
+    case connection_manager::CLOSED:
+      response_context.rpc_->set_status(status::TERMINATED);
+      response_context.rpc_->error_message_ = "Connection closed.";
+      break;
     case connection_manager::DONE: {
         if (!iter.has_more()) {
           response_context.rpc_->set_failed(application_error::INVALID_MESSAGE,
@@ -141,17 +320,27 @@ void rpc_channel_impl::handle_client_response(
         }
         rpc_response_header generic_response;
         zmq::message_t& msg_in = iter.next();
+        stats.response_bytes = msg_in.size();
         if (!generic_response.ParseFromArray(msg_in.data(), msg_in.size())) {
           response_context.rpc_->set_failed(application_error::INVALID_MESSAGE,
                                            "");
           break;
         }
-        if (generic_response.status() != status::OK) {
+        if (generic_response.has_processing_time_usec()) {
+          stats.server_time_usec = generic_response.processing_time_usec();
+        }
+        if (generic_response.status() == status::DEADLINE_EXCEEDED) {
+          // From a proxy whose upstream did not reply in time.
+          response_context.rpc_->set_status(status::DEADLINE_EXCEEDED);
+          response_context.rpc_->error_message_ = generic_response.error();
+        } else if (generic_response.status() != status::OK) {
           response_context.rpc_->set_failed(generic_response.application_error(),
                                            generic_response.error());
         } else {
           response_context.rpc_->set_status(status::OK);
           zmq::message_t& payload = iter.next();
+          reply_payload = &payload;
+          stats.response_bytes += payload.size();
           if (response_context.response_msg) {
             if (!response_context.response_msg->ParseFromArray(
                     payload.data(),
@@ -166,6 +355,12 @@ void rpc_channel_impl::handle_client_response(
                     payload.data()),
                 payload.size());
           }
+          if (response_context.cache_key) {
+            cache_->insert(*response_context.cache_key,
+                           std::string(static_cast<char*>(payload.data()),
+                                       payload.size()),
+                           response_context.cache_ttl_ms);
+          }
         }
       }
       break;
@@ -175,6 +370,19 @@ void rpc_channel_impl::handle_client_response(
       CHECK(false) << "Unexpected status: "
                    << status;
   }
+  uint64 now = zclock_time_usec();
+  stats.latency_usec = now - response_context.start_time_usec;
+  if (response_context.rpc_->sent_time_usec_) {
+    stats.queue_time_usec = response_context.rpc_->sent_time_usec_ -
+        response_context.start_time_usec;
+  }
+  // Before the call's own closure, which may delete its rpc.
+  if (coalesced.get()) {
+    for (size_t i = 0; i < coalesced->waiters.size(); ++i) {
+      complete_waiting_call(*response_context.rpc_, reply_payload,
+                            coalesced->waiters[i]);
+    }
+  }
   // We call signal() before we execute closure since the closure may delete
   // the rpc object (which contains the sync_event).
   response_context.rpc_->sync_event_->signal();
@@ -17,6 +17,9 @@
 #ifndef RPCZ_RPC_CHANNEL_IMPL_H
 #define RPCZ_RPC_CHANNEL_IMPL_H
 
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
 #include "rpcz/connection_manager.hpp"
 #include "rpcz/rpc_channel.hpp"
 
@@ -25,11 +28,22 @@ namespace rpcz {
 class connection;
 class closure;
 class message_vector;
+class response_cache;
+struct coalesced_client_call;
 struct rpc_response_context;
 
 class rpc_channel_impl: public rpc_channel {
  public:
-  rpc_channel_impl(connection connection);
+  // Unless owns_connection, the connection stays open when the channel is
+  // deleted, since other channels may share it.
+  rpc_channel_impl(connection connection, response_cache* cache,
+                   bool coalesce_calls, bool owns_connection);
+
+  // Like rpc_channel::create, but the channel closes the connection when it
+  // is deleted.
+  static rpc_channel* create_owning(connection connection,
+                                    response_cache* cache,
+                                    bool coalesce_calls);
 
   virtual ~rpc_channel_impl();
 
@@ -60,7 +74,38 @@ class rpc_channel_impl: public rpc_channel {
     rpc* rpc,
     closure* done);
 
+  // Completes the call with a response from the cache.
+  void handle_cached_response(
+      const std::string& response,
+      ::google::protobuf::Message* response_msg,
+      std::string* response_str,
+      rpc* rpc,
+      closure* done,
+      uint64 start_time_usec);
+
+  // Adds the call to the identical call in flight and returns true, or
+  // makes it the call that identical calls wait for and returns false.
+  bool join_coalesced_call(const std::string& key,
+                           const rpc_response_context& response_context);
+
+  // Called when the reply to a call that others may wait for arrives.
+  // Returns the waiting calls, which the caller owns.
+  coalesced_client_call* leave_coalesced_call(const std::string& key);
+
+  // Completes a call that waited for the given one, which has completed.
+  void complete_waiting_call(const rpc& completed_rpc,
+                             zmq::message_t* payload,
+                             const rpc_response_context& waiting_call);
+
+  typedef boost::unordered_map<std::string, coalesced_client_call*>
+      coalesced_call_map;
+
   connection connection_;
+  response_cache* cache_;
+  bool coalesce_calls_;
+  bool owns_connection_;
+  boost::mutex coalesced_calls_mu_;
+  coalesced_call_map coalesced_calls_;
 };
 } // namespace rpcz
 #endif /* RPCZ_SIMPLE_RPC_CHANNEL_IMPL_H_ */
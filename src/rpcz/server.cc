@@ -17,39 +17,124 @@
 #include "rpcz/server.hpp"
 #include <signal.h>
 #include <string.h>
+#include <algorithm>
 #include <functional>
 #include <iostream>
+#include <set>
 #include <utility>
+#include <vector>
 #ifndef WIN32
 #include <sys/errno.h>
 #include <sys/signal.h>
 #endif
 
 #include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/stubs/common.h>
 #include <zmq.hpp>
 
+#include "rpcz/access_log.hpp"
 #include "rpcz/application.hpp"
 #include "rpcz/callback.hpp"
+#include "rpcz/clock.hpp"
 #include "rpcz/connection_manager.hpp"
+#include "rpcz/idempotency_table.hpp"
 #include "rpcz/logging.hpp"
 #include "rpcz/macros.hpp"
+#include "rpcz/method_options.hpp"
+#include "rpcz/metrics_registry.hpp"
 #include "rpcz/rpc.hpp"
 #include "rpcz/reactor.hpp"
+#include "rpcz/response_cache.hpp"
+#include "rpcz/response_memo.hpp"
 #include "rpcz/service.hpp"
+#include "rpcz/trace.hpp"
+#include "rpcz/traffic_capture.hpp"
+#include "rpcz/traffic_mirror.hpp"
+#include "rpcz/watchdog.hpp"
 #include "rpcz/zmq_utils.hpp"
 #include "rpcz/rpcz.pb.h"
 
 namespace rpcz {
+class server_channel_impl;
+
+// A request to a coalesced method that is being handled, and the channels of
+// the identical requests that arrived in the meantime.
+struct coalesced_call {
+  uint64 hash;
+  std::string service;
+  std::string method;
+  zmq::message_t request;
+  std::vector<server_channel*> waiters;
+};
+
+// The requests to coalesced methods that are being handled by a server.
+class coalescing_table {
+ public:
+  coalescing_table() : coalesced_requests_(0) {}
+
+  void add_method(const std::string& service, const std::string& method) {
+    methods_.insert(std::make_pair(service, method));
+  }
+
+  // If an identical request is being handled, takes the channel to reply to
+  // it along with that request, and returns true. Otherwise, if the method
+  // is coalesced, makes the request the one the next identical requests
+  // wait for. Defined below server_channel_impl.
+  bool join(const std::string& service, const std::string& method,
+            zmq::message_t* request,
+            scoped_ptr<server_channel_impl>* channel);
+
+  // Called when the call is replied: identical requests are handled anew
+  // from now on. The caller takes ownership of the call.
+  void finish(coalesced_call* call) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    calls_.erase(call->hash);
+  }
+
+  uint64 get_coalesced_requests() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    return coalesced_requests_;
+  }
+
+ private:
+  typedef boost::unordered_map<uint64, coalesced_call*> call_map;
+
+  std::set<std::pair<std::string, std::string> > methods_;
+  boost::mutex mu_;
+  call_map calls_;
+  uint64 coalesced_requests_;
+};
 
 class server_channel_impl : public server_channel {
  public:
   server_channel_impl(const client_connection& connection)
-      : connection_(connection) {
+      : connection_(connection), start_time_usec_(zclock_time_usec()),
+        access_log_(NULL), inflight_counters_(NULL), inflight_bytes_(0),
+        memo_(NULL), memo_ttl_ms_(0),
+        coalescing_table_(NULL), coalesced_call_(NULL),
+        idempotency_table_(NULL) {
       }
 
+  ~server_channel_impl() {
+    // If the handler never replied, neither are the requests waiting for it.
+    if (coalesced_call_) {
+      scoped_ptr<coalesced_call> call(coalesced_call_);
+      coalescing_table_->finish(call.get());
+      delete_container_pointers(call->waiters.begin(), call->waiters.end());
+    }
+    if (idempotency_table_) {
+      std::vector<server_channel*> waiters;
+      idempotency_table_->abandon(idempotency_key_, &waiters);
+      delete_container_pointers(waiters.begin(), waiters.end());
+    }
+    add_inflight_request(inflight_counters_, -1, -inflight_bytes_);
+  }
+
   virtual void send(const google::protobuf::Message& response) {
     rpc_response_header generic_rpc_response;
     int msg_size = response.ByteSize();
@@ -57,14 +142,18 @@ class server_channel_impl : public server_channel {
     if (!response.SerializeToArray(payload->data(), msg_size)) {
       throw invalid_message_error("Invalid response message");
     }
+    count_allocation(ALLOCATION_FRAMES, msg_size);
+    memoize(payload.get());
     send_generic_response(generic_rpc_response,
                         payload.release());
   }
 
   virtual void send0(const std::string& response) {
     rpc_response_header generic_rpc_response;
-    send_generic_response(generic_rpc_response,
-                        string_to_message(response));
+    count_allocation(ALLOCATION_FRAMES, response.size());
+    zmq::message_t* payload = string_to_message(response);
+    memoize(payload);
+    send_generic_response(generic_rpc_response, payload);
   }
 
   virtual void send_error(int application_error,
@@ -83,16 +172,60 @@ class server_channel_impl : public server_channel {
  private:
   client_connection connection_;
   scoped_ptr<google::protobuf::Message> request_;
+  uint64 start_time_usec_;
+  // Set only when this request is sampled into the access log.
+  access_log* access_log_;
+  access_log_record record_;
+  connection_counters* inflight_counters_;
+  int64 inflight_bytes_;
+  // Set only when the response is to be memoized.
+  response_memo* memo_;
+  std::string memo_service_;
+  std::string memo_method_;
+  scoped_ptr<zmq::message_t> memo_request_;
+  int64 memo_ttl_ms_;
+  // Set only when identical requests may wait for this one's reply.
+  coalescing_table* coalescing_table_;
+  coalesced_call* coalesced_call_;
+  // Set only when the request has an idempotency key that the table did not
+  // know about.
+  idempotency_table* idempotency_table_;
+  std::string idempotency_key_;
 
   // Sends the response back to a function server through the reply function.
   // Takes ownership of the provided payload message.
-  void send_generic_response(const rpc_response_header& generic_rpc_response,
+  void send_generic_response(rpc_response_header& generic_rpc_response,
                            zmq::message_t* payload) {
+    uint64 processing_time_usec = zclock_time_usec() - start_time_usec_;
+    generic_rpc_response.set_processing_time_usec(processing_time_usec);
     size_t msg_size = generic_rpc_response.ByteSize();
     zmq::message_t* zmq_response_message = new zmq::message_t(msg_size);
     CHECK(generic_rpc_response.SerializeToArray(
             zmq_response_message->data(),
             msg_size));
+    count_allocation(ALLOCATION_FRAMES, msg_size);
+
+    if (access_log_) {
+      record_.latency_usec = processing_time_usec;
+      record_.response_bytes = msg_size + payload->size();
+      record_.status = generic_rpc_response.status();
+      record_.application_error = generic_rpc_response.application_error();
+      access_log_->append(record_);
+    }
+
+    if (idempotency_table_) {
+      std::vector<server_channel*> waiters;
+      idempotency_table_->finish(idempotency_key_, generic_rpc_response,
+                                 payload, &waiters);
+      idempotency_table_ = NULL;
+      reply_to_waiters(waiters, generic_rpc_response, payload);
+    }
+    if (coalesced_call_) {
+      scoped_ptr<coalesced_call> call(coalesced_call_);
+      coalesced_call_ = NULL;
+      coalescing_table_->finish(call.get());
+      reply_to_waiters(call->waiters, generic_rpc_response, payload);
+    }
 
     message_vector v;
     v.push_back(zmq_response_message);
@@ -100,6 +233,160 @@ class server_channel_impl : public server_channel {
     connection_.reply(&v);
   }
 
+  // Sends the reply to the requests that waited for this one, and deletes
+  // their channels. They share the payload frame.
+  static void reply_to_waiters(const std::vector<server_channel*>& waiters,
+                               rpc_response_header& generic_rpc_response,
+                               zmq::message_t* payload) {
+    for (size_t i = 0; i < waiters.size(); ++i) {
+      scoped_ptr<server_channel_impl> waiter(
+          static_cast<server_channel_impl*>(waiters[i]));
+      zmq::message_t* shared_payload = new zmq::message_t;
+      shared_payload->copy(payload);
+      waiter->send_generic_response(generic_rpc_response, shared_payload);
+    }
+  }
+
+  // Replies with the reply to the earlier request with the same idempotency
+  // key, or waits for it if it is in progress. Otherwise, records the reply
+  // to this request in the table once it is sent.
+  idempotency_table::begin_result start_idempotent(idempotency_table* table,
+                                                   const std::string& key) {
+    rpc_response_header generic_rpc_response;
+    scoped_ptr<zmq::message_t> payload(new zmq::message_t);
+    idempotency_table::begin_result result = table->begin(
+        key, this, &generic_rpc_response, payload.get());
+    if (result == idempotency_table::REPLAYED) {
+      send_generic_response(generic_rpc_response, payload.release());
+    } else if (result == idempotency_table::STARTED) {
+      idempotency_table_ = table;
+      idempotency_key_ = key;
+    }
+    return result;
+  }
+
+  // Records this request in the given access log once it is replied.
+  void start_access_log(access_log* log,
+                        const std::string& peer,
+                        const std::string& service,
+                        const std::string& method,
+                        size_t request_bytes) {
+    access_log_ = log;
+    memset(&record_, 0, sizeof(record_));
+    record_.timestamp_usec = start_time_usec_;
+    record_.request_bytes = request_bytes;
+    record_.peer_size = std::min(peer.size(), sizeof(record_.peer));
+    memcpy(record_.peer, peer.data(), record_.peer_size);
+    std::string full_name(service + "." + method);
+    // Not NUL-terminated when it fills the field; readers use strnlen().
+    memcpy(record_.method, full_name.data(),
+           std::min(full_name.size(), sizeof(record_.method)));
+  }
+
+  // Replies with the response memoized for this request, if there is one.
+  // Otherwise memoizes the response once it is sent. Returns whether the
+  // request was replied.
+  bool reply_from_memo(response_memo* memo, const std::string& service,
+                       const std::string& method, zmq::message_t* request,
+                       int64 ttl_ms) {
+    scoped_ptr<zmq::message_t> payload(new zmq::message_t);
+    if (memo->lookup(service, method, request, payload.get())) {
+      rpc_response_header generic_rpc_response;
+      send_generic_response(generic_rpc_response, payload.release());
+      return true;
+    }
+    memo_ = memo;
+    memo_service_ = service;
+    memo_method_ = method;
+    memo_request_.reset(new zmq::message_t);
+    memo_request_->copy(request);
+    memo_ttl_ms_ = ttl_ms;
+    return false;
+  }
+
+  void memoize(zmq::message_t* payload) {
+    if (memo_) {
+      memo_->insert(memo_service_, memo_method_, memo_request_.get(), payload,
+                    memo_ttl_ms_);
+    }
+  }
+
+  // Counts this request in the in-flight gauges of its endpoint until the
+  // channel is deleted.
+  void track_inflight(connection_counters* counters, size_t request_bytes) {
+    inflight_counters_ = counters;
+    inflight_bytes_ = request_bytes;
+    add_inflight_request(inflight_counters_, 1, inflight_bytes_);
+  }
+
+  friend class coalescing_table;
+  friend class proto_rpc_service;
+  friend class server;
+};
+
+bool coalescing_table::join(const std::string& service,
+                            const std::string& method,
+                            zmq::message_t* request,
+                            scoped_ptr<server_channel_impl>* channel) {
+  if (methods_.find(std::make_pair(service, method)) == methods_.end()) {
+    return false;
+  }
+  size_t hash = 0;
+  boost::hash_combine(hash, service);
+  boost::hash_combine(hash, method);
+  const char* data = static_cast<const char*>(request->data());
+  boost::hash_range(hash, data, data + request->size());
+  boost::unique_lock<boost::mutex> lock(mu_);
+  call_map::iterator it = calls_.find(hash);
+  if (it != calls_.end()) {
+    coalesced_call* call = it->second;
+    if (call->request.size() == request->size() &&
+        call->service == service && call->method == method &&
+        memcmp(call->request.data(), data, request->size()) == 0) {
+      call->waiters.push_back(channel->release());
+      ++coalesced_requests_;
+      return true;
+    }
+    // Another request with the same hash is handled; this one is handled on
+    // its own.
+    return false;
+  }
+  coalesced_call* call = new coalesced_call;
+  call->hash = hash;
+  call->service = service;
+  call->method = method;
+  call->request.copy(request);
+  calls_[hash] = call;
+  (*channel)->coalescing_table_ = this;
+  (*channel)->coalesced_call_ = call;
+  return false;
+}
+
+// Wraps the channel of a direct call whose request had to be parsed, and
+// keeps the parsed request until the reply.
+class request_owning_channel : public server_channel {
+ public:
+  request_owning_channel(server_channel* channel,
+                         google::protobuf::Message* request)
+      : channel_(channel), request_(request) {}
+
+  virtual void send(const google::protobuf::Message& response) {
+    channel_->send(response);
+  }
+
+  virtual void send_error(int application_error,
+                          const std::string& error_message="") {
+    channel_->send_error(application_error, error_message);
+  }
+
+  virtual void send0(const std::string& response) {
+    channel_->send0(response);
+  }
+
+ private:
+  scoped_ptr<server_channel> channel_;
+  scoped_ptr<google::protobuf::Message> request_;
+
   friend class proto_rpc_service;
 };
 
@@ -131,25 +418,74 @@ class proto_rpc_service : public rpc_service {
       channel->send_error(application_error::INVALID_MESSAGE);
       return;
     }
+    if (memory_accounting()) {
+      count_allocation(ALLOCATION_MESSAGES, channel->request_->SpaceUsed());
+    }
     server_channel_impl* channel_ptr = channel.release();
     service_->call_method(descriptor,
                          *channel_ptr->request_,
                          channel_ptr);
   }
 
+  virtual bool dispatch_local(const std::string& method,
+                              const google::protobuf::Message* request,
+                              const std::string& payload,
+                              server_channel* channel) {
+    const ::google::protobuf::MethodDescriptor* descriptor =
+        service_->GetDescriptor()->FindMethodByName(method);
+    if (descriptor == NULL) {
+      channel->send_error(application_error::NO_SUCH_METHOD);
+      delete channel;
+      return true;
+    }
+    const google::protobuf::Message& prototype =
+        service_->GetRequestPrototype(descriptor);
+    if (request && request->GetDescriptor() == prototype.GetDescriptor()) {
+      service_->call_method(descriptor, *request, channel);
+      return true;
+    }
+    // The caller's request is serialized or of another type.
+    scoped_ptr<request_owning_channel> owner(
+        new request_owning_channel(channel, prototype.New()));
+    if (!owner->request_->ParseFromString(
+            request ? request->SerializeAsString() : payload)) {
+      owner->send_error(application_error::INVALID_MESSAGE);
+      return true;
+    }
+    request_owning_channel* owner_ptr = owner.release();
+    service_->call_method(descriptor, *owner_ptr->request_, owner_ptr);
+    return true;
+  }
+
  private:
   scoped_ptr<service> service_;
 };
 
 server::server(application& application)
-  : connection_manager_(*application.connection_manager_.get()) {
+  : application_(&application),
+    connection_manager_(*application.connection_manager_.get()),
+    access_log_(NULL),
+    traffic_capture_(NULL),
+    traffic_mirror_(NULL),
+    response_memo_(NULL),
+    idempotency_table_(NULL) {
 }
 
 server::server(connection_manager& connection_manager)
-  : connection_manager_(connection_manager) {
+  : application_(NULL),
+    connection_manager_(connection_manager),
+    access_log_(NULL),
+    traffic_capture_(NULL),
+    traffic_mirror_(NULL),
+    response_memo_(NULL),
+    idempotency_table_(NULL) {
 }
 
-server::~server() { }
+server::~server() {
+  if (application_) {
+    application_->unregister_local_server(this);
+  }
+}
 
 void server::register_service(rpcz::service *service) {
   register_service(service,
@@ -159,6 +495,13 @@ void server::register_service(rpcz::service *service) {
 void server::register_service(rpcz::service *service, const std::string& name) {
   register_service(new proto_rpc_service(service),
                   name);
+  const google::protobuf::ServiceDescriptor* descriptor =
+      service->GetDescriptor();
+  for (int i = 0; i < descriptor->method_count(); ++i) {
+    if (get_method_options(descriptor->method(i)).idempotent()) {
+      set_coalesced(name, descriptor->method(i)->name());
+    }
+  }
 }
 
 void server::register_service(rpcz::rpc_service *rpc_service,
@@ -166,10 +509,51 @@ void server::register_service(rpcz::rpc_service *rpc_service,
   service_map_[name] = rpc_service;
 }
 
+void server::set_access_log(access_log* access_log) {
+  access_log_ = access_log;
+}
+
+void server::set_traffic_capture(traffic_capture* capture) {
+  traffic_capture_ = capture;
+}
+
+void server::set_traffic_mirror(traffic_mirror* mirror) {
+  traffic_mirror_ = mirror;
+}
+
+void server::set_response_memo(response_memo* memo) {
+  response_memo_ = memo;
+}
+
+void server::set_coalesced(const std::string& service,
+                           const std::string& method) {
+  if (coalescing_table_.get() == NULL) {
+    coalescing_table_.reset(new coalescing_table);
+  }
+  coalescing_table_->add_method(service, method);
+}
+
+uint64 server::get_coalesced_requests() const {
+  return coalescing_table_.get() ?
+      coalescing_table_->get_coalesced_requests() : 0;
+}
+
+void server::set_idempotency_table(idempotency_table* table) {
+  idempotency_table_ = table;
+}
+
 void server::bind(const std::string& endpoint) {
   connection_manager::server_function f = boost::bind(
       &server::handle_request, this, _1, _2);
   connection_manager_.bind(endpoint, f);
+  if (application_) {
+    application_->register_local_server(endpoint, this);
+  }
+}
+
+rpc_service* server::find_service(const std::string& name) const {
+  rpc_service_map::const_iterator it = service_map_.find(name);
+  return it == service_map_.end() ? NULL : it->second;
 }
 
 void server::handle_request(const client_connection& connection,
@@ -178,15 +562,25 @@ void server::handle_request(const client_connection& connection,
     return;
   }
   rpc_request_header rpc_request_header;
-  scoped_ptr<server_channel> channel(new server_channel_impl(connection));
+  scoped_ptr<server_channel_impl> channel(new server_channel_impl(connection));
+  count_allocation(ALLOCATION_CHANNELS, sizeof(server_channel_impl));
+  size_t request_bytes;
+  scoped_ptr<zmq::message_t> mirrored_header;
   {
     zmq::message_t& msg = iter.next();
+    request_bytes = msg.size();
     if (!rpc_request_header.ParseFromArray(msg.data(), msg.size())) {
       // Handle bad rpc.
       DLOG(INFO) << "Received bad header.";
       channel->send_error(application_error::INVALID_HEADER);
       return;
     };
+    if (traffic_mirror_ &&
+        traffic_mirror_->should_sample(rpc_request_header.service(),
+                                       rpc_request_header.method())) {
+      mirrored_header.reset(new zmq::message_t);
+      mirrored_header->copy(&msg);
+    }
   }
   if (!iter.has_more()) {
     return;
@@ -195,6 +589,31 @@ void server::handle_request(const client_connection& connection,
   if (iter.has_more()) {
     return;
   }
+  if (memory_accounting()) {
+    channel->track_inflight(connection.counters_,
+                            request_bytes + payload.size());
+  }
+  if (access_log_ && access_log_->should_sample(rpc_request_header.service(),
+                                                rpc_request_header.method())) {
+    channel->start_access_log(access_log_,
+                              connection.sender_,
+                              rpc_request_header.service(),
+                              rpc_request_header.method(),
+                              request_bytes + payload.size());
+  }
+  if (traffic_capture_ &&
+      traffic_capture_->should_sample(rpc_request_header.service(),
+                                      rpc_request_header.method())) {
+    traffic_capture_->record(zclock_time_usec(),
+                             rpc_request_header.service(),
+                             rpc_request_header.method(),
+                             payload.data(), payload.size());
+  }
+  RPCZ_TRACE(worker_dispatch,
+             trace_event_id(connection.event_id_.data(),
+                            connection.event_id_.size()),
+             rpc_request_header.service().c_str(),
+             rpc_request_header.method().c_str());
 
   rpc_service_map::const_iterator service_it = service_map_.find(
       rpc_request_header.service());
@@ -205,8 +624,65 @@ void server::handle_request(const client_connection& connection,
     return;
   }
   rpcz::rpc_service* service = service_it->second;
-  service->dispatch_request(rpc_request_header.method(),
-                           payload.data(), payload.size(),
-                           channel.release());
+  int64 memo_ttl_ms = response_memo_ ?
+      response_memo_->get_ttl_ms(rpc_request_header.service(),
+                                 rpc_request_header.method()) : 0;
+  // Retries of requests with an idempotency key, requests answered from the
+  // memo, and requests answered along with an identical one do not run the
+  // handler.
+  bool handled = false;
+  bool has_idempotency_key = rpc_request_header.has_idempotency_key();
+  if (idempotency_table_ && has_idempotency_key) {
+    std::string key(response_cache::make_key(
+        rpc_request_header.service(), rpc_request_header.method(),
+        rpc_request_header.idempotency_key().data(),
+        rpc_request_header.idempotency_key().size()));
+    idempotency_table::begin_result result =
+        channel->start_idempotent(idempotency_table_, key);
+    if (result == idempotency_table::WAITING) {
+      channel.release();
+    }
+    handled = result != idempotency_table::STARTED;
+  }
+  if (!handled && memo_ttl_ms > 0) {
+    handled = channel->reply_from_memo(
+        response_memo_, rpc_request_header.service(),
+        rpc_request_header.method(), &payload, memo_ttl_ms);
+  }
+  // Requests with distinct idempotency keys are distinct, even if their
+  // payloads are identical.
+  if (!handled && coalescing_table_.get() && !has_idempotency_key) {
+    handled = coalescing_table_->join(rpc_request_header.service(),
+                                      rpc_request_header.method(), &payload,
+                                      &channel);
+  }
+  if (!handled) {
+    metrics_registry* metrics = connection_manager_.metrics_.get();
+    if (metrics->cpu_accounting()) {
+      set_current_method(metrics->get_server_method(
+              rpc_request_header.service(), rpc_request_header.method()));
+    }
+    set_current_call(rpc_request_header.service(), rpc_request_header.method());
+    RPCZ_TRACE(handler_start,
+               trace_event_id(connection.event_id_.data(),
+                              connection.event_id_.size()),
+               rpc_request_header.service().c_str(),
+               rpc_request_header.method().c_str());
+    service->dispatch_request(rpc_request_header.method(),
+                             payload.data(), payload.size(),
+                             channel.release());
+    RPCZ_TRACE(handler_end,
+               trace_event_id(connection.event_id_.data(),
+                              connection.event_id_.size()),
+               rpc_request_header.service().c_str(),
+               rpc_request_header.method().c_str());
+  }
+  // After the handler, so that the primary call does not wait for it. The
+  // copies share the frames' data.
+  if (mirrored_header.get()) {
+    zmq::message_t* mirrored_payload = new zmq::message_t;
+    mirrored_payload->copy(&payload);
+    traffic_mirror_->mirror(mirrored_header.release(), mirrored_payload);
+  }
 }
 }  // namespace
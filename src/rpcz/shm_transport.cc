@@ -0,0 +1,876 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/shm_transport.hpp"
+
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <boost/atomic.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/shared_ptr.hpp>
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "rpcz/logging.hpp"
+
+namespace rpcz {
+namespace {
+const char kScheme[] = "shm://";
+}  // unnamed namespace
+
+bool shm_transport::handles(const std::string& endpoint) {
+  return endpoint.compare(0, sizeof(kScheme) - 1, kScheme) == 0;
+}
+
+#ifndef __linux__
+transport_socket* shm_transport::connect(const std::string& endpoint) {
+  throw std::runtime_error("shm:// endpoints are only supported on Linux.");
+}
+
+transport_socket* shm_transport::bind(const std::string& endpoint) {
+  throw std::runtime_error("shm:// endpoints are only supported on Linux.");
+}
+#else
+namespace {
+// Bytes of each ring. The pages are only backed once they are written.
+const uint64 kRingSize = 16 << 20;
+// The ring headers come first, then the ring of the client and the ring of
+// the server.
+const size_t kRingsOffset = 4096;
+const size_t kSegmentSize = kRingsOffset + 2 * kRingSize;
+// Frames at least this large are read in place.
+const size_t kInPlaceSize = 16 * 1024;
+// Messages larger than this are written in chunks of at most kChunkSize.
+const uint64 kMaxUnchunkedSize = kRingSize / 2;
+const size_t kChunkSize = 2 << 20;
+// Events handled per epoll_wait().
+const int kMaxEvents = 64;
+// The number of fds a client hands over: the segment and two event fds.
+const int kHandshakeFds = 3;
+
+// The state of a ring, shared by its writer and its reader. head and
+// reader_waiting are written by the writer, tail and writer_waiting by the
+// reader; they live on separate cache lines.
+struct ring_header {
+  boost::atomic<uint64> head;
+  boost::atomic<uint32> reader_waiting;
+  char padding1[64 - sizeof(uint64) - sizeof(uint32)];
+  boost::atomic<uint64> tail;
+  boost::atomic<uint32> writer_waiting;
+  char padding2[64 - sizeof(uint64) - sizeof(uint32)];
+};
+
+// Precedes each frame in a ring. Records are 8 byte aligned and never wrap
+// around the end of the ring; a padding record fills the rest of the ring
+// instead.
+struct record_header {
+  uint32 size;
+  boost::atomic<uint32> state;
+};
+
+enum record_state {
+  kMore = 1,
+  kPadding = 2,
+  // Set by the reader once the frame is no longer used.
+  kReleased = 4,
+  // The record belongs to a message written in chunks, which the reader may
+  // find in part and always copies.
+  kChunked = 8,
+  // The frame goes on in the next record.
+  kContinued = 16
+};
+
+uint64 record_bytes(uint64 size) {
+  return sizeof(record_header) + ((size + 7) & ~uint64(7));
+}
+
+struct shm_message {
+  shm_message() : chunked(false), next_frame(0), next_offset(0) {}
+
+  // The identity of the connection the message came from or goes to, for
+  // bound sockets.
+  std::string peer;
+  boost::ptr_vector<zmq::message_t> frames;
+  // Whether the message is written in chunks, and how far it was written.
+  bool chunked;
+  size_t next_frame;
+  size_t next_offset;
+};
+
+std::string get_socket_name(const std::string& endpoint) {
+  std::string name(endpoint.substr(sizeof(kScheme) - 1));
+  if (name.empty() || name.size() + 10 > sizeof(sockaddr_un().sun_path)) {
+    throw std::runtime_error("Invalid shm:// endpoint: " + endpoint);
+  }
+  // An abstract socket name, which goes away with the socket.
+  return std::string(1, '\0') + "rpcz.shm." + name;
+}
+
+socklen_t make_address(const std::string& name, struct sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  memcpy(address->sun_path, name.data(), name.size());
+  return offsetof(struct sockaddr_un, sun_path) + name.size();
+}
+
+void wake(int event_fd) {
+  uint64 one = 1;
+  if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+    // The counter is saturated, so the reader is being woken up anyway.
+  }
+}
+
+// The mapped segment of a connection and its event fds. Shared with the
+// frames that are read in place, which may outlive the connection.
+class shm_segment {
+ public:
+  // The client writes the first ring and the server the second one.
+  shm_segment(char* base, int own_event_fd, int peer_event_fd, bool server)
+      : base_(base), own_event_fd_(own_event_fd),
+        peer_event_fd_(peer_event_fd), in_(server ? 0 : 1) {}
+
+  ~shm_segment() {
+    munmap(base_, kSegmentSize);
+    close(own_event_fd_);
+    close(peer_event_fd_);
+  }
+
+  ring_header* in_header() { return header(in_); }
+  char* in_data() { return data(in_); }
+  ring_header* out_header() { return header(1 - in_); }
+  char* out_data() { return data(1 - in_); }
+
+  int own_event_fd() const { return own_event_fd_; }
+
+  void wake_self() { wake(own_event_fd_); }
+  void wake_peer() { wake(peer_event_fd_); }
+
+ private:
+  ring_header* header(int ring) {
+    return reinterpret_cast<ring_header*>(base_ + ring * sizeof(ring_header));
+  }
+
+  char* data(int ring) {
+    return base_ + kRingsOffset + ring * kRingSize;
+  }
+
+  char* const base_;
+  const int own_event_fd_;
+  const int peer_event_fd_;
+  const int in_;
+  DISALLOW_COPY_AND_ASSIGN(shm_segment);
+};
+
+// The hint of a frame that is read in place.
+struct in_place_frame {
+  boost::shared_ptr<shm_segment> segment;
+  record_header* record;
+};
+
+// Called by whichever thread frees the frame.
+void release_in_place_frame(void* data, void* hint) {
+  in_place_frame* frame = static_cast<in_place_frame*>(hint);
+  frame->record->state.fetch_or(kReleased, boost::memory_order_release);
+  if (frame->segment->in_header()->writer_waiting.load()) {
+    // The writer waits for space, which our broker frees up.
+    frame->segment->wake_self();
+  }
+  delete frame;
+}
+
+void delete_string(void* data, void* hint) {
+  delete static_cast<std::string*>(hint);
+}
+
+// One connection: its Unix socket, its segment and the messages that wait
+// for space in the outgoing ring.
+class shm_connection {
+ public:
+  shm_connection(int fd, const std::string& identity)
+      : fd_(fd), identity_(identity), read_pos_(0) {}
+
+  ~shm_connection() {
+    close(fd_);
+    delete_container_pointers(out_.begin(), out_.end());
+  }
+
+  int fd() const { return fd_; }
+
+  const std::string& identity() const { return identity_; }
+
+  // The segment, or NULL while the server waits for the client to hand it
+  // over.
+  shm_segment* segment() const { return segment_.get(); }
+
+  void set_segment(shm_segment* segment) {
+    segment_.reset(segment);
+    read_pos_ = segment->in_header()->tail.load();
+  }
+
+  // Queues a message and writes what fits. Takes ownership of the message.
+  void send(shm_message* message) {
+    uint64 bytes = 0;
+    for (size_t i = 0; i < message->frames.size(); ++i) {
+      bytes += record_bytes(message->frames[i].size());
+    }
+    message->chunked = bytes > kMaxUnchunkedSize;
+    out_.push_back(message);
+    flush();
+  }
+
+  // Writes the queued messages that fit in the outgoing ring.
+  void flush() {
+    if (!segment_) {
+      return;
+    }
+    ring_header* ring = segment_->out_header();
+    uint64 old_head = ring->head.load(boost::memory_order_relaxed);
+    while (!out_.empty()) {
+      if (!write(out_.front())) {
+        // Ask the reader for a wake-up, then look again in case it freed up
+        // space in between.
+        ring->writer_waiting.store(1);
+        if (!write(out_.front())) {
+          break;
+        }
+      }
+      delete out_.front();
+      out_.pop_front();
+    }
+    if (ring->head.load(boost::memory_order_relaxed) != old_head &&
+        ring->reader_waiting.load() &&
+        ring->reader_waiting.exchange(0)) {
+      segment_->wake_peer();
+    }
+  }
+
+  // Takes the messages written to the incoming ring. Returns false if the
+  // ring is corrupt.
+  bool read(std::deque<shm_message*>* ready) {
+    if (!segment_) {
+      return true;
+    }
+    ring_header* ring = segment_->in_header();
+    char* data = segment_->in_data();
+    uint64 head = ring->head.load(boost::memory_order_acquire);
+    while (read_pos_ != head) {
+      uint64 offset = read_pos_ % kRingSize;
+      record_header* record = reinterpret_cast<record_header*>(data + offset);
+      uint32 state = record->state.load(boost::memory_order_relaxed);
+      if (state & kPadding) {
+        read_pos_ += kRingSize - offset;
+        continue;
+      }
+      if (record_bytes(record->size) > kRingSize - offset) {
+        return corrupt();
+      }
+      if (partial_.get() == NULL) {
+        partial_.reset(new shm_message);
+      }
+      char* frame_data = data + offset + sizeof(record_header);
+      if (state & kChunked) {
+        if (partial_frame_.get() == NULL) {
+          partial_frame_.reset(new std::string);
+        }
+        partial_frame_->append(frame_data, record->size);
+        record->state.fetch_or(kReleased, boost::memory_order_release);
+        if (!(state & kContinued)) {
+          std::string* frame = partial_frame_.release();
+          partial_->frames.push_back(new zmq::message_t(
+              const_cast<char*>(frame->data()), frame->size(),
+              &delete_string, frame));
+        }
+      } else if (record->size >= kInPlaceSize) {
+        in_place_frame* hint = new in_place_frame;
+        hint->segment = segment_;
+        hint->record = record;
+        partial_->frames.push_back(new zmq::message_t(
+            frame_data, record->size, &release_in_place_frame, hint));
+      } else {
+        zmq::message_t* frame = new zmq::message_t(record->size);
+        memcpy(frame->data(), frame_data, record->size);
+        partial_->frames.push_back(frame);
+        record->state.fetch_or(kReleased, boost::memory_order_release);
+      }
+      read_pos_ += record_bytes(record->size);
+      if (!(state & (kMore | kContinued))) {
+        partial_->peer = identity_;
+        ready->push_back(partial_.release());
+      }
+    }
+    advance_tail();
+    return true;
+  }
+
+  // Returns true if messages can be read, and otherwise asks the writer for
+  // a wake-up.
+  bool prepare_poll() {
+    if (!segment_) {
+      return false;
+    }
+    ring_header* ring = segment_->in_header();
+    if (ring->head.load() != read_pos_) {
+      return true;
+    }
+    ring->reader_waiting.store(1);
+    return ring->head.load() != read_pos_;
+  }
+
+  // Frees the ring space of released frames, and wakes the writer up if it
+  // waits for space.
+  void advance_tail() {
+    ring_header* ring = segment_->in_header();
+    char* data = segment_->in_data();
+    uint64 tail = ring->tail.load(boost::memory_order_relaxed);
+    uint64 old_tail = tail;
+    while (tail != read_pos_) {
+      uint64 offset = tail % kRingSize;
+      record_header* record =
+          reinterpret_cast<record_header*>(data + offset);
+      uint32 state = record->state.load(boost::memory_order_acquire);
+      if (state & kPadding) {
+        tail += kRingSize - offset;
+      } else if (state & kReleased) {
+        tail += record_bytes(record->size);
+      } else {
+        break;
+      }
+    }
+    if (tail == old_tail) {
+      return;
+    }
+    ring->tail.store(tail);
+    if (ring->writer_waiting.load() && ring->writer_waiting.exchange(0)) {
+      segment_->wake_peer();
+    }
+  }
+
+ private:
+  // Writes the message if it fits, or for chunked messages the chunks that
+  // fit. Returns true once the whole message is written. Only called by the
+  // writer.
+  bool write(shm_message* message) {
+    if (message->chunked) {
+      return write_chunks(message);
+    }
+    ring_header* ring = segment_->out_header();
+    uint64 head = ring->head.load(boost::memory_order_relaxed);
+    uint64 end = head;
+    for (size_t i = 0; i < message->frames.size(); ++i) {
+      uint64 bytes = record_bytes(message->frames[i].size());
+      uint64 offset = end % kRingSize;
+      if (offset + bytes > kRingSize) {
+        end += kRingSize - offset;
+      }
+      end += bytes;
+    }
+    if (end - ring->tail.load() > kRingSize) {
+      return false;
+    }
+    for (size_t i = 0; i < message->frames.size(); ++i) {
+      zmq::message_t& frame = message->frames[i];
+      append_record(&head, i + 1 < message->frames.size() ? kMore : 0,
+                    static_cast<char*>(frame.data()), frame.size());
+    }
+    ring->head.store(head);
+    return true;
+  }
+
+  // Writes the chunks of the message that fit, publishing each one as it is
+  // written, since the reader has to free up space for the rest.
+  bool write_chunks(shm_message* message) {
+    ring_header* ring = segment_->out_header();
+    uint64 head = ring->head.load(boost::memory_order_relaxed);
+    while (message->next_frame < message->frames.size()) {
+      zmq::message_t& frame = message->frames[message->next_frame];
+      size_t size = std::min(frame.size() - message->next_offset, kChunkSize);
+      uint64 bytes = record_bytes(size);
+      uint64 offset = head % kRingSize;
+      uint64 end = head + bytes;
+      if (offset + bytes > kRingSize) {
+        end += kRingSize - offset;
+      }
+      if (end - ring->tail.load() > kRingSize) {
+        break;
+      }
+      uint32 state = kChunked;
+      if (message->next_offset + size < frame.size()) {
+        state |= kContinued;
+      } else if (message->next_frame + 1 < message->frames.size()) {
+        state |= kMore;
+      }
+      append_record(&head, state,
+                    static_cast<char*>(frame.data()) + message->next_offset,
+                    size);
+      ring->head.store(head);
+      if (state & kContinued) {
+        message->next_offset += size;
+      } else {
+        ++message->next_frame;
+        message->next_offset = 0;
+      }
+    }
+    return message->next_frame == message->frames.size();
+  }
+
+  // Copies a frame into a record at *head, after a padding record if it
+  // would wrap around, and advances *head past it. The caller made sure it
+  // fits.
+  void append_record(uint64* head, uint32 state, const char* frame_data,
+                     size_t size) {
+    char* data = segment_->out_data();
+    uint64 bytes = record_bytes(size);
+    uint64 offset = *head % kRingSize;
+    if (offset + bytes > kRingSize) {
+      record_header* padding = reinterpret_cast<record_header*>(data + offset);
+      padding->size = kRingSize - offset - sizeof(record_header);
+      padding->state.store(kPadding, boost::memory_order_relaxed);
+      *head += kRingSize - offset;
+      offset = 0;
+    }
+    record_header* record = reinterpret_cast<record_header*>(data + offset);
+    record->size = size;
+    record->state.store(state, boost::memory_order_relaxed);
+    memcpy(data + offset + sizeof(record_header), frame_data, size);
+    *head += bytes;
+  }
+
+  bool corrupt() {
+    LOG(ERROR) << "Corrupt shm:// ring, closing the connection.";
+    return false;
+  }
+
+  const int fd_;
+  const std::string identity_;
+  boost::shared_ptr<shm_segment> segment_;
+  // The next record to read from the incoming ring.
+  uint64 read_pos_;
+  // The message being read, when its frames are still being written, and
+  // the chunks read so far of its last frame.
+  scoped_ptr<shm_message> partial_;
+  scoped_ptr<std::string> partial_frame_;
+  std::deque<shm_message*> out_;
+  DISALLOW_COPY_AND_ASSIGN(shm_connection);
+};
+
+// The connections of a bound or connected endpoint, in one epoll set.
+class shm_socket : public transport_socket {
+ public:
+  // With peer_frame, received messages start with the identity of their
+  // connection and sent messages with the identity of their recipient.
+  explicit shm_socket(bool peer_frame)
+      : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), peer_frame_(peer_frame),
+        next_frame_(0) {
+    if (epoll_fd_ < 0) {
+      throw std::runtime_error(std::string("epoll_create1: ") +
+                               strerror(errno));
+    }
+  }
+
+  virtual ~shm_socket() {
+    delete_container_pointers(ready_.begin(), ready_.end());
+    close(epoll_fd_);
+  }
+
+  virtual bool send(zmq::message_t& frame, int flags) {
+    if (outgoing_.get() == NULL) {
+      outgoing_.reset(new shm_message);
+      if (peer_frame_) {
+        outgoing_->peer = message_to_string(frame);
+        return true;
+      }
+    }
+    zmq::message_t* owned = new zmq::message_t;
+    owned->move(&frame);
+    outgoing_->frames.push_back(owned);
+    if (!(flags & ZMQ_SNDMORE)) {
+      shm_message* message = outgoing_.release();
+      shm_connection* connection = get_connection(message->peer);
+      if (connection == NULL) {
+        delete message;
+      } else {
+        connection->send(message);
+      }
+    }
+    return true;
+  }
+
+  virtual void recv(zmq::message_t* frame, bool* more) {
+    if (incoming_.get() == NULL) {
+      CHECK(!ready_.empty());
+      incoming_.reset(ready_.front());
+      ready_.pop_front();
+      next_frame_ = 0;
+      if (peer_frame_) {
+        frame->rebuild(incoming_->peer.size());
+        memcpy(frame->data(), incoming_->peer.data(), incoming_->peer.size());
+        *more = true;
+        return;
+      }
+    }
+    frame->move(&incoming_->frames[next_frame_++]);
+    *more = next_frame_ < incoming_->frames.size();
+    if (!*more) {
+      incoming_.reset();
+    }
+  }
+
+  virtual zmq::pollitem_t get_pollitem() {
+    zmq::pollitem_t pollitem = {NULL, epoll_fd_, ZMQ_POLLIN, 0};
+    return pollitem;
+  }
+
+  // Busy peers do not wake us up, so the rings are read whether or not the
+  // epoll set was readable.
+  virtual int ready_messages(bool polled) {
+    if (polled) {
+      process_events();
+    }
+    std::vector<shm_connection*> connections;
+    get_connections(&connections);
+    for (size_t i = 0; i < connections.size(); ++i) {
+      if (!connections[i]->read(&ready_)) {
+        remove_connection(connections[i]);
+      }
+    }
+    return ready_.size();
+  }
+
+  virtual bool prepare_poll() {
+    if (!ready_.empty()) {
+      return true;
+    }
+    std::vector<shm_connection*> connections;
+    get_connections(&connections);
+    bool ready = false;
+    for (size_t i = 0; i < connections.size(); ++i) {
+      ready |= connections[i]->prepare_poll();
+    }
+    return ready;
+  }
+
+ protected:
+  // Returns the connection to send a message for the given peer to, or NULL
+  // if there is none.
+  virtual shm_connection* get_connection(const std::string& peer) = 0;
+
+  virtual void get_connections(std::vector<shm_connection*>* connections) = 0;
+
+  // Closes and deletes the connection.
+  virtual void remove_connection(shm_connection* connection) = 0;
+
+  // Called for events on the epoll set without a connection.
+  virtual void handle_accept() {}
+
+  // Called when the socket of a connection becomes readable. Returns false
+  // if the connection should be closed.
+  virtual bool handle_socket(shm_connection* connection) {
+    char buffer[16];
+    ssize_t n = ::recv(connection->fd(), buffer, sizeof(buffer),
+                       MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR));
+  }
+
+  void add_to_epoll(int fd, void* data) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = data;
+    CHECK_EQ(0, epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event));
+  }
+
+  // Removes the connection's fds from the epoll set. Its event fd may stay
+  // open for frames that are still read in place.
+  void remove_from_epoll(shm_connection* connection) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd(), NULL);
+    if (connection->segment()) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL,
+                connection->segment()->own_event_fd(), NULL);
+    }
+  }
+
+  std::deque<shm_message*> ready_;
+
+ private:
+  void process_events() {
+    struct epoll_event events[kMaxEvents];
+    int count = epoll_wait(epoll_fd_, events, kMaxEvents, 0);
+    // A connection has two fds in the set, so it is handled once per batch.
+    std::set<shm_connection*> connections;
+    for (int i = 0; i < count; ++i) {
+      shm_connection* connection =
+          static_cast<shm_connection*>(events[i].data.ptr);
+      if (connection == NULL) {
+        handle_accept();
+      } else {
+        connections.insert(connection);
+      }
+    }
+    for (std::set<shm_connection*>::const_iterator it = connections.begin();
+         it != connections.end(); ++it) {
+      shm_connection* connection = *it;
+      if (!handle_socket(connection)) {
+        remove_connection(connection);
+        continue;
+      }
+      if (connection->segment()) {
+        uint64 counter;
+        if (::read(connection->segment()->own_event_fd(), &counter,
+                 sizeof(counter)) < 0) {
+          // Not signaled.
+        }
+        connection->advance_tail();
+        connection->flush();
+      }
+    }
+  }
+
+  const int epoll_fd_;
+  const bool peer_frame_;
+  scoped_ptr<shm_message> outgoing_;
+  scoped_ptr<shm_message> incoming_;
+  size_t next_frame_;
+  DISALLOW_COPY_AND_ASSIGN(shm_socket);
+};
+
+class shm_client_socket : public shm_socket {
+ public:
+  explicit shm_client_socket(const std::string& endpoint)
+      : shm_socket(false), name_(get_socket_name(endpoint)) {
+    connect();
+  }
+
+ protected:
+  virtual shm_connection* get_connection(const std::string& peer) {
+    if (connection_.get() == NULL) {
+      connect();
+    }
+    return connection_.get();
+  }
+
+  virtual void get_connections(std::vector<shm_connection*>* connections) {
+    if (connection_.get()) {
+      connections->push_back(connection_.get());
+    }
+  }
+
+  virtual void remove_connection(shm_connection* connection) {
+    remove_from_epoll(connection);
+    connection_.reset();
+  }
+
+ private:
+  // Connects to the server and hands it a new segment. Returns quietly if
+  // the name is not bound.
+  void connect() {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_GE(fd, 0);
+    struct sockaddr_un address;
+    socklen_t size = make_address(name_, &address);
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&address), size)
+        != 0) {
+      close(fd);
+      return;
+    }
+    int fds[kHandshakeFds] = {
+      memfd_create("rpcz.shm", MFD_CLOEXEC),
+      eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+      eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)};
+    char* base = NULL;
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 &&
+        ftruncate(fds[0], kSegmentSize) == 0) {
+      void* mapped = mmap(NULL, kSegmentSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fds[0], 0);
+      if (mapped != MAP_FAILED) {
+        base = static_cast<char*>(mapped);
+      }
+    }
+    if (base == NULL || !send_fds(fd, fds)) {
+      LOG(ERROR) << "Could not set up a shm:// connection: "
+                 << strerror(errno);
+      if (base) {
+        munmap(base, kSegmentSize);
+      }
+      for (int i = 0; i < kHandshakeFds; ++i) {
+        if (fds[i] >= 0) {
+          close(fds[i]);
+        }
+      }
+      close(fd);
+      return;
+    }
+    close(fds[0]);
+    connection_.reset(new shm_connection(fd, ""));
+    connection_->set_segment(new shm_segment(base, fds[1], fds[2], false));
+    add_to_epoll(fd, connection_.get());
+    add_to_epoll(fds[1], connection_.get());
+  }
+
+  static bool send_fds(int fd, int* fds) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * kHandshakeFds)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * kHandshakeFds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * kHandshakeFds);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1;
+  }
+
+  const std::string name_;
+  scoped_ptr<shm_connection> connection_;
+};
+
+class shm_server_socket : public shm_socket {
+ public:
+  explicit shm_server_socket(const std::string& endpoint)
+      : shm_socket(true), listen_fd_(socket(AF_UNIX, SOCK_STREAM |
+                                            SOCK_NONBLOCK | SOCK_CLOEXEC, 0)),
+        next_id_(0) {
+    CHECK_GE(listen_fd_, 0);
+    struct sockaddr_un address;
+    socklen_t size = make_address(get_socket_name(endpoint), &address);
+    if (::bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&address), size)
+        != 0 || listen(listen_fd_, SOMAXCONN) != 0) {
+      std::string error(strerror(errno));
+      close(listen_fd_);
+      throw std::runtime_error("Could not bind " + endpoint + ": " + error);
+    }
+    add_to_epoll(listen_fd_, NULL);
+  }
+
+  ~shm_server_socket() {
+    delete_container_second_pointer(connections_.begin(),
+                                    connections_.end());
+    close(listen_fd_);
+  }
+
+ protected:
+  virtual shm_connection* get_connection(const std::string& peer) {
+    connection_map::const_iterator it = connections_.find(peer);
+    return it == connections_.end() ? NULL : it->second;
+  }
+
+  virtual void get_connections(std::vector<shm_connection*>* connections) {
+    for (connection_map::const_iterator it = connections_.begin();
+         it != connections_.end(); ++it) {
+      connections->push_back(it->second);
+    }
+  }
+
+  virtual void remove_connection(shm_connection* connection) {
+    remove_from_epoll(connection);
+    connections_.erase(connection->identity());
+    delete connection;
+  }
+
+  virtual void handle_accept() {
+    for (;;) {
+      int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      // Like ZeroMQ's generated identities: a zero byte and a counter.
+      uint32 id = next_id_++;
+      std::string identity(1, '\0');
+      identity.append(reinterpret_cast<const char*>(&id), sizeof(id));
+      shm_connection* connection = new shm_connection(fd, identity);
+      connections_[identity] = connection;
+      add_to_epoll(fd, connection);
+    }
+  }
+
+  // Takes over the segment the client hands over first.
+  virtual bool handle_socket(shm_connection* connection) {
+    if (connection->segment()) {
+      return shm_socket::handle_socket(connection);
+    }
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * kHandshakeFds)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(connection->fd(), &msg,
+                        MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EINTR;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n == 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * kHandshakeFds)) {
+      return false;
+    }
+    int fds[kHandshakeFds];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    struct stat info;
+    void* mapped = MAP_FAILED;
+    if (fstat(fds[0], &info) == 0 && uint64(info.st_size) == kSegmentSize) {
+      mapped = mmap(NULL, kSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fds[0], 0);
+    }
+    close(fds[0]);
+    if (mapped == MAP_FAILED) {
+      close(fds[1]);
+      close(fds[2]);
+      return false;
+    }
+    connection->set_segment(
+        new shm_segment(static_cast<char*>(mapped), fds[2], fds[1], true));
+    add_to_epoll(fds[2], connection);
+    return true;
+  }
+
+ private:
+  typedef std::map<std::string, shm_connection*> connection_map;
+
+  const int listen_fd_;
+  uint32 next_id_;
+  connection_map connections_;
+};
+}  // unnamed namespace
+
+transport_socket* shm_transport::connect(const std::string& endpoint) {
+  return new shm_client_socket(endpoint);
+}
+
+transport_socket* shm_transport::bind(const std::string& endpoint) {
+  return new shm_server_socket(endpoint);
+}
+#endif
+}  // namespace rpcz
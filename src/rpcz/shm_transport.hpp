@@ -0,0 +1,54 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_SHM_TRANSPORT_H
+#define RPCZ_SHM_TRANSPORT_H
+
+#include <string>
+#include "rpcz/macros.hpp"
+#include "rpcz/transport.hpp"
+
+namespace rpcz {
+
+// The transport of shm://<name> endpoints, for clients and servers on the
+// same host. Each connection shares a memfd segment holding two
+// single-producer single-consumer rings, one per direction. Frames are
+// copied into the ring once by the sender; frames of 16KB and more are then
+// read in place, and their ring space is reused once the receiver frees
+// them. A broker that sleeps is woken up through an eventfd, which is only
+// written when the peer announced that it sleeps.
+//
+// Servers listen on an abstract Unix socket named after the endpoint, which
+// clients use to hand over the segment and to find out that the peer went
+// away. Messages sent while a client is not connected are dropped, and the
+// client connects again on the next message. Messages larger than half a
+// ring (8MB) are written a chunk at a time as the receiver frees up space,
+// and copied out of the ring. Only available on Linux.
+class shm_transport : public transport {
+ public:
+  shm_transport() {}
+
+  // Returns true for shm:// endpoints.
+  static bool handles(const std::string& endpoint);
+
+  virtual transport_socket* connect(const std::string& endpoint);
+
+  // Throws std::runtime_error if the name is already bound.
+  virtual transport_socket* bind(const std::string& endpoint);
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(shm_transport);
+};
+}  // namespace rpcz
+#endif
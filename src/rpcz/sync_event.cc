@@ -28,6 +28,18 @@ void sync_event::wait() {
   }
 }
 
+bool sync_event::wait_for(int64 timeout_ms) {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  boost::system_time deadline =
+      boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+  while (!ready_) {
+    if (!cond_.timed_wait(lock, deadline)) {
+      return ready_;
+    }
+  }
+  return true;
+}
+
 void sync_event::signal() {
   boost::unique_lock<boost::mutex> lock(mu_);
   ready_ = true;
@@ -0,0 +1,677 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/tcp_transport.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include <boost/ptr_container/ptr_vector.hpp>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "rpcz/logging.hpp"
+
+namespace rpcz {
+namespace {
+const char kScheme[] = "ntcp://";
+}  // unnamed namespace
+
+bool tcp_transport::handles(const std::string& endpoint) {
+  return endpoint.compare(0, sizeof(kScheme) - 1, kScheme) == 0;
+}
+
+#ifndef __linux__
+transport_socket* tcp_transport::connect(const std::string& endpoint) {
+  throw std::runtime_error("ntcp:// endpoints are only supported on Linux.");
+}
+
+transport_socket* tcp_transport::bind(const std::string& endpoint) {
+  throw std::runtime_error("ntcp:// endpoints are only supported on Linux.");
+}
+#else
+namespace {
+// Size of each connection's read buffer.
+const size_t kReadBufferSize = 64 * 1024;
+// Frames at least this large are read directly into their message instead of
+// being copied out of the read buffer.
+const size_t kDirectReadSize = 16 * 1024;
+// Messages with more frames, or with larger frames, are taken as a corrupt
+// stream. Larger frames are not sent.
+const uint32 kMaxFrames = 1024;
+const uint32 kMaxFrameSize = 256 << 20;
+// Largest number of buffers passed to one write.
+const int kMaxIovecs = 64;
+// Events handled per epoll_wait().
+const int kMaxEvents = 64;
+
+struct tcp_message {
+  // The identity of the connection the message came from or goes to, for
+  // bound sockets.
+  std::string peer;
+  boost::ptr_vector<zmq::message_t> frames;
+};
+
+// Splits host:port. Brackets around IPv6 addresses are removed and a host of
+// * means any address.
+void parse_endpoint(const std::string& endpoint, std::string* host,
+                    std::string* port) {
+  std::string address(endpoint.substr(sizeof(kScheme) - 1));
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos || colon == 0 ||
+      colon == address.size() - 1) {
+    throw std::runtime_error("Expected ntcp://<host>:<port>: " + endpoint);
+  }
+  *host = address.substr(0, colon);
+  *port = address.substr(colon + 1);
+  if (host->size() > 2 && (*host)[0] == '[' &&
+      (*host)[host->size() - 1] == ']') {
+    *host = host->substr(1, host->size() - 2);
+  }
+  if (*host == "*") {
+    host->clear();
+  }
+}
+
+struct addrinfo* resolve(const std::string& endpoint, bool passive) {
+  std::string host;
+  std::string port;
+  parse_endpoint(endpoint, &host, &port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  struct addrinfo* result = NULL;
+  int rc = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                       &hints, &result);
+  if (rc != 0) {
+    throw std::runtime_error("Could not resolve " + endpoint + ": " +
+                             gai_strerror(rc));
+  }
+  return result;
+}
+
+void set_no_delay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// One TCP connection: the messages waiting to be written and the state of
+// the message being read.
+class tcp_connection {
+ public:
+  tcp_connection(int fd, const std::string& identity)
+      : fd_(fd), identity_(identity), connecting_(false),
+        watching_output_(false), out_offset_(0), buffer_(kReadBufferSize),
+        begin_(0), end_(0), next_frame_(0), direct_(NULL),
+        direct_offset_(0) {}
+
+  ~tcp_connection() {
+    close(fd_);
+    for (size_t i = 0; i < out_.size(); ++i) {
+      delete out_[i].message;
+    }
+  }
+
+  int fd() const { return fd_; }
+
+  const std::string& identity() const { return identity_; }
+
+  // A non-blocking connect() is in progress.
+  bool connecting() const { return connecting_; }
+  void set_connecting(bool connecting) { connecting_ = connecting; }
+
+  bool has_output() const { return !out_.empty(); }
+
+  // Whether the epoll set reports the connection as writable.
+  bool watching_output() const { return watching_output_; }
+  void set_watching_output(bool watching) { watching_output_ = watching; }
+
+  // Queues a message for writing. Takes ownership of the message.
+  void queue(tcp_message* message) {
+    outgoing out;
+    out.message = message;
+    out.header.push_back(htonl(message->frames.size()));
+    out.bytes = 0;
+    for (size_t i = 0; i < message->frames.size(); ++i) {
+      out.header.push_back(htonl(message->frames[i].size()));
+      out.bytes += message->frames[i].size();
+    }
+    out.bytes += out.header.size() * sizeof(uint32);
+    out_.push_back(out);
+  }
+
+  // Writes as much of the queued messages as the socket takes. Returns false
+  // if the connection broke.
+  bool flush() {
+    while (!out_.empty()) {
+      struct iovec iov[kMaxIovecs];
+      int count = 0;
+      size_t requested = 0;
+      size_t skip = out_offset_;
+      for (size_t m = 0; m < out_.size() && count < kMaxIovecs; ++m) {
+        outgoing& out = out_[m];
+        add_iovec(&out.header[0], out.header.size() * sizeof(uint32),
+                  iov, &count, &requested, &skip);
+        for (size_t i = 0; i < out.message->frames.size() &&
+             count < kMaxIovecs; ++i) {
+          add_iovec(out.message->frames[i].data(),
+                    out.message->frames[i].size(),
+                    iov, &count, &requested, &skip);
+        }
+      }
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t written = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      if (written < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      }
+      out_offset_ += written;
+      while (!out_.empty() && out_offset_ >= out_.front().bytes) {
+        out_offset_ -= out_.front().bytes;
+        delete out_.front().message;
+        out_.pop_front();
+      }
+      if (size_t(written) < requested) {
+        return true;
+      }
+    }
+    return true;
+  }
+
+  // Reads what is available and appends the completed messages to ready.
+  // Returns false if the connection was closed or broke.
+  bool read(std::deque<tcp_message*>* ready) {
+    if (begin_ > 0) {
+      memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    struct iovec iov[2];
+    int count = 0;
+    if (direct_) {
+      iov[count].iov_base = static_cast<char*>(direct_->data()) +
+          direct_offset_;
+      iov[count].iov_len = direct_->size() - direct_offset_;
+      ++count;
+    }
+    iov[count].iov_base = &buffer_[end_];
+    iov[count].iov_len = buffer_.size() - end_;
+    ++count;
+    ssize_t n = readv(fd_, iov, count);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    size_t received = n;
+    if (direct_) {
+      size_t direct = std::min(received, direct_->size() - direct_offset_);
+      direct_offset_ += direct;
+      received -= direct;
+      if (direct_offset_ < direct_->size()) {
+        return true;
+      }
+      direct_ = NULL;
+      ++next_frame_;
+    }
+    end_ += received;
+    return parse(ready);
+  }
+
+ private:
+  struct outgoing {
+    // The frame count and the frame sizes.
+    std::vector<uint32> header;
+    tcp_message* message;
+    size_t bytes;
+  };
+
+  static void add_iovec(void* data, size_t size, struct iovec* iov,
+                        int* count, size_t* requested, size_t* skip) {
+    if (*skip >= size) {
+      *skip -= size;
+      return;
+    }
+    iov[*count].iov_base = static_cast<char*>(data) + *skip;
+    iov[*count].iov_len = size - *skip;
+    *requested += size - *skip;
+    *skip = 0;
+    ++*count;
+  }
+
+  // Takes complete messages out of the read buffer. Returns false if the
+  // stream is corrupt.
+  bool parse(std::deque<tcp_message*>* ready) {
+    for (;;) {
+      if (partial_.get() == NULL) {
+        uint32 frames;
+        if (end_ - begin_ < sizeof(frames)) {
+          return true;
+        }
+        memcpy(&frames, &buffer_[begin_], sizeof(frames));
+        frames = ntohl(frames);
+        if (frames == 0 || frames > kMaxFrames) {
+          LOG(ERROR) << "Corrupt ntcp stream, closing the connection.";
+          return false;
+        }
+        size_t header_size = (frames + 1) * sizeof(uint32);
+        if (end_ - begin_ < header_size) {
+          return true;
+        }
+        sizes_.resize(frames);
+        memcpy(&sizes_[0], &buffer_[begin_ + sizeof(frames)],
+               frames * sizeof(uint32));
+        for (size_t i = 0; i < sizes_.size(); ++i) {
+          sizes_[i] = ntohl(sizes_[i]);
+          if (sizes_[i] > kMaxFrameSize) {
+            LOG(ERROR) << "Corrupt ntcp stream or frame of " << sizes_[i]
+                       << " bytes, closing the connection.";
+            return false;
+          }
+        }
+        begin_ += header_size;
+        partial_.reset(new tcp_message);
+        next_frame_ = 0;
+      }
+      while (next_frame_ < sizes_.size()) {
+        size_t size = sizes_[next_frame_];
+        size_t available = end_ - begin_;
+        if (available < size && size < kDirectReadSize) {
+          return true;
+        }
+        zmq::message_t* frame = new zmq::message_t(size);
+        partial_->frames.push_back(frame);
+        if (available < size) {
+          // Copy what we have, the rest is read directly into the frame.
+          memcpy(frame->data(), &buffer_[begin_], available);
+          begin_ = end_;
+          direct_ = frame;
+          direct_offset_ = available;
+          return true;
+        }
+        memcpy(frame->data(), &buffer_[begin_], size);
+        begin_ += size;
+        ++next_frame_;
+      }
+      ready->push_back(partial_.release());
+    }
+  }
+
+  const int fd_;
+  const std::string identity_;
+  bool connecting_;
+  bool watching_output_;
+  std::deque<outgoing> out_;
+  // Bytes of out_.front() that were written already.
+  size_t out_offset_;
+  std::vector<char> buffer_;
+  size_t begin_;
+  size_t end_;
+  // The message being read, its frame sizes and the next frame to read.
+  scoped_ptr<tcp_message> partial_;
+  std::vector<uint32> sizes_;
+  size_t next_frame_;
+  // A large frame of partial_ that is being read directly.
+  zmq::message_t* direct_;
+  size_t direct_offset_;
+  DISALLOW_COPY_AND_ASSIGN(tcp_connection);
+};
+
+// The connections of a bound or connected endpoint, in one epoll set.
+class tcp_socket : public transport_socket {
+ public:
+  // With peer_frame, received messages start with the identity of their
+  // connection and sent messages with the identity of their recipient.
+  explicit tcp_socket(bool peer_frame)
+      : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), peer_frame_(peer_frame),
+        outgoing_too_large_(false), next_frame_(0) {
+    if (epoll_fd_ < 0) {
+      throw std::runtime_error(std::string("epoll_create1: ") +
+                               strerror(errno));
+    }
+  }
+
+  virtual ~tcp_socket() {
+    delete_container_pointers(ready_.begin(), ready_.end());
+    close(epoll_fd_);
+  }
+
+  virtual bool send(zmq::message_t& frame, int flags) {
+    if (outgoing_.get() == NULL) {
+      outgoing_.reset(new tcp_message);
+      outgoing_too_large_ = false;
+      if (peer_frame_) {
+        outgoing_->peer = message_to_string(frame);
+        return true;
+      }
+    }
+    if (frame.size() > kMaxFrameSize) {
+      outgoing_too_large_ = true;
+    }
+    zmq::message_t* owned = new zmq::message_t;
+    owned->move(&frame);
+    outgoing_->frames.push_back(owned);
+    if (!(flags & ZMQ_SNDMORE)) {
+      tcp_message* message = outgoing_.release();
+      if (outgoing_too_large_) {
+        LOG(ERROR) << "Dropping an ntcp message with a frame larger than "
+                   << kMaxFrameSize << " bytes.";
+        delete message;
+        return true;
+      }
+      tcp_connection* connection = get_connection(message->peer);
+      if (connection == NULL) {
+        delete message;
+        return true;
+      }
+      connection->queue(message);
+      if (!connection->connecting() && !connection->flush()) {
+        remove_connection(connection);
+        return true;
+      }
+      watch_output(connection);
+    }
+    return true;
+  }
+
+  virtual void recv(zmq::message_t* frame, bool* more) {
+    if (incoming_.get() == NULL) {
+      CHECK(!ready_.empty());
+      incoming_.reset(ready_.front());
+      ready_.pop_front();
+      next_frame_ = 0;
+      if (peer_frame_) {
+        frame->rebuild(incoming_->peer.size());
+        memcpy(frame->data(), incoming_->peer.data(), incoming_->peer.size());
+        *more = true;
+        return;
+      }
+    }
+    frame->move(&incoming_->frames[next_frame_++]);
+    *more = next_frame_ < incoming_->frames.size();
+    if (!*more) {
+      incoming_.reset();
+    }
+  }
+
+  virtual zmq::pollitem_t get_pollitem() {
+    zmq::pollitem_t pollitem = {NULL, epoll_fd_, ZMQ_POLLIN, 0};
+    return pollitem;
+  }
+
+  virtual int ready_messages(bool polled) {
+    if (polled) {
+      process_events();
+    }
+    return ready_.size();
+  }
+
+  virtual bool prepare_poll() {
+    return !ready_.empty();
+  }
+
+ protected:
+  // Returns the connection to send a message for the given peer to, or NULL
+  // if there is none.
+  virtual tcp_connection* get_connection(const std::string& peer) = 0;
+
+  // Closes and deletes the connection.
+  virtual void remove_connection(tcp_connection* connection) = 0;
+
+  // Called for events on the epoll set without a connection.
+  virtual void handle_accept() {}
+
+  // Called when a connecting connection becomes writable.
+  virtual bool finish_connect(tcp_connection* connection) { return true; }
+
+  void add_to_epoll(int fd, void* data) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = data;
+    CHECK_EQ(0, epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event));
+  }
+
+  // Asks for writability events while the connection has output, or while
+  // it connects.
+  void watch_output(tcp_connection* connection) {
+    bool watch = connection->has_output() || connection->connecting();
+    if (watch == connection->watching_output()) {
+      return;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = watch ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = connection;
+    CHECK_EQ(0, epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection->fd(),
+                          &event));
+    connection->set_watching_output(watch);
+  }
+
+  std::deque<tcp_message*> ready_;
+
+ private:
+  void process_events() {
+    struct epoll_event events[kMaxEvents];
+    int count = epoll_wait(epoll_fd_, events, kMaxEvents, 0);
+    for (int i = 0; i < count; ++i) {
+      tcp_connection* connection =
+          static_cast<tcp_connection*>(events[i].data.ptr);
+      if (connection == NULL) {
+        handle_accept();
+        continue;
+      }
+      size_t first_ready = ready_.size();
+      bool ok = true;
+      if (events[i].events & EPOLLOUT) {
+        if (connection->connecting()) {
+          ok = finish_connect(connection);
+        }
+        if (ok && !connection->connecting()) {
+          ok = connection->flush();
+        }
+      }
+      if (ok && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        ok = connection->read(&ready_);
+      }
+      if (!ok) {
+        remove_connection(connection);
+        continue;
+      }
+      if (peer_frame_) {
+        for (size_t m = first_ready; m < ready_.size(); ++m) {
+          ready_[m]->peer = connection->identity();
+        }
+      }
+      watch_output(connection);
+    }
+  }
+
+  const int epoll_fd_;
+  const bool peer_frame_;
+  scoped_ptr<tcp_message> outgoing_;
+  // Whether a frame of outgoing_ is larger than kMaxFrameSize.
+  bool outgoing_too_large_;
+  scoped_ptr<tcp_message> incoming_;
+  size_t next_frame_;
+  DISALLOW_COPY_AND_ASSIGN(tcp_socket);
+};
+
+class tcp_client_socket : public tcp_socket {
+ public:
+  explicit tcp_client_socket(const std::string& endpoint)
+      : tcp_socket(false), addresses_(resolve(endpoint, false)) {
+    connect();
+  }
+
+  ~tcp_client_socket() {
+    freeaddrinfo(addresses_);
+  }
+
+ protected:
+  virtual tcp_connection* get_connection(const std::string& peer) {
+    if (connection_.get() == NULL) {
+      connect();
+    }
+    return connection_.get();
+  }
+
+  virtual void remove_connection(tcp_connection* connection) {
+    connection_.reset();
+  }
+
+  virtual bool finish_connect(tcp_connection* connection) {
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(connection->fd(), SOL_SOCKET, SO_ERROR, &error, &size);
+    if (error != 0) {
+      return false;
+    }
+    connection->set_connecting(false);
+    return true;
+  }
+
+ private:
+  // Starts connecting to the first address that accepts a socket.
+  void connect() {
+    for (struct addrinfo* address = addresses_; address;
+         address = address->ai_next) {
+      int fd = socket(address->ai_family,
+                      address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      address->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      set_no_delay(fd);
+      int rc = ::connect(fd, address->ai_addr, address->ai_addrlen);
+      if (rc != 0 && errno != EINPROGRESS) {
+        close(fd);
+        continue;
+      }
+      connection_.reset(new tcp_connection(fd, ""));
+      connection_->set_connecting(rc != 0);
+      add_to_epoll(fd, connection_.get());
+      watch_output(connection_.get());
+      return;
+    }
+  }
+
+  struct addrinfo* addresses_;
+  scoped_ptr<tcp_connection> connection_;
+};
+
+class tcp_server_socket : public tcp_socket {
+ public:
+  explicit tcp_server_socket(const std::string& endpoint)
+      : tcp_socket(true), listen_fd_(-1), next_id_(0) {
+    struct addrinfo* addresses = resolve(endpoint, true);
+    std::string error;
+    for (struct addrinfo* address = addresses; address;
+         address = address->ai_next) {
+      int fd = socket(address->ai_family,
+                      address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      address->ai_protocol);
+      if (fd < 0) {
+        error = strerror(errno);
+        continue;
+      }
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (::bind(fd, address->ai_addr, address->ai_addrlen) != 0 ||
+          listen(fd, SOMAXCONN) != 0) {
+        error = strerror(errno);
+        close(fd);
+        continue;
+      }
+      listen_fd_ = fd;
+      break;
+    }
+    freeaddrinfo(addresses);
+    if (listen_fd_ < 0) {
+      throw std::runtime_error("Could not bind " + endpoint + ": " + error);
+    }
+    add_to_epoll(listen_fd_, NULL);
+  }
+
+  ~tcp_server_socket() {
+    delete_container_second_pointer(connections_.begin(),
+                                    connections_.end());
+    close(listen_fd_);
+  }
+
+ protected:
+  virtual tcp_connection* get_connection(const std::string& peer) {
+    connection_map::const_iterator it = connections_.find(peer);
+    return it == connections_.end() ? NULL : it->second;
+  }
+
+  virtual void remove_connection(tcp_connection* connection) {
+    connections_.erase(connection->identity());
+    delete connection;
+  }
+
+  virtual void handle_accept() {
+    for (;;) {
+      int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      set_no_delay(fd);
+      // Like ZeroMQ's generated identities: a zero byte and a counter.
+      uint32 id = next_id_++;
+      std::string identity(1, '\0');
+      identity.append(reinterpret_cast<const char*>(&id), sizeof(id));
+      tcp_connection* connection = new tcp_connection(fd, identity);
+      connections_[identity] = connection;
+      add_to_epoll(fd, connection);
+    }
+  }
+
+ private:
+  typedef std::map<std::string, tcp_connection*> connection_map;
+
+  int listen_fd_;
+  uint32 next_id_;
+  connection_map connections_;
+};
+}  // unnamed namespace
+
+transport_socket* tcp_transport::connect(const std::string& endpoint) {
+  return new tcp_client_socket(endpoint);
+}
+
+transport_socket* tcp_transport::bind(const std::string& endpoint) {
+  return new tcp_server_socket(endpoint);
+}
+#endif
+}  // namespace rpcz
@@ -0,0 +1,53 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_TCP_TRANSPORT_H
+#define RPCZ_TCP_TRANSPORT_H
+
+#include <string>
+#include "rpcz/macros.hpp"
+#include "rpcz/transport.hpp"
+
+namespace rpcz {
+
+// The transport of ntcp://<host>:<port> endpoints: TCP connections that the
+// broker reads and writes itself, without ZeroMQ's I/O threads and pipes.
+// Each message is sent as its frame count, the frame sizes and the frames,
+// gathered into one vectored write. The count and sizes are 32-bit integers
+// in network byte order. Frames are limited to 256 MB: larger ones are not
+// sent, and a peer that announces one is disconnected. Incoming bytes are
+// read into a reused buffer; large frames are read directly into their
+// message. The broker polls one epoll set per bound or connected endpoint.
+//
+// Both ends must use ntcp://, which does not speak ZeroMQ's protocol.
+// Messages sent while a client is not connected are dropped, and the
+// client connects again on the next message. Only available on Linux.
+class tcp_transport : public transport {
+ public:
+  tcp_transport() {}
+
+  // Returns true for ntcp:// endpoints.
+  static bool handles(const std::string& endpoint);
+
+  // Throws std::runtime_error if the address can not be resolved.
+  virtual transport_socket* connect(const std::string& endpoint);
+
+  // Throws std::runtime_error if the address can not be bound.
+  virtual transport_socket* bind(const std::string& endpoint);
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(tcp_transport);
+};
+}  // namespace rpcz
+#endif
@@ -0,0 +1,33 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/trace.hpp"
+
+#ifdef RPCZ_ENABLE_TRACING
+// Probe semaphores. Tracers increment them while attached to the matching
+// probe; sys/sdt.h records their addresses in the probe notes and expects
+// them in the .probes section. They keep the C linkage of their declarations
+// in trace.hpp.
+#define RPCZ_DEFINE_TRACE_SEMAPHORE(probe) \
+  __attribute__((section(".probes"))) \
+  volatile unsigned short rpcz_##probe##_semaphore = 0
+
+RPCZ_DEFINE_TRACE_SEMAPHORE(request_enqueued);
+RPCZ_DEFINE_TRACE_SEMAPHORE(reply_received);
+RPCZ_DEFINE_TRACE_SEMAPHORE(timeout_fired);
+RPCZ_DEFINE_TRACE_SEMAPHORE(broker_forward);
+RPCZ_DEFINE_TRACE_SEMAPHORE(worker_dispatch);
+RPCZ_DEFINE_TRACE_SEMAPHORE(handler_start);
+RPCZ_DEFINE_TRACE_SEMAPHORE(handler_end);
+#endif  // RPCZ_ENABLE_TRACING
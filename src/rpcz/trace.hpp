@@ -0,0 +1,86 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_TRACE_H
+#define RPCZ_TRACE_H
+
+// Static tracepoints (USDT probes) on the request path. They are compiled in
+// only when building with -Drpcz_enable_tracing=ON, and then show up under
+// the "rpcz" provider to perf, bpftrace and systemtap:
+//
+//   bpftrace -e 'usdt:/usr/lib/librpcz.so:rpcz:handler_start
+//                { printf("%s.%s\n", str(arg1), str(arg2)); }'
+//
+// Every probe takes (uint64 event_id, const char* service,
+// const char* method). The event id is the one the client broker puts on the
+// wire, so client and server probes of the same request can be joined.
+//
+//   request_enqueued - the client broker sent a request to its connection.
+//   reply_received   - the client broker received the reply to a request.
+//   timeout_fired    - a client request's deadline expired.
+//   broker_forward   - the server broker handed a request to a worker.
+//   worker_dispatch  - a worker parsed the header of a request.
+//   handler_start    - the service is about to handle the request.
+//   handler_end      - the service returned (it may still reply later).
+//
+// A probe with no tracer attached costs a single nop. Work that is done only
+// to compute probe arguments must be guarded by RPCZ_TRACE_ENABLED(probe),
+// which is true only while a tracer is attached to that probe.
+
+#include <string.h>
+#include "rpcz/macros.hpp"
+
+#ifdef RPCZ_ENABLE_TRACING
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define RPCZ_DECLARE_TRACE_SEMAPHORE(probe) \
+  extern "C" volatile unsigned short rpcz_##probe##_semaphore
+
+RPCZ_DECLARE_TRACE_SEMAPHORE(request_enqueued);
+RPCZ_DECLARE_TRACE_SEMAPHORE(reply_received);
+RPCZ_DECLARE_TRACE_SEMAPHORE(timeout_fired);
+RPCZ_DECLARE_TRACE_SEMAPHORE(broker_forward);
+RPCZ_DECLARE_TRACE_SEMAPHORE(worker_dispatch);
+RPCZ_DECLARE_TRACE_SEMAPHORE(handler_start);
+RPCZ_DECLARE_TRACE_SEMAPHORE(handler_end);
+
+#define RPCZ_TRACE_ENABLED(probe) \
+  __builtin_expect(rpcz_##probe##_semaphore != 0, 0)
+
+#define RPCZ_TRACE(probe, event_id, service, method) \
+  DTRACE_PROBE3(rpcz, probe, event_id, service, method)
+
+#else
+
+#define RPCZ_TRACE_ENABLED(probe) false
+
+// Arguments are not evaluated when tracing is compiled out.
+#define RPCZ_TRACE(probe, event_id, service, method) do {} while (0)
+
+#endif  // RPCZ_ENABLE_TRACING
+
+namespace rpcz {
+// Decodes an event id frame as sent by the client broker. Returns 0 if the
+// frame does not hold an event id.
+inline uint64 trace_event_id(const void* data, size_t size) {
+  uint64 event_id = 0;
+  if (size == sizeof(event_id)) {
+    memcpy(&event_id, data, sizeof(event_id));
+  }
+  return event_id;
+}
+}  // namespace rpcz
+#endif
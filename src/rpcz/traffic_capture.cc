@@ -0,0 +1,198 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/traffic_capture.hpp"
+
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "rpcz/logging.hpp"
+
+namespace rpcz {
+namespace {
+uint64 round_up_to_8(uint64 n) {
+  return (n + 7) & ~uint64(7);
+}
+}  // unnamed namespace
+
+#ifdef WIN32
+traffic_capture::traffic_capture(const std::string& filename,
+                                 uint64 max_bytes, uint32 max_payload_bytes)
+    : fd_(-1), data_(NULL), max_bytes_(max_bytes),
+      max_payload_bytes_(max_payload_bytes), used_bytes_(0), dropped_(0) {
+  throw std::runtime_error("Traffic capture is not supported on Windows.");
+}
+
+traffic_capture::~traffic_capture() {
+}
+#else
+traffic_capture::traffic_capture(const std::string& filename,
+                                 uint64 max_bytes, uint32 max_payload_bytes)
+    : fd_(open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)),
+      data_(NULL), max_bytes_(max_bytes),
+      max_payload_bytes_(max_payload_bytes),
+      used_bytes_(sizeof(traffic_capture_file_header)), dropped_(0) {
+  if (fd_ < 0) {
+    throw std::runtime_error("Could not open traffic capture: " + filename);
+  }
+  if (max_bytes_ < sizeof(traffic_capture_file_header) ||
+      ftruncate(fd_, max_bytes_) != 0) {
+    close(fd_);
+    throw std::runtime_error("Could not size traffic capture: " + filename);
+  }
+  void* data = mmap(NULL, max_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd_, 0);
+  if (data == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("Could not map traffic capture: " + filename);
+  }
+  data_ = static_cast<char*>(data);
+  traffic_capture_file_header header;
+  memcpy(header.magic, kTrafficCaptureMagic, sizeof(header.magic));
+  header.version = kTrafficCaptureVersion;
+  header.header_size = sizeof(traffic_capture_record_header);
+  memcpy(data_, &header, sizeof(header));
+}
+
+traffic_capture::~traffic_capture() {
+  uint64 used_bytes = used_bytes_.load(boost::memory_order_acquire);
+  msync(data_, used_bytes, MS_SYNC);
+  munmap(data_, max_bytes_);
+  if (ftruncate(fd_, used_bytes) != 0) {
+    LOG(ERROR) << "Failed truncating the traffic capture.";
+  }
+  close(fd_);
+}
+#endif
+
+void traffic_capture::set_default_sample_rate(uint32 one_in) {
+  sampler_.set_default_sample_rate(one_in);
+}
+
+void traffic_capture::set_sample_rate(const std::string& service,
+                                      const std::string& method,
+                                      uint32 one_in) {
+  sampler_.set_sample_rate(service, method, one_in);
+}
+
+bool traffic_capture::should_sample(const std::string& service,
+                                    const std::string& method) {
+  return sampler_.should_sample(service, method);
+}
+
+bool traffic_capture::record(uint64 timestamp_usec,
+                             const std::string& service,
+                             const std::string& method,
+                             const void* payload, size_t payload_size) {
+  uint64 record_size = round_up_to_8(
+      sizeof(traffic_capture_record_header) + service.size() + method.size() +
+      payload_size);
+  if (payload_size > max_payload_bytes_ || record_size > 0xffffffffULL) {
+    dropped_.fetch_add(1, boost::memory_order_relaxed);
+    return false;
+  }
+  // Reserve the space of the record. Records are written concurrently into
+  // their own space, so the file may briefly contain a hole of zeros, which
+  // readers take as its end.
+  uint64 offset = used_bytes_.load(boost::memory_order_relaxed);
+  do {
+    if (offset + record_size > max_bytes_) {
+      dropped_.fetch_add(1, boost::memory_order_relaxed);
+      return false;
+    }
+  } while (!used_bytes_.compare_exchange_weak(offset, offset + record_size,
+                                              boost::memory_order_relaxed));
+  char* data = data_ + offset;
+  traffic_capture_record_header header;
+  header.record_size = 0;
+  header.service_size = service.size();
+  header.method_size = method.size();
+  header.payload_size = payload_size;
+  header.timestamp_usec = timestamp_usec;
+  memcpy(data, &header, sizeof(header));
+  data += sizeof(header);
+  memcpy(data, service.data(), service.size());
+  data += service.size();
+  memcpy(data, method.data(), method.size());
+  data += method.size();
+  memcpy(data, payload, payload_size);
+  // Publishing the size last marks the record as complete.
+  reinterpret_cast<boost::atomic<uint32>*>(data_ + offset)->store(
+      record_size, boost::memory_order_release);
+  return true;
+}
+
+uint64 traffic_capture::get_dropped_records() const {
+  return dropped_.load(boost::memory_order_relaxed);
+}
+
+uint64 traffic_capture::get_used_bytes() const {
+  return used_bytes_.load(boost::memory_order_relaxed);
+}
+
+traffic_capture_reader::traffic_capture_reader() : file_(NULL) {
+}
+
+traffic_capture_reader::~traffic_capture_reader() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+bool traffic_capture_reader::open(const std::string& filename) {
+  file_ = fopen(filename.c_str(), "rb");
+  if (file_ == NULL) {
+    return false;
+  }
+  traffic_capture_file_header header;
+  return (fread(&header, sizeof(header), 1, file_) == 1 &&
+          memcmp(header.magic, kTrafficCaptureMagic,
+                 sizeof(header.magic)) == 0 &&
+          header.version == kTrafficCaptureVersion &&
+          header.header_size == sizeof(traffic_capture_record_header));
+}
+
+bool traffic_capture_reader::next(captured_request* request) {
+  traffic_capture_record_header header;
+  if (fread(&header, sizeof(header), 1, file_) != 1 ||
+      header.record_size == 0) {
+    return false;
+  }
+  uint64 used_size = sizeof(header) + uint64(header.service_size) +
+      header.method_size + header.payload_size;
+  if (used_size > header.record_size) {
+    LOG(ERROR) << "Corrupt traffic capture record.";
+    return false;
+  }
+  uint64 body_size = header.record_size - sizeof(header);
+  std::vector<char> body(body_size);
+  if (body_size && fread(&body[0], body_size, 1, file_) != 1) {
+    return false;
+  }
+  const char* data = body.empty() ? NULL : &body[0];
+  request->timestamp_usec = header.timestamp_usec;
+  request->service.assign(data, header.service_size);
+  data += header.service_size;
+  request->method.assign(data, header.method_size);
+  data += header.method_size;
+  request->payload.assign(data, header.payload_size);
+  return true;
+}
+}  // namespace rpcz
@@ -0,0 +1,125 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/traffic_mirror.hpp"
+
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include "zmq.hpp"
+
+#include "rpcz/application.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpcz.pb.h"
+#include "rpcz/zmq_utils.hpp"
+
+namespace rpcz {
+
+struct traffic_mirror_stats {
+  traffic_mirror_stats() : inflight(0), mirrored(0), dropped(0), failed(0) {}
+
+  boost::atomic<uint32> inflight;
+  boost::atomic<uint64> mirrored;
+  boost::atomic<uint64> dropped;
+  boost::atomic<uint64> failed;
+};
+
+namespace {
+void handle_shadow_reply(boost::shared_ptr<traffic_mirror_stats> stats,
+                         connection_manager::status result,
+                         message_iterator& iter) {
+  stats->inflight.fetch_sub(1, boost::memory_order_relaxed);
+  bool ok = false;
+  if (result == connection_manager::DONE && iter.has_more()) {
+    zmq::message_t& msg = iter.next();
+    rpc_response_header header;
+    ok = header.ParseFromArray(msg.data(), msg.size()) &&
+        header.status() == status::OK;
+  }
+  if (!ok) {
+    stats->failed.fetch_add(1, boost::memory_order_relaxed);
+  }
+}
+}  // unnamed namespace
+
+traffic_mirror::traffic_mirror(application& application,
+                               const std::string& endpoint)
+    : connection_(application.connection_manager_->connect(endpoint)),
+      deadline_ms_(1000), max_inflight_(100),
+      stats_(new traffic_mirror_stats) {
+}
+
+traffic_mirror::traffic_mirror(connection_manager& connection_manager,
+                               const std::string& endpoint)
+    : connection_(connection_manager.connect(endpoint)),
+      deadline_ms_(1000), max_inflight_(100),
+      stats_(new traffic_mirror_stats) {
+}
+
+traffic_mirror::~traffic_mirror() {
+  connection_.close();
+}
+
+void traffic_mirror::set_default_sample_rate(uint32 one_in) {
+  sampler_.set_default_sample_rate(one_in);
+}
+
+void traffic_mirror::set_sample_rate(const std::string& service,
+                                     const std::string& method,
+                                     uint32 one_in) {
+  sampler_.set_sample_rate(service, method, one_in);
+}
+
+void traffic_mirror::set_deadline_ms(int64 deadline_ms) {
+  deadline_ms_ = deadline_ms;
+}
+
+void traffic_mirror::set_max_inflight(uint32 max_inflight) {
+  max_inflight_ = max_inflight;
+}
+
+bool traffic_mirror::should_sample(const std::string& service,
+                                   const std::string& method) {
+  return sampler_.should_sample(service, method);
+}
+
+bool traffic_mirror::mirror(zmq::message_t* header, zmq::message_t* payload) {
+  message_vector request;
+  request.push_back(header);
+  request.push_back(payload);
+  if (stats_->inflight.fetch_add(1, boost::memory_order_relaxed) >=
+      max_inflight_) {
+    stats_->inflight.fetch_sub(1, boost::memory_order_relaxed);
+    stats_->dropped.fetch_add(1, boost::memory_order_relaxed);
+    return false;
+  }
+  stats_->mirrored.fetch_add(1, boost::memory_order_relaxed);
+  connection_.send_request(request, deadline_ms_,
+                           boost::bind(&handle_shadow_reply, stats_, _1, _2));
+  return true;
+}
+
+uint64 traffic_mirror::get_mirrored_requests() const {
+  return stats_->mirrored.load(boost::memory_order_relaxed);
+}
+
+uint64 traffic_mirror::get_dropped_requests() const {
+  return stats_->dropped.load(boost::memory_order_relaxed);
+}
+
+uint64 traffic_mirror::get_failed_requests() const {
+  return stats_->failed.load(boost::memory_order_relaxed);
+}
+}  // namespace rpcz
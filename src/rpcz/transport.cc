@@ -0,0 +1,56 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/transport.hpp"
+
+#include "zmq.hpp"
+#include "rpcz/zmq_utils.hpp"
+
+namespace rpcz {
+
+zmq::message_t& message_iterator::next_from_transport() {
+  bool more;
+  transport_->recv(&message_, &more);
+  has_more_ = more;
+  return message_;
+}
+
+zmq::socket_t* zmq_transport::new_socket(int type) {
+  zmq::socket_t* socket = new zmq::socket_t(*context_, type);
+  int linger_ms = 0;
+  socket->setsockopt(ZMQ_LINGER, &linger_ms, sizeof(linger_ms));
+#if RPCZ_ENABLE_IPV6
+#if ZMQ_VERSION_MAJOR == 3
+  int ipv4only = 0;
+  socket->setsockopt(ZMQ_IPV4ONLY, &ipv4only, sizeof(ipv4only));
+#elif ZMQ_VERSION_MAJOR >= 4
+  int ipv6 = 1;
+  socket->setsockopt(ZMQ_IPV6, &ipv6, sizeof(ipv6));
+#endif
+#endif
+  return socket;
+}
+
+transport_socket* zmq_transport::connect(const std::string& endpoint) {
+  zmq::socket_t* socket = new_socket(ZMQ_DEALER);
+  socket->connect(endpoint.c_str());
+  return new zmq_transport_socket(socket);
+}
+
+transport_socket* zmq_transport::bind(const std::string& endpoint) {
+  zmq::socket_t* socket = new_socket(ZMQ_ROUTER);
+  socket->bind(endpoint.c_str());
+  return new zmq_transport_socket(socket);
+}
+}  // namespace rpcz
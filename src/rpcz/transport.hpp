@@ -0,0 +1,145 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_TRANSPORT_H
+#define RPCZ_TRANSPORT_H
+
+#include <string.h>
+#include <string>
+#include "zmq.hpp"
+#include "rpcz/macros.hpp"
+#include "rpcz/zmq_utils.hpp"
+
+namespace rpcz {
+
+// A socket of the broker, either one of its internal sockets or a connection
+// to a remote endpoint. Messages are made of frames, like ZeroMQ messages.
+// Sockets that connect() behave like ZeroMQ DEALER sockets. Sockets that
+// bind() behave like ROUTER sockets: each received message starts with a
+// frame that identifies its peer, and messages sent start with the frame of
+// the peer to send them to. Only used from the broker thread.
+class transport_socket {
+ public:
+  virtual ~transport_socket() {}
+
+  // Sends a frame, taking over its contents. flags is 0 or ZMQ_SNDMORE; a
+  // message is sent when its last frame is.
+  virtual bool send(zmq::message_t& frame, int flags) = 0;
+
+  // Receives the next frame. Sets *more if the message has more frames.
+  // Only called when the socket is ready or in the middle of a message.
+  virtual void recv(zmq::message_t* frame, bool* more) = 0;
+
+  // The item zmq_poll() watches to find out that the socket became ready.
+  virtual zmq::pollitem_t get_pollitem() = 0;
+
+  // Called by the reactor after each poll, with whether the poll item was
+  // readable. Returns the number of messages that can be received now.
+  virtual int ready_messages(bool polled) = 0;
+
+  // Called by the reactor before it polls. Returns true if messages can be
+  // received without polling, and otherwise arranges for the poll item to
+  // become readable when they arrive.
+  virtual bool prepare_poll() = 0;
+};
+
+// Creates the sockets of one kind of endpoints.
+class transport {
+ public:
+  virtual ~transport() {}
+
+  virtual transport_socket* connect(const std::string& endpoint) = 0;
+
+  virtual transport_socket* bind(const std::string& endpoint) = 0;
+};
+
+// A ZeroMQ socket. Takes ownership of the socket.
+class zmq_transport_socket : public transport_socket {
+ public:
+  explicit zmq_transport_socket(zmq::socket_t* socket) : socket_(socket) {}
+
+  virtual bool send(zmq::message_t& frame, int flags) {
+    return socket_->send(frame, flags);
+  }
+
+  virtual void recv(zmq::message_t* frame, bool* more) {
+    socket_->recv(frame, 0);
+    more_t has_more;
+    size_t more_size = sizeof(has_more);
+    socket_->getsockopt(ZMQ_RCVMORE, &has_more, &more_size);
+    *more = has_more;
+  }
+
+  virtual zmq::pollitem_t get_pollitem() {
+    zmq::pollitem_t pollitem = {*socket_, 0, ZMQ_POLLIN, 0};
+    return pollitem;
+  }
+
+  virtual int ready_messages(bool polled) {
+    return polled ? 1 : 0;
+  }
+
+  virtual bool prepare_poll() {
+    return false;
+  }
+
+ private:
+  scoped_ptr<zmq::socket_t> socket_;
+  DISALLOW_COPY_AND_ASSIGN(zmq_transport_socket);
+};
+
+// The default transport: ZeroMQ sockets of the given context, for tcp://,
+// ipc:// and inproc:// endpoints.
+class zmq_transport : public transport {
+ public:
+  explicit zmq_transport(zmq::context_t* context) : context_(context) {}
+
+  virtual transport_socket* connect(const std::string& endpoint);
+
+  virtual transport_socket* bind(const std::string& endpoint);
+
+ private:
+  zmq::socket_t* new_socket(int type);
+
+  zmq::context_t* context_;
+  DISALLOW_COPY_AND_ASSIGN(zmq_transport);
+};
+
+// Sends the remaining frames of iter to socket. Returns the number of bytes
+// forwarded.
+inline size_t forward_messages(message_iterator& iter,
+                               transport_socket& socket) {
+  size_t bytes = 0;
+  while (iter.has_more()) {
+    zmq::message_t& msg = iter.next();
+    bytes += msg.size();
+    socket.send(msg, iter.has_more() ? ZMQ_SNDMORE : 0);
+  }
+  return bytes;
+}
+
+inline bool send_string(transport_socket* socket, const std::string& str,
+                        int flags) {
+  zmq::message_t msg(str.size());
+  str.copy(static_cast<char*>(msg.data()), str.size(), 0);
+  return socket->send(msg, flags);
+}
+
+inline bool send_uint64(transport_socket* socket, uint64 value, int flags) {
+  zmq::message_t msg(sizeof(value));
+  memcpy(msg.data(), &value, sizeof(value));
+  return socket->send(msg, flags);
+}
+}  // namespace rpcz
+#endif
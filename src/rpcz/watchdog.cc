@@ -0,0 +1,267 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rpcz/watchdog.hpp"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+#include <boost/bind.hpp>
+
+#ifdef __linux__
+#include <execinfo.h>
+#include <signal.h>
+#endif
+
+#include "rpcz/clock.hpp"
+#include "rpcz/logging.hpp"
+#include "rpcz/metrics_registry.hpp"
+
+namespace rpcz {
+namespace {
+// How long to wait for a worker to answer a stack capture request.
+const int kStackCaptureTimeoutMs = 100;
+
+RPCZ_THREAD_LOCAL worker_state* current_worker = NULL;
+RPCZ_THREAD_LOCAL worker_watchdog* current_watchdog = NULL;
+
+#ifdef __linux__
+int stack_capture_signal() {
+  return SIGRTMIN + 3;
+}
+
+void capture_stack_handler(int) {
+  worker_state* state = current_worker;
+  if (state) {
+    state->stack_size = backtrace(state->stack,
+                                  worker_state::kMaxStackFrames);
+    state->stack_ready.store(true, boost::memory_order_release);
+  }
+}
+
+void install_stack_capture_handler() {
+  // backtrace() loads libgcc on its first call, which is not safe to do in a
+  // signal handler.
+  void* frame;
+  backtrace(&frame, 1);
+  struct sigaction action;
+  action.sa_handler = capture_stack_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(stack_capture_signal(), &action, NULL);
+}
+
+// Returns the symbolized stack of a worker, or an empty string if the worker
+// did not answer in time.
+std::string capture_stack(worker_state* state) {
+  state->stack_ready.store(false, boost::memory_order_relaxed);
+  if (pthread_kill(state->thread, stack_capture_signal()) != 0) {
+    return "";
+  }
+  for (int i = 0; i < kStackCaptureTimeoutMs; ++i) {
+    if (state->stack_ready.load(boost::memory_order_acquire)) {
+      std::ostringstream stack;
+      char** symbols = backtrace_symbols(state->stack, state->stack_size);
+      for (int j = 0; symbols && j < state->stack_size; ++j) {
+        stack << "\n    " << symbols[j];
+      }
+      free(symbols);
+      return stack.str();
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+  return "";
+}
+#endif
+}  // unnamed namespace
+
+worker_state::worker_state(int index)
+    : index(index), phase(IDLE), command_start_usec(0), command(""),
+      replaced(false) {
+#ifdef __linux__
+  stack_size = 0;
+  stack_ready = false;
+#endif
+}
+
+worker_watchdog::worker_watchdog(metrics_registry* metrics,
+                                 boost::function<void()> add_worker)
+    : metrics_(metrics), add_worker_(add_worker), enabled_(false),
+      stall_threshold_ms_(0), replace_stalled_workers_(false),
+      max_replacement_workers_(0), replacement_workers_(0) {
+}
+
+worker_watchdog::~worker_watchdog() {
+  stop();
+  delete_container_pointers(states_.begin(), states_.end());
+}
+
+worker_state* worker_watchdog::new_worker_state() {
+  boost::unique_lock<boost::mutex> lock(mu_);
+  worker_state* state = new worker_state(states_.size());
+  states_.push_back(state);
+  return state;
+}
+
+void worker_watchdog::start(int64 stall_threshold_ms,
+                            bool replace_stalled_workers,
+                            int max_replacement_workers) {
+  CHECK(!enabled());
+  CHECK_GE(stall_threshold_ms, 1);
+  CHECK_GE(max_replacement_workers, 0);
+  stall_threshold_ms_ = stall_threshold_ms;
+  replace_stalled_workers_ = replace_stalled_workers;
+  max_replacement_workers_ = max_replacement_workers;
+#ifdef __linux__
+  install_stack_capture_handler();
+#endif
+  enabled_.store(true);
+  thread_ = boost::thread(boost::bind(&worker_watchdog::loop, this));
+}
+
+void worker_watchdog::stop() {
+  if (!enabled()) {
+    return;
+  }
+  quit_.signal();
+  thread_.join();
+  enabled_.store(false);
+}
+
+void worker_watchdog::loop() {
+  int64 interval_ms = std::max<int64>(stall_threshold_ms_ / 4, 1);
+  while (!quit_.wait_for(interval_ms)) {
+    std::vector<worker_state*> states;
+    {
+      boost::unique_lock<boost::mutex> lock(mu_);
+      states = states_;
+    }
+    uint64 now_usec = zclock_time_usec();
+    for (size_t i = 0; i < states.size(); ++i) {
+      check(states[i], now_usec);
+    }
+  }
+}
+
+void worker_watchdog::check(worker_state* state, uint64 now_usec) {
+  if (state->phase.load(boost::memory_order_acquire) != worker_state::BUSY) {
+    return;
+  }
+  uint64 start_usec = state->command_start_usec.load(
+      boost::memory_order_relaxed);
+  if (now_usec < start_usec ||
+      now_usec - start_usec < uint64(stall_threshold_ms_) * 1000) {
+    return;
+  }
+  int busy = worker_state::BUSY;
+  if (!state->phase.compare_exchange_strong(busy, worker_state::STALLED)) {
+    // The command has just finished.
+    return;
+  }
+  metrics_->add_worker_stall();
+  log_stall(state, now_usec - start_usec);
+  if (!replace_stalled_workers_) {
+    return;
+  }
+  // Only this thread adds replacements, so the count cannot go over the
+  // limit between the check and the increment.
+  if (replacement_workers_.load() >= max_replacement_workers_) {
+    LOG(WARNING) << "Not replacing worker thread " << state->index << ": "
+                 << max_replacement_workers_
+                 << " replacement workers are already running.";
+    return;
+  }
+  metrics_->set_replacement_workers(++replacement_workers_);
+  state->replaced.store(true);
+  add_worker_();
+}
+
+void worker_watchdog::retire_replaced_worker() {
+  metrics_->set_replacement_workers(--replacement_workers_);
+}
+
+void worker_watchdog::log_stall(worker_state* state, uint64 running_usec) {
+  std::string call;
+  {
+    boost::unique_lock<boost::mutex> lock(state->mu);
+    if (!state->service.empty()) {
+      call = state->service + "." + state->method;
+    }
+  }
+  std::string stack;
+#ifdef __linux__
+  stack = capture_stack(state);
+#endif
+  if (call.empty()) {
+    call = state->command.load(boost::memory_order_relaxed);
+  }
+  LOG(WARNING) << "Worker thread " << state->index << " has been running "
+               << call << " for "
+               << running_usec / 1000 << "ms." << stack;
+}
+
+void set_current_worker(worker_state* state, worker_watchdog* watchdog) {
+#ifdef __linux__
+  state->thread = pthread_self();
+#endif
+  current_worker = state;
+  current_watchdog = watchdog;
+}
+
+void begin_worker_command(const char* command) {
+  if (!current_watchdog->enabled()) {
+    return;
+  }
+  current_worker->command.store(command, boost::memory_order_relaxed);
+  current_worker->command_start_usec.store(zclock_time_usec(),
+                                           boost::memory_order_relaxed);
+  current_worker->phase.store(worker_state::BUSY, boost::memory_order_release);
+}
+
+bool end_worker_command() {
+  if (current_worker->phase.load(boost::memory_order_relaxed) ==
+      worker_state::IDLE) {
+    return false;
+  }
+  {
+    boost::unique_lock<boost::mutex> lock(current_worker->mu);
+    current_worker->service.clear();
+    current_worker->method.clear();
+  }
+  if (current_worker->phase.exchange(worker_state::IDLE) !=
+      worker_state::STALLED) {
+    return false;
+  }
+  // The watchdog sets replaced before it asks for the replacement, and only
+  // while the worker is stalled, so it is up to date here.
+  if (!current_worker->replaced.exchange(false)) {
+    LOG(INFO) << "Worker thread " << current_worker->index
+              << " is back after a stall.";
+    return false;
+  }
+  LOG(INFO) << "Worker thread " << current_worker->index
+            << " is back after a stall, and retires for its replacement.";
+  current_watchdog->retire_replaced_worker();
+  return true;
+}
+
+void set_current_call(const std::string& service, const std::string& method) {
+  if (current_worker == NULL || !current_watchdog->enabled()) {
+    return;
+  }
+  boost::unique_lock<boost::mutex> lock(current_worker->mu);
+  current_worker->service = service;
+  current_worker->method = method;
+}
+}  // namespace rpcz
@@ -0,0 +1,141 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_WATCHDOG_H
+#define RPCZ_WATCHDOG_H
+
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "rpcz/macros.hpp"
+#include "rpcz/sync_event.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+namespace rpcz {
+class metrics_registry;
+
+// What a worker thread is doing, as seen by the watchdog and the broker.
+struct worker_state {
+  enum phase {
+    IDLE = 0,
+    BUSY = 1,
+    // Busy for longer than the stall threshold. The broker does not hand
+    // new commands to stalled workers.
+    STALLED = 2,
+  };
+
+  explicit worker_state(int index);
+
+  const int index;
+  boost::atomic<int> phase;
+  boost::atomic<uint64> command_start_usec;
+  // A static description of the running command.
+  boost::atomic<const char*> command;
+  // Whether a replacement worker was started for the current stall. The
+  // worker retires when it recovers from such a stall.
+  boost::atomic<bool> replaced;
+
+  // The call being handled, if known. Guarded by mu.
+  boost::mutex mu;
+  std::string service;
+  std::string method;
+
+#ifdef __linux__
+  static const int kMaxStackFrames = 64;
+  pthread_t thread;
+  // Filled by the worker thread in a signal handler.
+  void* stack[kMaxStackFrames];
+  int stack_size;
+  boost::atomic<bool> stack_ready;
+#endif
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(worker_state);
+};
+
+// Watches the worker threads of a connection_manager for commands that run
+// for too long: a handler blocked on a lock or on a synchronous downstream
+// call. When a worker has been inside a single command for longer than the
+// threshold, the watchdog logs what it is running along with its stack (on
+// Linux), counts the stall in the metrics and takes the worker out of the
+// rotation until it finishes. It can also ask for a replacement worker, so
+// that the number of workers available for new commands is kept; a stalled
+// worker that got replaced retires once it finishes its command.
+class worker_watchdog {
+ public:
+  // add_worker is called from the watchdog thread to request a replacement
+  // worker.
+  worker_watchdog(metrics_registry* metrics,
+                  boost::function<void()> add_worker);
+  ~worker_watchdog();
+
+  // Creates the state of a new worker thread. Owned by the watchdog.
+  worker_state* new_worker_state();
+
+  // Starts watching with the given threshold. At most
+  // max_replacement_workers replacements run at a time; stalls beyond that
+  // are only reported. Stack capture uses the signal SIGRTMIN + 3, which
+  // must not be used by the application.
+  void start(int64 stall_threshold_ms, bool replace_stalled_workers,
+             int max_replacement_workers);
+  void stop();
+
+  // Called by a replaced worker that finished its stalled command, as it
+  // retires.
+  void retire_replaced_worker();
+
+  bool enabled() const {
+    return enabled_.load(boost::memory_order_relaxed);
+  }
+
+ private:
+  void loop();
+  void check(worker_state* state, uint64 now_usec);
+  void log_stall(worker_state* state, uint64 running_usec);
+
+  metrics_registry* metrics_;
+  boost::function<void()> add_worker_;
+  boost::atomic<bool> enabled_;
+  int64 stall_threshold_ms_;
+  bool replace_stalled_workers_;
+  int max_replacement_workers_;
+  boost::atomic<int> replacement_workers_;
+  boost::mutex mu_;
+  std::vector<worker_state*> states_;
+  sync_event quit_;
+  boost::thread thread_;
+  DISALLOW_COPY_AND_ASSIGN(worker_watchdog);
+};
+
+// Called by a worker thread once, before handling any command.
+void set_current_worker(worker_state* state, worker_watchdog* watchdog);
+
+// Mark the start and the end of a command on the current worker thread.
+// command describes the command in stall reports and must be a literal.
+// end_worker_command() returns whether the worker was replaced during the
+// command, in which case it should retire.
+void begin_worker_command(const char* command);
+bool end_worker_command();
+
+// Records the call handled by the current worker thread, so that a stall
+// report can name it. Does nothing unless the watchdog is running.
+void set_current_call(const std::string& service, const std::string& method);
+}  // namespace rpcz
+#endif
@@ -0,0 +1,85 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Prints the records of rpcz access log files (see rpcz/access_log.hpp), one
+// per line:
+//
+//   <timestamp_usec> <peer> <service.method> <request bytes>
+//       <response bytes> <latency_usec> <status>[(<application error>)]
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include "rpcz/access_log.hpp"
+#include "rpcz/rpc.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace rpcz {
+std::string peer_to_hex(const access_log_record& record) {
+  std::string result;
+  char digits[3];
+  for (int i = 0; i < record.peer_size; ++i) {
+    snprintf(digits, sizeof(digits), "%02x",
+             static_cast<unsigned char>(record.peer[i]));
+    result += digits;
+  }
+  return result.empty() ? "-" : result;
+}
+
+int dump(const std::string& filename) {
+  access_log_reader reader;
+  if (!reader.open(filename)) {
+    cerr << "Could not read access log '" << filename << "'" << endl;
+    return 1;
+  }
+  access_log_record record;
+  while (reader.next(&record)) {
+    std::string method(record.method,
+                       strnlen(record.method, sizeof(record.method)));
+    cout << record.timestamp_usec << " "
+         << peer_to_hex(record) << " "
+         << method << " "
+         << record.request_bytes << " "
+         << record.response_bytes << " "
+         << record.latency_usec << " ";
+    if (rpc_response_header_status_code_IsValid(record.status)) {
+      cout << rpc_response_header_status_code_Name(
+          static_cast<status_code>(record.status));
+    } else {
+      cout << record.status;
+    }
+    if (record.status == status::APPLICATION_ERROR) {
+      cout << "(" << record.application_error << ")";
+    }
+    cout << endl;
+  }
+  return 0;
+}
+}  // namespace rpcz
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <access log file>..." << endl;
+    return 1;
+  }
+  int retval = 0;
+  for (int i = 1; i < argc; ++i) {
+    retval |= rpcz::dump(argv[i]);
+  }
+  return retval;
+}
@@ -0,0 +1,123 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays the requests of a traffic capture (see rpcz/traffic_capture.hpp)
+// against a server, at the recorded timing or scaled up, and prints the
+// latency histogram and errors of the replayed calls:
+//
+//   zreplay [--speed=2] [--copies=3] <capture file> <endpoint>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+#include "rpcz/application.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/load_generator.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/traffic_capture.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace po = boost::program_options;
+
+double FLAGS_speed;
+int FLAGS_copies;
+int FLAGS_connections;
+int FLAGS_deadline_ms;
+
+namespace rpcz {
+// Sends each captured request --copies times at its recorded offset from the
+// first request divided by --speed.
+void replay_capture(traffic_capture_reader* reader, load_generator* generator) {
+  captured_request request;
+  uint64 first_timestamp_usec = 0;
+  uint64 start_usec = zclock_time_usec();
+  for (bool first = true; reader->next(&request); first = false) {
+    if (first) {
+      first_timestamp_usec = request.timestamp_usec;
+    }
+    uint64 offset_usec = request.timestamp_usec > first_timestamp_usec ?
+        request.timestamp_usec - first_timestamp_usec : 0;
+    uint64 scheduled_usec = start_usec + uint64(offset_usec / FLAGS_speed);
+    load_request call(request.service, request.method, request.payload);
+    for (int i = 0; i < FLAGS_copies; ++i) {
+      generator->send_at(call, scheduled_usec);
+    }
+  }
+  generator->wait();
+}
+
+int replay(const std::string& filename, const std::string& endpoint) {
+  if (FLAGS_speed <= 0 || FLAGS_copies < 1 || FLAGS_connections < 1) {
+    cerr << "--speed, --copies and --connections must be positive." << endl;
+    return 1;
+  }
+  traffic_capture_reader reader;
+  if (!reader.open(filename)) {
+    cerr << "Could not read traffic capture '" << filename << "'" << endl;
+    return 1;
+  }
+  application::options options;
+  options.connection_manager_threads = 4;
+  application app(options);
+  std::vector<rpc_channel*> channels;
+  for (int i = 0; i < FLAGS_connections; ++i) {
+    channels.push_back(app.create_rpc_channel(endpoint));
+  }
+  load_generator generator(channels, FLAGS_deadline_ms);
+  uint64 start_usec = zclock_time_usec();
+  replay_capture(&reader, &generator);
+  generator.print_report(cout, zclock_time_usec() - start_usec);
+  delete_container_pointers(channels.begin(), channels.end());
+  return 0;
+}
+}  // namespace rpcz
+
+int main(int argc, char *argv[]) {
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("capture", po::value<std::string>(), "Traffic capture to replay.")
+      ("endpoint", po::value<std::string>(), "Server to send requests to.")
+      ("speed", po::value<double>(&FLAGS_speed)->default_value(1),
+       "Replays this many times faster than recorded.")
+      ("copies", po::value<int>(&FLAGS_copies)->default_value(1),
+       "Sends each captured request this many times.")
+      ("connections", po::value<int>(&FLAGS_connections)->default_value(1),
+       "Connections to open to the endpoint.")
+      ("deadline_ms", po::value<int>(&FLAGS_deadline_ms)->default_value(-1),
+       "Deadline of each call, -1 for none.");
+  po::positional_options_description positional;
+  positional.add("capture", 1).add("endpoint", 1);
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv).
+              options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+  } catch (po::error &e) {
+    cerr << "Command line error: " << e.what() << endl;
+    return 1;
+  }
+  if (vm.count("help") || !vm.count("capture") || !vm.count("endpoint")) {
+    cout << "Usage: " << argv[0] << " [options] <capture file> <endpoint>"
+         << endl << endl << desc;
+    return 1;
+  }
+  return rpcz::replay(vm["capture"].as<std::string>(),
+                      vm["endpoint"].as<std::string>());
+}
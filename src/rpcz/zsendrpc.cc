@@ -14,6 +14,7 @@
 //
 // Author: nadavs@google.com <Nadav Samet>
 
+#include <fstream>
 #include <iostream>
 #include <vector>
 #include <boost/bind.hpp>
@@ -22,6 +23,8 @@
 #include <google/protobuf/dynamic_message.h>
 #include <google/protobuf/text_format.h>
 #include "rpcz/application.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/load_generator.hpp"
 #include "rpcz/rpc_channel.hpp"
 #include "rpcz/service.hpp"
 #include "rpcz/rpc.hpp"
@@ -45,6 +48,11 @@ namespace po = boost::program_options;
 std::string FLAGS_proto;
 std::string FLAGS_service_name;
 std::vector<std::string> FLAGS_proto_path;
+int FLAGS_qps;
+int FLAGS_concurrency;
+int FLAGS_duration;
+int FLAGS_connections;
+int FLAGS_deadline_ms;
 
 static const char *PNAME = "zsendrpc";
 
@@ -57,27 +65,21 @@ class ErrorCollector : public MultiFileErrorCollector {
   }
 };
 
-int run_call(const std::string& endpoint,
-             const std::string& method,
-             const std::string& payload) {
-  DiskSourceTree disk_source_tree;
-  ErrorCollector error_collector;
-  for_each(FLAGS_proto_path.begin(), FLAGS_proto_path.end(),
-      boost::bind(&DiskSourceTree::MapPath,
-          &disk_source_tree, _1, _1));
-  Importer imp(&disk_source_tree, &error_collector);
-
-  const FileDescriptor* file_desc = imp.Import(FLAGS_proto);
+// Imports FLAGS_proto and looks up the given method. Prints an error and
+// returns NULL if it can not be found.
+const MethodDescriptor* find_method(Importer* importer,
+                                    const std::string& method) {
+  const FileDescriptor* file_desc = importer->Import(FLAGS_proto);
 
   if (file_desc == NULL) {
     cerr << "Could not load proto '" << FLAGS_proto
          << "'" << endl;
-    return -1;
+    return NULL;
   }
   if (method.find('.') == method.npos) {
     cerr << "<service.method> must contain a dot: '" << method << "'"
               << endl;
-    return -1;
+    return NULL;
   }
   std::string service_name(method, 0, method.find_last_of('.'));
   std::string method_name(method, method.find_last_of('.') + 1);
@@ -86,15 +88,36 @@ int run_call(const std::string& endpoint,
   if (service_desc == NULL) {
     cerr << "Could not find service '" << service_name
               << "' in proto definition." << endl;
-    return -1;
+    return NULL;
   }
   const ::MethodDescriptor* method_desc =
       service_desc->FindMethodByName(method_name);
   if (method_desc == NULL) {
     cerr << "Could not find method '" << method_name
               << "' in proto definition (but service was found)." << endl;
+    return NULL;
+  }
+  return method_desc;
+}
+
+void map_proto_path(DiskSourceTree* disk_source_tree) {
+  for_each(FLAGS_proto_path.begin(), FLAGS_proto_path.end(),
+      boost::bind(&DiskSourceTree::MapPath,
+          disk_source_tree, _1, _1));
+}
+
+int run_call(const std::string& endpoint,
+             const std::string& method,
+             const std::string& payload) {
+  DiskSourceTree disk_source_tree;
+  ErrorCollector error_collector;
+  map_proto_path(&disk_source_tree);
+  Importer imp(&disk_source_tree, &error_collector);
+  const MethodDescriptor* method_desc = find_method(&imp, method);
+  if (method_desc == NULL) {
     return -1;
   }
+  std::string service_name(method_desc->service()->name());
 
   DynamicMessageFactory factory;
   Message *request = factory.GetPrototype(
@@ -111,6 +134,7 @@ int run_call(const std::string& endpoint,
   application app;
   scoped_ptr<rpc_channel> channel(app.create_rpc_channel(endpoint));
   rpc rpc;
+  rpc.set_deadline_ms(FLAGS_deadline_ms);
   ::Message *reply = factory.GetPrototype(
       method_desc->output_type())->New();
   channel->call_method(
@@ -132,6 +156,99 @@ int run_call(const std::string& endpoint,
   return 0;
 }
 
+// payload is a request in text format, or @file for a file with a request
+// in text format on each line.
+bool serialize_requests(const std::string& payload,
+                        const std::string& service_name,
+                        const MethodDescriptor* method_desc,
+                        const Message& prototype,
+                        std::vector<load_request>* requests) {
+  std::vector<std::string> text_requests;
+  if (!payload.empty() && payload[0] == '@') {
+    std::ifstream file(payload.substr(1).c_str());
+    if (!file) {
+      cerr << "Could not open " << payload.substr(1) << endl;
+      return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+      if (!line.empty()) {
+        text_requests.push_back(line);
+      }
+    }
+  } else {
+    text_requests.push_back(payload);
+  }
+  if (text_requests.empty()) {
+    cerr << "No requests given." << endl;
+    return false;
+  }
+  scoped_ptr<Message> request(prototype.New());
+  for (size_t i = 0; i < text_requests.size(); ++i) {
+    if (!TextFormat::ParseFromString(text_requests[i], request.get())) {
+      cerr << "Could not parse the given ASCII message: " << text_requests[i]
+           << endl;
+      return false;
+    }
+    requests->push_back(load_request(service_name, method_desc->name(),
+                                     request->SerializeAsString()));
+  }
+  return true;
+}
+
+int run_bench(const std::string& endpoint,
+              const std::string& method,
+              const std::string& payload) {
+  DiskSourceTree disk_source_tree;
+  ErrorCollector error_collector;
+  map_proto_path(&disk_source_tree);
+  Importer imp(&disk_source_tree, &error_collector);
+  const MethodDescriptor* method_desc = find_method(&imp, method);
+  if (method_desc == NULL) {
+    return -1;
+  }
+  if (FLAGS_connections < 1 || FLAGS_concurrency < 1 || FLAGS_qps < 0 ||
+      FLAGS_duration < 1) {
+    cerr << "--connections, --concurrency and --duration must be positive, "
+         << "and --qps not negative." << endl;
+    return -1;
+  }
+
+  // The requests are parsed and serialized once, so that the load generator
+  // spends its time on sending them.
+  std::vector<load_request> requests;
+  {
+    DynamicMessageFactory factory;
+    if (!serialize_requests(
+            payload,
+            FLAGS_service_name.empty() ? method_desc->service()->name()
+                                       : FLAGS_service_name,
+            method_desc, *factory.GetPrototype(method_desc->input_type()),
+            &requests)) {
+      return -1;
+    }
+  }
+
+  application::options options;
+  options.connection_manager_threads = 4;
+  application app(options);
+  std::vector<rpc_channel*> channels;
+  for (int i = 0; i < FLAGS_connections; ++i) {
+    channels.push_back(app.create_rpc_channel(endpoint));
+  }
+  load_generator generator(channels, FLAGS_deadline_ms);
+  uint64 duration_usec = uint64(FLAGS_duration) * 1000000;
+  uint64 start_usec = zclock_time_usec();
+  if (FLAGS_qps > 0) {
+    generator.run_open_loop(requests, FLAGS_qps, duration_usec);
+  } else {
+    generator.run_closed_loop(requests, FLAGS_concurrency, duration_usec);
+  }
+  generator.print_report(cout, zclock_time_usec() - start_usec);
+  delete_container_pointers(channels.begin(), channels.end());
+  return 0;
+}
+
 #define ARGV_ERROR -2
 
 int run(std::vector<std::string> args) {
@@ -140,19 +257,22 @@ int run(std::vector<std::string> args) {
     return ARGV_ERROR;
   }
   std::string command(args[0]);
-  if (command != "call") {
-    cerr << "Only the call command is supported" << endl;
+  if (command != "call" && command != "bench") {
+    cerr << "Only the call and bench commands are supported" << endl;
     return ARGV_ERROR;
   } else {
     if (args.size() != 4) {
-      cerr << "call needs 3 arguments:" <<
-          "call <endpoint> <service.method> <payload>" 
+      cerr << command << " needs 3 arguments:" <<
+          command << " <endpoint> <service.method> <payload>" 
           << endl << endl;
       return ARGV_ERROR;
     }
     std::string endpoint(args[1]);
     std::string method(args[2]);
     std::string payload(args[3]);
+    if (command == "bench") {
+      return run_bench(endpoint, method, payload);
+    }
     return run_call(endpoint, method, payload);
   }
   return 0;
@@ -165,7 +285,13 @@ void show_usage(const char* pname, const po::options_description& desc) {
        << pname << " --proto=file.proto <command> [args]" << endl
        << endl
        << "Where <command> is one of the following: " << endl
-       << "  call" << endl
+       << "  call <endpoint> <service.method> <payload>" << endl
+       << "  bench <endpoint> <service.method> <payload or @file>" << endl
+       << endl
+       << "bench sends the request (or the requests in the file, one per"
+       << endl
+       << "line) for --duration seconds and prints the latency histogram."
+       << endl
        << endl;
   // cout << desc;
 }
@@ -187,7 +313,18 @@ int main(int argc, char *argv[]) {
        "List of directories to search.")
       ("service_name", po::value<std::string>(&FLAGS_service_name),
        "service name to use. Leave empty to use the same service name as in "
-       "the proto definition.");
+       "the proto definition.")
+      ("qps", po::value<int>(&FLAGS_qps)->default_value(0),
+       "bench: calls per second. If 0, keeps --concurrency calls in flight "
+       "instead.")
+      ("concurrency", po::value<int>(&FLAGS_concurrency)->default_value(1),
+       "bench: calls in flight when --qps is 0.")
+      ("duration", po::value<int>(&FLAGS_duration)->default_value(10),
+       "bench: seconds to run.")
+      ("connections", po::value<int>(&FLAGS_connections)->default_value(1),
+       "bench: connections to open to the endpoint.")
+      ("deadline_ms", po::value<int>(&FLAGS_deadline_ms)->default_value(-1),
+       "Deadline of each call, -1 for none.");
 
   po::positional_options_description p;
   po::parsed_options parsed = po::command_line_parser(argc, argv).
@@ -0,0 +1,119 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include "gtest/gtest.h"
+#include "rpcz/access_log.hpp"
+
+namespace rpcz {
+
+class access_log_test : public ::testing::Test {
+ public:
+  access_log_test()
+      : filename_("access_log_test." +
+                  boost::lexical_cast<std::string>(this) + ".alog") {}
+
+  ~access_log_test() {
+    remove(filename_.c_str());
+  }
+
+ protected:
+  std::string filename_;
+};
+
+access_log_record make_record(uint64 timestamp, const char* method) {
+  access_log_record record;
+  memset(&record, 0, sizeof(record));
+  record.timestamp_usec = timestamp;
+  size_t size = std::min(strlen(method), sizeof(record.method) - 1);
+  memcpy(record.method, method, size);
+  record.method[size] = '\0';
+  return record;
+}
+
+void append_records(access_log* log, int thread, int count) {
+  for (int i = 0; i < count; ++i) {
+    log->append(make_record(thread * count + i, "SearchService.Search"));
+  }
+}
+
+TEST_F(access_log_test, WritesRecordsFromAllThreads) {
+  const int kThreads = 4;
+  const int kRecords = 1000;
+  {
+    access_log log(filename_, kRecords);
+    boost::thread_group threads;
+    for (int i = 0; i < kThreads; ++i) {
+      threads.add_thread(new boost::thread(
+              boost::bind(append_records, &log, i, kRecords)));
+    }
+    threads.join_all();
+    ASSERT_EQ(0, log.get_dropped_records());
+  }
+  access_log_reader reader;
+  ASSERT_TRUE(reader.open(filename_));
+  std::set<uint64> timestamps;
+  access_log_record record;
+  while (reader.next(&record)) {
+    ASSERT_STREQ("SearchService.Search", record.method);
+    timestamps.insert(record.timestamp_usec);
+  }
+  ASSERT_EQ(kThreads * kRecords, timestamps.size());
+}
+
+TEST_F(access_log_test, DropsRecordsWhenFull) {
+  {
+    access_log log(filename_, 4);
+    // The drain thread may empty the buffer in between, so we can only tell
+    // that something was dropped.
+    append_records(&log, 0, 100000);
+    ASSERT_LT(0, log.get_dropped_records());
+  }
+  access_log_reader reader;
+  ASSERT_TRUE(reader.open(filename_));
+}
+
+TEST_F(access_log_test, SampleRates) {
+  access_log log(filename_);
+  log.set_default_sample_rate(0);
+  log.set_sample_rate("SearchService", "Search", 1);
+  log.set_sample_rate("SearchService", "Rare", 10);
+  int rare = 0;
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(log.should_sample("SearchService", "Search"));
+    ASSERT_FALSE(log.should_sample("SearchService", "Other"));
+    ASSERT_FALSE(log.should_sample("OtherService", "Search"));
+    if (log.should_sample("SearchService", "Rare")) {
+      ++rare;
+    }
+  }
+  ASSERT_LT(500, rare);
+  ASSERT_GT(2000, rare);
+}
+
+TEST_F(access_log_test, ReaderRejectsOtherFiles) {
+  FILE* file = fopen(filename_.c_str(), "wb");
+  fputs("not an access log", file);
+  fclose(file);
+  access_log_reader reader;
+  ASSERT_FALSE(reader.open(filename_));
+}
+}  // namespace rpcz
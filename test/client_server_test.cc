@@ -15,13 +15,17 @@
 // Author: nadavs@google.com <Nadav Samet>
 
 #include <iostream>
+#include <new>
 #include <boost/thread/thread.hpp>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <zmq.hpp>
 
+#include "rpcz/application.hpp"
 #include "rpcz/callback.hpp"
 #include "rpcz/connection_manager.hpp"
+#include "rpcz/locality.hpp"
+#include "rpcz/metrics.hpp"
 #include "rpcz/rpc_channel.hpp"
 #include "rpcz/rpc.hpp"
 #include "rpcz/server.hpp"
@@ -29,6 +33,7 @@
 
 #include "proto/search.pb.h"
 #include "proto/search.rpcz.h"
+#include "test_util.hpp"
 
 using namespace std;
 
@@ -182,6 +187,140 @@ TEST_F(server_test, SimpleRequestAsync) {
   ASSERT_EQ("The search for happiness", response.results(0));
 }
 
+TEST_F(server_test, SimpleRequestStats) {
+  SearchService_Stub stub(rpc_channel::create(frontend_connection_), true);
+  SearchRequest request;
+  SearchResponse response;
+  rpc rpc;
+  request.set_query("happiness");
+  stub.Search(request, &response, &rpc, NULL);
+  rpc.wait();
+  ASSERT_TRUE(rpc.ok());
+  const rpc_stats& stats = rpc.get_stats();
+  EXPECT_LT(request.ByteSize(), stats.request_bytes);
+  EXPECT_LT(response.ByteSize(), stats.response_bytes);
+  EXPECT_LE(0, stats.queue_time_usec);
+  EXPECT_LE(0, stats.server_time_usec);
+  EXPECT_LE(stats.queue_time_usec, stats.latency_usec);
+  EXPECT_LE(stats.server_time_usec, stats.latency_usec);
+  EXPECT_EQ(frontend_connection_.get_connection_id(), stats.connection_id);
+}
+
+TEST_F(server_test, TimedOutRequestStats) {
+  SearchService_Stub stub(rpc_channel::create(frontend_connection_), true);
+  SearchRequest request;
+  SearchResponse response;
+  rpc rpc;
+  request.set_query("timeout");
+  rpc.set_deadline_ms(1);
+  stub.Search(request, &response, &rpc, NULL);
+  rpc.wait();
+  ASSERT_EQ(rpc_response_header::DEADLINE_EXCEEDED, rpc.get_status());
+  EXPECT_EQ(-1, rpc.get_stats().server_time_usec);
+  EXPECT_EQ(0, rpc.get_stats().response_bytes);
+  // The deadline comes from the millisecond clock, so it can fire well
+  // before a full millisecond has passed.
+  EXPECT_LT(0, rpc.get_stats().latency_usec);
+}
+
+const method_stats* find_method(const std::vector<method_stats>& methods,
+                                const std::string& service,
+                                const std::string& method) {
+  for (size_t i = 0; i < methods.size(); ++i) {
+    if (methods[i].service == service && methods[i].method == method) {
+      return &methods[i];
+    }
+  }
+  return NULL;
+}
+
+TEST_F(server_test, CpuAccounting) {
+  cm_->set_cpu_accounting(true);
+  send_blocking_request(frontend_connection_, "happiness");
+  // The handler and the callback are accounted for when they return, which
+  // can be after the client got its response; their calls are counted last.
+  metrics_snapshot snapshot;
+  const method_stats* server_stats = NULL;
+  const method_stats* client_stats = NULL;
+  for (int i = 0; i < 100; ++i) {
+    cm_->get_metrics_snapshot(&snapshot);
+    server_stats =
+        find_method(snapshot.server_methods, "SearchService", "Search");
+    client_stats =
+        find_method(snapshot.client_methods, "SearchService", "Search");
+    if (server_stats && server_stats->calls == 1 &&
+        client_stats && client_stats->calls == 1) {
+      break;
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_TRUE(server_stats != NULL);
+  ASSERT_TRUE(client_stats != NULL);
+  EXPECT_EQ(1, server_stats->calls);
+  EXPECT_EQ(1, client_stats->calls);
+}
+
+TEST_F(server_test, WorkerWatchdog) {
+  cm_->enable_watchdog(20, true, 1);
+  sync_event release;
+  cm_->add(new_callback(&release, &sync_event::wait));
+  cm_->add(new_callback(&release, &sync_event::wait));
+  metrics_snapshot snapshot;
+  for (int i = 0; i < 100 && snapshot.worker_stalls < 2; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    cm_->get_metrics_snapshot(&snapshot);
+  }
+  ASSERT_LE(2, snapshot.worker_stalls);
+  // Only one of the stuck workers got replaced.
+  EXPECT_EQ(1, snapshot.replacement_workers);
+  // The stuck workers get no new work, so none of these requests hangs.
+  for (int i = 0; i < 20; ++i) {
+    send_blocking_request(frontend_connection_, "happiness");
+  }
+  release.signal();
+  for (int i = 0; i < 100 && snapshot.replacement_workers != 0; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    cm_->get_metrics_snapshot(&snapshot);
+  }
+  // The replacement retired once the workers recovered.
+  EXPECT_EQ(0, snapshot.replacement_workers);
+  send_blocking_request(frontend_connection_, "happiness");
+}
+
+const connection_stats* find_connection(
+    const std::vector<connection_stats>& connections,
+    const std::string& endpoint, bool server) {
+  for (size_t i = 0; i < connections.size(); ++i) {
+    if (connections[i].endpoint == endpoint &&
+        connections[i].server == server) {
+      return &connections[i];
+    }
+  }
+  return NULL;
+}
+
+TEST_F(server_test, MemoryAccounting) {
+  set_memory_accounting(true);
+  send_blocking_request(frontend_connection_, "delegate");
+  set_memory_accounting(false);
+  metrics_snapshot snapshot;
+  cm_->get_metrics_snapshot(&snapshot);
+  ASSERT_EQ(5, snapshot.allocations.size());
+  for (size_t i = 0; i < snapshot.allocations.size(); ++i) {
+    EXPECT_LT(0, snapshot.allocations[i].objects)
+        << snapshot.allocations[i].subsystem;
+  }
+  ASSERT_TRUE(find_connection(snapshot.connections,
+                              "inproc://myserver.frontend", true) != NULL);
+  ASSERT_TRUE(find_connection(snapshot.connections,
+                              "inproc://myserver.backend", true) != NULL);
+  const connection_stats* client = find_connection(
+      snapshot.connections, "inproc://myserver.frontend", false);
+  ASSERT_TRUE(client != NULL);
+  EXPECT_EQ(0, client->inflight_requests);
+  EXPECT_EQ(0, client->inflight_request_bytes);
+}
+
 TEST_F(server_test, SimpleRequestWithError) {
   SearchService_Stub stub(rpc_channel::create(frontend_connection_), true);
   SearchRequest request;
@@ -275,6 +414,20 @@ TEST_F(server_test, EasyBlockingRequestWithTimeout) {
   stub.Search(request, &response);
 }
 
+TEST_F(server_test, EasyBlockingRequestReturnsStatus) {
+  SearchService_Stub stub(rpc_channel::create(frontend_connection_), true);
+  SearchRequest request;
+  SearchResponse response;
+  request.set_query("delegate");
+  ASSERT_EQ(status::OK, stub.Search(request, &response, std::nothrow));
+  ASSERT_EQ("42!", response.results(0));
+  request.set_query("foo");
+  rpc rpc;
+  ASSERT_EQ(status::APPLICATION_ERROR,
+            stub.Search(request, &response, &rpc, std::nothrow));
+  ASSERT_EQ("I don't like foo.", rpc.get_error_message());
+}
+
 TEST_F(server_test, ConnectionManagerTermination) {
   SearchService_Stub stub(rpc_channel::create(frontend_connection_), true);
   SearchRequest request;
@@ -289,4 +442,249 @@ TEST_F(server_test, ConnectionManagerTermination) {
   cm_->run();
   LOG(INFO)<<"I'm there";
 }
+// Records the thread that handles each request.
+class ThreadRecordingSearchService : public SearchService {
+ public:
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    thread_id = boost::this_thread::get_id();
+    if (request.query() == "foo") {
+      reply.Error(-4, "I don't like foo.");
+      return;
+    }
+    SearchResponse response;
+    response.add_results("The search for " + request.query());
+    reply.send(response);
+  }
+
+  boost::thread::id thread_id;
+};
+
+class direct_dispatch_test : public ::testing::Test {
+ protected:
+  void start(application::dispatch_mode mode) {
+    application::options options;
+    options.in_process_dispatch = mode;
+    application_.reset(new application(options));
+    server_.reset(new server(*application_));
+    server_->register_service(service_ = new ThreadRecordingSearchService);
+    server_->register_service(
+        frontend_service_ = new SearchServiceImpl(NULL, NULL), "Frontend");
+    int port = pick_unused_port();
+    server_->bind(make_endpoint("tcp", "*", port));
+    channel_.reset(application_->create_rpc_channel(
+            make_endpoint("tcp", "localhost", port)));
+  }
+
+  ~direct_dispatch_test() {
+    channel_.reset();
+    server_.reset();
+    application_.reset();
+  }
+
+  scoped_ptr<application> application_;
+  scoped_ptr<server> server_;
+  scoped_ptr<rpc_channel> channel_;
+  ThreadRecordingSearchService* service_;
+  SearchServiceImpl* frontend_service_;
+};
+
+TEST_F(direct_dispatch_test, CallsServiceOnCallingThread) {
+  start(application::DISPATCH_ON_CALLING_THREAD);
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  SearchResponse response;
+  request.set_query("happiness");
+  rpc rpc;
+  stub.Search(request, &response, &rpc, NULL);
+  ASSERT_EQ(status::OK, rpc.get_status());
+  ASSERT_EQ("The search for happiness", response.results(0));
+  ASSERT_EQ(boost::this_thread::get_id(), service_->thread_id);
+  // Nothing went over the wire.
+  ASSERT_EQ(0, rpc.get_stats().request_bytes);
+  ASSERT_LE(0, rpc.get_stats().server_time_usec);
+}
+
+TEST_F(direct_dispatch_test, CallsServiceOnWorkers) {
+  start(application::DISPATCH_ON_WORKERS);
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  SearchResponse response;
+  request.set_query("happiness");
+  stub.Search(request, &response);
+  ASSERT_EQ("The search for happiness", response.results(0));
+  ASSERT_NE(boost::this_thread::get_id(), service_->thread_id);
+}
+
+TEST_F(direct_dispatch_test, ReportsApplicationErrors) {
+  start(application::DISPATCH_ON_WORKERS);
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  SearchResponse response;
+  request.set_query("foo");
+  try {
+    stub.Search(request, &response);
+    ASSERT_TRUE(false);
+  } catch (rpc_error &error) {
+    ASSERT_EQ(status::APPLICATION_ERROR, error.get_status());
+    ASSERT_EQ(-4, error.get_application_error_code());
+    ASSERT_EQ("I don't like foo.", error.get_error_message());
+  }
+}
+
+TEST_F(direct_dispatch_test, EnforcesDeadlines) {
+  start(application::DISPATCH_ON_WORKERS);
+  SearchService_Stub stub(channel_.get(), std::string("Frontend"));
+  SearchRequest request;
+  SearchResponse response;
+  request.set_query("timeout");
+  try {
+    stub.Search(request, &response, 1);
+    ASSERT_TRUE(false);
+  } catch (rpc_error &error) {
+    ASSERT_EQ(status::DEADLINE_EXCEEDED, error.get_status());
+  }
+  // The late reply to the timed out call is dropped.
+  frontend_service_->timeout_request_received.wait();
+  request.set_query("delayed");
+  stub.Search(request, &response);
+}
+
+TEST_F(direct_dispatch_test, ServesSerializedRequests) {
+  start(application::DISPATCH_ON_CALLING_THREAD);
+  SearchRequest request;
+  request.set_query("bytes");
+  std::string payload;
+  rpc found;
+  channel_->call_method0("SearchService", "Search",
+                         request.SerializeAsString(), &payload, &found, NULL);
+  ASSERT_EQ(status::OK, found.get_status());
+  SearchResponse response;
+  ASSERT_TRUE(response.ParseFromString(payload));
+  ASSERT_EQ("The search for bytes", response.results(0));
+
+  rpc missing;
+  channel_->call_method0("NoSuchService", "Search", "", &payload, &missing,
+                         NULL);
+  ASSERT_EQ(status::APPLICATION_ERROR, missing.get_status());
+  ASSERT_EQ(application_error::NO_SUCH_SERVICE,
+            missing.get_application_error_code());
+}
+
+TEST_F(direct_dispatch_test, RemoteByDefault) {
+  start(application::DISPATCH_REMOTE);
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  SearchResponse response;
+  request.set_query("happiness");
+  rpc rpc;
+  stub.Search(request, &response, &rpc, NULL);
+  rpc.wait();
+  ASSERT_EQ(status::OK, rpc.get_status());
+  ASSERT_LT(0, rpc.get_stats().request_bytes);
+}
+
+TEST_F(direct_dispatch_test, DeletedChannelClosesItsConnection) {
+  start(application::DISPATCH_REMOTE);
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  SearchResponse response;
+  stub.Search(request, &response);
+  metrics_snapshot snapshot;
+  application_->get_metrics_snapshot(&snapshot);
+  size_t connections = snapshot.connections.size();
+  channel_.reset();
+  // The broker closes the connection asynchronously.
+  for (int i = 0; i < 100; ++i) {
+    application_->get_metrics_snapshot(&snapshot);
+    if (snapshot.connections.size() < connections) {
+      break;
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(connections - 1, snapshot.connections.size());
+}
+
+// Answers with the transport that the request came through.
+class LocalityRecordingSearchService : public SearchService {
+ public:
+  // endpoint is the tcp:// endpoint the server binds.
+  LocalityRecordingSearchService(application* application,
+                                 const std::string& endpoint)
+      : application_(application),
+        local_endpoint_(get_local_endpoint(endpoint)) {}
+
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    metrics_snapshot snapshot;
+    application_->get_metrics_snapshot(&snapshot);
+    const connection_stats* local = find_connection(
+        snapshot.connections, local_endpoint_, true);
+    SearchResponse response;
+    response.add_results(
+        local && local->inflight_requests == 1 ? "ipc" : "tcp");
+    reply.send(response);
+  }
+
+ private:
+  application* application_;
+  std::string local_endpoint_;
+};
+
+TEST(locality_upgrade_test, SwitchesSameHostConnectionsToIpc) {
+  application::options options;
+  options.locality_upgrade = true;
+  application server_application(options);
+  server server(server_application);
+  int port = pick_unused_port();
+  std::string endpoint(make_endpoint("tcp", "*", port));
+  server.register_service(
+      new LocalityRecordingSearchService(&server_application, endpoint));
+  server.bind(endpoint);
+  application client_application(options);
+  SearchService_Stub stub(
+      client_application.create_rpc_channel(
+          make_endpoint("tcp", "localhost", port)), true);
+  set_memory_accounting(true);
+  // The first requests can go out over tcp before the server's answer to
+  // the handshake arrives.
+  SearchRequest request;
+  SearchResponse response;
+  for (int i = 0; i < 100; ++i) {
+    stub.Search(request, &response, 1000);
+    if (response.results(0) == "ipc") {
+      break;
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  set_memory_accounting(false);
+  ASSERT_EQ("ipc", response.results(0));
+}
+
+TEST(locality_upgrade_test, StaysOnTcpUnlessClientEnablesIt) {
+  application::options options;
+  options.locality_upgrade = true;
+  application server_application(options);
+  server server(server_application);
+  int port = pick_unused_port();
+  std::string endpoint(make_endpoint("tcp", "*", port));
+  server.register_service(
+      new LocalityRecordingSearchService(&server_application, endpoint));
+  server.bind(endpoint);
+  application client_application;
+  SearchService_Stub stub(
+      client_application.create_rpc_channel(
+          make_endpoint("tcp", "localhost", port)), true);
+  set_memory_accounting(true);
+  SearchRequest request;
+  SearchResponse response;
+  for (int i = 0; i < 10; ++i) {
+    stub.Search(request, &response, 1000);
+    ASSERT_EQ("tcp", response.results(0));
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  set_memory_accounting(false);
+}
 }  // namespace
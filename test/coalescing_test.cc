@@ -0,0 +1,290 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+
+namespace rpcz {
+
+// Keeps the replies until release() is called.
+class HoldingSearchService : public SearchService {
+ public:
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    queries_.push_back(request.query());
+    replies_.push_back(reply);
+  }
+
+  size_t get_calls() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    return queries_.size();
+  }
+
+  void release() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    for (size_t i = 0; i < replies_.size(); ++i) {
+      if (queries_[i] == "fail") {
+        replies_[i].Error(17, "Failed");
+      } else {
+        SearchResponse response;
+        response.add_results(queries_[i]);
+        replies_[i].send(response);
+      }
+    }
+    replies_.clear();
+    queries_.clear();
+  }
+
+ private:
+  boost::mutex mu_;
+  std::vector<std::string> queries_;
+  std::vector<reply<SearchResponse> > replies_;
+};
+
+class coalescing_test : public ::testing::Test {
+ protected:
+  static const int kRequests = 5;
+
+  coalescing_test()
+      : server_(application_), service_(new HoldingSearchService) {
+    server_.register_service(service_);
+    server_.set_coalesced("SearchService", "Search");
+    server_.bind("inproc://coalescing_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://coalescing_test"));
+    stub_.reset(new SearchService_Stub(channel_.get()));
+  }
+
+  // Sends kRequests identical requests, and releases the handler once they
+  // all reached the server and the first one is held by the handler.
+  void search_concurrently(const std::string& query) {
+    SearchRequest request;
+    request.set_query(query);
+    for (int i = 0; i < kRequests; ++i) {
+      stub_->Search(request, &responses_[i], &rpcs_[i], NULL);
+    }
+    uint64 coalesced = server_.get_coalesced_requests();
+    for (int i = 0;
+         i < 100 && (server_.get_coalesced_requests() < coalesced + 4 ||
+                     service_->get_calls() < 1); ++i) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+    ASSERT_EQ(1, service_->get_calls());
+    service_->release();
+    for (int i = 0; i < kRequests; ++i) {
+      rpcs_[i].wait();
+    }
+  }
+
+  application application_;
+  server server_;
+  HoldingSearchService* service_;
+  scoped_ptr<rpc_channel> channel_;
+  scoped_ptr<SearchService_Stub> stub_;
+  rpc rpcs_[kRequests];
+  SearchResponse responses_[kRequests];
+};
+
+TEST_F(coalescing_test, RunsHandlerOnceForIdenticalRequests) {
+  search_concurrently("happiness");
+  ASSERT_EQ(kRequests - 1, server_.get_coalesced_requests());
+  for (int i = 0; i < kRequests; ++i) {
+    ASSERT_EQ(status::OK, rpcs_[i].get_status());
+    ASSERT_EQ("happiness", responses_[i].results(0));
+  }
+}
+
+TEST_F(coalescing_test, SharesErrors) {
+  search_concurrently("fail");
+  ASSERT_EQ(kRequests - 1, server_.get_coalesced_requests());
+  for (int i = 0; i < kRequests; ++i) {
+    ASSERT_EQ(status::APPLICATION_ERROR, rpcs_[i].get_status());
+    ASSERT_EQ(17, rpcs_[i].get_application_error_code());
+  }
+}
+
+TEST_F(coalescing_test, HandlesDifferentRequestsSeparately) {
+  SearchRequest request;
+  SearchResponse responses[2];
+  rpc rpcs[2];
+  request.set_query("happiness");
+  stub_->Search(request, &responses[0], &rpcs[0], NULL);
+  request.set_query("sadness");
+  stub_->Search(request, &responses[1], &rpcs[1], NULL);
+  for (int i = 0; i < 100 && service_->get_calls() < 2; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(2, service_->get_calls());
+  service_->release();
+  rpcs[0].wait();
+  rpcs[1].wait();
+  ASSERT_EQ("happiness", responses[0].results(0));
+  ASSERT_EQ("sadness", responses[1].results(0));
+  ASSERT_EQ(0, server_.get_coalesced_requests());
+}
+
+TEST_F(coalescing_test, HandlesRequestsAnewOnceReplied) {
+  search_concurrently("happiness");
+  SearchRequest request;
+  request.set_query("happiness");
+  rpc rpc;
+  SearchResponse response;
+  stub_->Search(request, &response, &rpc, NULL);
+  for (int i = 0; i < 100 && service_->get_calls() < 1; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(1, service_->get_calls());
+  service_->release();
+  rpc.wait();
+  ASSERT_EQ(status::OK, rpc.get_status());
+  ASSERT_EQ(kRequests - 1, server_.get_coalesced_requests());
+}
+
+class client_coalescing_test : public ::testing::Test {
+ protected:
+  static const int kRequests = 5;
+
+  client_coalescing_test()
+      : application_(make_options()), server_(application_),
+        service_(new HoldingSearchService) {
+    server_.register_service(service_);
+    server_.bind("inproc://client_coalescing_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://client_coalescing_test"));
+    stub_.reset(new SearchService_Stub(channel_.get()));
+  }
+
+  static application::options make_options() {
+    application::options options;
+    options.coalesce_calls = true;
+    return options;
+  }
+
+  void wait_for_calls(size_t calls) {
+    for (int i = 0; i < 100 && service_->get_calls() < calls; ++i) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+  }
+
+  application application_;
+  server server_;
+  HoldingSearchService* service_;
+  scoped_ptr<rpc_channel> channel_;
+  scoped_ptr<SearchService_Stub> stub_;
+};
+
+TEST_F(client_coalescing_test, SendsIdenticalCallsOnce) {
+  SearchRequest request;
+  request.set_query("happiness");
+  rpc rpcs[kRequests];
+  SearchResponse responses[kRequests];
+  for (int i = 0; i < kRequests; ++i) {
+    stub_->Search(request, &responses[i], &rpcs[i], NULL);
+  }
+  wait_for_calls(1);
+  // Give the server time to see requests that should not have been sent.
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  ASSERT_EQ(1, service_->get_calls());
+  service_->release();
+  for (int i = 0; i < kRequests; ++i) {
+    rpcs[i].wait();
+    ASSERT_EQ(status::OK, rpcs[i].get_status());
+    ASSERT_EQ("happiness", responses[i].results(0));
+  }
+}
+
+TEST_F(client_coalescing_test, SharesErrors) {
+  SearchRequest request;
+  request.set_query("fail");
+  rpc rpcs[2];
+  SearchResponse responses[2];
+  stub_->Search(request, &responses[0], &rpcs[0], NULL);
+  stub_->Search(request, &responses[1], &rpcs[1], NULL);
+  wait_for_calls(1);
+  service_->release();
+  for (int i = 0; i < 2; ++i) {
+    rpcs[i].wait();
+    ASSERT_EQ(status::APPLICATION_ERROR, rpcs[i].get_status());
+    ASSERT_EQ(17, rpcs[i].get_application_error_code());
+  }
+}
+
+TEST_F(client_coalescing_test, SendsDifferentCalls) {
+  SearchRequest request;
+  rpc rpcs[2];
+  SearchResponse responses[2];
+  request.set_query("happiness");
+  stub_->Search(request, &responses[0], &rpcs[0], NULL);
+  request.set_query("sadness");
+  stub_->Search(request, &responses[1], &rpcs[1], NULL);
+  wait_for_calls(2);
+  ASSERT_EQ(2, service_->get_calls());
+  service_->release();
+  rpcs[0].wait();
+  rpcs[1].wait();
+  ASSERT_EQ("happiness", responses[0].results(0));
+  ASSERT_EQ("sadness", responses[1].results(0));
+}
+
+TEST_F(client_coalescing_test, WaitsOnlyForCallsWithTheSameDeadline) {
+  SearchRequest request;
+  request.set_query("happiness");
+  SearchResponse responses[2];
+  rpc leader;
+  stub_->Search(request, &responses[0], &leader, NULL);
+  rpc rpc;
+  rpc.set_deadline_ms(50);
+  stub_->Search(request, &responses[1], &rpc, NULL);
+  rpc.wait();
+  ASSERT_EQ(status::DEADLINE_EXCEEDED, rpc.get_status());
+  wait_for_calls(2);
+  ASSERT_EQ(2, service_->get_calls());
+  service_->release();
+  leader.wait();
+  ASSERT_EQ(status::OK, leader.get_status());
+}
+
+TEST_F(client_coalescing_test, SendsCallsAgainOnceReplied) {
+  SearchRequest request;
+  request.set_query("happiness");
+  SearchResponse response;
+  {
+    rpc rpc;
+    stub_->Search(request, &response, &rpc, NULL);
+    wait_for_calls(1);
+    service_->release();
+    rpc.wait();
+  }
+  rpc rpc;
+  stub_->Search(request, &response, &rpc, NULL);
+  wait_for_calls(1);
+  ASSERT_EQ(1, service_->get_calls());
+  service_->release();
+  rpc.wait();
+  ASSERT_EQ(status::OK, rpc.get_status());
+}
+}  // namespace rpcz
@@ -107,6 +107,34 @@ TEST_F(connection_manager_test, TestTimeoutAsync) {
   event.wait();
 }
 
+void expect_closed(connection_manager::status status, message_iterator& iter,
+                   sync_event* sync) {
+  ASSERT_EQ(connection_manager::CLOSED, status);
+  ASSERT_FALSE(iter.has_more());
+  sync->signal();
+}
+
+TEST_F(connection_manager_test, FailsRequestsOnClosedConnections) {
+  zmq::socket_t server(context, ZMQ_DEALER);
+  server.bind("inproc://server.test");
+
+  connection_manager cm(&context, 4);
+  connection closed(cm.connect("inproc://server.test"));
+  closed.close();
+  // Closing again is harmless.
+  closed.close();
+  // The slot of the closed connection is reused, under another id.
+  connection reopened(cm.connect("inproc://server.test"));
+  ASSERT_NE(closed.get_connection_id(), reopened.get_connection_id());
+  scoped_ptr<message_vector> request(create_simple_request());
+
+  sync_event event;
+  closed.send_request(*request, -1,
+                      boost::bind(&expect_closed, _1, _2, &event));
+  event.wait();
+  reopened.close();
+}
+
 class barrier_closure : public connection_manager::client_request_callback {
  public:
   barrier_closure() : count_(0) {}
@@ -191,6 +219,42 @@ TEST_F(connection_manager_test, TestBindServer) {
   event.wait();
 }
 
+TEST_F(connection_manager_test, TestBindServerInMemory) {
+  connection_manager cm(&context, 4);
+  cm.bind("mem://server.point", &handle_request);
+  connection c = cm.connect("mem://server.point");
+  message_vector v;
+  v.push_back(string_to_message("317"));
+  sync_event event;
+  c.send_request(v, -1,
+                boost::bind(&handle_server_response, &event, _1, _2));
+  event.wait();
+}
+
+TEST_F(connection_manager_test, TestInMemoryAcrossManagers) {
+  connection_manager server_cm(&context, 4);
+  server_cm.bind("mem://server.point", &handle_request);
+  connection_manager client_cm(&context, 4);
+  connection c = client_cm.connect("mem://server.point");
+  for (int i = 0; i < 100; ++i) {
+    message_vector v;
+    v.push_back(string_to_message("317"));
+    sync_event event;
+    c.send_request(v, -1,
+                  boost::bind(&handle_server_response, &event, _1, _2));
+    event.wait();
+  }
+}
+
+TEST_F(connection_manager_test, TestInMemoryUnboundTimesOut) {
+  connection_manager cm(&context, 4);
+  connection c = cm.connect("mem://nobody.home");
+  scoped_ptr<message_vector> request(create_simple_request());
+  sync_event event;
+  c.send_request(*request, 10, boost::bind(&expect_timeout, _1, _2, &event));
+  event.wait();
+}
+
 const static char* kEndpoint = "inproc://test";
 const static char* kReply = "gotit";
 
@@ -0,0 +1,151 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <boost/thread/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/idempotency_table.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+class idempotency_test : public ::testing::Test {
+ protected:
+  idempotency_test()
+      : table_(1000, 60000), server_(application_),
+        service_(new CountingSearchService) {
+    server_.register_service(service_);
+    server_.set_idempotency_table(&table_);
+    server_.bind("inproc://idempotency_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://idempotency_test"));
+    stub_.reset(new SearchService_Stub(channel_.get()));
+  }
+
+  // Returns the call count the server answered with.
+  std::string search(const std::string& query, const std::string& key) {
+    SearchRequest request;
+    request.set_query(query);
+    SearchResponse response;
+    rpc rpc;
+    rpc.set_idempotency_key(key);
+    stub_->Search(request, &response, &rpc, NULL);
+    rpc.wait();
+    EXPECT_TRUE(rpc.ok()) << rpc.to_string();
+    return response.results_size() ? response.results(1) : "";
+  }
+
+  idempotency_table table_;
+  application application_;
+  server server_;
+  CountingSearchService* service_;
+  scoped_ptr<rpc_channel> channel_;
+  scoped_ptr<SearchService_Stub> stub_;
+};
+
+TEST_F(idempotency_test, ExecutesRetriesOnce) {
+  ASSERT_EQ("1", search("write", "key1"));
+  ASSERT_EQ("1", search("write", "key1"));
+  ASSERT_EQ("1", search("write", "key1"));
+  ASSERT_EQ(1, service_->get_calls());
+  ASSERT_EQ(2, table_.get_deduplicated_requests());
+  ASSERT_EQ("2", search("write", "key2"));
+  ASSERT_EQ(2, service_->get_calls());
+}
+
+TEST_F(idempotency_test, ExecutesRequestsWithoutKey) {
+  ASSERT_EQ("1", search("write", ""));
+  ASSERT_EQ("2", search("write", ""));
+  ASSERT_EQ(0, table_.get_entries());
+}
+
+TEST_F(idempotency_test, ReplaysErrors) {
+  for (int i = 0; i < 2; ++i) {
+    SearchRequest request;
+    request.set_query("fail");
+    SearchResponse response;
+    rpc rpc;
+    rpc.set_idempotency_key("key");
+    stub_->Search(request, &response, &rpc, NULL);
+    rpc.wait();
+    ASSERT_EQ(status::APPLICATION_ERROR, rpc.get_status());
+    ASSERT_EQ(17, rpc.get_application_error_code());
+  }
+  ASSERT_EQ(1, service_->get_calls());
+}
+
+TEST_F(idempotency_test, RetriesWaitForRequestInProgress) {
+  SearchRequest request;
+  request.set_query("hold");
+  SearchResponse responses[2];
+  rpc rpcs[2];
+  rpcs[0].set_idempotency_key("key");
+  rpcs[1].set_idempotency_key("key");
+  stub_->Search(request, &responses[0], &rpcs[0], NULL);
+  for (int i = 0; i < 100 && service_->get_calls() < 1; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  stub_->Search(request, &responses[1], &rpcs[1], NULL);
+  for (int i = 0; i < 100 && table_.get_deduplicated_requests() < 1; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(1, table_.get_deduplicated_requests());
+  service_->release();
+  rpcs[0].wait();
+  rpcs[1].wait();
+  ASSERT_EQ("1", responses[0].results(1));
+  ASSERT_EQ("1", responses[1].results(1));
+  ASSERT_EQ(1, service_->get_calls());
+}
+
+TEST(idempotency_table_test, ExpiresAndBoundsReplies) {
+  application application;
+  server server(application);
+  CountingSearchService* service = new CountingSearchService;
+  server.register_service(service);
+  idempotency_table table(1, 10, 1);
+  server.set_idempotency_table(&table);
+  server.bind("inproc://idempotency_table_test");
+  scoped_ptr<rpc_channel> channel(application.create_rpc_channel(
+          "inproc://idempotency_table_test"));
+  SearchService_Stub stub(channel.get());
+  // The table holds a single reply, so key2's pushes out key1's, and the
+  // last call comes after key1's second reply expired.
+  const char* keys[] = {"key1", "key2", "key1", "key1"};
+  for (int i = 0; i < 4; ++i) {
+    if (i == 3) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+    }
+    SearchRequest request;
+    request.set_query("bounded");
+    SearchResponse response;
+    rpc rpc;
+    rpc.set_idempotency_key(keys[i]);
+    stub.Search(request, &response, &rpc, NULL);
+    rpc.wait();
+    ASSERT_TRUE(rpc.ok());
+    ASSERT_EQ(1, table.get_entries());
+  }
+  ASSERT_EQ(4, service->get_calls());
+  ASSERT_EQ(0, table.get_deduplicated_requests());
+}
+}  // namespace rpcz
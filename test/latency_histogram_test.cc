@@ -0,0 +1,56 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gtest/gtest.h"
+#include "rpcz/latency_histogram.hpp"
+
+namespace rpcz {
+
+TEST(latency_histogram_test, Empty) {
+  latency_histogram histogram;
+  ASSERT_EQ(0, histogram.count());
+  ASSERT_EQ(0, histogram.percentile(0.5));
+  ASSERT_EQ(0, histogram.max());
+}
+
+TEST(latency_histogram_test, SmallValuesAreExact) {
+  latency_histogram histogram;
+  for (int i = 1; i <= 20; ++i) {
+    histogram.record(i);
+  }
+  ASSERT_EQ(20, histogram.count());
+  ASSERT_EQ(10, histogram.percentile(0.5));
+  ASSERT_EQ(20, histogram.percentile(1));
+  ASSERT_EQ(20, histogram.max());
+  ASSERT_DOUBLE_EQ(10.5, histogram.mean());
+}
+
+TEST(latency_histogram_test, LargeValuesWithinBucketWidth) {
+  latency_histogram histogram;
+  for (uint64 i = 1; i <= 10000; ++i) {
+    histogram.record(i * 100);
+  }
+  uint64 p99 = histogram.percentile(0.99);
+  ASSERT_LE(990000, p99);
+  ASSERT_GE(990000 + 990000 / 16, p99);
+  ASSERT_EQ(1000000, histogram.percentile(1));
+}
+
+TEST(latency_histogram_test, CapsHugeValues) {
+  latency_histogram histogram;
+  histogram.record(1ULL << 50);
+  ASSERT_EQ((1ULL << 40) - 1, histogram.max());
+  ASSERT_EQ((1ULL << 40) - 1, histogram.percentile(0.5));
+}
+}  // namespace rpcz
@@ -0,0 +1,125 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/load_generator.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+
+namespace rpcz {
+
+class EchoSearchService : public SearchService {
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    if (request.query() == "fail") {
+      reply.Error(17);
+      return;
+    }
+    SearchResponse response;
+    response.add_results(request.query());
+    reply.send(response);
+  }
+};
+
+class load_generator_test : public ::testing::Test {
+ protected:
+  load_generator_test() : server_(application_) {
+    server_.register_service(new EchoSearchService);
+    server_.bind("inproc://load_generator_test");
+    for (int i = 0; i < 2; ++i) {
+      channels_.push_back(application_.create_rpc_channel(
+              "inproc://load_generator_test"));
+    }
+  }
+
+  ~load_generator_test() {
+    delete_container_pointers(channels_.begin(), channels_.end());
+  }
+
+  static load_request search(const std::string& query) {
+    SearchRequest request;
+    request.set_query(query);
+    return load_request("SearchService", "Search",
+                        request.SerializeAsString());
+  }
+
+  application application_;
+  server server_;
+  std::vector<rpc_channel*> channels_;
+};
+
+TEST_F(load_generator_test, ClosedLoopKeepsCalling) {
+  load_generator generator(channels_, 1000);
+  generator.run_closed_loop(std::vector<load_request>(1, search("foo")), 4,
+                            50000);
+  EXPECT_LT(4, generator.get_calls());
+  EXPECT_EQ(0, generator.get_errors());
+  EXPECT_EQ(generator.get_calls(), generator.get_histogram().count());
+}
+
+TEST_F(load_generator_test, SendsMessagesLikeStubs) {
+  SearchRequest request;
+  request.set_query("foo");
+  std::vector<load_request> requests(1, load_request(
+          SearchService::descriptor()->FindMethodByName("Search"),
+          &request));
+  EXPECT_EQ("SearchService", requests[0].service);
+  load_generator generator(channels_, 1000);
+  generator.run_closed_loop(requests, 4, 50000);
+  EXPECT_LT(4, generator.get_calls());
+  EXPECT_EQ(0, generator.get_errors());
+}
+
+TEST_F(load_generator_test, OpenLoopSendsAtRate) {
+  load_generator generator(channels_, 1000);
+  generator.run_open_loop(std::vector<load_request>(1, search("foo")), 1000,
+                          100000);
+  EXPECT_EQ(100, generator.get_calls() + generator.get_errors());
+}
+
+TEST_F(load_generator_test, CountsErrorsByMethodAndStatus) {
+  std::vector<load_request> requests;
+  requests.push_back(search("foo"));
+  requests.push_back(search("fail"));
+  load_generator generator(channels_, 1000);
+  generator.run_open_loop(requests, 1000, 10000);
+  EXPECT_EQ(5, generator.get_calls());
+  EXPECT_EQ(5, generator.get_errors());
+  std::ostringstream report;
+  generator.print_report(report, 10000);
+  EXPECT_NE(std::string::npos,
+            report.str().find("SearchService.Search APPLICATION_ERROR 17: 5"));
+}
+
+TEST_F(load_generator_test, SendsAtScheduledTimes) {
+  load_generator generator(channels_, 1000);
+  uint64 start_usec = zclock_time_usec();
+  generator.send_at(search("foo"), start_usec);
+  generator.send_at(search("fail"), start_usec + 20000);
+  generator.wait();
+  EXPECT_LE(start_usec + 20000, zclock_time_usec());
+  EXPECT_EQ(1, generator.get_calls());
+  EXPECT_EQ(1, generator.get_errors());
+}
+}  // namespace rpcz
@@ -0,0 +1,47 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include "gtest/gtest.h"
+#include "rpcz/locality.hpp"
+
+namespace rpcz {
+
+TEST(locality_test, UpgradesOnlyTcpEndpointsWithAPort) {
+  ASSERT_TRUE(is_upgradable_endpoint("tcp://*:5555"));
+  ASSERT_TRUE(is_upgradable_endpoint("tcp://localhost:5555"));
+  ASSERT_TRUE(is_upgradable_endpoint("ntcp://127.0.0.1:5555"));
+  ASSERT_FALSE(is_upgradable_endpoint("tcp://*:*"));
+  ASSERT_FALSE(is_upgradable_endpoint("tcp://localhost"));
+  ASSERT_FALSE(is_upgradable_endpoint("ipc:///tmp/x:5555"));
+  ASSERT_FALSE(is_upgradable_endpoint("inproc://x"));
+  ASSERT_FALSE(is_upgradable_endpoint("shm://x"));
+}
+
+TEST(locality_test, NamesLocalEndpointsAfterTheAddress) {
+  ASSERT_EQ("ipc:///tmp/rpcz.local.__5555",
+            get_local_endpoint("tcp://*:5555"));
+  ASSERT_EQ("ipc:///tmp/rpcz.local.127.0.0.1_5555",
+            get_local_endpoint("ntcp://127.0.0.1:5555"));
+  ASSERT_EQ("ipc:///tmp/rpcz.local.___1__5555",
+            get_local_endpoint("tcp://[::1]:5555"));
+}
+
+#ifdef __linux__
+TEST(locality_test, IdentifiesTheHost) {
+  ASSERT_NE("", get_host_identity());
+  ASSERT_EQ(get_host_identity(), get_host_identity());
+}
+#endif
+}  // namespace rpcz
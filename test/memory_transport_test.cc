@@ -0,0 +1,125 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <zmq.hpp>
+#include "gtest/gtest.h"
+#include "rpcz/memory_transport.hpp"
+#include "rpcz/zmq_utils.hpp"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+bool fd_readable(transport_socket* socket) {
+  struct pollfd pollfd = {socket->get_pollitem().fd, POLLIN, 0};
+  return poll(&pollfd, 1, 0) == 1;
+}
+
+TEST(memory_transport_test, RoutesRequestsAndReplies) {
+  memory_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("mem://routes"));
+  scoped_ptr<transport_socket> client1(transport.connect("mem://routes"));
+  scoped_ptr<transport_socket> client2(transport.connect("mem://routes"));
+  send_frames(client1.get(), "", "one");
+  send_frames(client2.get(), "", "two");
+  ASSERT_EQ(2, server->ready_messages(false));
+
+  bool more;
+  std::string peer1(recv_string(server.get(), &more));
+  ASSERT_TRUE(more);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  ASSERT_EQ("one", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+  std::string peer2(recv_string(server.get(), &more));
+  ASSERT_NE(peer1, peer2);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  ASSERT_EQ("two", recv_string(server.get(), &more));
+  ASSERT_EQ(0, server->ready_messages(false));
+
+  send_string(server.get(), peer2, ZMQ_SNDMORE);
+  send_frames(server.get(), "", "reply");
+  ASSERT_EQ(0, client1->ready_messages(false));
+  ASSERT_EQ(1, client2->ready_messages(false));
+  ASSERT_EQ("", recv_string(client2.get(), &more));
+  ASSERT_EQ("reply", recv_string(client2.get(), &more));
+  ASSERT_FALSE(more);
+}
+
+TEST(memory_transport_test, HandsOverFramesWithoutCopies) {
+  memory_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("mem://nocopy"));
+  scoped_ptr<transport_socket> client(transport.connect("mem://nocopy"));
+  zmq::message_t payload(1 << 20);
+  void* data = payload.data();
+  client->send(payload, 0);
+  bool more;
+  zmq::message_t frame;
+  server->recv(&frame, &more);
+  server->recv(&frame, &more);
+  ASSERT_EQ(data, frame.data());
+}
+
+TEST(memory_transport_test, WakesUpOnlyWaitingReaders) {
+  memory_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("mem://wakeup"));
+  scoped_ptr<transport_socket> client(transport.connect("mem://wakeup"));
+  // The reader is busy: no wake-up.
+  send_frames(client.get(), "", "busy");
+  ASSERT_FALSE(fd_readable(server.get()));
+  ASSERT_TRUE(server->prepare_poll());
+  bool more;
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+
+  // The reader is about to poll: the next message wakes it up.
+  ASSERT_FALSE(server->prepare_poll());
+  send_frames(client.get(), "", "sleeping");
+  ASSERT_TRUE(fd_readable(server.get()));
+  ASSERT_EQ(1, server->ready_messages(true));
+  ASSERT_FALSE(fd_readable(server.get()));
+}
+
+TEST(memory_transport_test, BindingTwiceFails) {
+  memory_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("mem://twice"));
+  ASSERT_THROW(transport.bind("mem://twice"), std::runtime_error);
+}
+
+TEST(memory_transport_test, ReconnectsWhenBoundAgain) {
+  memory_transport transport;
+  scoped_ptr<transport_socket> client(transport.connect("mem://later"));
+  // Not bound yet: dropped.
+  send_frames(client.get(), "", "early");
+  scoped_ptr<transport_socket> server(transport.bind("mem://later"));
+  send_frames(client.get(), "", "first");
+  ASSERT_EQ(1, server->ready_messages(false));
+  server.reset();
+  server.reset(transport.bind("mem://later"));
+  send_frames(client.get(), "", "second");
+  ASSERT_EQ(1, server->ready_messages(false));
+  bool more;
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  ASSERT_EQ("second", recv_string(server.get(), &more));
+}
+
+TEST(memory_transport_test, HandlesOnlyMemEndpoints) {
+  ASSERT_TRUE(memory_transport::handles("mem://x"));
+  ASSERT_FALSE(memory_transport::handles("tcp://localhost:5555"));
+  ASSERT_FALSE(memory_transport::handles("inproc://mem://"));
+}
+}  // namespace rpcz
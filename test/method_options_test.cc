@@ -0,0 +1,164 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <new>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/clock.hpp"
+#include "rpcz/method_options.hpp"
+#include "rpcz/response_cache.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+
+namespace rpcz {
+
+// Keeps the replies to Lookup until release() is called, and never answers
+// Update.
+class HoldingConfigService : public ConfigService {
+ public:
+  virtual void Lookup(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    replies_.push_back(reply);
+  }
+
+  virtual void Update(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+  }
+
+  size_t get_lookups() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    return replies_.size();
+  }
+
+  void release() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    for (size_t i = 0; i < replies_.size(); ++i) {
+      replies_[i].send(SearchResponse());
+    }
+    replies_.clear();
+  }
+
+ private:
+  boost::mutex mu_;
+  std::vector<reply<SearchResponse> > replies_;
+};
+
+TEST(method_options_test, GeneratesOptionConstants) {
+  EXPECT_EQ(2000, ConfigService::Lookup_options::deadline_ms);
+  EXPECT_TRUE(ConfigService::Lookup_options::idempotent);
+  EXPECT_EQ(5000, ConfigService::Lookup_options::cache_ttl_ms);
+  EXPECT_EQ(0, ConfigService::Lookup_options::priority);
+  EXPECT_STREQ("lookups", ConfigService::Lookup_options::executor);
+
+  EXPECT_EQ(50, ConfigService::Update_options::deadline_ms);
+  EXPECT_FALSE(ConfigService::Update_options::idempotent);
+  EXPECT_EQ(0, ConfigService::Update_options::cache_ttl_ms);
+  EXPECT_EQ(3, ConfigService::Update_options::priority);
+  EXPECT_STREQ("", ConfigService::Update_options::executor);
+
+  EXPECT_EQ(-1, SearchService::Search_options::deadline_ms);
+  EXPECT_FALSE(SearchService::Search_options::idempotent);
+}
+
+TEST(method_options_test, MethodOptionsOverrideServiceDefaults) {
+  const google::protobuf::ServiceDescriptor* descriptor =
+      ConfigService::descriptor();
+  method_options lookup(
+      get_method_options(descriptor->FindMethodByName("Lookup")));
+  EXPECT_EQ(2000, lookup.deadline_ms());
+  EXPECT_TRUE(lookup.idempotent());
+  EXPECT_EQ(5000, lookup.cache_ttl_ms());
+  method_options update(
+      get_method_options(descriptor->FindMethodByName("Update")));
+  EXPECT_EQ(50, update.deadline_ms());
+  EXPECT_EQ(3, update.priority());
+  EXPECT_FALSE(update.idempotent());
+}
+
+TEST(method_options_test, ResponseCacheTakesTtls) {
+  response_cache cache(1 << 20);
+  cache.set_cacheable(ConfigService::descriptor());
+  EXPECT_EQ(5000, cache.get_ttl_ms("ConfigService", "Lookup"));
+  EXPECT_EQ(0, cache.get_ttl_ms("ConfigService", "Update"));
+}
+
+class method_options_server_test : public ::testing::Test {
+ protected:
+  method_options_server_test()
+      : server_(application_), service_(new HoldingConfigService) {
+    server_.register_service(service_);
+    server_.bind("inproc://method_options_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://method_options_test"));
+    stub_.reset(new ConfigService_Stub(channel_.get()));
+  }
+
+  application application_;
+  server server_;
+  HoldingConfigService* service_;
+  scoped_ptr<rpc_channel> channel_;
+  scoped_ptr<ConfigService_Stub> stub_;
+};
+
+TEST_F(method_options_server_test, StubsUseMethodDeadline) {
+  SearchRequest request;
+  request.set_query("config");
+  SearchResponse response;
+  uint64 start_usec = zclock_time_usec();
+  EXPECT_EQ(status::DEADLINE_EXCEEDED,
+            stub_->Update(request, &response, std::nothrow));
+  // Far below the 2000 ms service default.
+  EXPECT_GT(1000000, zclock_time_usec() - start_usec);
+  EXPECT_THROW(stub_->Update(request, &response), rpc_error);
+
+  rpc rpc;
+  stub_->Update(request, &response, &rpc, NULL);
+  EXPECT_EQ(50, rpc.get_deadline_ms());
+  rpc.wait();
+  EXPECT_EQ(status::DEADLINE_EXCEEDED, rpc.get_status());
+}
+
+TEST_F(method_options_server_test, CoalescesIdempotentMethods) {
+  SearchRequest request;
+  request.set_query("config");
+  SearchResponse responses[2];
+  rpc rpcs[2];
+  for (int i = 0; i < 2; ++i) {
+    stub_->Lookup(request, &responses[i], &rpcs[i], NULL);
+  }
+  for (int i = 0;
+       i < 100 && (server_.get_coalesced_requests() < 1 ||
+                   service_->get_lookups() < 1); ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(1, service_->get_lookups());
+  service_->release();
+  for (int i = 0; i < 2; ++i) {
+    rpcs[i].wait();
+    EXPECT_EQ(status::OK, rpcs[i].get_status());
+  }
+  EXPECT_EQ(1, server_.get_coalesced_requests());
+}
+}  // namespace rpcz
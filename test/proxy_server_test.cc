@@ -0,0 +1,166 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/proxy_server.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+
+namespace rpcz {
+
+// Answers with the name of its backend, and never answers "hang".
+class NamedSearchService : public SearchService {
+ public:
+  explicit NamedSearchService(const std::string& name) : name_(name) {}
+
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    if (request.query() == "hang") {
+      return;
+    }
+    if (request.query() == "fail") {
+      reply.Error(17, "Failed at " + name_);
+      return;
+    }
+    SearchResponse response;
+    response.add_results(name_);
+    response.add_results(request.query());
+    reply.send(response);
+  }
+
+ private:
+  const std::string name_;
+};
+
+class proxy_server_test : public ::testing::Test {
+ protected:
+  proxy_server_test()
+      : backend1_(application_), backend2_(application_),
+        proxy_(application_) {
+    backend1_.register_service(new NamedSearchService("backend1"));
+    backend1_.register_service(new NamedSearchService("backend1"), "Other");
+    backend1_.bind("inproc://proxy_test.backend1");
+    backend2_.register_service(new NamedSearchService("backend2"));
+    backend2_.register_service(new NamedSearchService("backend2"), "Other");
+    backend2_.bind("inproc://proxy_test.backend2");
+  }
+
+  void start_proxy() {
+    proxy_.bind("inproc://proxy_test.frontend");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://proxy_test.frontend"));
+  }
+
+  // Returns the backend that answered the query.
+  std::string search(const std::string& service, const std::string& query) {
+    SearchService_Stub stub(channel_.get(), service);
+    SearchRequest request;
+    request.set_query(query);
+    SearchResponse response;
+    stub.Search(request, &response, 1000);
+    EXPECT_EQ(query, response.results(1));
+    return response.results(0);
+  }
+
+  application application_;
+  server backend1_;
+  server backend2_;
+  proxy_server proxy_;
+  scoped_ptr<rpc_channel> channel_;
+};
+
+TEST_F(proxy_server_test, ForwardsRequestsAndReplies) {
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend1");
+  start_proxy();
+  ASSERT_EQ("backend1", search("SearchService", "happiness"));
+  // A large payload goes through untouched.
+  std::string large(1 << 20, 'x');
+  ASSERT_EQ("backend1", search("SearchService", large));
+}
+
+TEST_F(proxy_server_test, RelaysApplicationErrors) {
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend1");
+  start_proxy();
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  request.set_query("fail");
+  SearchResponse response;
+  rpc rpc;
+  stub.Search(request, &response, &rpc, NULL);
+  rpc.wait();
+  ASSERT_EQ(status::APPLICATION_ERROR, rpc.get_status());
+  ASSERT_EQ(17, rpc.get_application_error_code());
+  ASSERT_EQ("Failed at backend1", rpc.get_error_message());
+}
+
+TEST_F(proxy_server_test, RoutesByServiceAndMethod) {
+  proxy_.add_route("SearchService", "Search", "inproc://proxy_test.backend1");
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend2");
+  proxy_.add_route("", "", "inproc://proxy_test.backend2");
+  start_proxy();
+  ASSERT_EQ("backend1", search("SearchService", "method route"));
+  ASSERT_EQ("backend2", search("Other", "default route"));
+}
+
+TEST_F(proxy_server_test, SpreadsRequestsOverUpstreams) {
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend1");
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend2");
+  start_proxy();
+  int backend1 = 0;
+  for (int i = 0; i < 10; ++i) {
+    if (search("SearchService", "spread") == "backend1") {
+      ++backend1;
+    }
+  }
+  ASSERT_EQ(5, backend1);
+}
+
+TEST_F(proxy_server_test, FailsRequestsWithoutRoute) {
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend1");
+  start_proxy();
+  SearchService_Stub stub(channel_.get(), std::string("Other"));
+  SearchRequest request;
+  request.set_query("lost");
+  SearchResponse response;
+  rpc rpc;
+  stub.Search(request, &response, &rpc, NULL);
+  rpc.wait();
+  ASSERT_EQ(status::APPLICATION_ERROR, rpc.get_status());
+  ASSERT_EQ(application_error::NO_SUCH_SERVICE,
+            rpc.get_application_error_code());
+}
+
+TEST_F(proxy_server_test, EnforcesUpstreamDeadline) {
+  proxy_.add_route("SearchService", "", "inproc://proxy_test.backend1");
+  proxy_.set_deadline_ms(10);
+  start_proxy();
+  SearchService_Stub stub(channel_.get());
+  SearchRequest request;
+  request.set_query("hang");
+  SearchResponse response;
+  rpc rpc;
+  stub.Search(request, &response, &rpc, NULL);
+  rpc.wait();
+  ASSERT_EQ(status::DEADLINE_EXCEEDED, rpc.get_status());
+  ASSERT_EQ("Upstream deadline exceeded.", rpc.get_error_message());
+}
+}  // namespace rpcz
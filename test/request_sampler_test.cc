@@ -0,0 +1,56 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gtest/gtest.h"
+#include "rpcz/request_sampler.hpp"
+
+namespace rpcz {
+
+TEST(request_sampler_test, SamplesEverythingByDefault) {
+  request_sampler sampler;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(sampler.should_sample("SearchService", "Search"));
+  }
+}
+
+TEST(request_sampler_test, ZeroSamplesNothing) {
+  request_sampler sampler;
+  sampler.set_default_sample_rate(0);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_FALSE(sampler.should_sample("SearchService", "Search"));
+  }
+}
+
+TEST(request_sampler_test, MethodRateOverridesDefault) {
+  request_sampler sampler;
+  sampler.set_default_sample_rate(0);
+  sampler.set_sample_rate("SearchService", "Search", 1);
+  ASSERT_TRUE(sampler.should_sample("SearchService", "Search"));
+  ASSERT_FALSE(sampler.should_sample("SearchService", "Other"));
+  ASSERT_FALSE(sampler.should_sample("OtherService", "Search"));
+}
+
+TEST(request_sampler_test, SamplesOneInN) {
+  request_sampler sampler;
+  sampler.set_default_sample_rate(10);
+  int sampled = 0;
+  for (int i = 0; i < 10000; ++i) {
+    if (sampler.should_sample("SearchService", "Search")) {
+      ++sampled;
+    }
+  }
+  EXPECT_LT(700, sampled);
+  EXPECT_GT(1300, sampled);
+}
+}  // namespace rpcz
@@ -0,0 +1,187 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <boost/thread/thread.hpp>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/response_cache.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/rpcz_options.pb.h"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+// Entries of this size take 96 bytes of the cache.
+const char kResponse[] = "response-response-response-rrr";
+
+TEST(response_cache_test, LooksUpInsertedResponses) {
+  response_cache cache(1 << 20);
+  std::string key(response_cache::make_key("Service", "Method", "abc", 3));
+  std::string response;
+  ASSERT_FALSE(cache.lookup(key, &response));
+  cache.insert(key, "first", 1000);
+  ASSERT_TRUE(cache.lookup(key, &response));
+  ASSERT_EQ("first", response);
+  cache.insert(key, "second", 1000);
+  ASSERT_TRUE(cache.lookup(key, &response));
+  ASSERT_EQ("second", response);
+  ASSERT_FALSE(cache.lookup(
+      response_cache::make_key("Service", "Other", "abc", 3), &response));
+  ASSERT_EQ(2, cache.get_hits());
+  ASSERT_EQ(2, cache.get_misses());
+  cache.clear();
+  ASSERT_FALSE(cache.lookup(key, &response));
+  ASSERT_EQ(0, cache.get_bytes());
+}
+
+TEST(response_cache_test, KeysSeparateServiceMethodAndRequest) {
+  ASSERT_NE(response_cache::make_key("ab", "c", "", 0),
+            response_cache::make_key("a", "bc", "", 0));
+  ASSERT_NE(response_cache::make_key("a", "b", "c", 1),
+            response_cache::make_key("a", "bc", "", 0));
+}
+
+TEST(response_cache_test, ExpiresEntries) {
+  response_cache cache(1 << 20);
+  cache.insert("key", "response", 1);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+  std::string response;
+  ASSERT_FALSE(cache.lookup("key", &response));
+}
+
+TEST(response_cache_test, EvictsEntriesNotLookedUp) {
+  response_cache cache(300, 1);
+  cache.insert("k1", kResponse, 1000);
+  cache.insert("k2", kResponse, 1000);
+  cache.insert("k3", kResponse, 1000);
+  ASSERT_EQ(288, cache.get_bytes());
+  std::string response;
+  ASSERT_TRUE(cache.lookup("k1", &response));
+  cache.insert("k4", kResponse, 1000);
+  ASSERT_EQ(1, cache.get_evictions());
+  ASSERT_EQ(288, cache.get_bytes());
+  ASSERT_TRUE(cache.lookup("k1", &response));
+  ASSERT_FALSE(cache.lookup("k2", &response));
+  ASSERT_TRUE(cache.lookup("k3", &response));
+  ASSERT_TRUE(cache.lookup("k4", &response));
+  // Responses larger than the cache are not cached.
+  cache.insert("k5", std::string(300, 'x'), 1000);
+  ASSERT_FALSE(cache.lookup("k5", &response));
+}
+
+TEST(response_cache_test, KnowsCacheableMethods) {
+  response_cache cache(1 << 20);
+  cache.set_cacheable("SearchService", "Search", 500);
+  ASSERT_EQ(500, cache.get_ttl_ms("SearchService", "Search"));
+  ASSERT_EQ(0, cache.get_ttl_ms("SearchService", "Other"));
+  ASSERT_EQ(0, cache.get_ttl_ms("Other", "Search"));
+}
+
+TEST(response_cache_test, TakesTtlsFromMethodOptions) {
+  google::protobuf::FileDescriptorProto file;
+  file.set_name("cacheable.proto");
+  file.add_message_type()->set_name("Empty");
+  google::protobuf::ServiceDescriptorProto* service = file.add_service();
+  service->set_name("CacheableService");
+  service->mutable_options()->MutableExtension(service_defaults)
+      ->set_cache_ttl_ms(100);
+  const char* names[] = {"Default", "Own", "Never"};
+  for (int i = 0; i < 3; ++i) {
+    google::protobuf::MethodDescriptorProto* m = service->add_method();
+    m->set_name(names[i]);
+    m->set_input_type("Empty");
+    m->set_output_type("Empty");
+  }
+  service->mutable_method(1)->mutable_options()->MutableExtension(method)
+      ->set_cache_ttl_ms(500);
+  service->mutable_method(2)->mutable_options()->MutableExtension(method)
+      ->set_cache_ttl_ms(0);
+  google::protobuf::DescriptorPool pool;
+  const google::protobuf::FileDescriptor* descriptor = pool.BuildFile(file);
+  ASSERT_TRUE(descriptor != NULL);
+
+  response_cache cache(1 << 20);
+  cache.set_cacheable(descriptor->service(0));
+  cache.set_cacheable(descriptor->service(0), "Renamed");
+  ASSERT_EQ(100, cache.get_ttl_ms("CacheableService", "Default"));
+  ASSERT_EQ(500, cache.get_ttl_ms("CacheableService", "Own"));
+  ASSERT_EQ(0, cache.get_ttl_ms("CacheableService", "Never"));
+  ASSERT_EQ(500, cache.get_ttl_ms("Renamed", "Own"));
+}
+
+class response_cache_channel_test : public ::testing::Test {
+ protected:
+  response_cache_channel_test()
+      : cache_(1 << 20),
+        application_(make_options(&cache_)),
+        server_(application_),
+        service_(new CountingSearchService) {
+    cache_.set_cacheable("SearchService", "Search", 60000);
+    server_.register_service(service_);
+    server_.bind("inproc://response_cache_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://response_cache_test"));
+  }
+
+  static application::options make_options(response_cache* cache) {
+    application::options options;
+    options.response_cache = cache;
+    return options;
+  }
+
+  status_code search(const std::string& query) {
+    SearchService_Stub stub(channel_.get());
+    SearchRequest request;
+    request.set_query(query);
+    SearchResponse response;
+    rpc rpc;
+    stub.Search(request, &response, &rpc, NULL);
+    rpc.wait();
+    if (rpc.ok()) {
+      EXPECT_EQ(query, response.results(0));
+    }
+    return rpc.get_status();
+  }
+
+  response_cache cache_;
+  application application_;
+  server server_;
+  CountingSearchService* service_;
+  scoped_ptr<rpc_channel> channel_;
+};
+
+TEST_F(response_cache_channel_test, AnswersRepeatedRequestsFromCache) {
+  ASSERT_EQ(status::OK, search("happiness"));
+  ASSERT_EQ(status::OK, search("happiness"));
+  ASSERT_EQ(1, service_->get_calls());
+  ASSERT_EQ(1, cache_.get_hits());
+  ASSERT_EQ(status::OK, search("sadness"));
+  ASSERT_EQ(2, service_->get_calls());
+}
+
+TEST_F(response_cache_channel_test, DoesNotCacheErrors) {
+  ASSERT_EQ(status::APPLICATION_ERROR, search("fail"));
+  ASSERT_EQ(status::APPLICATION_ERROR, search("fail"));
+  ASSERT_EQ(2, service_->get_calls());
+}
+}  // namespace rpcz
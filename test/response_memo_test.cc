@@ -0,0 +1,153 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <boost/thread/thread.hpp>
+#include <gtest/gtest.h>
+#include <zmq.hpp>
+
+#include "rpcz/application.hpp"
+#include "rpcz/response_memo.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+#include "rpcz/zmq_utils.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+bool lookup(response_memo* memo, const std::string& request,
+            std::string* response) {
+  scoped_ptr<zmq::message_t> request_frame(string_to_message(request));
+  zmq::message_t response_frame;
+  if (!memo->lookup("Service", "Method", request_frame.get(),
+                    &response_frame)) {
+    return false;
+  }
+  *response = message_to_string(response_frame);
+  return true;
+}
+
+void insert(response_memo* memo, const std::string& request,
+            const std::string& response, int64 ttl_ms) {
+  scoped_ptr<zmq::message_t> request_frame(string_to_message(request));
+  scoped_ptr<zmq::message_t> response_frame(string_to_message(response));
+  memo->insert("Service", "Method", request_frame.get(),
+               response_frame.get(), ttl_ms);
+}
+
+TEST(response_memo_test, LooksUpMemoizedResponses) {
+  // Room for the large entry below.
+  response_memo memo(2 << 20);
+  std::string response;
+  ASSERT_FALSE(lookup(&memo, "request", &response));
+  insert(&memo, "request", "response", 1000);
+  ASSERT_TRUE(lookup(&memo, "request", &response));
+  ASSERT_EQ("response", response);
+  ASSERT_FALSE(lookup(&memo, "other request", &response));
+  // Large frames are shared rather than copied, and survive the original.
+  std::string large(1 << 20, 'x');
+  scoped_ptr<zmq::message_t> request_frame(string_to_message("large"));
+  scoped_ptr<zmq::message_t> large_frame(string_to_message(large));
+  memo.insert("Service", "Method", request_frame.get(), large_frame.get(),
+              1000);
+  zmq::message_t shared_frame;
+  ASSERT_TRUE(memo.lookup("Service", "Method", request_frame.get(),
+                          &shared_frame));
+  ASSERT_EQ(large_frame->data(), shared_frame.data());
+  large_frame.reset();
+  ASSERT_TRUE(lookup(&memo, "large", &response));
+  ASSERT_EQ(large, response);
+  ASSERT_EQ(3, memo.get_hits());
+  ASSERT_EQ(2, memo.get_misses());
+  memo.clear();
+  ASSERT_EQ(0, memo.get_bytes());
+}
+
+TEST(response_memo_test, ExpiresEntries) {
+  response_memo memo(1 << 20);
+  insert(&memo, "request", "response", 1);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+  std::string response;
+  ASSERT_FALSE(lookup(&memo, "request", &response));
+  ASSERT_EQ(0, memo.get_bytes());
+}
+
+TEST(response_memo_test, EvictsLeastRecentlyUsed) {
+  // Room for two entries of 151 bytes.
+  response_memo memo(400);
+  insert(&memo, "r1", "response", 1000);
+  insert(&memo, "r2", "response", 1000);
+  std::string response;
+  ASSERT_TRUE(lookup(&memo, "r1", &response));
+  insert(&memo, "r3", "response", 1000);
+  ASSERT_EQ(1, memo.get_evictions());
+  ASSERT_TRUE(lookup(&memo, "r1", &response));
+  ASSERT_FALSE(lookup(&memo, "r2", &response));
+  ASSERT_TRUE(lookup(&memo, "r3", &response));
+}
+
+class response_memo_server_test : public ::testing::Test {
+ protected:
+  response_memo_server_test()
+      : memo_(1 << 20), server_(application_),
+        service_(new CountingSearchService) {
+    memo_.set_memoized("SearchService", "Search", 60000);
+    server_.register_service(service_);
+    server_.set_response_memo(&memo_);
+    server_.bind("inproc://response_memo_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://response_memo_test"));
+  }
+
+  status_code search(const std::string& query) {
+    SearchService_Stub stub(channel_.get());
+    SearchRequest request;
+    request.set_query(query);
+    SearchResponse response;
+    rpc rpc;
+    stub.Search(request, &response, &rpc, NULL);
+    rpc.wait();
+    if (rpc.ok()) {
+      EXPECT_EQ(query, response.results(0));
+    }
+    return rpc.get_status();
+  }
+
+  response_memo memo_;
+  application application_;
+  server server_;
+  CountingSearchService* service_;
+  scoped_ptr<rpc_channel> channel_;
+};
+
+TEST_F(response_memo_server_test, AnswersRepeatedRequestsFromMemo) {
+  ASSERT_EQ(status::OK, search("happiness"));
+  ASSERT_EQ(status::OK, search("happiness"));
+  ASSERT_EQ(status::OK, search("happiness"));
+  ASSERT_EQ(1, service_->get_calls());
+  ASSERT_EQ(2, memo_.get_hits());
+  ASSERT_EQ(status::OK, search("sadness"));
+  ASSERT_EQ(2, service_->get_calls());
+}
+
+TEST_F(response_memo_server_test, DoesNotMemoizeErrors) {
+  ASSERT_EQ(status::APPLICATION_ERROR, search("fail"));
+  ASSERT_EQ(status::APPLICATION_ERROR, search("fail"));
+  ASSERT_EQ(2, service_->get_calls());
+}
+}  // namespace rpcz
@@ -0,0 +1,197 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <stdexcept>
+#include <string>
+#include <zmq.hpp>
+#include "gtest/gtest.h"
+#include "rpcz/shm_transport.hpp"
+#include "rpcz/zmq_utils.hpp"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+TEST(shm_transport_test, RoundTrip) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("shm://round_trip"));
+  scoped_ptr<transport_socket> client(transport.connect("shm://round_trip"));
+  send_frames(client.get(), "", "request");
+  wait_for_message(server.get(), client.get());
+
+  bool more;
+  std::string peer(recv_string(server.get(), &more));
+  ASSERT_TRUE(more);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  ASSERT_EQ("request", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+
+  send_string(server.get(), peer, ZMQ_SNDMORE);
+  send_frames(server.get(), "", "reply");
+  wait_for_message(client.get(), server.get());
+  ASSERT_EQ("", recv_string(client.get(), &more));
+  ASSERT_EQ("reply", recv_string(client.get(), &more));
+  ASSERT_FALSE(more);
+}
+
+TEST(shm_transport_test, ReusesRingSpaceOfReleasedFrames) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("shm://reuse"));
+  scoped_ptr<transport_socket> client(transport.connect("shm://reuse"));
+  // 64MB in total through 16MB rings, with large frames read in place.
+  const size_t kSize = 1 << 20;
+  for (int i = 0; i < 64; ++i) {
+    zmq::message_t payload(kSize);
+    memset(payload.data(), 'a' + i % 26, kSize);
+    send_string(client.get(), "", ZMQ_SNDMORE);
+    client->send(payload, 0);
+    wait_for_message(server.get(), client.get());
+    bool more;
+    recv_string(server.get(), &more);
+    recv_string(server.get(), &more);
+    zmq::message_t frame;
+    server->recv(&frame, &more);
+    ASSERT_FALSE(more);
+    ASSERT_EQ(kSize, frame.size());
+    ASSERT_EQ('a' + i % 26, static_cast<char*>(frame.data())[kSize - 1]);
+  }
+}
+
+TEST(shm_transport_test, WaitsForSpaceWhileFramesAreHeld) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("shm://held"));
+  scoped_ptr<transport_socket> client(transport.connect("shm://held"));
+  const size_t kSize = 4 << 20;
+  for (int i = 0; i < 4; ++i) {
+    zmq::message_t payload(kSize);
+    send_string(client.get(), "", ZMQ_SNDMORE);
+    client->send(payload, 0);
+  }
+  // Three messages fill the ring; the fourth waits until the first three
+  // are freed.
+  bool more;
+  zmq::message_t held[3];
+  for (int i = 0; i < 3; ++i) {
+    wait_for_message(server.get(), client.get());
+    recv_string(server.get(), &more);
+    recv_string(server.get(), &more);
+    server->recv(&held[i], &more);
+  }
+  ASSERT_EQ(0, server->ready_messages(false));
+  for (int i = 0; i < 3; ++i) {
+    held[i].rebuild(0);
+  }
+  wait_for_message(server.get(), client.get());
+}
+
+TEST(shm_transport_test, CopiesMessagesLargerThanTheRingInChunks) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("shm://chunks"));
+  scoped_ptr<transport_socket> client(transport.connect("shm://chunks"));
+  // 24MB through 16MB rings, followed by a message that is not chunked.
+  const size_t kSize = 24 << 20;
+  zmq::message_t payload(kSize);
+  for (size_t i = 0; i < kSize; ++i) {
+    static_cast<char*>(payload.data())[i] = 'a' + i % 26;
+  }
+  send_string(client.get(), "", ZMQ_SNDMORE);
+  client->send(payload, ZMQ_SNDMORE);
+  send_string(client.get(), "trailer", 0);
+  send_frames(client.get(), "", "next");
+
+  wait_for_message(server.get(), client.get());
+  bool more;
+  recv_string(server.get(), &more);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  zmq::message_t frame;
+  server->recv(&frame, &more);
+  ASSERT_TRUE(more);
+  ASSERT_EQ(kSize, frame.size());
+  for (size_t i = 0; i < kSize; i += 4099) {
+    ASSERT_EQ('a' + i % 26, static_cast<char*>(frame.data())[i]);
+  }
+  ASSERT_EQ("trailer", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+
+  if (server->ready_messages(false) == 0) {
+    wait_for_message(server.get(), client.get());
+  }
+  recv_string(server.get(), &more);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  ASSERT_EQ("next", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+}
+
+TEST(shm_transport_test, RoutesRepliesToTheirClient) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("shm://routes"));
+  scoped_ptr<transport_socket> client1(transport.connect("shm://routes"));
+  scoped_ptr<transport_socket> client2(transport.connect("shm://routes"));
+  send_frames(client1.get(), "", "one");
+  wait_for_message(server.get(), client1.get());
+  bool more;
+  std::string peer1(recv_string(server.get(), &more));
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  send_frames(client2.get(), "", "two");
+  wait_for_message(server.get(), client2.get());
+  std::string peer2(recv_string(server.get(), &more));
+  ASSERT_NE(peer1, peer2);
+  recv_string(server.get(), &more);
+  ASSERT_EQ("two", recv_string(server.get(), &more));
+
+  send_string(server.get(), peer2, ZMQ_SNDMORE);
+  send_frames(server.get(), "", "for two");
+  wait_for_message(client2.get(), server.get());
+  recv_string(client2.get(), &more);
+  ASSERT_EQ("for two", recv_string(client2.get(), &more));
+  ASSERT_EQ(0, client1->ready_messages(true));
+}
+
+TEST(shm_transport_test, ReconnectsWhenBoundAgain) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> client(transport.connect("shm://later"));
+  // Not bound yet: dropped.
+  send_frames(client.get(), "", "early");
+  scoped_ptr<transport_socket> server(transport.bind("shm://later"));
+  send_frames(client.get(), "", "first");
+  wait_for_message(server.get(), client.get());
+  bool more;
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  ASSERT_EQ("first", recv_string(server.get(), &more));
+
+  // The client notices that the server went away and connects again.
+  server.reset();
+  server.reset(transport.bind("shm://later"));
+  ASSERT_EQ(0, client->ready_messages(true));
+  send_frames(client.get(), "", "second");
+  wait_for_message(server.get(), client.get());
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  ASSERT_EQ("second", recv_string(server.get(), &more));
+}
+
+TEST(shm_transport_test, BindingTwiceFails) {
+  shm_transport transport;
+  scoped_ptr<transport_socket> server(transport.bind("shm://twice"));
+  ASSERT_THROW(transport.bind("shm://twice"), std::runtime_error);
+}
+
+TEST(shm_transport_test, HandlesOnlyShmEndpoints) {
+  ASSERT_TRUE(shm_transport::handles("shm://x"));
+  ASSERT_FALSE(shm_transport::handles("ipc:///tmp/x"));
+  ASSERT_THROW(shm_transport().bind("shm://"), std::runtime_error);
+}
+}  // namespace rpcz
@@ -0,0 +1,86 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <new>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/status_search.pb.h"
+#include "proto/status_search.rpcz.h"
+
+namespace rpcz {
+
+class FailingSearchService : public StatusSearchService {
+ public:
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    if (request.query() == "fail") {
+      reply.Error(17, "I don't like fail.");
+      return;
+    }
+    SearchResponse response;
+    response.add_results("The search for " + request.query());
+    reply.send(response);
+  }
+};
+
+class sync_errors_test : public ::testing::Test {
+ protected:
+  sync_errors_test() : server_(application_) {
+    server_.register_service(new FailingSearchService);
+    server_.bind("inproc://sync_errors_test");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://sync_errors_test"));
+    stub_.reset(new StatusSearchService_Stub(channel_.get()));
+  }
+
+  application application_;
+  server server_;
+  scoped_ptr<rpc_channel> channel_;
+  scoped_ptr<StatusSearchService_Stub> stub_;
+};
+
+// status_search.proto is generated with sync_errors=status.
+TEST_F(sync_errors_test, PlainMethodReturnsStatus) {
+  SearchRequest request;
+  request.set_query("happiness");
+  SearchResponse response;
+  status_code code = stub_->Search(request, &response);
+  EXPECT_EQ(status::OK, code);
+  ASSERT_EQ(1, response.results_size());
+  EXPECT_EQ("The search for happiness", response.results(0));
+
+  request.set_query("fail");
+  EXPECT_EQ(status::APPLICATION_ERROR, stub_->Search(request, &response));
+}
+
+TEST_F(sync_errors_test, NothrowVariantsKeepTheirSignatures) {
+  SearchRequest request;
+  request.set_query("fail");
+  SearchResponse response;
+  EXPECT_EQ(status::APPLICATION_ERROR,
+            stub_->Search(request, &response, std::nothrow));
+  rpc rpc;
+  EXPECT_EQ(status::APPLICATION_ERROR,
+            stub_->Search(request, &response, &rpc, std::nothrow));
+  EXPECT_EQ(17, rpc.get_application_error_code());
+  EXPECT_EQ("I don't like fail.", rpc.get_error_message());
+}
+}  // namespace rpcz
@@ -0,0 +1,177 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <zmq.hpp>
+#include "gtest/gtest.h"
+#include "rpcz/tcp_transport.hpp"
+#include "rpcz/zmq_utils.hpp"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+TEST(tcp_transport_test, RoundTrip) {
+  tcp_transport transport;
+  std::string endpoint(make_endpoint("ntcp", "127.0.0.1", pick_unused_port()));
+  scoped_ptr<transport_socket> server(transport.bind(endpoint));
+  scoped_ptr<transport_socket> client(transport.connect(endpoint));
+  send_frames(client.get(), "", "request");
+  wait_for_message(server.get(), client.get());
+
+  bool more;
+  std::string peer(recv_string(server.get(), &more));
+  ASSERT_TRUE(more);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  ASSERT_EQ("request", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+
+  send_string(server.get(), peer, ZMQ_SNDMORE);
+  send_frames(server.get(), "", "reply");
+  wait_for_message(client.get(), server.get());
+  ASSERT_EQ("", recv_string(client.get(), &more));
+  ASSERT_EQ("reply", recv_string(client.get(), &more));
+  ASSERT_FALSE(more);
+}
+
+TEST(tcp_transport_test, LargeFrames) {
+  tcp_transport transport;
+  std::string endpoint(make_endpoint("ntcp", "127.0.0.1", pick_unused_port()));
+  scoped_ptr<transport_socket> server(transport.bind(endpoint));
+  scoped_ptr<transport_socket> client(transport.connect(endpoint));
+  const size_t kSize = 4 << 20;
+  zmq::message_t payload(kSize);
+  memset(payload.data(), 'x', kSize);
+  static_cast<char*>(payload.data())[kSize - 1] = 'y';
+  send_string(client.get(), "", ZMQ_SNDMORE);
+  client->send(payload, ZMQ_SNDMORE);
+  send_string(client.get(), "after", 0);
+  wait_for_message(server.get(), client.get());
+
+  bool more;
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  zmq::message_t frame;
+  server->recv(&frame, &more);
+  ASSERT_EQ(kSize, frame.size());
+  ASSERT_EQ('x', static_cast<char*>(frame.data())[0]);
+  ASSERT_EQ('y', static_cast<char*>(frame.data())[kSize - 1]);
+  ASSERT_EQ("after", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+}
+
+TEST(tcp_transport_test, RoutesRepliesToTheirClient) {
+  tcp_transport transport;
+  std::string endpoint(make_endpoint("ntcp", "127.0.0.1", pick_unused_port()));
+  scoped_ptr<transport_socket> server(transport.bind(endpoint));
+  scoped_ptr<transport_socket> client1(transport.connect(endpoint));
+  scoped_ptr<transport_socket> client2(transport.connect(endpoint));
+  send_frames(client1.get(), "", "one");
+  wait_for_message(server.get(), client1.get());
+  bool more;
+  std::string peer1(recv_string(server.get(), &more));
+  recv_string(server.get(), &more);
+  recv_string(server.get(), &more);
+  send_frames(client2.get(), "", "two");
+  wait_for_message(server.get(), client2.get());
+  std::string peer2(recv_string(server.get(), &more));
+  ASSERT_NE(peer1, peer2);
+  recv_string(server.get(), &more);
+  ASSERT_EQ("two", recv_string(server.get(), &more));
+
+  send_string(server.get(), peer2, ZMQ_SNDMORE);
+  send_frames(server.get(), "", "for two");
+  wait_for_message(client2.get(), server.get());
+  recv_string(client2.get(), &more);
+  ASSERT_EQ("for two", recv_string(client2.get(), &more));
+  ASSERT_EQ(0, client1->ready_messages(true));
+}
+
+// Connects a plain TCP socket to the loopback port.
+int connect_raw(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  EXPECT_EQ(0, connect(fd, reinterpret_cast<struct sockaddr*>(&address),
+                       sizeof(address)));
+  return fd;
+}
+
+// Lets the server handle what arrived until fd is readable on our side.
+bool wait_until_readable(transport_socket* server, int fd) {
+  for (int i = 0; i < 1000; ++i) {
+    struct pollfd pollfds[2] = {
+      {server->get_pollitem().fd, POLLIN, 0},
+      {fd, POLLIN, 0}};
+    poll(pollfds, 2, 10);
+    server->ready_messages(pollfds[0].revents & POLLIN);
+    if (pollfds[1].revents) {
+      return true;
+    }
+  }
+  return false;
+}
+
+TEST(tcp_transport_test, FramesUseNetworkByteOrderAndAreBounded) {
+  tcp_transport transport;
+  int port = pick_unused_port();
+  scoped_ptr<transport_socket> server(
+      transport.bind(make_endpoint("ntcp", "127.0.0.1", port)));
+  int fd = connect_raw(port);
+  uint32 header[] = {htonl(2), htonl(0), htonl(5)};
+  ASSERT_EQ(ssize_t(sizeof(header)), write(fd, header, sizeof(header)));
+  ASSERT_EQ(5, write(fd, "hello", 5));
+  for (int i = 0; i < 1000 && server->ready_messages(true) == 0; ++i) {
+    struct pollfd pollfd = {server->get_pollitem().fd, POLLIN, 0};
+    poll(&pollfd, 1, 10);
+  }
+  bool more;
+  recv_string(server.get(), &more);
+  ASSERT_EQ("", recv_string(server.get(), &more));
+  ASSERT_EQ("hello", recv_string(server.get(), &more));
+  ASSERT_FALSE(more);
+
+  // A frame over the limit is taken as a corrupt stream.
+  uint32 oversized[] = {htonl(1), htonl(1 << 30)};
+  ASSERT_EQ(ssize_t(sizeof(oversized)),
+            write(fd, oversized, sizeof(oversized)));
+  ASSERT_TRUE(wait_until_readable(server.get(), fd));
+  char byte;
+  ASSERT_EQ(0, read(fd, &byte, 1));
+  close(fd);
+}
+
+TEST(tcp_transport_test, BindingTwiceFails) {
+  tcp_transport transport;
+  std::string endpoint(make_endpoint("ntcp", "127.0.0.1", pick_unused_port()));
+  scoped_ptr<transport_socket> server(transport.bind(endpoint));
+  ASSERT_THROW(transport.bind(endpoint), std::runtime_error);
+}
+
+TEST(tcp_transport_test, HandlesOnlyNtcpEndpoints) {
+  ASSERT_TRUE(tcp_transport::handles("ntcp://localhost:5555"));
+  ASSERT_FALSE(tcp_transport::handles("tcp://localhost:5555"));
+  ASSERT_THROW(tcp_transport().connect("ntcp://localhost"),
+               std::runtime_error);
+}
+}  // namespace rpcz
@@ -0,0 +1,157 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RPCZ_TEST_UTIL_H
+#define RPCZ_TEST_UTIL_H
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <zmq.hpp>
+#include "gtest/gtest.h"
+#include "rpcz/logging.hpp"
+#include "rpcz/transport.hpp"
+#include "rpcz/zmq_utils.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+
+namespace rpcz {
+
+// Returns a TCP port of the loopback interface that nothing listens on, so
+// that tests running in parallel do not fight over fixed ports: a socket is
+// bound to port 0 and the port the kernel picked is read back. The socket
+// never connects, so the port can be bound again right away.
+inline int pick_unused_port() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK_GE(fd, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  CHECK_EQ(0, bind(fd, reinterpret_cast<struct sockaddr*>(&address),
+                   sizeof(address)));
+  socklen_t size = sizeof(address);
+  CHECK_EQ(0, getsockname(fd, reinterpret_cast<struct sockaddr*>(&address),
+                          &size));
+  close(fd);
+  return ntohs(address.sin_port);
+}
+
+// Returns "<scheme>://<host>:<port>".
+inline std::string make_endpoint(const std::string& scheme,
+                                 const std::string& host, int port) {
+  std::ostringstream endpoint;
+  endpoint << scheme << "://" << host << ":" << port;
+  return endpoint.str();
+}
+
+// Sends a message of two frames.
+inline void send_frames(transport_socket* socket, const std::string& first,
+                        const std::string& second) {
+  send_string(socket, first, ZMQ_SNDMORE);
+  send_string(socket, second, 0);
+}
+
+inline std::string recv_string(transport_socket* socket, bool* more) {
+  zmq::message_t frame;
+  socket->recv(&frame, more);
+  return message_to_string(frame);
+}
+
+// Polls the sockets until the first one has a message, like the reactor.
+// The other socket is polled too, since its transport may have to make
+// progress for the message to arrive.
+inline void wait_for_message(transport_socket* socket,
+                             transport_socket* other) {
+  for (int i = 0; i < 1000; ++i) {
+    bool ready = socket->prepare_poll();
+    other->prepare_poll();
+    struct pollfd pollfds[2] = {
+      {socket->get_pollitem().fd, POLLIN, 0},
+      {other->get_pollitem().fd, POLLIN, 0}};
+    poll(pollfds, 2, ready ? 0 : 10);
+    other->ready_messages(pollfds[1].revents & POLLIN);
+    if (socket->ready_messages(pollfds[0].revents & POLLIN) > 0) {
+      return;
+    }
+  }
+  FAIL() << "No message arrived.";
+}
+
+// Counts its calls. Answers a query with three results: the query, the
+// number of calls so far and the name of the service. Fails "fail" with
+// application error 17, keeps the replies to "hold" until release() and
+// never answers "hang".
+class CountingSearchService : public SearchService {
+ public:
+  explicit CountingSearchService(const std::string& name = "")
+      : name_(name), calls_(0) {}
+
+  virtual void Search(
+      const SearchRequest& request,
+      reply<SearchResponse> reply) {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    ++calls_;
+    if (request.query() == "hang") {
+      return;
+    }
+    if (request.query() == "hold") {
+      held_.push_back(reply);
+      return;
+    }
+    if (request.query() == "fail") {
+      reply.Error(17, "Failed");
+      return;
+    }
+    reply.send(make_response(request.query()));
+  }
+
+  int get_calls() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    return calls_;
+  }
+
+  void release() {
+    boost::unique_lock<boost::mutex> lock(mu_);
+    for (size_t i = 0; i < held_.size(); ++i) {
+      held_[i].send(make_response("hold"));
+    }
+    held_.clear();
+  }
+
+ private:
+  SearchResponse make_response(const std::string& query) {
+    SearchResponse response;
+    response.add_results(query);
+    response.add_results(boost::lexical_cast<std::string>(calls_));
+    response.add_results(name_);
+    return response;
+  }
+
+  const std::string name_;
+  boost::mutex mu_;
+  int calls_;
+  std::vector<reply<SearchResponse> > held_;
+};
+}  // namespace rpcz
+#endif
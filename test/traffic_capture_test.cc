@@ -0,0 +1,127 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <set>
+#include <string>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include "gtest/gtest.h"
+#include "rpcz/traffic_capture.hpp"
+
+namespace rpcz {
+
+class traffic_capture_test : public ::testing::Test {
+ public:
+  traffic_capture_test()
+      : filename_("traffic_capture_test." +
+                  boost::lexical_cast<std::string>(this) + ".capture") {}
+
+  ~traffic_capture_test() {
+    remove(filename_.c_str());
+  }
+
+ protected:
+  std::string filename_;
+};
+
+void record_requests(traffic_capture* capture, int thread, int count) {
+  for (int i = 0; i < count; ++i) {
+    // Payloads of varying sizes exercise the record padding.
+    std::string payload(boost::lexical_cast<std::string>(thread * count + i));
+    capture->record(thread * count + i, "SearchService", "Search",
+                    payload.data(), payload.size());
+  }
+}
+
+TEST_F(traffic_capture_test, RecordsRequestsFromAllThreads) {
+  const int kThreads = 4;
+  const int kRequests = 1000;
+  {
+    traffic_capture capture(filename_, 1 << 20);
+    boost::thread_group threads;
+    for (int i = 0; i < kThreads; ++i) {
+      threads.add_thread(new boost::thread(
+              boost::bind(record_requests, &capture, i, kRequests)));
+    }
+    threads.join_all();
+    ASSERT_EQ(0, capture.get_dropped_records());
+  }
+  traffic_capture_reader reader;
+  ASSERT_TRUE(reader.open(filename_));
+  std::set<uint64> timestamps;
+  captured_request request;
+  while (reader.next(&request)) {
+    ASSERT_EQ("SearchService", request.service);
+    ASSERT_EQ("Search", request.method);
+    ASSERT_EQ(boost::lexical_cast<std::string>(request.timestamp_usec),
+              request.payload);
+    timestamps.insert(request.timestamp_usec);
+  }
+  ASSERT_EQ(kThreads * kRequests, timestamps.size());
+}
+
+TEST_F(traffic_capture_test, DropsRequestsOverTheCaps) {
+  {
+    traffic_capture capture(filename_, 4096, 100);
+    std::string large(101, 'x');
+    ASSERT_FALSE(capture.record(1, "S", "M", large.data(), large.size()));
+    ASSERT_EQ(1, capture.get_dropped_records());
+    std::string payload(100, 'x');
+    int recorded = 0;
+    while (capture.record(recorded, "S", "M", payload.data(),
+                          payload.size())) {
+      ++recorded;
+    }
+    ASSERT_LT(0, recorded);
+    ASSERT_EQ(2, capture.get_dropped_records());
+    ASSERT_GE(4096, capture.get_used_bytes());
+  }
+  traffic_capture_reader reader;
+  ASSERT_TRUE(reader.open(filename_));
+  captured_request request;
+  int read = 0;
+  while (reader.next(&request)) {
+    ASSERT_EQ(std::string(100, 'x'), request.payload);
+    ++read;
+  }
+  ASSERT_LT(0, read);
+}
+
+TEST_F(traffic_capture_test, SampleRates) {
+  traffic_capture capture(filename_, 4096);
+  capture.set_default_sample_rate(0);
+  capture.set_sample_rate("SearchService", "Search", 1);
+  capture.set_sample_rate("SearchService", "Rare", 10);
+  int rare = 0;
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(capture.should_sample("SearchService", "Search"));
+    ASSERT_FALSE(capture.should_sample("SearchService", "Other"));
+    if (capture.should_sample("SearchService", "Rare")) {
+      ++rare;
+    }
+  }
+  ASSERT_LT(500, rare);
+  ASSERT_GT(2000, rare);
+}
+
+TEST_F(traffic_capture_test, ReaderRejectsOtherFiles) {
+  FILE* file = fopen(filename_.c_str(), "wb");
+  fputs("not a traffic capture", file);
+  fclose(file);
+  traffic_capture_reader reader;
+  ASSERT_FALSE(reader.open(filename_));
+}
+}  // namespace rpcz
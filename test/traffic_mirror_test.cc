@@ -0,0 +1,154 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <boost/thread/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "rpcz/application.hpp"
+#include "rpcz/rpc.hpp"
+#include "rpcz/rpc_channel.hpp"
+#include "rpcz/server.hpp"
+#include "rpcz/traffic_mirror.hpp"
+
+#include "proto/search.pb.h"
+#include "proto/search.rpcz.h"
+#include "test_util.hpp"
+
+namespace rpcz {
+
+class traffic_mirror_test : public ::testing::Test {
+ protected:
+  traffic_mirror_test()
+      : shadow_(application_),
+        shadow_service_(new CountingSearchService("shadow")),
+        mirror_(application_, "inproc://mirror_test.shadow"),
+        primary_(application_),
+        primary_service_(new CountingSearchService("primary")) {
+    shadow_.register_service(shadow_service_);
+    shadow_.bind("inproc://mirror_test.shadow");
+    primary_.register_service(primary_service_);
+  }
+
+  void start_primary() {
+    primary_.set_traffic_mirror(&mirror_);
+    primary_.bind("inproc://mirror_test.primary");
+    channel_.reset(application_.create_rpc_channel(
+            "inproc://mirror_test.primary"));
+  }
+
+  // Returns the name of the server that answered.
+  std::string search(const std::string& query) {
+    SearchService_Stub stub(channel_.get());
+    SearchRequest request;
+    request.set_query(query);
+    SearchResponse response;
+    stub.Search(request, &response, 1000);
+    EXPECT_EQ(query, response.results(0));
+    return response.results(2);
+  }
+
+  // Sends a request that the primary never answers.
+  void search_and_give_up(const std::string& query) {
+    SearchService_Stub stub(channel_.get());
+    SearchRequest request;
+    request.set_query(query);
+    SearchResponse response;
+    rpc rpc;
+    rpc.set_deadline_ms(10);
+    stub.Search(request, &response, &rpc, NULL);
+    rpc.wait();
+  }
+
+  // Mirroring happens after the primary call has been answered, so the
+  // tests wait for its effects.
+  static void wait_for(CountingSearchService* service, int calls) {
+    for (int i = 0; i < 100 && service->get_calls() < calls; ++i) {
+      sleep_a_bit();
+    }
+  }
+
+  static void sleep_a_bit() {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  application application_;
+  server shadow_;
+  CountingSearchService* shadow_service_;
+  traffic_mirror mirror_;
+  server primary_;
+  CountingSearchService* primary_service_;
+  scoped_ptr<rpc_channel> channel_;
+};
+
+TEST_F(traffic_mirror_test, MirrorsRequests) {
+  start_primary();
+  ASSERT_EQ("primary", search("happiness"));
+  wait_for(shadow_service_, 1);
+  ASSERT_EQ(1, primary_service_->get_calls());
+  ASSERT_EQ(1, shadow_service_->get_calls());
+  ASSERT_EQ(1, mirror_.get_mirrored_requests());
+  // A large payload is mirrored as well.
+  std::string large(1 << 20, 'x');
+  ASSERT_EQ("primary", search(large));
+  wait_for(shadow_service_, 2);
+  ASSERT_EQ(2, shadow_service_->get_calls());
+}
+
+TEST_F(traffic_mirror_test, HonorsSampleRate) {
+  mirror_.set_sample_rate("SearchService", "Search", 0);
+  start_primary();
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ("primary", search("happiness"));
+  }
+  ASSERT_EQ(10, primary_service_->get_calls());
+  ASSERT_EQ(0, mirror_.get_mirrored_requests());
+  ASSERT_EQ(0, shadow_service_->get_calls());
+}
+
+TEST_F(traffic_mirror_test, DropsRequestsWhenShadowIsBusy) {
+  mirror_.set_max_inflight(1);
+  start_primary();
+  // The shadow never answers, so the first mirrored request stays in
+  // flight until its deadline.
+  search_and_give_up("hang");
+  wait_for(shadow_service_, 1);
+  for (int i = 0; i < 3; ++i) {
+    search_and_give_up("hang");
+  }
+  for (int i = 0; i < 100 && mirror_.get_dropped_requests() < 3; ++i) {
+    sleep_a_bit();
+  }
+  ASSERT_EQ(4, primary_service_->get_calls());
+  ASSERT_EQ(1, mirror_.get_mirrored_requests());
+  ASSERT_EQ(3, mirror_.get_dropped_requests());
+  ASSERT_EQ(1, shadow_service_->get_calls());
+}
+
+TEST_F(traffic_mirror_test, CountsShadowFailures) {
+  mirror_.set_deadline_ms(10);
+  start_primary();
+  search_and_give_up("hang");
+  for (int i = 0; i < 100 && mirror_.get_failed_requests() < 1; ++i) {
+    sleep_a_bit();
+  }
+  ASSERT_EQ(1, mirror_.get_mirrored_requests());
+  ASSERT_EQ(1, mirror_.get_failed_requests());
+  // Once the deadline passed, requests are mirrored again.
+  ASSERT_EQ("primary", search("happiness"));
+  wait_for(shadow_service_, 2);
+  ASSERT_EQ(2, mirror_.get_mirrored_requests());
+  ASSERT_EQ(1, mirror_.get_failed_requests());
+}
+}  // namespace rpcz